@@ -1,6 +1,6 @@
 #!/bin/bash
 
-rm -f client server
+rm -f client server bench
 
 echo "Compiling Server..."
 gcc src/server/main.c \
@@ -8,6 +8,15 @@ gcc src/server/main.c \
 	src/server/stats.c \
 	src/server/net.c \
 	src/server/client_handler.c \
+	src/server/reactor.c \
+	src/server/pool.c \
+	src/server/uring.c src/server/timer.c src/server/admission.c \
+	src/server/commands.c src/server/splice.c src/server/multipart.c \
+	src/server/resume.c src/server/store.c src/server/writer.c \
+	src/server/chain.c \
+	src/common/crc32c.c \
+	src/common/delta.c src/common/xxh64.c src/common/lz.c \
+	src/common/sha256.c \
 	-o server -lpthread
 
 if [ $? -eq 0 ]; then
@@ -21,6 +30,14 @@ echo "Compiling Client..."
 gcc src/client/main.c \
 	src/client/system/network.c \
 	src/client/system/api.c \
+	src/client/system/delta_plan.c \
+	src/client/system/pack.c \
+	src/client/system/transfers.c \
+	src/common/crc32c.c \
+	src/common/delta.c \
+	src/common/xxh64.c \
+	src/common/sha256.c \
+	src/common/lz.c \
 	src/client/system/atomic.c \
 	src/client/tui/render.c \
 	src/client/tui/components.c \
@@ -38,4 +55,14 @@ else
 	exit 1
 fi
 
+echo "Compiling Benchmark..."
+gcc src/bench/bench.c -o bench -lpthread
+
+if [ $? -eq 0 ]; then
+	echo "Benchmark compiled successfully."
+else
+	echo "Benchmark compilation failed!"
+	exit 1
+fi
+
 echo "Done. Run ./server (optionally with port) and ./client"
\ No newline at end of file
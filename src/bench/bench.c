@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+struct BenchConfig {
+	const char *host;
+	int port;
+	const char *password;
+	size_t upload_mb;
+	int stats_seconds;
+	int stats_threads;
+};
+
+static struct BenchConfig config = {
+	.host = "127.0.0.1",
+	.port = 8080,
+	.password = "admin",
+	.upload_mb = 1024,
+	.stats_seconds = 5,
+	.stats_threads = 4
+};
+
+static atomic_ullong stats_done = 0;
+static atomic_bool stats_running = false;
+
+static double now_seconds(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int open_session(void)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(config.port);
+	inet_pton(AF_INET, config.host, &addr.sin_addr);
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	char auth[256];
+	snprintf(auth, sizeof(auth), "AUTH %s", config.password);
+	char reply[16] = { 0 };
+	if (send(sock, auth, strlen(auth), 0) < 0
+	    || recv(sock, reply, sizeof(reply) - 1, 0) <= 0
+	    || strcmp(reply, "OK") != 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int request(const char *cmd, char *out, size_t out_size)
+{
+	int sock = open_session();
+	if (sock < 0)
+		return -1;
+
+	size_t total = 0;
+	if (send(sock, cmd, strlen(cmd), 0) < 0) {
+		close(sock);
+		return -1;
+	}
+	while (total < out_size - 1) {
+		ssize_t n = recv(sock, out + total, out_size - 1 - total, 0);
+		if (n <= 0)
+			break;
+		total += (size_t)n;
+	}
+	out[total] = '\0';
+	close(sock);
+	return total > 0 ? 0 : -1;
+}
+
+static unsigned long long metric_value(const char *metrics, const char *key)
+{
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), " %s=", key);
+	const char *p = strstr(metrics, pattern);
+	return p ? strtoull(p + strlen(pattern), NULL, 10) : 0;
+}
+
+static int run_upload(void)
+{
+	char before[4096], after[4096];
+	if (request("METRICS", before, sizeof(before)) != 0) {
+		fprintf(stderr, "Cannot read METRICS from server\n");
+		return -1;
+	}
+
+	size_t total = config.upload_mb * 1024 * 1024;
+	int sock = open_session();
+	if (sock < 0)
+		return -1;
+
+	char header[128];
+	snprintf(header, sizeof(header), "FILE bench.bin %zu", total);
+	char ack[16] = { 0 };
+	send(sock, header, strlen(header), 0);
+	if (recv(sock, ack, sizeof(ack) - 1, 0) <= 0
+	    || strncmp(ack, "GO", 2) != 0) {
+		close(sock);
+		return -1;
+	}
+
+	static char chunk[1024 * 1024];
+	memset(chunk, 0xA5, sizeof(chunk));
+
+	double start = now_seconds();
+	size_t sent = 0;
+	while (sent < total) {
+		size_t len = total - sent;
+		if (len > sizeof(chunk))
+			len = sizeof(chunk);
+		ssize_t n = send(sock, chunk, len, 0);
+		if (n <= 0)
+			break;
+		sent += (size_t)n;
+	}
+	close(sock);
+
+	unsigned long long bytes = 0;
+	for (int tries = 0; tries < 100; tries++) {
+		usleep(50000);
+		if (request("METRICS", after, sizeof(after)) != 0)
+			break;
+		bytes = metric_value(after, "upload_bytes")
+		    - metric_value(before, "upload_bytes");
+		if (bytes >= sent)
+			break;
+	}
+	double elapsed = now_seconds() - start;
+
+	unsigned long long syscalls = metric_value(after, "upload_syscalls")
+	    - metric_value(before, "upload_syscalls");
+	double gb = bytes / (1024.0 * 1024.0 * 1024.0);
+
+	printf("upload: %zu MB in %.2f s (%.1f MB/s)\n", sent >> 20, elapsed,
+	       (sent / (1024.0 * 1024.0)) / elapsed);
+	printf("upload: %llu server syscalls, %.0f syscalls/GB\n", syscalls,
+	       gb > 0 ? syscalls / gb : 0.0);
+	return 0;
+}
+
+static void *stats_worker(void *arg)
+{
+	char buf[256];
+	while (atomic_load(&stats_running)) {
+		if (request("STATS", buf, sizeof(buf)) == 0)
+			atomic_fetch_add(&stats_done, 1);
+	}
+	return arg;
+}
+
+static int run_stats(void)
+{
+	pthread_t *threads = calloc((size_t)config.stats_threads,
+				    sizeof(pthread_t));
+	if (!threads)
+		return -1;
+
+	atomic_store(&stats_running, true);
+	double start = now_seconds();
+	for (int i = 0; i < config.stats_threads; i++)
+		pthread_create(&threads[i], NULL, stats_worker, NULL);
+
+	sleep((unsigned int)config.stats_seconds);
+	atomic_store(&stats_running, false);
+	for (int i = 0; i < config.stats_threads; i++)
+		pthread_join(threads[i], NULL);
+	double elapsed = now_seconds() - start;
+	free(threads);
+
+	printf("stats: %llu requests in %.2f s (%.0f req/s, %d threads)\n",
+	       atomic_load(&stats_done), elapsed,
+	       atomic_load(&stats_done) / elapsed, config.stats_threads);
+	return 0;
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [--host IP] [--port N] [--password P] "
+	       "[--upload-mb N] [--stats-seconds N] [--stats-threads N]\n",
+	       prog);
+	printf("Run once against './server --io-backend epoll' and once "
+	       "against '--io-backend uring' to compare.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_opts[] = {
+		{"host", required_argument, NULL, 'H'},
+		{"port", required_argument, NULL, 'p'},
+		{"password", required_argument, NULL, 'P'},
+		{"upload-mb", required_argument, NULL, 'u'},
+		{"stats-seconds", required_argument, NULL, 's'},
+		{"stats-threads", required_argument, NULL, 't'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'H':
+			config.host = optarg;
+			break;
+		case 'p':
+			config.port = atoi(optarg);
+			break;
+		case 'P':
+			config.password = optarg;
+			break;
+		case 'u':
+			config.upload_mb = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			config.stats_seconds = atoi(optarg);
+			break;
+		case 't':
+			config.stats_threads = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (config.stats_threads <= 0 || config.stats_seconds < 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	if (config.upload_mb > 0 && run_upload() != 0) {
+		fprintf(stderr, "Upload benchmark failed\n");
+		return 1;
+	}
+	if (config.stats_seconds > 0 && run_stats() != 0) {
+		fprintf(stderr, "STATS benchmark failed\n");
+		return 1;
+	}
+	return 0;
+}
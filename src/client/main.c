@@ -3,6 +3,7 @@
 #include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -11,6 +12,9 @@
 #include "globals.h"
 #include "tui/interface.h"
 #include "system/api.h" 
+#include "system/transfers.h"
+
+#define UI_FRAME_MS 40
 
 pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;
 struct ServerInfo server_list[MAX_SERVERS];
@@ -34,9 +38,70 @@ bool term_too_small = false;
 MEVENT event;
 int last_click_x, last_click_y;
 
+/*
+ * Telemetry of the current server, polled on its own thread: a STATS
+ * request waits behind an upload streaming on the same session.
+ */
+struct stats_poll {
+	pthread_t thread;
+	bool started;
+	atomic_bool done;
+	char ip[16];
+	int port;
+	float cpu;
+	size_t mem_used, mem_total;
+	int result;
+};
+
+static void *stats_poll_run(void *arg)
+{
+	struct stats_poll *poll = arg;
+	poll->result = core_update_stats(poll->ip, poll->port, &poll->cpu,
+					 &poll->mem_used, &poll->mem_total);
+	atomic_store(&poll->done, true);
+	return NULL;
+}
+
+static void stats_poll_start(struct stats_poll *poll)
+{
+	if (poll->started)
+		return;
+	snprintf(poll->ip, sizeof(poll->ip), "%s", current_server.ip);
+	poll->port = current_server.port;
+	atomic_store(&poll->done, false);
+	poll->started = pthread_create(&poll->thread, NULL, stats_poll_run, poll) == 0;
+}
+
+/* Copies a finished poll into current_server if it is still the server polled. */
+static void stats_poll_collect(struct stats_poll *poll, bool wait)
+{
+	if (!poll->started || (!wait && !atomic_load(&poll->done)))
+		return;
+	pthread_join(poll->thread, NULL);
+	poll->started = false;
+	if (poll->result == 0 && connected_to_server && poll->port == current_server.port
+	    && strcmp(poll->ip, current_server.ip) == 0) {
+		current_server.cpu_usage = poll->cpu;
+		current_server.mem_used = poll->mem_used;
+		current_server.mem_total = poll->mem_total;
+	}
+}
+
 int main(void)
 {
 	setlocale(LC_ALL, "");
+	const char *streams = getenv("OVERSEER_UPLOAD_STREAMS");
+	if (streams)
+		core_set_upload_streams(atoi(streams));
+	const char *delta = getenv("OVERSEER_DELTA_UPLOADS");
+	if (delta)
+		core_set_delta_uploads(atoi(delta) != 0);
+	const char *compression = getenv("OVERSEER_COMPRESSION");
+	if (compression)
+		core_set_compression(atoi(compression) != 0);
+	const char *transfers = getenv("OVERSEER_TRANSFER_CONCURRENCY");
+	if (transfers)
+		transfer_set_concurrency(atoi(transfers));
 	initscr();
 	cbreak();
 	noecho();
@@ -49,6 +114,9 @@ int main(void)
 	printf("\033[?1003h\n");
 
 	pthread_t beacon_thread = 0;
+	struct stats_poll stats_poll = { 0 };
+	struct timeval frame_last_time;
+	gettimeofday(&frame_last_time, NULL);
 	gettimeofday(&scan_last_time, NULL);
 	gettimeofday(&ui_last_time, NULL);
 	gettimeofday(&stats_last_time, NULL);
@@ -68,6 +136,14 @@ int main(void)
 			}
 		}
 
+		struct timeval now;
+		gettimeofday(&now, NULL);
+
+		long frame_ms = (now.tv_sec - frame_last_time.tv_sec) * 1000 + (now.tv_usec - frame_last_time.tv_usec) / 1000;
+		if (ch == ERR && frame_ms < UI_FRAME_MS)
+			continue;
+		frame_last_time = now;
+
 		target_row_start = rows * 0.15;
 		target_row_end = rows * 0.85;
 		target_cols_start = cols * 0.15;
@@ -125,25 +201,22 @@ int main(void)
 				draw_button_btop(target_row_start + 12, target_cols_start + 4, 20, "SEND FILE", true);
 				draw_button_btop(target_row_start + 16, target_cols_start + 4, 20, "EXECUTE CMD", true);
 				draw_button_btop(target_row_start + 20, target_cols_start + 4, 20, "TERMINATE", false);
+
+				draw_transfer_panel(target_row_start + 12, chart_x, target_row_end - target_row_start - 13, 30);
 			}
 		}
 
-		struct timeval now;
-		gettimeofday(&now, NULL);
-
 		long ui_ms = (now.tv_sec - ui_last_time.tv_sec) * 1000 + (now.tv_usec - ui_last_time.tv_usec) / 1000;
 		if (ui_ms > 80) {
 			ui_render_cycle++;
 			ui_last_time = now;
 		}
 
+		stats_poll_collect(&stats_poll, false);
 		if (connected_to_server) {
 			long stats_ms = (now.tv_sec - stats_last_time.tv_sec) * 1000 + (now.tv_usec - stats_last_time.tv_usec) / 1000;
 			if (stats_ms > 1000) {
-				core_update_stats(current_server.ip, current_server.port, 
-						  &current_server.cpu_usage, 
-						  &current_server.mem_used, 
-						  &current_server.mem_total);
+				stats_poll_start(&stats_poll);
 				stats_last_time = now;
 			}
 		}
@@ -157,6 +230,7 @@ int main(void)
 					scan_in_progress = false;
 					atomic_store(&beacon_thread_active, false);
 					if (beacon_thread) pthread_join(beacon_thread, NULL);
+					beacon_thread = 0;
 				}
 			}
 		}
@@ -166,6 +240,17 @@ int main(void)
 
 	atomic_store(&beacon_thread_active, false);
 	if (beacon_thread) pthread_join(beacon_thread, NULL);
+	int running;
+	transfer_counts(&running, NULL);
+	if (running > 0) {
+		attron(COLOR_PAIR(CP_INVERT));
+		mvprintw(rows - 1, 2, " FINISHING %d TRANSFER%s... ", running, running > 1 ? "S" : "");
+		attroff(COLOR_PAIR(CP_INVERT));
+		refresh();
+	}
+	transfer_shutdown();
+	stats_poll_collect(&stats_poll, true);
+	core_shutdown();
 	endwin();
 	printf("\033[?1003l\n");
 	return 0;
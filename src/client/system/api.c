@@ -23,6 +23,18 @@ int core_connect(const char *ip, int port, const char *password)
 	return res;
 }
 
+void core_disconnect(const char *ip, int port)
+{
+	if (!ip)
+		return;
+	close_server_session(ip, port);
+}
+
+void core_shutdown(void)
+{
+	close_all_sessions();
+}
+
 int core_send_message(const char *ip, int port, const char *payload)
 {
 	if (!ip || !payload)
@@ -43,6 +55,19 @@ int core_execute_command(const char *ip, int port, const char *cmd, char *out_bu
 }
 
 int core_upload_file(const char *ip, int port, const char *path, progress_cb_t cb)
+{
+	return core_upload_file_digest(ip, port, path, cb, NULL);
+}
+
+int core_upload_file_digest(const char *ip, int port, const char *path, progress_cb_t cb, uint32_t *crc32c)
+{
+	upload_result_t result;
+	int res = core_upload_file_result(ip, port, path, cb, &result);
+	if (res == 0 && crc32c) *crc32c = result.crc32c;
+	return res;
+}
+
+int core_upload_file_result(const char *ip, int port, const char *path, progress_cb_t cb, upload_result_t *result)
 {
 	if (!ip || !path)
 		return -1;
@@ -55,7 +80,54 @@ int core_upload_file(const char *ip, int port, const char *path, progress_cb_t c
 	if (st.st_size == 0)
 		return -1;
 
-	return send_file_to_server(ip, port, path, cb);
+	return send_file_to_server(ip, port, path, cb, result);
+}
+
+int core_upload_file_multi(upload_target_t *targets, int count, const char *path, target_progress_cb_t cb)
+{
+	if (!targets || !path || count < 1)
+		return -1;
+
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return -1;
+
+	return send_file_to_servers(targets, count, path, cb);
+}
+
+int core_upload_chain(chain_node_t *nodes, int count, const char *path, progress_cb_t cb, upload_result_t *result)
+{
+	if (!nodes || !path || count < 1)
+		return -1;
+	for (int i = 0; i < count; i++)
+		for (int j = 0; j < i; j++)
+			if (nodes[i].port == nodes[j].port && strcmp(nodes[i].ip, nodes[j].ip) == 0)
+				return -1;
+
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return -1;
+
+	return send_file_chain(nodes, count, path, cb, result);
+}
+
+int core_upload_dir(const char *ip, int port, const char *path, progress_cb_t cb, pack_result_t *result)
+{
+	if (!ip || !path)
+		return -1;
+
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+		return -1;
+
+	return send_dir_to_server(ip, port, path, cb, result);
+}
+
+int core_download_file(const char *ip, int port, const char *name, const char *dest_path, progress_cb_t cb)
+{
+	if (!ip || !name || !dest_path || !*name || strchr(name, '/'))
+		return -1;
+	return fetch_file_from_server(ip, port, name, dest_path, cb);
 }
 
 int core_update_stats(const char *ip, int port, float *cpu, size_t *mem_used, size_t *mem_total)
@@ -64,6 +136,129 @@ int core_update_stats(const char *ip, int port, float *cpu, size_t *mem_used, si
 	return get_server_stats(ip, port, cpu, mem_used, mem_total);
 }
 
+void core_set_upload_streams(int streams)
+{
+	net_set_upload_streams(streams);
+}
+
+void core_set_delta_uploads(bool enabled)
+{
+	net_set_delta_uploads(enabled);
+}
+
+void core_set_compression(bool enabled)
+{
+	net_set_compression(enabled);
+}
+
+struct core_future {
+	net_call_t *call;
+	bool threaded;
+	pthread_t thread;
+	atomic_bool done;
+	int result;
+	char ip[16];
+	int port;
+	char *path;
+	progress_cb_t cb;
+};
+
+static core_future_t *future_wrap(net_call_t *call)
+{
+	if (!call) return NULL;
+	core_future_t *future = calloc(1, sizeof(*future));
+	if (!future) {
+		net_call_wait(call);
+		return NULL;
+	}
+	future->call = call;
+	return future;
+}
+
+core_future_t *core_send_message_async(const char *ip, int port, const char *payload)
+{
+	if (!ip || !payload)
+		return NULL;
+	size_t len = strlen(payload);
+	if (len == 0 || len > 1024)
+		return NULL;
+	return future_wrap(send_message_async(ip, port, payload));
+}
+
+core_future_t *core_execute_command_async(const char *ip, int port, const char *cmd, char *out_buf, size_t buf_size)
+{
+	if (!ip || !cmd || !out_buf)
+		return NULL;
+	return future_wrap(send_command_async(ip, port, cmd, out_buf, buf_size));
+}
+
+core_future_t *core_update_stats_async(const char *ip, int port, float *cpu, size_t *mem_used, size_t *mem_total)
+{
+	if (!ip || !cpu || !mem_used || !mem_total)
+		return NULL;
+	return future_wrap(get_server_stats_async(ip, port, cpu, mem_used, mem_total));
+}
+
+static void *upload_thread(void *arg)
+{
+	core_future_t *future = arg;
+	future->result = core_upload_file(future->ip, future->port, future->path, future->cb);
+	atomic_store(&future->done, true);
+	return NULL;
+}
+
+core_future_t *core_upload_file_async(const char *ip, int port, const char *path, progress_cb_t cb)
+{
+	if (!ip || !path)
+		return NULL;
+
+	core_future_t *future = calloc(1, sizeof(*future));
+	if (!future)
+		return NULL;
+	future->path = strdup(path);
+	if (!future->path) {
+		free(future);
+		return NULL;
+	}
+	strncpy(future->ip, ip, sizeof(future->ip) - 1);
+	future->port = port;
+	future->cb = cb;
+	future->threaded = true;
+
+	if (pthread_create(&future->thread, NULL, upload_thread, future) != 0) {
+		free(future->path);
+		free(future);
+		return NULL;
+	}
+	return future;
+}
+
+bool core_future_ready(core_future_t *future)
+{
+	if (!future)
+		return true;
+	if (future->threaded)
+		return atomic_load(&future->done);
+	return net_call_done(future->call);
+}
+
+int core_future_wait(core_future_t *future)
+{
+	if (!future)
+		return -1;
+
+	int result;
+	if (future->threaded) {
+		pthread_join(future->thread, NULL);
+		result = future->result;
+		free(future->path);
+	} else {
+		result = net_call_wait(future->call);
+	}
+	free(future);
+	return result;
+}
+
 void core_start_scan(pthread_t *thread)
 {
 	pthread_mutex_lock(&list_mutex);
@@ -165,7 +360,7 @@ int core_upload_file_atomic(const char* ip, int port, safe_buffer_t* path_buf, p
 		return -1;
 	}
 
-	int result = send_file_to_server(ip_copy, port_copy, path_copy, cb);
+	int result = send_file_to_server(ip_copy, port_copy, path_copy, cb, NULL);
 	free(path_copy);
 	return result;
 }
@@ -14,10 +14,48 @@ typedef struct {
 } safe_buffer_t;
 
 int core_connect(const char *ip, int port, const char *password);
+void core_disconnect(const char *ip, int port);
+void core_shutdown(void);
 int core_send_message(const char *ip, int port, const char *payload);
 int core_execute_command(const char *ip, int port, const char *cmd, char *out_buf, size_t buf_size);
 int core_upload_file(const char *ip, int port, const char *path, progress_cb_t cb);
+/* As core_upload_file(), also returning the CRC32C of the uploaded file. */
+int core_upload_file_digest(const char *ip, int port, const char *path, progress_cb_t cb, uint32_t *crc32c);
+int core_upload_file_result(const char *ip, int port, const char *path, progress_cb_t cb, upload_result_t *result);
+/*
+ * As core_upload_file() to every target at once, reading the file once;
+ * see send_file_to_servers(). Returns how many targets stored it.
+ */
+int core_upload_file_multi(upload_target_t *targets, int count, const char *path, target_progress_cb_t cb);
+/*
+ * Uploads a file to every node, sending it once down a chain of servers in
+ * the order given; see send_file_chain(). Nodes must be distinct.
+ */
+int core_upload_chain(chain_node_t *nodes, int count, const char *path, progress_cb_t cb, upload_result_t *result);
+/* Uploads a directory tree as one packed stream; see send_dir_to_server(). */
+int core_upload_dir(const char *ip, int port, const char *path, progress_cb_t cb, pack_result_t *result);
+/* Downloads a stored file to dest_path; see fetch_file_from_server(). */
+int core_download_file(const char *ip, int port, const char *name, const char *dest_path, progress_cb_t cb);
 int core_update_stats(const char *ip, int port, float *cpu, size_t *mem_used, size_t *mem_total);
+void core_set_upload_streams(int streams);
+void core_set_delta_uploads(bool enabled);
+void core_set_compression(bool enabled);
+
+/*
+ * Async variants. Each returns a future at once, or NULL on bad arguments;
+ * output buffers must stay valid until core_future_wait(), which returns
+ * what the blocking call would have and frees the future. Requests to one
+ * server share a connection and complete in any order, so a long EXEC no
+ * longer delays STATS. Uploads run on their own thread.
+ */
+typedef struct core_future core_future_t;
+
+core_future_t *core_send_message_async(const char *ip, int port, const char *payload);
+core_future_t *core_execute_command_async(const char *ip, int port, const char *cmd, char *out_buf, size_t buf_size);
+core_future_t *core_upload_file_async(const char *ip, int port, const char *path, progress_cb_t cb);
+core_future_t *core_update_stats_async(const char *ip, int port, float *cpu, size_t *mem_used, size_t *mem_total);
+bool core_future_ready(core_future_t *future);
+int core_future_wait(core_future_t *future);
 void core_start_scan(pthread_t *thread);
 
 int core_init_safe_buffer(safe_buffer_t *buf, size_t initial_capacity);
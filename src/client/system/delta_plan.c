@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include "delta_plan.h"
+#include "../../common/delta.h"
+#include "../../common/protocol.h"
+
+typedef struct {
+	const unsigned char *sig;
+	int32_t *heads;
+	int32_t *next;
+	uint32_t mask;
+} block_index_t;
+
+static uint32_t index_slot(const block_index_t *ix, uint32_t weak)
+{
+	return (weak * 2654435761u) >> 7 & ix->mask;
+}
+
+static int index_build(block_index_t *ix, const unsigned char *sig, size_t count)
+{
+	size_t slots = 1024;
+	while (slots < count * 2) slots *= 2;
+
+	ix->sig = sig;
+	ix->mask = (uint32_t)slots - 1;
+	ix->heads = malloc(slots * sizeof(*ix->heads));
+	ix->next = malloc((count ? count : 1) * sizeof(*ix->next));
+	if (!ix->heads || !ix->next) return -1;
+
+	memset(ix->heads, 0xff, slots * sizeof(*ix->heads));
+	for (size_t i = count; i-- > 0;) {
+		uint32_t slot = index_slot(ix, get_u32(sig + i * SIGNATURE_ENTRY_SIZE));
+		ix->next[i] = ix->heads[slot];
+		ix->heads[slot] = (int32_t)i;
+	}
+	return 0;
+}
+
+typedef struct {
+	const unsigned char *window;
+	size_t block;
+	uint32_t weak;
+	bool hashed;
+	uint64_t strong;
+} window_t;
+
+/* The strong checksum of the window is computed once, on the first weak match. */
+static bool block_matches(const block_index_t *ix, int32_t i, window_t *w)
+{
+	const unsigned char *entry = ix->sig + (size_t)i * SIGNATURE_ENTRY_SIZE;
+	if (get_u32(entry) != w->weak) return false;
+	if (!w->hashed) {
+		w->strong = delta_strong(w->window, w->block);
+		w->hashed = true;
+	}
+	return get_u64(entry + 4) == w->strong;
+}
+
+/* The stored block at this window, preferring the one after the last match. */
+static int32_t index_find(const block_index_t *ix, size_t count, window_t *w, int32_t expect)
+{
+	if (expect >= 0 && (size_t)expect < count && block_matches(ix, expect, w))
+		return expect;
+	for (int32_t i = ix->heads[index_slot(ix, w->weak)]; i >= 0; i = ix->next[i]) {
+		if (i != expect && block_matches(ix, i, w))
+			return i;
+	}
+	return -1;
+}
+
+static int plan_push(delta_plan_t *plan, delta_op_t op)
+{
+	if (plan->count > 0) {
+		delta_op_t *last = &plan->ops[plan->count - 1];
+		if (op.copy && last->copy && last->block + last->count == op.block) {
+			last->count += op.count;
+			last->len += op.len;
+			return 0;
+		}
+	}
+	if (plan->count == plan->capacity) {
+		size_t capacity = plan->capacity ? plan->capacity * 2 : 64;
+		delta_op_t *ops = realloc(plan->ops, capacity * sizeof(*ops));
+		if (!ops) return -1;
+		plan->ops = ops;
+		plan->capacity = capacity;
+	}
+	plan->ops[plan->count++] = op;
+	return 0;
+}
+
+static int push_literal(delta_plan_t *plan, size_t from, size_t to)
+{
+	if (to == from) return 0;
+	delta_op_t op = { .copy = false, .offset = from, .len = to - from };
+	return plan_push(plan, op);
+}
+
+/*
+ * Rolls the weak checksum along data one byte at a time; after a match it
+ * jumps a whole block and first tries the stored block that follows the
+ * one just matched by its strong checksum alone, so an unchanged run costs
+ * one XXH64 per block.
+ */
+int delta_plan_build(delta_plan_t *plan, const unsigned char *data, size_t size,
+		     const unsigned char *sig, size_t count, size_t block)
+{
+	block_index_t ix;
+	memset(plan, 0, sizeof(*plan));
+	int res = index_build(&ix, sig, count);
+
+	size_t pos = 0, literal = 0;
+	uint32_t weak = 0;
+	bool fresh = true;
+	int32_t expect = -1;
+	while (res == 0 && count > 0 && pos + block <= size) {
+		window_t w = { .window = data + pos, .block = block };
+		int32_t found = -1;
+		if (fresh && expect >= 0 && (size_t)expect < count) {
+			w.strong = delta_strong(w.window, block);
+			w.hashed = true;
+			if (w.strong == get_u64(sig + (size_t)expect * SIGNATURE_ENTRY_SIZE + 4)) found = expect;
+		}
+		if (found < 0) {
+			if (fresh) weak = delta_weak(w.window, block);
+			fresh = false;
+			w.weak = weak;
+			found = index_find(&ix, count, &w, expect);
+		}
+		if (found < 0) {
+			if (pos + block < size) weak = delta_roll(weak, block, data[pos], data[pos + block]);
+			pos++;
+			continue;
+		}
+		delta_op_t op = { .copy = true, .offset = pos, .len = block, .block = (uint32_t)found, .count = 1 };
+		if (push_literal(plan, literal, pos) != 0 || plan_push(plan, op) != 0) res = -1;
+		plan->reused += block;
+		pos += block;
+		literal = pos;
+		fresh = true;
+		expect = found + 1;
+	}
+	if (res == 0) res = push_literal(plan, literal, size);
+
+	free(ix.heads);
+	free(ix.next);
+	if (res != 0) delta_plan_free(plan);
+	return res;
+}
+
+void delta_plan_free(delta_plan_t *plan)
+{
+	free(plan->ops);
+	memset(plan, 0, sizeof(*plan));
+}
@@ -0,0 +1,33 @@
+#ifndef DELTA_PLAN_H
+#define DELTA_PLAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Bytes [offset, offset + len) of the local file, or count stored blocks from block. */
+typedef struct {
+	bool copy;
+	uint64_t offset;
+	uint64_t len;
+	uint32_t block;
+	uint32_t count;
+} delta_op_t;
+
+typedef struct {
+	delta_op_t *ops;
+	size_t count;
+	size_t capacity;
+	uint64_t reused;
+} delta_plan_t;
+
+/*
+ * Matches the blocks described by a SIGNATURE reply (count entries of
+ * SIGNATURE_ENTRY_SIZE at sig) against every offset of data, and lists
+ * the file as runs of new bytes and runs of stored blocks, in order.
+ */
+int delta_plan_build(delta_plan_t *plan, const unsigned char *data, size_t size,
+		     const unsigned char *sig, size_t count, size_t block);
+void delta_plan_free(delta_plan_t *plan);
+
+#endif
@@ -1,16 +1,237 @@
+#define _GNU_SOURCE
 #define _XOPEN_SOURCE_EXTENDED
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <libgen.h>
+#include <time.h>
 #include <stdatomic.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
 #include "network.h"
 #include "../globals.h"
+#include "../../common/protocol.h"
+#include "../../common/crc32c.h"
+#include "../../common/delta.h"
+#include "../../common/sha256.h"
+#include "../../common/lz.h"
+#include "delta_plan.h"
+#include "pack.h"
+
+#define SESSION_IO_TIMEOUT_SEC	5
+#define SESSION_PROBE_SEC	20
+#define SESSION_KEEPIDLE	30
+#define SESSION_RBUF_SIZE	4096
+#define PROGRESS_INTERVAL_MS	100
+#define UPLOAD_STREAMS_DEFAULT	4
+#define UPLOAD_STREAMS_MAX	16
+#define PARALLEL_MIN_SIZE	(8 * 1024 * 1024)
+#define PARALLEL_RANGE_ALIGN	(1024 * 1024)
+#define CRC_BUF_SIZE		65536
+#define DELTA_MIN_SAVING	8
+#define UPLOAD_FALLBACK		1
+#define PACK_BATCH_SIZE		(2 * PACK_INLINE_MAX)
+#define LZ_SAMPLE_SIZE		65536
+#define LZ_SAMPLE_BLOCKS	4
+#define LZ_MIN_SAVING		8
+#define LZ_GIVE_UP		4
+#define TEE_RING_SLOTS		8
+#define TEE_DROPPED		SIZE_MAX
+
+#define CALL_PENDING	1
+
+typedef enum {
+	CALL_MESSAGE,
+	CALL_EXEC,
+	CALL_STATS,
+	CALL_CONTROL
+} call_kind_t;
+
+/*
+ * One request on a session. The session reader thread fills out with the
+ * reply payload and sets status; only the reader completes a linked call.
+ * sent is set once the whole request frame went out; retry marks a call
+ * that may run twice, so it is resent after a broken session even then.
+ */
+struct net_call {
+	struct session *session;
+	call_kind_t kind;
+	uint32_t id;
+	int status;
+	int result;
+	bool sent;
+	bool retry;
+	uint8_t reply_type;
+	char *out;
+	size_t size;
+	size_t len;
+	float *cpu;
+	size_t *mem_used;
+	size_t *mem_total;
+	char reply[64];
+	uint8_t type;
+	size_t req_len;
+	unsigned char req[FRAME_MAX_REQUEST];
+	struct net_call *next;
+};
+
+/*
+ * A multiplexed binary connection to one server. Any number of threads may
+ * have calls pending; sends are serialized by send_lock, and the reader
+ * thread routes each reply frame to its call by request id. conn_lock
+ * serializes opening and dropping the connection.
+ */
+typedef struct session {
+	char ip[16];
+	int port;
+	char password[64];
+	int sock;
+	bool broken;
+	bool streaming;
+	bool unsupported;
+	uint32_t caps;
+	uint32_t next_id;
+	time_t last_used;
+	time_t last_io;
+	char rbuf[SESSION_RBUF_SIZE];
+	size_t rpos;
+	size_t rlen;
+	bool reader_running;
+	pthread_t reader;
+	net_call_t *pending;
+	pthread_mutex_t conn_lock;
+	pthread_mutex_t send_lock;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} session_t;
+
+/*
+ * Bytes sent by every stream of one upload, reported every
+ * PROGRESS_INTERVAL_MS. With compress set, DATA frames may go out
+ * compressed; lz_raw bytes were offered to the codec, took lz_wire on the
+ * wire and lz_cpu_ns of CPU, sampling included.
+ */
+typedef struct {
+	progress_cb_t callback;
+	size_t total;
+	size_t base;
+	int streams;
+	atomic_size_t sent;
+	unsigned long long start;
+	unsigned long long next;
+	bool compress;
+	atomic_size_t lz_raw;
+	atomic_size_t lz_wire;
+	atomic_ullong lz_cpu_ns;
+} upload_progress_t;
+
+typedef struct {
+	session_t *session;
+	uint32_t id;
+	int fd;
+	int running;
+	upload_progress_t progress;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} parallel_upload_t;
+
+typedef struct {
+	parallel_upload_t *upload;
+	off_t offset;
+	size_t len;
+	bool stored;
+	uint32_t stored_crc;
+	uint32_t crc;
+	int result;
+	bool started;
+	pthread_t thread;
+} range_job_t;
+
+/* A download being written into fd by one fetch_job_t per stream. */
+typedef struct {
+	session_t *session;
+	const char *name;
+	size_t filesize;
+	int fd;
+	int running;
+	upload_progress_t progress;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} parallel_download_t;
+
+typedef struct {
+	parallel_download_t *download;
+	off_t offset;
+	size_t len;
+	int result;
+	bool started;
+	pthread_t thread;
+} fetch_job_t;
+
+/*
+ * CRC32C of one range of the file being uploaded, computed on a thread of
+ * its own while the same range goes out with sendfile(), so hashing never
+ * holds up the socket.
+ */
+typedef struct {
+	int fd;
+	off_t offset;
+	size_t len;
+	uint32_t crc;
+	int result;
+	atomic_bool stop;
+	bool started;
+	pthread_t thread;
+} file_hasher_t;
+
+/*
+ * A file read once for a tee upload into TEE_RING_SLOTS chunks of
+ * FRAME_DATA_CHUNK, chunk i in slot i % TEE_RING_SLOTS. sent[t] counts the
+ * chunks target t has sent, or is TEE_DROPPED once it gave up; a slot is
+ * refilled only when every sender still going is past it. crc covers the
+ * chunks read so far.
+ */
+typedef struct {
+	int fd;
+	const char *name;
+	size_t filesize;
+	size_t chunks;
+	char *ring;
+	size_t read;
+	bool failed;
+	uint32_t crc;
+	int count;
+	size_t sent[MAX_SERVERS];
+	target_progress_cb_t callback;
+	pthread_mutex_t report_lock;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} tee_upload_t;
+
+typedef struct {
+	tee_upload_t *tee;
+	upload_target_t *target;
+	int index;
+	bool started;
+	pthread_t thread;
+} tee_sender_t;
+
+static atomic_int upload_streams = UPLOAD_STREAMS_DEFAULT;
+static atomic_bool delta_uploads = false;
+static atomic_bool wire_compression = false;
+static session_t sessions[MAX_SERVERS];
+static int session_slots = 0;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int perform_auth(int sock, const char *password)
 {
@@ -25,14 +246,548 @@ static int perform_auth(int sock, const char *password)
 	if (n <= 0) return -1;
 	
 	buf[n] = '\0';
+	if (strncmp(buf, "BUSY", 4) == 0) return NET_ERR_BUSY;
 	return (strcmp(buf, "OK") == 0) ? 0 : -1;
 }
 
-void send_message(const char *ip, int port, const char *msg)
+static int dial(const char *ip, int port, int timeout_sec)
 {
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) return -1;
+
+	struct sockaddr_in serv_addr;
+	memset(&serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_port = htons(port);
+	inet_pton(AF_INET, ip, &serv_addr.sin_addr);
+
+	struct timeval timeout = {timeout_sec, 0};
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int send_all(int sock, const void *data, size_t len)
+{
+	const char *p = data;
+	while (len > 0) {
+		ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+		if (n <= 0) return -1;
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static int frame_send(int sock, uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t len)
+{
+	unsigned char head[FRAME_HEADER_SIZE];
+	frame_encode(head, type, flags, (uint32_t)len, id);
+
+	struct iovec iov[2] = {
+		{.iov_base = head, .iov_len = sizeof(head)},
+		{.iov_base = (void *)payload, .iov_len = len}
+	};
+	struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+	ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	if (n < 0) return -1;
+
+	size_t sent = (size_t)n;
+	if (sent < sizeof(head))
+		return send_all(sock, head + sent, sizeof(head) - sent) == 0 ? send_all(sock, payload, len) : -1;
+	return send_all(sock, (const char *)payload + (sent - sizeof(head)), len - (sent - sizeof(head)));
+}
+
+/* True when the reader should give up waiting: no reply progress for too long. */
+static bool session_stalled(session_t *s)
+{
+	pthread_mutex_lock(&s->lock);
+	bool stalled = s->broken || (s->pending && !s->streaming
+				     && time(NULL) - s->last_io >= SESSION_IO_TIMEOUT_SEC);
+	pthread_mutex_unlock(&s->lock);
+	return stalled;
+}
+
+static int session_read(session_t *s, int sock, void *dst, size_t len, bool patient)
+{
+	char *out = dst;
+	while (len > 0) {
+		if (s->rpos == s->rlen) {
+			bool direct = out && len >= sizeof(s->rbuf);
+			ssize_t n = recv(sock, direct ? out : s->rbuf, direct ? len : sizeof(s->rbuf), 0);
+			if (n < 0 && patient && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			    && !session_stalled(s))
+				continue;
+			if (n <= 0) return -1;
+			if (direct) {
+				out += n;
+				len -= (size_t)n;
+				continue;
+			}
+			s->rpos = 0;
+			s->rlen = (size_t)n;
+		}
+		size_t take = s->rlen - s->rpos;
+		if (take > len) take = len;
+		if (out) {
+			memcpy(out, s->rbuf + s->rpos, take);
+			out += take;
+		}
+		s->rpos += take;
+		len -= take;
+	}
+	return 0;
+}
+
+/* Reads one frame during the handshake; keeps what fits in out. */
+static ssize_t session_read_frame(session_t *s, int sock, struct FrameHeader *h, void *out, size_t size)
+{
+	unsigned char head[FRAME_HEADER_SIZE];
+	if (session_read(s, sock, head, sizeof(head), false) != 0 || !frame_decode(head, h)) return -1;
+
+	size_t keep = h->length < size ? h->length : size;
+	if (session_read(s, sock, out, keep, false) != 0 || session_read(s, sock, NULL, h->length - keep, false) != 0)
+		return -1;
+	return (ssize_t)keep;
+}
+
+static uint32_t session_next_id(session_t *s)
+{
+	if (++s->next_id == 0) s->next_id = 1;
+	return s->next_id;
+}
+
+static void call_unlink(session_t *s, net_call_t *call)
+{
+	net_call_t **p = &s->pending;
+	while (*p && *p != call) p = &(*p)->next;
+	if (*p) *p = call->next;
+	call->next = NULL;
+}
+
+/*
+ * Reads a FRAME_F_LZ payload of length bytes and expands it, keeping what
+ * fits in size bytes of out; *keep is set to that.
+ */
+static int session_read_packed(session_t *s, int sock, size_t length, char *out, size_t size, size_t *keep)
+{
+	unsigned char *packed = malloc(length ? length : 1);
+	if (!packed) return -1;
+	if (session_read(s, sock, packed, length, true) != 0) {
+		free(packed);
+		return -1;
+	}
+
+	size_t raw = length >= LZ_HEAD_SIZE ? get_u32(packed) : 0;
+	unsigned char *plain = raw <= FRAME_DATA_CHUNK ? malloc(raw ? raw : 1) : NULL;
+	bool ok = plain && length >= LZ_HEAD_SIZE
+	    && lz_decompress(packed + LZ_HEAD_SIZE, length - LZ_HEAD_SIZE, plain, raw);
+	if (ok) {
+		*keep = raw < size ? raw : size;
+		memcpy(out, plain, *keep);
+	}
+	free(plain);
+	free(packed);
+	return ok ? 0 : -1;
+}
+
+static void *session_reader(void *arg)
+{
+	session_t *s = arg;
+	pthread_mutex_lock(&s->lock);
+	int sock = s->sock;
+	pthread_mutex_unlock(&s->lock);
+
+	for (;;) {
+		unsigned char head[FRAME_HEADER_SIZE];
+		struct FrameHeader h;
+		if (session_read(s, sock, head, sizeof(head), true) != 0 || !frame_decode(head, &h)) break;
+
+		pthread_mutex_lock(&s->lock);
+		net_call_t *call = s->pending;
+		while (call && call->id != h.request_id) call = call->next;
+		s->last_io = time(NULL);
+		pthread_mutex_unlock(&s->lock);
+
+		size_t keep = 0;
+		if (call && (h.flags & FRAME_F_LZ)) {
+			if (session_read_packed(s, sock, h.length, call->out + call->len, call->size - 1 - call->len,
+						&keep) != 0)
+				break;
+		} else {
+			if (call) {
+				keep = call->size - 1 - call->len;
+				if (keep > h.length) keep = h.length;
+			}
+			if (session_read(s, sock, call ? call->out + call->len : NULL, keep, true) != 0
+			    || session_read(s, sock, NULL, h.length - keep, true) != 0)
+				break;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		if (call) {
+			call->len += keep;
+			call->out[call->len] = '\0';
+			call->reply_type = h.type;
+			if (!(h.flags & FRAME_F_MORE)) {
+				call_unlink(s, call);
+				call->status = 0;
+				pthread_cond_broadcast(&s->cond);
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->broken = true;
+	while (s->pending) {
+		net_call_t *call = s->pending;
+		s->pending = call->next;
+		call->next = NULL;
+		call->status = -1;
+	}
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/* Marks the connection dead and wakes the reader; caller holds send_lock. */
+static void session_break(session_t *s, int sock)
+{
+	pthread_mutex_lock(&s->lock);
+	s->broken = true;
+	pthread_mutex_unlock(&s->lock);
+	shutdown(sock, SHUT_RDWR);
+}
+
+/* Caller holds conn_lock. */
+static void session_drop(session_t *s)
+{
+	pthread_mutex_lock(&s->lock);
+	int sock = s->sock;
+	bool running = s->reader_running;
+	s->sock = -1;
+	s->reader_running = false;
+	pthread_mutex_unlock(&s->lock);
 	if (sock < 0) return;
 
+	shutdown(sock, SHUT_RDWR);
+	if (running) pthread_join(s->reader, NULL);
+	pthread_mutex_lock(&s->send_lock);
+	close(sock);
+	pthread_mutex_unlock(&s->send_lock);
+	s->rpos = 0;
+	s->rlen = 0;
+}
+
+/*
+ * Negotiates the binary protocol: HELLO and AUTH go out together and the
+ * server answers both. A server that replies with text predates framing;
+ * it is marked unsupported and served by one-shot text connections.
+ */
+static int session_greet(session_t *s, int sock)
+{
+	s->rpos = 0;
+	s->rlen = 0;
+
+	unsigned char caps[4];
+	put_u32(caps, atomic_load(&wire_compression) ? PROTOCOL_CAPS : PROTOCOL_CAPS & ~CAP_LZ);
+	uint32_t hello_id = session_next_id(s);
+	uint32_t auth_id = session_next_id(s);
+
+	struct FrameHeader h;
+	unsigned char reply[16];
+	if (frame_send(sock, FRAME_HELLO, 0, hello_id, caps, sizeof(caps)) != 0
+	    || frame_send(sock, FRAME_AUTH, 0, auth_id, s->password, strlen(s->password)) != 0
+	    || session_read_frame(s, sock, &h, reply, sizeof(reply)) < 4
+	    || h.type != FRAME_HELLO || h.request_id != hello_id) {
+		int res = -1;
+		if (s->rlen > 0 && (unsigned char)s->rbuf[0] != FRAME_MAGIC) {
+			if (strncmp(s->rbuf, "BUSY", 4) == 0) res = NET_ERR_BUSY;
+			else s->unsupported = true;
+		}
+		return res;
+	}
+	s->caps = get_u32(reply);
+
+	if (session_read_frame(s, sock, &h, reply, sizeof(reply)) < 0 || h.type != FRAME_OK)
+		return h.type == FRAME_BUSY ? NET_ERR_BUSY : -1;
+	return 0;
+}
+
+/* Caller holds conn_lock. */
+static int session_open(session_t *s)
+{
+	int sock = dial(s->ip, s->port, SESSION_IO_TIMEOUT_SEC);
+	if (sock < 0) return -1;
+
+	int res = session_greet(s, sock);
+	if (res != 0) {
+		close(sock);
+		return res;
+	}
+
+	int on = 1;
+	int idle = SESSION_KEEPIDLE;
+	setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	pthread_mutex_lock(&s->lock);
+	s->sock = sock;
+	s->broken = false;
+	s->last_used = time(NULL);
+	pthread_mutex_unlock(&s->lock);
+
+	if (pthread_create(&s->reader, NULL, session_reader, s) != 0) {
+		session_drop(s);
+		return -1;
+	}
+	s->reader_running = true;
+	return 0;
+}
+
+static void call_init(net_call_t *call, session_t *s, call_kind_t kind, uint8_t type,
+		      const void *payload, size_t len, char *out, size_t size)
+{
+	memset(call, 0, sizeof(*call));
+	call->session = s;
+	call->kind = kind;
+	call->type = type;
+	call->status = -1;
+	call->req_len = len < sizeof(call->req) ? len : sizeof(call->req);
+	if (payload) memcpy(call->req, payload, call->req_len);
+	call->out = out ? out : call->reply;
+	call->size = out ? size : sizeof(call->reply);
+}
+
+/* Links call into the pending list under a fresh id; returns the socket or -1. */
+static int call_register(session_t *s, net_call_t *call)
+{
+	pthread_mutex_lock(&s->lock);
+	int sock = s->broken ? -1 : s->sock;
+	if (sock >= 0) {
+		call->id = session_next_id(s);
+		call->status = CALL_PENDING;
+		call->len = 0;
+		call->out[0] = '\0';
+		call->next = s->pending;
+		s->pending = call;
+		s->last_io = time(NULL);
+		s->last_used = s->last_io;
+	} else
+		call->status = -1;
+	pthread_mutex_unlock(&s->lock);
+	return sock;
+}
+
+/* Waits again on the same id, for a request answered by more than one reply. */
+static int call_relink(session_t *s, net_call_t *call)
+{
+	pthread_mutex_lock(&s->lock);
+	bool ok = !s->broken && s->sock >= 0;
+	if (ok) {
+		call->status = CALL_PENDING;
+		call->len = 0;
+		call->next = s->pending;
+		s->pending = call;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return ok ? 0 : -1;
+}
+
+static void call_submit(net_call_t *call)
+{
+	session_t *s = call->session;
+	pthread_mutex_lock(&s->send_lock);
+	int sock = call_register(s, call);
+	call->sent = sock >= 0 && frame_send(sock, call->type, 0, call->id, call->req, call->req_len) == 0;
+	if (sock >= 0 && !call->sent)
+		session_break(s, sock);
+	pthread_mutex_unlock(&s->send_lock);
+}
+
+static void call_wait(net_call_t *call)
+{
+	session_t *s = call->session;
+	pthread_mutex_lock(&s->lock);
+	while (call->status == CALL_PENDING)
+		pthread_cond_wait(&s->cond, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static bool session_ping(session_t *s)
+{
+	net_call_t call;
+	call_init(&call, s, CALL_CONTROL, FRAME_PING, NULL, 0, NULL, 0);
+	call_submit(&call);
+	call_wait(&call);
+	return call.status == 0 && call.reply_type == FRAME_PONG;
+}
+
+static session_t *session_find(const char *ip, int port, bool create)
+{
+	session_t *found = NULL;
+
+	pthread_mutex_lock(&sessions_lock);
+	for (int i = 0; i < session_slots; i++) {
+		if (sessions[i].port == port && strcmp(sessions[i].ip, ip) == 0) {
+			found = &sessions[i];
+			break;
+		}
+	}
+	if (!found && create && session_slots < MAX_SERVERS) {
+		found = &sessions[session_slots++];
+		memset(found, 0, sizeof(*found));
+		strncpy(found->ip, ip, sizeof(found->ip) - 1);
+		found->port = port;
+		found->sock = -1;
+		pthread_mutex_init(&found->conn_lock, NULL);
+		pthread_mutex_init(&found->send_lock, NULL);
+		pthread_mutex_init(&found->lock, NULL);
+		pthread_cond_init(&found->cond, NULL);
+	}
+	pthread_mutex_unlock(&sessions_lock);
+	return found;
+}
+
+/*
+ * Returns the session for a server, (re)connecting it when needed. The
+ * session is shared: callers only queue calls on it. NULL means the caller
+ * should use a one-shot connection, because the server does not speak the
+ * binary protocol or cannot be reached.
+ */
+static session_t *session_acquire(const char *ip, int port)
+{
+	session_t *s = session_find(ip, port, true);
+	if (!s) return NULL;
+
+	pthread_mutex_lock(&s->conn_lock);
+	if (strcmp(s->password, connection_password) != 0) {
+		session_drop(s);
+		strncpy(s->password, connection_password, sizeof(s->password) - 1);
+		s->unsupported = false;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	bool broken = s->broken;
+	bool idle = s->sock >= 0 && !s->pending && time(NULL) - s->last_used >= SESSION_PROBE_SEC;
+	pthread_mutex_unlock(&s->lock);
+
+	if (broken || (idle && !session_ping(s)))
+		session_drop(s);
+	if (!s->unsupported && s->sock < 0)
+		session_open(s);
+
+	bool ready = s->sock >= 0;
+	pthread_mutex_unlock(&s->conn_lock);
+	return ready ? s : NULL;
+}
+
+static int call_result(net_call_t *call)
+{
+	if (call->status != 0)
+		return (call->kind == CALL_EXEC && call->len > 0) ? 0 : -1;
+	if (call->reply_type == FRAME_BUSY) {
+		if (call->kind == CALL_EXEC) call->out[0] = '\0';
+		return NET_ERR_BUSY;
+	}
+	if (call->reply_type == FRAME_ERR) {
+		if (call->kind == CALL_EXEC) call->out[0] = '\0';
+		return -1;
+	}
+	if (call->kind != CALL_STATS)
+		return 0;
+	if (call->reply_type != FRAME_STATS || call->len < STATS_PAYLOAD_SIZE)
+		return -1;
+
+	const unsigned char *p = (const unsigned char *)call->reply;
+	*call->cpu = get_u32(p) / 100.0f;
+	*call->mem_used = (size_t)get_u64(p + 4);
+	*call->mem_total = (size_t)get_u64(p + 12);
+	return 0;
+}
+
+/* Queues a request on the server's session; NULL when there is none. */
+static net_call_t *call_start(const char *ip, int port, call_kind_t kind, uint8_t type,
+			      const void *payload, size_t len, char *out, size_t size)
+{
+	net_call_t *call = malloc(sizeof(*call));
+	if (!call) return NULL;
+
+	session_t *s = session_acquire(ip, port);
+	call_init(call, s, kind, type, payload, len, out, size);
+	call->retry = kind == CALL_STATS || kind == CALL_CONTROL;
+	if (s) call_submit(call);
+	return call;
+}
+
+bool net_call_done(net_call_t *call)
+{
+	if (!call || !call->session) return true;
+	pthread_mutex_lock(&call->session->lock);
+	bool done = call->status != CALL_PENDING;
+	pthread_mutex_unlock(&call->session->lock);
+	return done;
+}
+
+int net_call_wait(net_call_t *call)
+{
+	if (!call) return -1;
+
+	session_t *s = call->session;
+	if (s) {
+		call_wait(call);
+		if (call->status != 0 && (call->retry || !call->sent) && call->len == 0
+		    && session_acquire(s->ip, s->port) == s) {
+			call_submit(call);
+			call_wait(call);
+		}
+		call->result = call_result(call);
+	}
+
+	int res = call->result;
+	free(call);
+	return res;
+}
+
+void close_server_session(const char *ip, int port)
+{
+	session_t *s = session_find(ip, port, false);
+	if (!s) return;
+
+	pthread_mutex_lock(&s->conn_lock);
+	if (s->sock >= 0) {
+		net_call_t call;
+		call_init(&call, s, CALL_CONTROL, FRAME_QUIT, NULL, 0, NULL, 0);
+		call_submit(&call);
+		call_wait(&call);
+	}
+	session_drop(s);
+	memset(s->password, 0, sizeof(s->password));
+	pthread_mutex_unlock(&s->conn_lock);
+}
+
+void close_all_sessions(void)
+{
+	pthread_mutex_lock(&sessions_lock);
+	int count = session_slots;
+	pthread_mutex_unlock(&sessions_lock);
+
+	for (int i = 0; i < count; i++)
+		close_server_session(sessions[i].ip, sessions[i].port);
+}
+
+static int legacy_message(const char *ip, int port, const char *msg)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) return -1;
+
 	struct sockaddr_in serv_addr;
 	memset(&serv_addr, 0, sizeof(serv_addr));
 	serv_addr.sin_family = AF_INET;
@@ -49,12 +804,25 @@ void send_message(const char *ip, int port, const char *msg)
 		}
 	}
 	close(sock);
+	return 0;
 }
 
-int send_command_with_response(const char *ip, int port, const char *cmd, char *out_buf, size_t buf_size)
+net_call_t *send_message_async(const char *ip, int port, const char *msg)
 {
-	if (!out_buf || buf_size == 0) return -1;
-	memset(out_buf, 0, buf_size);
+	net_call_t *call = call_start(ip, port, CALL_MESSAGE, FRAME_MSG, msg, strnlen(msg, FRAME_MAX_REQUEST), NULL, 0);
+	if (call && !call->session) call->result = legacy_message(ip, port, msg);
+	return call;
+}
+
+void send_message(const char *ip, int port, const char *msg)
+{
+	net_call_wait(send_message_async(ip, port, msg));
+}
+
+static int legacy_exec(const char *ip, int port, const char *cmd, char *out_buf, size_t buf_size)
+{
+	char protocol_msg[1024];
+	snprintf(protocol_msg, sizeof(protocol_msg), "EXEC %s", cmd);
 
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (sock < 0) return -1;
@@ -79,9 +847,6 @@ int send_command_with_response(const char *ip, int port, const char *cmd, char *
 		return -1;
 	}
 
-	char protocol_msg[1024];
-	snprintf(protocol_msg, sizeof(protocol_msg), "EXEC %s", cmd);
-
 	if (send(sock, protocol_msg, strlen(protocol_msg), 0) < 0) {
 		close(sock);
 		return -1;
@@ -100,7 +865,22 @@ int send_command_with_response(const char *ip, int port, const char *cmd, char *
 	return 0;
 }
 
-int get_server_stats(const char *ip, int port, float *cpu, size_t *mem_used, size_t *mem_total)
+net_call_t *send_command_async(const char *ip, int port, const char *cmd, char *out_buf, size_t buf_size)
+{
+	if (!out_buf || buf_size == 0) return NULL;
+	memset(out_buf, 0, buf_size);
+
+	net_call_t *call = call_start(ip, port, CALL_EXEC, FRAME_EXEC, cmd, strnlen(cmd, FRAME_MAX_REQUEST), out_buf, buf_size);
+	if (call && !call->session) call->result = legacy_exec(ip, port, cmd, out_buf, buf_size);
+	return call;
+}
+
+int send_command_with_response(const char *ip, int port, const char *cmd, char *out_buf, size_t buf_size)
+{
+	return net_call_wait(send_command_async(ip, port, cmd, out_buf, buf_size));
+}
+
+static int legacy_stats(const char *ip, int port, float *cpu, size_t *mem_used, size_t *mem_total)
 {
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (sock < 0) return -1;
@@ -143,84 +923,1467 @@ int get_server_stats(const char *ip, int port, float *cpu, size_t *mem_used, siz
 	return -1;
 }
 
-int send_file_to_server(const char *ip, int port, const char *filepath, progress_cb_t callback)
+net_call_t *get_server_stats_async(const char *ip, int port, float *cpu, size_t *mem_used, size_t *mem_total)
 {
-	FILE *fp = fopen(filepath, "rb");
-	if (!fp) return -1;
-
-	fseek(fp, 0L, SEEK_END);
-	size_t filesize = ftell(fp);
-	rewind(fp);
+	net_call_t *call = call_start(ip, port, CALL_STATS, FRAME_STATS, NULL, 0, NULL, 0);
+	if (!call) return NULL;
+	call->cpu = cpu;
+	call->mem_used = mem_used;
+	call->mem_total = mem_total;
+	if (!call->session) call->result = legacy_stats(ip, port, cpu, mem_used, mem_total);
+	return call;
+}
 
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock < 0) {
-		fclose(fp);
-		return -1;
-	}
+int get_server_stats(const char *ip, int port, float *cpu, size_t *mem_used, size_t *mem_total)
+{
+	return net_call_wait(get_server_stats_async(ip, port, cpu, mem_used, mem_total));
+}
 
-	struct sockaddr_in serv_addr;
-	memset(&serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_port = htons(port);
-	inet_pton(AF_INET, ip, &serv_addr.sin_addr);
+static unsigned long long progress_clock_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (unsigned long long)ts.tv_sec * 1000ULL + (unsigned long long)ts.tv_nsec / 1000000ULL;
+}
 
-	if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-		close(sock);
-		fclose(fp);
-		return -1;
+/* Moves len bytes of fd at *offset to the socket; copies if sendfile cannot. */
+static int send_range(int sock, int fd, off_t *offset, size_t len, bool *copy)
+{
+	while (len > 0 && !*copy) {
+		ssize_t n = sendfile(sock, fd, offset, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			*copy = true;
+			break;
+		}
+		if (n <= 0) return -1;
+		len -= (size_t)n;
 	}
 
-	if (perform_auth(sock, connection_password) != 0) {
-		close(sock);
-		fclose(fp);
-		return -1;
+	char buffer[65536];
+	while (len > 0) {
+		size_t want = len < sizeof(buffer) ? len : sizeof(buffer);
+		ssize_t n = pread(fd, buffer, want, *offset);
+		if (n <= 0 || send_all(sock, buffer, (size_t)n) != 0) return -1;
+		*offset += n;
+		len -= (size_t)n;
 	}
+	return 0;
+}
 
-	char filename_copy[256];
-	strncpy(filename_copy, filepath, 255);
-	char *base_name = basename(filename_copy);
-
-	char header[512];
-	snprintf(header, sizeof(header), "FILE %s %zu", base_name, filesize);
-	send(sock, header, strlen(header), 0);
-
-	char ack[16] = {0};
-	recv(sock, ack, 15, 0);
-	if (strncmp(ack, "GO", 2) != 0) {
-		close(sock);
-		fclose(fp);
-		return -2;
-	}
+static void progress_init(upload_progress_t *p, progress_cb_t callback, size_t total, int streams)
+{
+	p->callback = callback;
+	p->total = total;
+	p->base = 0;
+	p->streams = streams;
+	atomic_init(&p->sent, 0);
+	p->start = progress_clock_ms();
+	p->next = p->start + PROGRESS_INTERVAL_MS;
+	p->compress = false;
+	atomic_init(&p->lz_raw, 0);
+	atomic_init(&p->lz_wire, 0);
+	atomic_init(&p->lz_cpu_ns, 0);
+}
 
-	char buffer[8192];
-	size_t total_sent = 0;
-	struct timeval start, now;
-	gettimeofday(&start, NULL);
+/* What compression did for an upload, for its result. */
+static void progress_result(upload_progress_t *p, upload_result_t *result)
+{
+	result->compressed = atomic_load(&p->lz_raw);
+	result->compressed_wire = atomic_load(&p->lz_wire);
+	result->compress_ms = atomic_load(&p->lz_cpu_ns) / 1e6;
+}
 
-	while (total_sent < filesize) {
-		size_t bytes_read = fread(buffer, 1, sizeof(buffer), fp);
-		if (bytes_read == 0) break;
+/* Reports the bytes sent on every stream so far, at most once per interval unless final. */
+static void progress_report(upload_progress_t *p, bool final)
+{
+	unsigned long long now = progress_clock_ms();
+	if (!p->callback || (!final && now < p->next)) return;
 
-		ssize_t bytes_sent = send(sock, buffer, bytes_read, 0);
-		if (bytes_sent < 0) break;
+	size_t sent = atomic_load(&p->sent);
+	double elapsed = (now - p->start) / 1000.0;
+	double speed = elapsed > 0 ? ((sent - p->base) / (1024.0 * 1024.0)) / elapsed : 0.0;
+	p->callback(sent, p->total, speed, p->streams);
+	p->next = now + PROGRESS_INTERVAL_MS;
+}
 
-		total_sent += bytes_sent;
+/*
+ * The next run of data in [offset, end) of fd: it starts at *data, which
+ * is end when only a hole is left, and stops at *hole. Filesystems
+ * without SEEK_DATA report the whole range as data.
+ */
+static void file_extent(int fd, off_t offset, off_t end, off_t *data, off_t *hole)
+{
+	*data = lseek(fd, offset, SEEK_DATA);
+	if (*data < 0) *data = errno == ENXIO ? end : offset;
+	if (*data > end) *data = end;
+	*hole = *data < end ? lseek(fd, *data, SEEK_HOLE) : end;
+	if (*hole < 0 || *hole > end) *hole = end;
+}
 
-		gettimeofday(&now, NULL);
-		double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1000000.0;
-		double speed = 0.0;
-		if (elapsed > 0) {
-			speed = (total_sent / (1024.0 * 1024.0)) / elapsed;
+/* Folds len bytes of fd at offset into *crc; holes are folded in without being read. */
+static int file_crc(int fd, off_t offset, size_t len, uint32_t *crc)
+{
+	char buffer[CRC_BUF_SIZE];
+	off_t end = offset + (off_t)len;
+	while (offset < end) {
+		off_t data, hole;
+		file_extent(fd, offset, end, &data, &hole);
+		*crc = crc32c_zeros(*crc, (uint64_t)(data - offset));
+		for (offset = data; offset < hole;) {
+			size_t want = (size_t)(hole - offset) < sizeof(buffer) ? (size_t)(hole - offset) : sizeof(buffer);
+			ssize_t n = pread(fd, buffer, want, offset);
+			if (n <= 0) return -1;
+			*crc = crc32c_update(*crc, buffer, (size_t)n);
+			offset += n;
+		}
+	}
+	return 0;
+}
+
+static void *hasher_run(void *arg)
+{
+	file_hasher_t *h = arg;
+	off_t offset = h->offset;
+	size_t len = h->len;
+
+	while (len > 0 && h->result == 0 && !atomic_load(&h->stop)) {
+		size_t window = len < FRAME_DATA_CHUNK ? len : FRAME_DATA_CHUNK;
+		h->result = file_crc(h->fd, offset, window, &h->crc);
+		offset += (off_t)window;
+		len -= window;
+	}
+	if (len > 0) h->result = -1;
+	return NULL;
+}
+
+static void hasher_start(file_hasher_t *h, int fd, off_t offset, size_t len)
+{
+	h->fd = fd;
+	h->offset = offset;
+	h->len = len;
+	h->crc = 0;
+	h->result = 0;
+	atomic_init(&h->stop, false);
+	h->started = pthread_create(&h->thread, NULL, hasher_run, h) == 0;
+}
+
+/* Waits for the CRC of the range; abandon stops it early after a failed send. */
+static int hasher_finish(file_hasher_t *h, bool abandon, uint32_t *crc)
+{
+	if (abandon) atomic_store(&h->stop, true);
+	if (h->started) pthread_join(h->thread, NULL);
+	else if (!abandon) hasher_run(h);
+	else h->result = -1;
+	*crc = h->crc;
+	return h->result;
+}
+
+static unsigned long long thread_cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static int pread_all(int fd, void *buf, size_t len, off_t offset)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = pread(fd, p, len, offset);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		offset += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+/*
+ * Whether a range is worth compressing: its first LZ_SAMPLE_BLOCKS blocks
+ * of LZ_SAMPLE_SIZE must shrink by at least 1/LZ_MIN_SAVING. Files that
+ * are already compressed fail here and keep the sendfile() path.
+ */
+static bool lz_sample(int fd, off_t offset, size_t len, upload_progress_t *progress)
+{
+	unsigned char *buf = malloc(LZ_SAMPLE_SIZE + lz_bound(LZ_SAMPLE_SIZE));
+	unsigned long long start = thread_cpu_ns();
+	size_t raw = 0, packed = 0;
+
+	for (int i = 0; buf && i < LZ_SAMPLE_BLOCKS && raw < len; i++) {
+		size_t want = len - raw < LZ_SAMPLE_SIZE ? len - raw : LZ_SAMPLE_SIZE;
+		if (pread_all(fd, buf, want, offset + (off_t)raw) != 0) break;
+		size_t n = lz_compress(buf, want, buf + LZ_SAMPLE_SIZE, lz_bound(want));
+		raw += want;
+		packed += n ? n : want;
+	}
+	atomic_fetch_add(&progress->lz_cpu_ns, thread_cpu_ns() - start);
+	free(buf);
+	return raw > 0 && packed <= raw - raw / LZ_MIN_SAVING;
+}
+
+/*
+ * Sends len bytes of fd from offset with sendfile() in windows of
+ * FRAME_DATA_CHUNK. A non-zero frame_id wraps each window in a DATA frame
+ * for a binary connection; zero sends the bytes raw. Bytes are added to
+ * progress; a single-stream upload also reports from here, while parallel
+ * uploads are reported by the thread that waits for the streams.
+ */
+static size_t stream_raw(int sock, int fd, off_t offset, size_t len, uint32_t frame_id,
+			 upload_progress_t *progress)
+{
+	off_t end = offset + (off_t)len;
+	size_t sent = 0;
+	bool copy = false;
+
+	while (offset < end) {
+		size_t window = (size_t)(end - offset);
+		if (window > FRAME_DATA_CHUNK) window = FRAME_DATA_CHUNK;
+
+		if (frame_id) {
+			unsigned char head[FRAME_HEADER_SIZE];
+			frame_encode(head, FRAME_DATA, offset + (off_t)window < end ? FRAME_F_MORE : 0, (uint32_t)window, frame_id);
+			if (send(sock, head, sizeof(head), MSG_NOSIGNAL | MSG_MORE) != (ssize_t)sizeof(head)) break;
+		}
+		if (send_range(sock, fd, &offset, window, &copy) != 0) break;
+
+		sent += window;
+		atomic_fetch_add(&progress->sent, window);
+		if (progress->streams == 1) progress_report(progress, offset == end);
+	}
+	return sent;
+}
+
+/*
+ * As stream_raw() with DATA frames, but each window is read and sent as
+ * an lz block with FRAME_F_LZ when that saves at least 1/LZ_MIN_SAVING of
+ * it, and as it is otherwise. After LZ_GIVE_UP windows in a row that do
+ * not compress, the rest goes out with sendfile().
+ */
+static size_t stream_packed(int sock, int fd, off_t offset, size_t len, uint32_t frame_id,
+			    upload_progress_t *progress)
+{
+	off_t end = offset + (off_t)len;
+	unsigned char *raw = malloc(FRAME_DATA_CHUNK);
+	unsigned char *packed = malloc(LZ_HEAD_SIZE + FRAME_DATA_CHUNK);
+	bool ok = raw && packed;
+	size_t sent = 0;
+	int misses = 0;
+
+	while (ok && offset < end && misses < LZ_GIVE_UP) {
+		size_t window = (size_t)(end - offset);
+		if (window > FRAME_DATA_CHUNK) window = FRAME_DATA_CHUNK;
+		uint8_t more = offset + (off_t)window < end ? FRAME_F_MORE : 0;
+		if (pread_all(fd, raw, window, offset) != 0) {
+			ok = false;
+			break;
+		}
+
+		unsigned long long start = thread_cpu_ns();
+		size_t n = lz_compress(raw, window, packed + LZ_HEAD_SIZE, window - window / LZ_MIN_SAVING);
+		atomic_fetch_add(&progress->lz_cpu_ns, thread_cpu_ns() - start);
+		atomic_fetch_add(&progress->lz_raw, window);
+		atomic_fetch_add(&progress->lz_wire, n ? LZ_HEAD_SIZE + n : window);
+		if (n) put_u32(packed, (uint32_t)window);
+		ok = n ? frame_send(sock, FRAME_DATA, more | FRAME_F_LZ, frame_id, packed, LZ_HEAD_SIZE + n) == 0
+		       : frame_send(sock, FRAME_DATA, more, frame_id, raw, window) == 0;
+		if (!ok) break;
+		misses = n ? 0 : misses + 1;
+
+		offset += (off_t)window;
+		sent += window;
+		atomic_fetch_add(&progress->sent, window);
+		if (progress->streams == 1) progress_report(progress, offset == end);
+	}
+	free(raw);
+	free(packed);
+	if (ok && offset < end) sent += stream_raw(sock, fd, offset, (size_t)(end - offset), frame_id, progress);
+	return sent;
+}
+
+/* Sends a range as DATA frames, compressed when progress allows it and a sample says it pays. */
+static size_t stream_file(int sock, int fd, off_t offset, size_t len, uint32_t frame_id,
+			  upload_progress_t *progress)
+{
+	if (frame_id && progress->compress && len >= LZ_SAMPLE_SIZE / 8 && lz_sample(fd, offset, len, progress))
+		return stream_packed(sock, fd, offset, len, frame_id, progress);
+	return stream_raw(sock, fd, offset, len, frame_id, progress);
+}
+
+/*
+ * As stream_file() with DATA frames, but only the data extents of fd are
+ * read and sent; each hole between them goes out as one HOLE frame.
+ */
+static size_t stream_sparse(int sock, int fd, off_t offset, size_t len, uint32_t frame_id,
+			    upload_progress_t *progress)
+{
+	off_t end = offset + (off_t)len;
+	size_t sent = 0;
+
+	while (offset < end) {
+		off_t data, hole;
+		file_extent(fd, offset, end, &data, &hole);
+		if (data > offset) {
+			unsigned char gap[HOLE_PAYLOAD_SIZE];
+			put_u64(gap, (uint64_t)(data - offset));
+			if (frame_send(sock, FRAME_HOLE, 0, frame_id, gap, sizeof(gap)) != 0) break;
+			sent += (size_t)(data - offset);
+			atomic_fetch_add(&progress->sent, (size_t)(data - offset));
+			progress_report(progress, data == end);
+			offset = data;
+			continue;
+		}
+		size_t run = stream_file(sock, fd, offset, (size_t)(hole - offset), frame_id, progress);
+		sent += run;
+		if (run != (size_t)(hole - offset)) break;
+		offset = hole;
+	}
+	return sent;
+}
+
+/* Sends one request on the session and waits for its reply, kept in out if given. */
+static int session_call(session_t *s, uint8_t type, const void *payload, size_t len, net_call_t *call,
+			char *out, size_t size)
+{
+	call_init(call, s, CALL_CONTROL, type, payload, len, out, size);
+	call_submit(call);
+	call_wait(call);
+	if (call->status != 0) return -1;
+	if (call->reply_type == FRAME_BUSY) return NET_ERR_BUSY;
+	return call->reply_type == FRAME_OK ? 0 : -2;
+}
+
+/*
+ * Sends the request in call and waits for GO. On success send_lock stays
+ * held, so nothing else interleaves on the wire until session_stream_end(),
+ * and the socket is returned; otherwise -1, -2 or NET_ERR_BUSY.
+ */
+static int session_stream_begin(session_t *s, net_call_t *call)
+{
+	pthread_mutex_lock(&s->send_lock);
+	int sock = call_register(s, call);
+	if (sock >= 0 && frame_send(sock, call->type, 0, call->id, call->req, call->req_len) != 0)
+		session_break(s, sock);
+	call_wait(call);
+	if (call->status != 0 || call->reply_type != FRAME_GO || call_relink(s, call) != 0) {
+		pthread_mutex_unlock(&s->send_lock);
+		if (call->status != 0 || call->reply_type == FRAME_GO) return -1;
+		return call->reply_type == FRAME_BUSY ? NET_ERR_BUSY : -2;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->streaming = true;
+	pthread_mutex_unlock(&s->lock);
+	return sock;
+}
+
+/* Whether uploads on s may send compressed DATA frames. */
+static bool upload_compress(const session_t *s)
+{
+	return (s->caps & CAP_LZ) && atomic_load(&wire_compression);
+}
+
+/* Releases send_lock; a stream that stopped short leaves the session unusable. */
+static void session_stream_end(session_t *s, int sock, bool complete)
+{
+	pthread_mutex_lock(&s->lock);
+	s->streaming = false;
+	s->last_io = time(NULL);
+	pthread_mutex_unlock(&s->lock);
+	if (!complete) session_break(s, sock);
+	pthread_mutex_unlock(&s->send_lock);
+}
+
+/*
+ * Uploads over the session. send_lock is held from FILE until the last DATA
+ * frame; replies to requests issued earlier keep arriving meanwhile. The
+ * final OK is awaited without the lock.
+ *
+ * With CAP_RESUME the server is first asked how much of the file it holds
+ * from an interrupted upload. If the CRC32C of that prefix matches the
+ * local file, RESUME sends only the rest, followed by the CRC32C of the
+ * whole file, and the server keeps the file only if it matches. The CRC is
+ * returned in *digest either way. With CAP_SPARSE the holes of a sparse
+ * file are sent as HOLE frames rather than as zeros.
+ */
+static int session_send_file(session_t *s, const char *name, int fd, size_t filesize, progress_cb_t callback,
+			     upload_result_t *result)
+{
+	unsigned char request[RESUME_PAYLOAD_MIN + 256];
+	size_t name_len = strnlen(name, 255);
+	bool resume = (s->caps & CAP_RESUME) != 0;
+	uint64_t offset = 0;
+	uint32_t crc = 0;
+	size_t head = resume ? RESUME_PAYLOAD_MIN : FILE_PAYLOAD_MIN;
+	net_call_t call;
+
+	put_u64(request, filesize);
+	memcpy(request + PARTIAL_PAYLOAD_MIN, name, name_len);
+	if (resume) {
+		int res = session_call(s, FRAME_PARTIAL, request, PARTIAL_PAYLOAD_MIN + name_len, &call, NULL, 0);
+		if (res == NET_ERR_BUSY || res == -1) return res;
+		if (res == 0 && call.len >= PARTIAL_REPLY_SIZE) {
+			const unsigned char *p = (const unsigned char *)call.reply;
+			uint32_t local = 0;
+			offset = get_u64(p);
+			crc = get_u32(p + 8);
+			if (offset > filesize || file_crc(fd, 0, (size_t)offset, &local) != 0 || local != crc) {
+				offset = 0;
+				crc = 0;
+			}
 		}
+		put_u64(request + 8, offset);
+		memcpy(request + RESUME_PAYLOAD_MIN, name, name_len);
+	}
+
+	call_init(&call, s, CALL_CONTROL, resume ? FRAME_RESUME : FRAME_FILE, request, head + name_len, NULL, 0);
+	int sock = session_stream_begin(s, &call);
+	if (sock < 0) return sock;
+
+	size_t len = filesize - (size_t)offset;
+	upload_progress_t progress;
+	file_hasher_t hasher;
+	progress_init(&progress, callback, filesize, 1);
+	progress.base = (size_t)offset;
+	progress.compress = upload_compress(s);
+	atomic_store(&progress.sent, (size_t)offset);
+
+	hasher_start(&hasher, fd, (off_t)offset, len);
+	size_t sent = (s->caps & CAP_SPARSE) ? stream_sparse(sock, fd, (off_t)offset, len, call.id, &progress)
+					     : stream_file(sock, fd, (off_t)offset, len, call.id, &progress);
+	uint32_t rest;
+	bool hashed = hasher_finish(&hasher, sent != len, &rest) == 0;
+	crc = crc32c_combine(crc, rest, len);
+	if (resume && sent == len) {
+		unsigned char sum[CHECKSUM_PAYLOAD_SIZE];
+		put_u32(sum, crc);
+		if (!hashed || frame_send(sock, FRAME_CHECKSUM, 0, call.id, sum, sizeof(sum)) != 0) sent = 0;
+	}
+	session_stream_end(s, sock, sent == len);
+
+	call_wait(&call);
+	bool ok = sent == len && hashed && call.status == 0 && call.reply_type == FRAME_OK
+	    && call.len >= 8 && get_u64((const unsigned char *)call.reply) == filesize;
+	if (!ok) return -1;
+	result->crc32c = crc;
+	progress_result(&progress, result);
+	return 0;
+}
+
+/* Sends the runs of a delta plan: new bytes as DATA, stored blocks as COPY. */
+static bool delta_send(int sock, int fd, const delta_plan_t *plan, uint32_t id, upload_progress_t *progress)
+{
+	for (size_t i = 0; i < plan->count; i++) {
+		const delta_op_t *op = &plan->ops[i];
+		if (!op->copy) {
+			if (stream_file(sock, fd, (off_t)op->offset, op->len, id, progress) != op->len) return false;
+			continue;
+		}
+		unsigned char copy[COPY_PAYLOAD_SIZE];
+		put_u32(copy, op->block);
+		put_u32(copy + 4, op->count);
+		if (frame_send(sock, FRAME_COPY, 0, id, copy, sizeof(copy)) != 0) return false;
+		atomic_fetch_add(&progress->sent, op->len);
+		progress_report(progress, i + 1 == plan->count);
+	}
+	return true;
+}
+
+/* SHA-256 of the whole file, the key the server stores content by, and its CRC32C. */
+static int file_key(int fd, size_t filesize, unsigned char sha[SHA256_SIZE], uint32_t *crc)
+{
+	char buffer[CRC_BUF_SIZE];
+	struct Sha256 state;
+	off_t offset = 0;
+
+	sha256_init(&state);
+	*crc = 0;
+	while ((size_t)offset < filesize) {
+		size_t want = filesize - (size_t)offset;
+		if (want > sizeof(buffer)) want = sizeof(buffer);
+		ssize_t n = pread(fd, buffer, want, offset);
+		if (n <= 0) return -1;
+		sha256_update(&state, buffer, (size_t)n);
+		*crc = crc32c_update(*crc, buffer, (size_t)n);
+		offset += n;
+	}
+	sha256_digest(&state, sha);
+	return 0;
+}
+
+/*
+ * Stores the file without sending it when the server already holds the
+ * same content. PROBE is cheap; only when content of the same size is
+ * stored is the file hashed and LINK sent, naming that content. Returns
+ * UPLOAD_FALLBACK when the bytes have to be sent after all.
+ */
+static int session_send_link(session_t *s, const char *name, int fd, size_t filesize, progress_cb_t callback,
+			     upload_result_t *result)
+{
+	unsigned char probe[PROBE_PAYLOAD_SIZE];
+	net_call_t call;
+
+	put_u64(probe, filesize);
+	int res = session_call(s, FRAME_PROBE, probe, sizeof(probe), &call, NULL, 0);
+	if (res == -1 || res == NET_ERR_BUSY) return res;
+	if (res != 0 || call.len < PROBE_REPLY_SIZE || get_u32((const unsigned char *)call.reply) == 0)
+		return UPLOAD_FALLBACK;
+
+	unsigned char sha[SHA256_SIZE];
+	uint32_t crc;
+	if (file_key(fd, filesize, sha, &crc) != 0) return UPLOAD_FALLBACK;
+
+	size_t name_len = strnlen(name, 255);
+	unsigned char request[LINK_PAYLOAD_MIN + 256];
+	put_u64(request, filesize);
+	memcpy(request + 8, sha, SHA256_SIZE);
+	memcpy(request + LINK_PAYLOAD_MIN, name, name_len);
+	res = session_call(s, FRAME_LINK, request, LINK_PAYLOAD_MIN + name_len, &call, NULL, 0);
+	if (res == -1 || res == NET_ERR_BUSY) return res;
+	if (res != 0) return UPLOAD_FALLBACK;
+	if (call.len < 8 || get_u64((const unsigned char *)call.reply) != filesize) return -1;
+
+	if (callback) callback(filesize, filesize, 0.0, 1);
+	result->crc32c = crc;
+	result->reused = filesize;
+	result->deduplicated = true;
+	return 0;
+}
+
+/*
+ * Uploads a new version of a file the server already holds. SIGNATURE
+ * returns the block checksums of the stored copy, the local file is
+ * searched for those blocks at every offset, and DELTA sends only the
+ * bytes in between; the server copies the rest from its own copy. Returns
+ * UPLOAD_FALLBACK when there is no stored copy, when it changed before
+ * DELTA, or when less than 1/DELTA_MIN_SAVING of the file would be
+ * saved, so the caller sends the whole file instead.
+ */
+static int session_send_delta(session_t *s, const char *name, int fd, size_t filesize, progress_cb_t callback,
+			      upload_result_t *result)
+{
+	size_t name_len = strnlen(name, 255);
+	size_t sig_size = SIGNATURE_HEAD_SIZE + (size_t)DELTA_MAX_BLOCKS * SIGNATURE_ENTRY_SIZE + 1;
+	char *sig = malloc(sig_size);
+	if (!sig || filesize == 0) {
+		free(sig);
+		return UPLOAD_FALLBACK;
+	}
+
+	net_call_t call;
+	int res = session_call(s, FRAME_SIGNATURE, name, name_len, &call, sig, sig_size);
+	const unsigned char *p = (const unsigned char *)sig;
+	bool usable = res == 0 && call.len >= SIGNATURE_HEAD_SIZE && get_u32(p) > 0
+	    && call.len == SIGNATURE_HEAD_SIZE + (size_t)get_u32(p + 12) * SIGNATURE_ENTRY_SIZE;
+	if (!usable) {
+		free(sig);
+		return res == -1 || res == NET_ERR_BUSY ? res : UPLOAD_FALLBACK;
+	}
+	size_t block = get_u32(p);
+	uint64_t stored = get_u64(p + 4);
+
+	unsigned char *data = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		free(sig);
+		return UPLOAD_FALLBACK;
+	}
+	madvise(data, filesize, MADV_SEQUENTIAL);
+
+	file_hasher_t hasher;
+	delta_plan_t plan;
+	uint32_t crc;
+	hasher_start(&hasher, fd, 0, filesize);
+	res = delta_plan_build(&plan, data, filesize, p + SIGNATURE_HEAD_SIZE, get_u32(p + 12), block);
+	munmap(data, filesize);
+	free(sig);
+	if (res != 0 || plan.reused == 0 || plan.reused < filesize / DELTA_MIN_SAVING) {
+		hasher_finish(&hasher, true, &crc);
+		if (res == 0) delta_plan_free(&plan);
+		return UPLOAD_FALLBACK;
+	}
+
+	unsigned char request[DELTA_PAYLOAD_MIN + 256];
+	put_u64(request, filesize);
+	put_u64(request + 8, stored);
+	put_u32(request + 16, (uint32_t)block);
+	memcpy(request + DELTA_PAYLOAD_MIN, name, name_len);
+	call_init(&call, s, CALL_CONTROL, FRAME_DELTA, request, DELTA_PAYLOAD_MIN + name_len, NULL, 0);
+	int sock = session_stream_begin(s, &call);
+	if (sock < 0) {
+		hasher_finish(&hasher, true, &crc);
+		delta_plan_free(&plan);
+		return sock == -2 ? UPLOAD_FALLBACK : sock;
+	}
+
+	upload_progress_t progress;
+	progress_init(&progress, callback, filesize, 1);
+	progress.compress = upload_compress(s);
+	bool sent = delta_send(sock, fd, &plan, call.id, &progress);
+	bool hashed = hasher_finish(&hasher, !sent, &crc) == 0;
+	if (sent) {
+		unsigned char sum[CHECKSUM_PAYLOAD_SIZE];
+		put_u32(sum, crc);
+		sent = hashed && frame_send(sock, FRAME_CHECKSUM, 0, call.id, sum, sizeof(sum)) == 0;
+	}
+	session_stream_end(s, sock, sent);
+	delta_plan_free(&plan);
+
+	call_wait(&call);
+	if (sent && call.status == 0 && call.reply_type == FRAME_ERR) return UPLOAD_FALLBACK;
+	const unsigned char *reply = (const unsigned char *)call.reply;
+	if (!sent || call.status != 0 || call.reply_type != FRAME_OK || call.len < DELTA_REPLY_SIZE
+	    || get_u64(reply) != filesize)
+		return -1;
+	result->crc32c = crc;
+	result->reused = (size_t)get_u64(reply + 8);
+	progress_result(&progress, result);
+	return 0;
+}
+
+/* Opens and greets a connection of its own to the server of s; conn holds its read buffer. */
+static int session_dial(const session_t *s, session_t *conn)
+{
+	int sock = dial(s->ip, s->port, SESSION_IO_TIMEOUT_SEC);
+	if (sock < 0) return -1;
+
+	memcpy(conn->password, s->password, sizeof(conn->password));
+	int res = session_greet(conn, sock);
+	if (res != 0) {
+		close(sock);
+		return res;
+	}
+	return sock;
+}
+
+/*
+ * Sends one range of a parallel upload on a connection of its own: HELLO
+ * and AUTH, then RANGE, GO and the DATA frames, answered by OK with the
+ * byte count.
+ */
+static void *range_worker(void *arg)
+{
+	range_job_t *job = arg;
+	parallel_upload_t *up = job->upload;
+	session_t *conn = calloc(1, sizeof(*conn));
+	int sock = conn ? session_dial(up->session, conn) : -1;
+
+	job->result = sock < 0 ? sock : 0;
+	if (job->result == 0) {
+		unsigned char request[RANGE_PAYLOAD_SIZE];
+		put_u32(request, up->id);
+		put_u64(request + 4, (uint64_t)job->offset);
+		put_u64(request + 12, job->len);
+
+		struct FrameHeader h;
+		unsigned char reply[8];
+		uint32_t id = session_next_id(conn);
+		job->result = -1;
+		if (frame_send(sock, FRAME_RANGE, 0, id, request, sizeof(request)) == 0
+		    && session_read_frame(conn, sock, &h, reply, sizeof(reply)) >= 0) {
+			if (h.type == FRAME_BUSY)
+				job->result = NET_ERR_BUSY;
+			else if (h.type == FRAME_GO) {
+				file_hasher_t hasher;
+				hasher_start(&hasher, up->fd, job->offset, job->len);
+				bool sent = stream_file(sock, up->fd, job->offset, job->len, id, &up->progress) == job->len;
+				if (hasher_finish(&hasher, !sent, &job->crc) == 0 && sent
+				    && session_read_frame(conn, sock, &h, reply, sizeof(reply)) == 8
+				    && h.type == FRAME_OK && get_u64(reply) == job->len)
+					job->result = 0;
+			}
+		}
+		frame_send(sock, FRAME_QUIT, 0, session_next_id(conn), NULL, 0);
+	}
+	if (sock >= 0) close(sock);
+	free(conn);
+
+	pthread_mutex_lock(&up->lock);
+	up->running--;
+	pthread_cond_signal(&up->cond);
+	pthread_mutex_unlock(&up->lock);
+	return NULL;
+}
+
+/* The share of one stream of a parallel transfer, a multiple of PARALLEL_RANGE_ALIGN. */
+static size_t stream_range(size_t filesize, int streams)
+{
+	size_t range = (filesize + (size_t)streams - 1) / (size_t)streams;
+	return (range + PARALLEL_RANGE_ALIGN - 1) / PARALLEL_RANGE_ALIGN * PARALLEL_RANGE_ALIGN;
+}
+
+/* Waits for *running to drop to zero, reporting progress meanwhile. */
+static void workers_wait(pthread_mutex_t *lock, pthread_cond_t *cond, int *running, upload_progress_t *progress)
+{
+	pthread_mutex_lock(lock);
+	while (*running > 0) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += PROGRESS_INTERVAL_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(cond, lock, &deadline);
+		pthread_mutex_unlock(lock);
+		progress_report(progress, false);
+		pthread_mutex_lock(lock);
+	}
+	pthread_mutex_unlock(lock);
+}
+
+/*
+ * Splits the file into one range per stream, each a multiple of
+ * PARALLEL_RANGE_ALIGN, and sends them at once over separate connections.
+ * The server writes every range in place and only renames the file into
+ * storage/ on COMMIT, once all of them have arrived and their combined
+ * CRC32C matches the file's. If the server still holds ranges of an
+ * interrupted upload of this file, those whose CRC matches the local
+ * bytes are not sent again.
+ */
+static int session_send_parallel(session_t *s, const char *name, int fd, size_t filesize, int streams, progress_cb_t callback,
+				 upload_result_t *result)
+{
+	unsigned char request[UPLOAD_PAYLOAD_MIN + 256];
+	size_t name_len = strnlen(name, 255);
+	put_u64(request, filesize);
+	memcpy(request + UPLOAD_PAYLOAD_MIN, name, name_len);
+
+	net_call_t call;
+	char reply[4 + UPLOAD_DONE_MAX * DONE_RANGE_SIZE + 1];
+	int res = session_call(s, FRAME_UPLOAD, request, UPLOAD_PAYLOAD_MIN + name_len, &call, reply, sizeof(reply));
+	if (res != 0) return res;
+	if (call.len < 4) return -1;
+	const unsigned char *stored = (const unsigned char *)reply + 4;
+	size_t stored_count = (call.len - 4) / DONE_RANGE_SIZE;
+
+	parallel_upload_t up;
+	memset(&up, 0, sizeof(up));
+	up.session = s;
+	up.id = get_u32((const unsigned char *)reply);
+	up.fd = fd;
+	pthread_mutex_init(&up.lock, NULL);
+	pthread_cond_init(&up.cond, NULL);
+
+	size_t range = stream_range(filesize, streams);
+	range_job_t jobs[UPLOAD_STREAMS_MAX];
+	int count = 0;
+	for (size_t offset = 0; offset < filesize; offset += range, count++) {
+		jobs[count].upload = &up;
+		jobs[count].offset = (off_t)offset;
+		jobs[count].len = filesize - offset < range ? filesize - offset : range;
+		jobs[count].stored = false;
+		jobs[count].crc = 0;
+		jobs[count].result = -1;
+		jobs[count].started = false;
+		for (size_t i = 0; i < stored_count; i++) {
+			const unsigned char *p = stored + i * DONE_RANGE_SIZE;
+			if (get_u64(p) == offset && get_u64(p + 8) == jobs[count].len) {
+				jobs[count].stored = true;
+				jobs[count].stored_crc = get_u32(p + 16);
+			}
+		}
+	}
+	progress_init(&up.progress, callback, filesize, count);
+	up.progress.compress = upload_compress(s);
+
+	for (int i = 0; i < count; i++) {
+		if (jobs[i].stored && file_crc(fd, jobs[i].offset, jobs[i].len, &jobs[i].crc) == 0
+		    && jobs[i].crc == jobs[i].stored_crc) {
+			jobs[i].result = 0;
+			up.progress.base += jobs[i].len;
+			atomic_fetch_add(&up.progress.sent, jobs[i].len);
+			continue;
+		}
+		jobs[i].crc = 0;
+		pthread_mutex_lock(&up.lock);
+		up.running++;
+		pthread_mutex_unlock(&up.lock);
+		jobs[i].started = pthread_create(&jobs[i].thread, NULL, range_worker, &jobs[i]) == 0;
+		if (!jobs[i].started) {
+			pthread_mutex_lock(&up.lock);
+			up.running--;
+			pthread_mutex_unlock(&up.lock);
+		}
+	}
+
+	workers_wait(&up.lock, &up.cond, &up.running, &up.progress);
+
+	res = 0;
+	for (int i = 0; i < count; i++) {
+		if (jobs[i].started) pthread_join(jobs[i].thread, NULL);
+		if (jobs[i].result == NET_ERR_BUSY) res = NET_ERR_BUSY;
+		else if (jobs[i].result != 0 && res == 0) res = -1;
+	}
+	pthread_mutex_destroy(&up.lock);
+	pthread_cond_destroy(&up.cond);
+	if (res != 0) return res;
+	progress_report(&up.progress, true);
+
+	uint32_t crc = 0;
+	for (int i = 0; i < count; i++)
+		crc = crc32c_combine(crc, jobs[i].crc, jobs[i].len);
+
+	unsigned char commit[COMMIT_PAYLOAD_CRC];
+	put_u32(commit, up.id);
+	put_u32(commit + 4, crc);
+	res = session_call(s, FRAME_COMMIT, commit, sizeof(commit), &call, NULL, 0);
+	if (res != 0) return res == -2 ? -1 : res;
+	if (call.len < 8 || get_u64((const unsigned char *)call.reply) != filesize) return -1;
+	result->crc32c = crc;
+	progress_result(&up.progress, result);
+	return 0;
+}
+
+void net_set_upload_streams(int streams)
+{
+	if (streams < 1) streams = 1;
+	if (streams > UPLOAD_STREAMS_MAX) streams = UPLOAD_STREAMS_MAX;
+	atomic_store(&upload_streams, streams);
+}
+
+void net_set_delta_uploads(bool enabled)
+{
+	atomic_store(&delta_uploads, enabled);
+}
+
+void net_set_compression(bool enabled)
+{
+	atomic_store(&wire_compression, enabled);
+}
+
+int send_file_to_server(const char *ip, int port, const char *filepath, progress_cb_t callback, upload_result_t *result)
+{
+	int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	size_t filesize = (size_t)st.st_size;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	char filename_copy[256];
+	strncpy(filename_copy, filepath, 255);
+	filename_copy[255] = '\0';
+	char *base_name = basename(filename_copy);
+
+	char header[512];
+	snprintf(header, sizeof(header), "FILE %s %zu", base_name, filesize);
+
+	upload_result_t done = { 0 };
+	session_t *s = session_acquire(ip, port);
+	if (s) {
+		int streams = atomic_load(&upload_streams);
+		int res = UPLOAD_FALLBACK;
+		if (s->caps & CAP_DEDUP)
+			res = session_send_link(s, base_name, fd, filesize, callback, &done);
+		if (res == UPLOAD_FALLBACK && atomic_load(&delta_uploads) && (s->caps & CAP_DELTA))
+			res = session_send_delta(s, base_name, fd, filesize, callback, &done);
+		if (res == UPLOAD_FALLBACK && (s->caps & CAP_SPARSE) && (size_t)st.st_blocks * 512 < filesize)
+			streams = 1;
+		if (res == UPLOAD_FALLBACK)
+			res = (streams > 1 && (s->caps & CAP_PARALLEL) && filesize >= PARALLEL_MIN_SIZE)
+			    ? session_send_parallel(s, base_name, fd, filesize, streams, callback, &done)
+			    : session_send_file(s, base_name, fd, filesize, callback, &done);
+		close(fd);
+		if (res == 0 && result) *result = done;
+		return res;
+	}
+
+	int sock = dial(ip, port, 0);
+	if (sock < 0) {
+		close(fd);
+		return -1;
+	}
+
+	int auth = perform_auth(sock, connection_password);
+	if (auth != 0) {
+		close(sock);
+		close(fd);
+		return auth == NET_ERR_BUSY ? NET_ERR_BUSY : -1;
+	}
+
+	send(sock, header, strlen(header), 0);
 
-		if (callback) callback(total_sent, filesize, speed);
+	char ack[16] = {0};
+	recv(sock, ack, 15, 0);
+	if (strncmp(ack, "GO", 2) != 0) {
+		close(sock);
+		close(fd);
+		return strncmp(ack, "BUSY", 4) == 0 ? NET_ERR_BUSY : -2;
 	}
 
-	fclose(fp);
+	upload_progress_t progress;
+	file_hasher_t hasher;
+	progress_init(&progress, callback, filesize, 1);
+	hasher_start(&hasher, fd, 0, filesize);
+	size_t sent = stream_file(sock, fd, 0, filesize, 0, &progress);
+	if (hasher_finish(&hasher, sent != filesize, &done.crc32c) == 0 && result) *result = done;
+
+	close(fd);
 	close(sock);
 	return 0;
 }
 
+int send_file_chain(chain_node_t *nodes, int count, const char *filepath, progress_cb_t callback,
+		    upload_result_t *result)
+{
+	unsigned char request[CHAIN_PAYLOAD_MIN + (CHAIN_MAX_NODES - 1) * CHAIN_HOP_SIZE + 256];
+	char report[CHAIN_MAX_NODES + 1];
+	if (count < 1 || count > CHAIN_MAX_NODES) return -1;
+
+	for (int i = 0; i < count; i++) nodes[i].status = CHAIN_NODE_UNREACHABLE;
+	for (int i = 1; i < count; i++) {
+		unsigned char *hop = request + CHAIN_PAYLOAD_MIN + (size_t)(i - 1) * CHAIN_HOP_SIZE;
+		struct in_addr addr;
+		if (inet_pton(AF_INET, nodes[i].ip, &addr) != 1 || nodes[i].port <= 0 || nodes[i].port > 65535)
+			return -1;
+		put_u32(hop, ntohl(addr.s_addr));
+		put_u32(hop + 4, (uint32_t)nodes[i].port);
+	}
+
+	int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	size_t filesize = (size_t)st.st_size;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	char filename_copy[256];
+	strncpy(filename_copy, filepath, 255);
+	filename_copy[255] = '\0';
+	char *base_name = basename(filename_copy);
+	size_t name_len = strnlen(base_name, 255);
+	size_t head = CHAIN_PAYLOAD_MIN + (size_t)(count - 1) * CHAIN_HOP_SIZE;
+	put_u64(request, filesize);
+	put_u32(request + 8, (uint32_t)(count - 1));
+	memcpy(request + head, base_name, name_len);
+
+	session_t *s = session_acquire(nodes[0].ip, nodes[0].port);
+	if (!s || !(s->caps & CAP_CHAIN)) {
+		close(fd);
+		return s ? -2 : -1;
+	}
+
+	net_call_t call;
+	call_init(&call, s, CALL_CONTROL, FRAME_CHAIN, request, head + name_len, report, sizeof(report));
+	int sock = session_stream_begin(s, &call);
+	if (sock < 0) {
+		close(fd);
+		return sock;
+	}
+	for (int i = 0; i < count; i++) nodes[i].status = CHAIN_NODE_BROKEN;
+
+	upload_progress_t progress;
+	file_hasher_t hasher;
+	uint32_t crc = 0;
+	progress_init(&progress, callback, filesize, 1);
+	progress.compress = upload_compress(s);
+	hasher_start(&hasher, fd, 0, filesize);
+	size_t sent = (s->caps & CAP_SPARSE) && (size_t)st.st_blocks * 512 < filesize
+			      ? stream_sparse(sock, fd, 0, filesize, call.id, &progress)
+			      : stream_file(sock, fd, 0, filesize, call.id, &progress);
+	bool hashed = hasher_finish(&hasher, sent != filesize, &crc) == 0;
+	if (sent == filesize) {
+		unsigned char sum[CHECKSUM_PAYLOAD_SIZE];
+		put_u32(sum, crc);
+		if (!hashed || frame_send(sock, FRAME_CHECKSUM, 0, call.id, sum, sizeof(sum)) != 0) sent = 0;
+	}
+	session_stream_end(s, sock, sent == filesize);
+	close(fd);
+
+	call_wait(&call);
+	if (sent != filesize || call.status != 0 || call.reply_type != FRAME_OK) return -1;
+	int stored = 0;
+	for (int i = 0; i < count; i++) {
+		unsigned char status = (size_t)i < call.len ? (unsigned char)report[i] : CHAIN_BROKEN;
+		nodes[i].status = status <= CHAIN_REJECTED ? (chain_node_status_t)status : CHAIN_NODE_BROKEN;
+		if (nodes[i].status == CHAIN_NODE_STORED) stored++;
+	}
+	if (result) {
+		result->crc32c = crc;
+		progress_result(&progress, result);
+	}
+	return stored;
+}
+
+static size_t tee_chunk_len(const tee_upload_t *tee, size_t chunk)
+{
+	size_t left = tee->filesize - chunk * FRAME_DATA_CHUNK;
+	return left < FRAME_DATA_CHUNK ? left : FRAME_DATA_CHUNK;
+}
+
+/* Records that a sender is past chunk, or dropped out, and wakes the reader. */
+static void tee_advance(tee_upload_t *tee, int index, size_t chunks)
+{
+	pthread_mutex_lock(&tee->lock);
+	tee->sent[index] = chunks;
+	pthread_cond_broadcast(&tee->cond);
+	pthread_mutex_unlock(&tee->lock);
+}
+
+/* Waits until chunk has been read; false when reading failed first. */
+static bool tee_wait_chunk(tee_upload_t *tee, size_t chunk, uint32_t *crc)
+{
+	pthread_mutex_lock(&tee->lock);
+	while (tee->read <= chunk && !tee->failed) pthread_cond_wait(&tee->cond, &tee->lock);
+	bool ready = tee->read > chunk;
+	*crc = tee->crc;
+	pthread_mutex_unlock(&tee->lock);
+	return ready;
+}
+
+static void tee_report(tee_upload_t *tee, int index, size_t sent, unsigned long long start)
+{
+	if (!tee->callback) return;
+	double elapsed = (progress_clock_ms() - start) / 1000.0;
+	pthread_mutex_lock(&tee->report_lock);
+	tee->callback(index, sent, tee->filesize, elapsed > 0 ? sent / (1024.0 * 1024.0) / elapsed : 0.0);
+	pthread_mutex_unlock(&tee->report_lock);
+}
+
+/*
+ * Sends the file to one target from the ring, as RESUME from offset 0
+ * ended by the CRC32C of the whole file where the server supports it, and
+ * as FILE otherwise.
+ */
+static int tee_send(tee_upload_t *tee, int index, upload_target_t *target)
+{
+	unsigned char request[RESUME_PAYLOAD_MIN + 256];
+	size_t name_len = strnlen(tee->name, 255);
+	session_t *s = session_acquire(target->ip, target->port);
+	if (!s) return -1;
+
+	bool resume = (s->caps & CAP_RESUME) != 0;
+	size_t head = resume ? RESUME_PAYLOAD_MIN : FILE_PAYLOAD_MIN;
+	put_u64(request, tee->filesize);
+	put_u64(request + 8, 0);
+	memcpy(request + head, tee->name, name_len);
+
+	net_call_t call;
+	call_init(&call, s, CALL_CONTROL, resume ? FRAME_RESUME : FRAME_FILE, request, head + name_len, NULL, 0);
+	int sock = session_stream_begin(s, &call);
+	if (sock < 0) return sock;
+
+	unsigned long long start = progress_clock_ms();
+	unsigned long long next = start + PROGRESS_INTERVAL_MS;
+	uint32_t crc = 0;
+	size_t chunk = 0;
+	size_t sent = 0;
+	for (; chunk < tee->chunks && tee_wait_chunk(tee, chunk, &crc); chunk++) {
+		size_t len = tee_chunk_len(tee, chunk);
+		const char *data = tee->ring + (chunk % TEE_RING_SLOTS) * FRAME_DATA_CHUNK;
+		if (frame_send(sock, FRAME_DATA, 0, call.id, data, len) != 0) break;
+		sent += len;
+		tee_advance(tee, index, chunk + 1);
+		if (progress_clock_ms() >= next || chunk + 1 == tee->chunks) {
+			tee_report(tee, index, sent, start);
+			next = progress_clock_ms() + PROGRESS_INTERVAL_MS;
+		}
+	}
+	bool complete = chunk == tee->chunks;
+	if (complete && resume) {
+		unsigned char sum[CHECKSUM_PAYLOAD_SIZE];
+		put_u32(sum, crc);
+		complete = frame_send(sock, FRAME_CHECKSUM, 0, call.id, sum, sizeof(sum)) == 0;
+	}
+	session_stream_end(s, sock, complete);
+
+	call_wait(&call);
+	bool ok = complete && call.status == 0 && call.reply_type == FRAME_OK && call.len >= 8
+	    && get_u64((const unsigned char *)call.reply) == tee->filesize;
+	if (!ok) return -1;
+	target->upload.crc32c = crc;
+	return 0;
+}
+
+static void *tee_sender_run(void *arg)
+{
+	tee_sender_t *sender = arg;
+	sender->target->result = tee_send(sender->tee, sender->index, sender->target);
+	tee_advance(sender->tee, sender->index, TEE_DROPPED);
+	return NULL;
+}
+
+/* Fills the ring ahead of the senders until the file is read or every one dropped out. */
+static void tee_read(tee_upload_t *tee)
+{
+	for (size_t chunk = 0; chunk < tee->chunks; chunk++) {
+		pthread_mutex_lock(&tee->lock);
+		for (;;) {
+			bool behind = false, live = false;
+			for (int i = 0; i < tee->count; i++) {
+				if (tee->sent[i] == TEE_DROPPED) continue;
+				live = true;
+				if (tee->sent[i] + TEE_RING_SLOTS <= chunk) behind = true;
+			}
+			if (!live) {
+				tee->failed = true;
+				pthread_cond_broadcast(&tee->cond);
+				pthread_mutex_unlock(&tee->lock);
+				return;
+			}
+			if (!behind) break;
+			pthread_cond_wait(&tee->cond, &tee->lock);
+		}
+		pthread_mutex_unlock(&tee->lock);
+
+		size_t len = tee_chunk_len(tee, chunk);
+		char *slot = tee->ring + (chunk % TEE_RING_SLOTS) * FRAME_DATA_CHUNK;
+		bool ok = pread_all(tee->fd, slot, len, (off_t)(chunk * FRAME_DATA_CHUNK)) == 0;
+
+		pthread_mutex_lock(&tee->lock);
+		if (ok) {
+			tee->crc = crc32c_update(tee->crc, slot, len);
+			tee->read = chunk + 1;
+		} else {
+			tee->failed = true;
+		}
+		pthread_cond_broadcast(&tee->cond);
+		pthread_mutex_unlock(&tee->lock);
+		if (!ok) return;
+	}
+}
+
+int send_file_to_servers(upload_target_t *targets, int count, const char *filepath, target_progress_cb_t callback)
+{
+	if (count < 1 || count > MAX_SERVERS) return -1;
+	for (int i = 0; i < count; i++)
+		for (int j = 0; j < i; j++)
+			if (targets[i].port == targets[j].port && strcmp(targets[i].ip, targets[j].ip) == 0) return -1;
+	for (int i = 0; i < count; i++) {
+		targets[i].result = -1;
+		memset(&targets[i].upload, 0, sizeof(targets[i].upload));
+	}
+
+	int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	char filename_copy[256];
+	strncpy(filename_copy, filepath, 255);
+	filename_copy[255] = '\0';
+
+	tee_upload_t tee = {
+		.fd = fd,
+		.name = basename(filename_copy),
+		.filesize = (size_t)st.st_size,
+		.count = count,
+		.callback = callback,
+	};
+	tee.chunks = (tee.filesize + FRAME_DATA_CHUNK - 1) / FRAME_DATA_CHUNK;
+	tee.ring = malloc((size_t)TEE_RING_SLOTS * FRAME_DATA_CHUNK);
+	if (!tee.ring) {
+		close(fd);
+		return -1;
+	}
+	pthread_mutex_init(&tee.report_lock, NULL);
+	pthread_mutex_init(&tee.lock, NULL);
+	pthread_cond_init(&tee.cond, NULL);
+
+	tee_sender_t senders[MAX_SERVERS];
+	for (int i = 0; i < count; i++) {
+		senders[i] = (tee_sender_t){ .tee = &tee, .target = &targets[i], .index = i };
+		senders[i].started = pthread_create(&senders[i].thread, NULL, tee_sender_run, &senders[i]) == 0;
+		if (!senders[i].started) tee.sent[i] = TEE_DROPPED;
+	}
+	tee_read(&tee);
+
+	int stored = 0;
+	for (int i = 0; i < count; i++) {
+		if (senders[i].started) pthread_join(senders[i].thread, NULL);
+		if (targets[i].result == 0) stored++;
+	}
+	pthread_cond_destroy(&tee.cond);
+	pthread_mutex_destroy(&tee.lock);
+	pthread_mutex_destroy(&tee.report_lock);
+	free(tee.ring);
+	close(fd);
+	return stored;
+}
+
+/* Appends one frame to buf at used; returns the new length. */
+static size_t batch_frame(unsigned char *buf, size_t used, uint8_t type, uint32_t id, const void *payload,
+			  size_t len)
+{
+	frame_encode(buf + used, type, 0, (uint32_t)len, id);
+	memcpy(buf + used + FRAME_HEADER_SIZE, payload, len);
+	return used + FRAME_HEADER_SIZE + len;
+}
+
+/* A file too large to read ahead: its ENTRY, DATA streamed from fd as it is hashed, then CHECKSUM. */
+static bool pack_stream_entry(int sock, uint32_t id, const unsigned char *entry, size_t entry_len,
+			      pack_item_t *item, upload_progress_t *progress)
+{
+	file_hasher_t hasher;
+	unsigned char sum[CHECKSUM_PAYLOAD_SIZE];
+	uint32_t crc;
+
+	if (frame_send(sock, FRAME_ENTRY, 0, id, entry, entry_len) != 0) return false;
+	hasher_start(&hasher, item->fd, 0, item->size);
+	size_t sent = stream_file(sock, item->fd, 0, item->size, id, progress);
+	if (hasher_finish(&hasher, sent != item->size, &crc) != 0 || sent != item->size) return false;
+	put_u32(sum, crc);
+	return frame_send(sock, FRAME_CHECKSUM, 0, id, sum, sizeof(sum)) == 0;
+}
+
+/*
+ * Sends every file of list as it comes off the readers. Small files are
+ * gathered, ENTRY, DATA and CHECKSUM together, into batches of up to
+ * PACK_BATCH_SIZE, so a tree of small files goes out in a few large
+ * writes; larger files are streamed on their own. Files that could not be
+ * read are left out and counted in failed, those sent in sent.
+ */
+static bool pack_send(int sock, uint32_t id, const pack_list_t *list, const char *dirpath,
+		      upload_progress_t *progress, size_t *sent, size_t *failed)
+{
+	pack_reader_t *reader = pack_reader_start(list, dirpath);
+	unsigned char *batch = malloc(PACK_BATCH_SIZE);
+	size_t used = 0;
+	bool ok = reader && batch;
+
+	for (size_t i = 0; ok && i < list->count; i++) {
+		pack_item_t *item = pack_reader_take(reader, i);
+		size_t path_len = strlen(list->entries[i].path);
+		size_t entry_len = ENTRY_PAYLOAD_MIN + path_len;
+		unsigned char entry[ENTRY_PAYLOAD_MIN + PACK_PATH_MAX];
+		unsigned char sum[CHECKSUM_PAYLOAD_SIZE];
+
+		put_u64(entry, item->size);
+		memcpy(entry + ENTRY_PAYLOAD_MIN, list->entries[i].path, path_len);
+		if (item->failed) {
+			(*failed)++;
+		} else if (item->data) {
+			if (used + 3 * FRAME_HEADER_SIZE + entry_len + item->size + sizeof(sum) > PACK_BATCH_SIZE) {
+				ok = send_all(sock, batch, used) == 0;
+				used = 0;
+			}
+			put_u32(sum, item->crc);
+			used = batch_frame(batch, used, FRAME_ENTRY, id, entry, entry_len);
+			if (item->size) used = batch_frame(batch, used, FRAME_DATA, id, item->data, item->size);
+			used = batch_frame(batch, used, FRAME_CHECKSUM, id, sum, sizeof(sum));
+			atomic_fetch_add(&progress->sent, item->size);
+			progress_report(progress, false);
+			(*sent)++;
+		} else {
+			ok = used == 0 || send_all(sock, batch, used) == 0;
+			used = 0;
+			ok = ok && pack_stream_entry(sock, id, entry, entry_len, item, progress);
+			(*sent)++;
+		}
+		pack_reader_done(reader, i);
+	}
+	if (ok && used) ok = send_all(sock, batch, used) == 0;
+	if (reader) pack_reader_stop(reader);
+	free(batch);
+	progress_report(progress, true);
+	return ok;
+}
+
+int send_dir_to_server(const char *ip, int port, const char *dirpath, progress_cb_t callback, pack_result_t *result)
+{
+	pack_list_t list;
+	if (pack_list_build(&list, dirpath) != 0) return -1;
+
+	char path_copy[PATH_MAX];
+	strncpy(path_copy, dirpath, sizeof(path_copy) - 1);
+	path_copy[sizeof(path_copy) - 1] = '\0';
+	char *root = basename(path_copy);
+
+	session_t *s = session_acquire(ip, port);
+	if (!s || !(s->caps & CAP_PACK)) {
+		pack_list_free(&list);
+		return s ? -2 : -1;
+	}
+
+	net_call_t call;
+	call_init(&call, s, CALL_CONTROL, FRAME_PACK, root, strnlen(root, 255), NULL, 0);
+	int sock = session_stream_begin(s, &call);
+	if (sock < 0) {
+		pack_list_free(&list);
+		return sock;
+	}
+
+	upload_progress_t progress;
+	size_t sent = 0, failed = 0;
+	progress_init(&progress, callback, (size_t)list.bytes, 1);
+	progress.compress = upload_compress(s);
+	bool ok = pack_send(sock, call.id, &list, dirpath, &progress, &sent, &failed)
+	    && frame_send(sock, FRAME_ENTRY, 0, call.id, NULL, 0) == 0;
+	session_stream_end(s, sock, ok);
+	pack_list_free(&list);
+
+	call_wait(&call);
+	if (!ok || call.status != 0 || call.reply_type != FRAME_OK || call.len < PACK_REPLY_SIZE) return -1;
+	const unsigned char *p = (const unsigned char *)call.reply;
+	if (result) {
+		result->files = get_u32(p);
+		result->failed = failed + (sent > result->files ? sent - result->files : 0);
+		result->bytes = get_u64(p + 4);
+	}
+	return 0;
+}
+
+/*
+ * Asks for one range with GET and writes its DATA frames into place with
+ * pwrite(). Fails if the server's copy no longer has the size the download
+ * was planned for.
+ */
+static int fetch_range(session_t *conn, int sock, parallel_download_t *dl, off_t offset, size_t len)
+{
+	unsigned char request[GET_PAYLOAD_MIN + 256];
+	size_t name_len = strnlen(dl->name, 255);
+	put_u64(request, (uint64_t)offset);
+	put_u64(request + 8, len);
+	memcpy(request + GET_PAYLOAD_MIN, dl->name, name_len);
+
+	struct FrameHeader h;
+	unsigned char reply[GET_REPLY_SIZE];
+	uint32_t id = session_next_id(conn);
+	if (frame_send(sock, FRAME_GET, 0, id, request, GET_PAYLOAD_MIN + name_len) != 0
+	    || session_read_frame(conn, sock, &h, reply, sizeof(reply)) < 0)
+		return -1;
+	if (h.type == FRAME_BUSY) return NET_ERR_BUSY;
+	if (h.type != FRAME_OK || h.length < GET_REPLY_SIZE || get_u64(reply) != dl->filesize
+	    || get_u64(reply + 8) != len)
+		return -1;
+
+	unsigned char *buf = malloc(FRAME_MAX_PAYLOAD);
+	size_t got = 0;
+	int res = buf ? 0 : -1;
+	while (res == 0 && got < len) {
+		unsigned char head[FRAME_HEADER_SIZE];
+		if (session_read(conn, sock, head, sizeof(head), false) != 0 || !frame_decode(head, &h)
+		    || h.type != FRAME_DATA || h.request_id != id || h.length > FRAME_MAX_PAYLOAD
+		    || h.length > len - got || session_read(conn, sock, buf, h.length, false) != 0) {
+			res = -1;
+			break;
+		}
+		for (size_t done = 0; res == 0 && done < h.length;) {
+			ssize_t n = pwrite(dl->fd, buf + done, h.length - done, offset + (off_t)(got + done));
+			if (n <= 0) res = -1;
+			else done += (size_t)n;
+		}
+		got += h.length;
+		atomic_fetch_add(&dl->progress.sent, h.length);
+	}
+	free(buf);
+	return res;
+}
+
+static void *fetch_worker(void *arg)
+{
+	fetch_job_t *job = arg;
+	parallel_download_t *dl = job->download;
+	session_t *conn = calloc(1, sizeof(*conn));
+	int sock = conn ? session_dial(dl->session, conn) : -1;
+
+	job->result = sock < 0 ? sock : 0;
+	if (job->result == 0) {
+		job->result = fetch_range(conn, sock, dl, job->offset, job->len);
+		frame_send(sock, FRAME_QUIT, 0, session_next_id(conn), NULL, 0);
+	}
+	if (sock >= 0) close(sock);
+	free(conn);
+
+	pthread_mutex_lock(&dl->lock);
+	dl->running--;
+	pthread_cond_signal(&dl->cond);
+	pthread_mutex_unlock(&dl->lock);
+	return NULL;
+}
+
+/* Fetches every range of dl at once, each over a connection of its own. */
+static int fetch_ranges(parallel_download_t *dl, int streams)
+{
+	size_t range = stream_range(dl->filesize, streams);
+	fetch_job_t jobs[UPLOAD_STREAMS_MAX];
+	int count = 0;
+
+	for (size_t offset = 0; offset < dl->filesize; offset += range, count++) {
+		jobs[count].download = dl;
+		jobs[count].offset = (off_t)offset;
+		jobs[count].len = dl->filesize - offset < range ? dl->filesize - offset : range;
+		jobs[count].result = -1;
+		pthread_mutex_lock(&dl->lock);
+		dl->running++;
+		pthread_mutex_unlock(&dl->lock);
+		jobs[count].started = pthread_create(&jobs[count].thread, NULL, fetch_worker, &jobs[count]) == 0;
+		if (!jobs[count].started) {
+			pthread_mutex_lock(&dl->lock);
+			dl->running--;
+			pthread_mutex_unlock(&dl->lock);
+		}
+	}
+	if (count > 0) dl->progress.streams = count;
+	workers_wait(&dl->lock, &dl->cond, &dl->running, &dl->progress);
+
+	int res = 0;
+	for (int i = 0; i < count; i++) {
+		if (jobs[i].started) pthread_join(jobs[i].thread, NULL);
+		if (jobs[i].result == NET_ERR_BUSY) res = NET_ERR_BUSY;
+		else if (jobs[i].result != 0 && res == 0) res = -1;
+	}
+	return res;
+}
+
+int fetch_file_from_server(const char *ip, int port, const char *filename, const char *destpath,
+			   progress_cb_t callback)
+{
+	session_t *s = session_acquire(ip, port);
+	if (!s || !(s->caps & CAP_GET)) return -2;
+
+	unsigned char request[GET_PAYLOAD_MIN + 256];
+	size_t name_len = strnlen(filename, 255);
+	put_u64(request, 0);
+	put_u64(request + 8, 0);
+	memcpy(request + GET_PAYLOAD_MIN, filename, name_len);
+
+	net_call_t call;
+	int res = session_call(s, FRAME_GET, request, GET_PAYLOAD_MIN + name_len, &call, NULL, 0);
+	if (res != 0) return res == -2 ? -1 : res;
+	if (call.len < GET_REPLY_SIZE) return -1;
+
+	char part[PATH_MAX];
+	snprintf(part, sizeof(part), "%s.part", destpath);
+	int fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return -1;
+
+	parallel_download_t dl;
+	memset(&dl, 0, sizeof(dl));
+	dl.session = s;
+	dl.name = filename;
+	dl.filesize = (size_t)get_u64((const unsigned char *)call.reply);
+	dl.fd = fd;
+	pthread_mutex_init(&dl.lock, NULL);
+	pthread_cond_init(&dl.cond, NULL);
+
+	int streams = dl.filesize >= PARALLEL_MIN_SIZE ? atomic_load(&upload_streams) : 1;
+	progress_init(&dl.progress, callback, dl.filesize, streams);
+	res = ftruncate(fd, (off_t)dl.filesize) == 0 ? fetch_ranges(&dl, streams) : -1;
+	pthread_mutex_destroy(&dl.lock);
+	pthread_cond_destroy(&dl.cond);
+	if (close(fd) != 0 && res == 0) res = -1;
+	if (res == 0 && rename(part, destpath) != 0) res = -1;
+	if (res != 0) {
+		unlink(part);
+		return res;
+	}
+	progress_report(&dl.progress, true);
+	return 0;
+}
+
 int connect_handshake(const char *ip, int port, const char *password)
 {
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -2,14 +2,160 @@
 #define NETWORK_H
 
 #include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
 
-typedef void (*progress_cb_t)(size_t sent, size_t total, double speed_mbps);
+/* Returned when the server sheds load with "BUSY retry-after=N". */
+#define NET_ERR_BUSY -3
+
+/* sent and speed_mbps cover every stream of the upload together. */
+typedef void (*progress_cb_t)(size_t sent, size_t total, double speed_mbps, int streams);
+
+/*
+ * An upload's CRC32C, and the bytes taken from what the server already
+ * held: part of its copy for a delta upload, all of them when the content
+ * was already stored and deduplicated is set. With compression on,
+ * compressed bytes were offered to the codec and took compressed_wire on
+ * the wire, for compress_ms of CPU time; 0 when a sample showed the file
+ * would not compress.
+ */
+typedef struct {
+	uint32_t crc32c;
+	size_t reused;
+	bool deduplicated;
+	size_t compressed;
+	size_t compressed_wire;
+	double compress_ms;
+} upload_result_t;
+
+/*
+ * A request in flight on the server's shared session. Any number may be
+ * outstanding at once; replies arrive in whatever order the server finishes
+ * them. net_call_wait() returns the same result as the blocking call and
+ * frees the handle, so it must be called exactly once.
+ */
+typedef struct net_call net_call_t;
+
+net_call_t *send_message_async(const char *ip, int port, const char *msg);
+net_call_t *send_command_async(const char *ip, int port, const char *cmd, char *out_buf, size_t buf_size);
+net_call_t *get_server_stats_async(const char *ip, int port, float *cpu, size_t *mem_used, size_t *mem_total);
+bool net_call_done(net_call_t *call);
+int net_call_wait(net_call_t *call);
 
 void send_message(const char *ip, int port, const char *msg);
 int send_command_with_response(const char *ip, int port, const char *cmd, char *out_buf, size_t buf_size);
 int get_server_stats(const char *ip, int port, float *cpu, size_t *mem_used, size_t *mem_total);
-int send_file_to_server(const char *ip, int port, const char *filepath, progress_cb_t callback);
+
+/*
+ * Uploads a file. The CRC32C of the bytes sent is computed alongside on a
+ * thread of its own; servers that support it reject the file unless theirs
+ * matches. A server that already holds the same content stores the file
+ * without it being sent. On success *result, when not NULL, holds the CRC
+ * and how much was saved.
+ */
+int send_file_to_server(const char *ip, int port, const char *filepath, progress_cb_t callback,
+			upload_result_t *result);
+
+/* How a chained upload went on one server; the values of enum ChainStatus. */
+typedef enum {
+	CHAIN_NODE_STORED,
+	CHAIN_NODE_UNREACHABLE,
+	CHAIN_NODE_BROKEN,
+	CHAIN_NODE_REJECTED
+} chain_node_status_t;
+
+typedef struct {
+	char ip[16];
+	int port;
+	chain_node_status_t status;
+} chain_node_t;
+
+/*
+ * Uploads a file once to nodes[0], which stores it and passes it on down
+ * the line of the other nodes as it arrives, each server to the next, so
+ * the client's uplink carries one copy however many servers keep it.
+ * Servers that cannot be reached are skipped and every one checks the
+ * CRC32C on its own copy. Each node's status is set; returns how many
+ * stored the file, -2 when nodes[0] does not support chained uploads and
+ * -1 or NET_ERR_BUSY when the upload to it fails.
+ */
+int send_file_chain(chain_node_t *nodes, int count, const char *filepath, progress_cb_t callback,
+		    upload_result_t *result);
+
+/* One server of a tee upload; result and upload are set when it ends. */
+typedef struct {
+	char ip[16];
+	int port;
+	int result;
+	upload_result_t upload;
+} upload_target_t;
+
+/* Progress of one target of a tee upload; calls never overlap. */
+typedef void (*target_progress_cb_t)(int target, size_t sent, size_t total, double speed_mbps);
+
+/*
+ * Uploads a file to every target at once, each over its own session, for
+ * servers that cannot reach one another to form a chain. The file is read
+ * once into a ring of buffers that the senders consume at their own pace;
+ * the slowest bounds how far ahead reading gets, and a target that fails
+ * drops out without holding the others back. Targets must be distinct.
+ * Each target's result is 0 or what send_file_to_server() would have
+ * returned. Returns how many targets stored the file, or -1 when it
+ * cannot be read.
+ */
+int send_file_to_servers(upload_target_t *targets, int count, const char *filepath, target_progress_cb_t callback);
+
+/* Files of a directory upload stored by the server, left out and their bytes. */
+typedef struct {
+	size_t files;
+	size_t failed;
+	uint64_t bytes;
+} pack_result_t;
+
+/*
+ * Uploads the regular files under dirpath to storage/<its name> as one
+ * packed stream, keeping their relative paths. Files are read ahead on
+ * several threads and each is checked by CRC32C on arrival; a file that
+ * fails is left out without stopping the rest. Returns -2 when the server
+ * does not support packed uploads.
+ */
+int send_dir_to_server(const char *ip, int port, const char *dirpath, progress_cb_t callback,
+		       pack_result_t *result);
+
+/*
+ * Downloads storage/<filename> from the server into destpath, through
+ * destpath.part, which is renamed into place once every byte is in. Files
+ * of at least 8 MB are fetched in ranges over as many connections as
+ * uploads use, each range written into place with pwrite(). Returns -2
+ * when the server does not support downloads and -1 when it has no such
+ * file or the transfer fails.
+ */
+int fetch_file_from_server(const char *ip, int port, const char *filename, const char *destpath,
+			   progress_cb_t callback);
+
+/*
+ * Connections used for one upload of at least 8 MB to a server that
+ * supports parallel uploads; 1 keeps every upload on the shared session.
+ */
+void net_set_upload_streams(int streams);
+
+/*
+ * Sends only what changed when the server already holds a file of the same
+ * name, falling back to a whole upload when that would save little.
+ */
+void net_set_delta_uploads(bool enabled);
+
+/*
+ * Offers compression to servers when sessions are opened. Uploads to a
+ * server that accepts it sample each file and send the compressible ones
+ * as lz blocks, and the server compresses EXEC output. Off by default:
+ * it pays on slow links, while on a fast one it costs more CPU than it
+ * saves in time.
+ */
+void net_set_compression(bool enabled);
 int connect_handshake(const char *ip, int port, const char *password);
+void close_server_session(const char *ip, int port);
+void close_all_sessions(void);
 void *beacon_listener(void *arg);
 
 #endif
\ No newline at end of file
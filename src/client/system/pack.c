@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "pack.h"
+#include "../../common/crc32c.h"
+
+struct pack_reader {
+	const pack_list_t *list;
+	char root[PATH_MAX];
+	pack_item_t slots[PACK_WINDOW];
+	size_t next;
+	size_t consumed;
+	bool stop;
+	int threads;
+	pthread_t thread[PACK_READERS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static int list_push(pack_list_t *list, const char *rel, size_t size)
+{
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity ? list->capacity * 2 : 256;
+		pack_entry_t *entries = realloc(list->entries, capacity * sizeof(*entries));
+		if (!entries) return -1;
+		list->entries = entries;
+		list->capacity = capacity;
+	}
+	pack_entry_t *e = &list->entries[list->count++];
+	snprintf(e->path, sizeof(e->path), "%s", rel);
+	e->size = size;
+	list->bytes += size;
+	return 0;
+}
+
+static int name_compare(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int list_walk(pack_list_t *list, const char *root, const char *rel)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s%s%s", root, *rel ? "/" : "", rel);
+	DIR *dir = opendir(path);
+	if (!dir) return -1;
+
+	char **names = NULL;
+	size_t count = 0, capacity = 0;
+	struct dirent *d;
+	int res = 0;
+	while (res == 0 && (d = readdir(dir)) != NULL) {
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) continue;
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 32;
+			char **grown = realloc(names, capacity * sizeof(*names));
+			if (!grown) {
+				res = -1;
+				break;
+			}
+			names = grown;
+		}
+		if (!(names[count] = strdup(d->d_name))) res = -1;
+		else count++;
+	}
+	closedir(dir);
+	if (res == 0) qsort(names, count, sizeof(*names), name_compare);
+
+	for (size_t i = 0; i < count; i++) {
+		char child[PACK_PATH_MAX + 2];
+		struct stat st;
+		int n = snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "", names[i]);
+		snprintf(path, sizeof(path), "%s/%s", root, child);
+		if (res == 0 && n <= PACK_PATH_MAX && lstat(path, &st) == 0) {
+			if (S_ISDIR(st.st_mode)) res = list_walk(list, root, child);
+			else if (S_ISREG(st.st_mode)) res = list_push(list, child, (size_t)st.st_size);
+		}
+		free(names[i]);
+	}
+	free(names);
+	return res;
+}
+
+int pack_list_build(pack_list_t *list, const char *root)
+{
+	memset(list, 0, sizeof(*list));
+	if (list_walk(list, root, "") == 0) return 0;
+	pack_list_free(list);
+	return -1;
+}
+
+void pack_list_free(pack_list_t *list)
+{
+	free(list->entries);
+	memset(list, 0, sizeof(*list));
+}
+
+static void item_read(const char *root, const pack_entry_t *e, pack_item_t *it)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	memset(it, 0, sizeof(*it));
+	snprintf(path, sizeof(path), "%s/%s", root, e->path);
+	it->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (it->fd < 0 || fstat(it->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		it->failed = true;
+		return;
+	}
+	it->size = (size_t)st.st_size;
+	if (it->size > PACK_INLINE_MAX) return;
+
+	it->data = malloc(it->size ? it->size : 1);
+	size_t got = 0;
+	while (it->data && got < it->size) {
+		ssize_t n = pread(it->fd, it->data + got, it->size - got, (off_t)got);
+		if (n <= 0) break;
+		got += (size_t)n;
+	}
+	it->failed = !it->data || got != it->size;
+	if (!it->failed) it->crc = crc32c_update(0, it->data, it->size);
+	close(it->fd);
+	it->fd = -1;
+}
+
+static void item_free(pack_item_t *it)
+{
+	if (it->fd >= 0) close(it->fd);
+	free(it->data);
+	memset(it, 0, sizeof(*it));
+	it->fd = -1;
+}
+
+static void *reader_run(void *arg)
+{
+	pack_reader_t *r = arg;
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->stop && r->next < r->list->count) {
+		if (r->next >= r->consumed + PACK_WINDOW) {
+			pthread_cond_wait(&r->cond, &r->lock);
+			continue;
+		}
+		size_t i = r->next++;
+		pthread_mutex_unlock(&r->lock);
+
+		pack_item_t item;
+		item_read(r->root, &r->list->entries[i], &item);
+
+		pthread_mutex_lock(&r->lock);
+		r->slots[i % PACK_WINDOW] = item;
+		r->slots[i % PACK_WINDOW].ready = true;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+pack_reader_t *pack_reader_start(const pack_list_t *list, const char *root)
+{
+	pack_reader_t *r = calloc(1, sizeof(*r));
+	if (!r) return NULL;
+	r->list = list;
+	snprintf(r->root, sizeof(r->root), "%s", root);
+	for (int i = 0; i < PACK_WINDOW; i++) r->slots[i].fd = -1;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	while (r->threads < PACK_READERS && pthread_create(&r->thread[r->threads], NULL, reader_run, r) == 0)
+		r->threads++;
+	if (r->threads == 0) {
+		pack_reader_stop(r);
+		return NULL;
+	}
+	return r;
+}
+
+pack_item_t *pack_reader_take(pack_reader_t *r, size_t i)
+{
+	pack_item_t *it = &r->slots[i % PACK_WINDOW];
+	pthread_mutex_lock(&r->lock);
+	while (!it->ready) pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+	return it;
+}
+
+void pack_reader_done(pack_reader_t *r, size_t i)
+{
+	pthread_mutex_lock(&r->lock);
+	item_free(&r->slots[i % PACK_WINDOW]);
+	r->consumed = i + 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+void pack_reader_stop(pack_reader_t *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->stop = true;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	for (int i = 0; i < r->threads; i++) pthread_join(r->thread[i], NULL);
+	for (int i = 0; i < PACK_WINDOW; i++) {
+		if (r->slots[i].ready) item_free(&r->slots[i]);
+	}
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	free(r);
+}
@@ -0,0 +1,61 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../../common/protocol.h"
+
+#define PACK_READERS		4
+#define PACK_WINDOW		64
+#define PACK_INLINE_MAX		(256 * 1024)
+
+/* A regular file under the directory being packed, by its path relative to it. */
+typedef struct {
+	char path[PACK_PATH_MAX + 1];
+	size_t size;
+} pack_entry_t;
+
+typedef struct {
+	pack_entry_t *entries;
+	size_t count;
+	size_t capacity;
+	uint64_t bytes;
+} pack_list_t;
+
+/*
+ * Lists the regular files under root, depth first in name order. Symbolic
+ * links and other special files are skipped, as are paths longer than
+ * PACK_PATH_MAX.
+ */
+int pack_list_build(pack_list_t *list, const char *root);
+void pack_list_free(pack_list_t *list);
+
+/*
+ * One file as read ahead: up to PACK_INLINE_MAX bytes are read whole into
+ * data with their CRC32C; larger files are left open in fd to be streamed.
+ */
+typedef struct {
+	int fd;
+	size_t size;
+	unsigned char *data;
+	uint32_t crc;
+	bool ready;
+	bool failed;
+} pack_item_t;
+
+typedef struct pack_reader pack_reader_t;
+
+/*
+ * Opens and reads the files of list on PACK_READERS threads, at most
+ * PACK_WINDOW files ahead of the sender, so a tree of small files is not
+ * read one open() at a time. list must outlive the reader.
+ */
+pack_reader_t *pack_reader_start(const pack_list_t *list, const char *root);
+
+/* Waits for file i; files are taken in list order, each released with pack_reader_done(). */
+pack_item_t *pack_reader_take(pack_reader_t *r, size_t i);
+void pack_reader_done(pack_reader_t *r, size_t i);
+void pack_reader_stop(pack_reader_t *r);
+
+#endif
@@ -0,0 +1,248 @@
+#define _XOPEN_SOURCE_EXTENDED
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "transfers.h"
+#include "api.h"
+
+static transfer_t slots[TRANSFER_SLOTS];
+static unsigned long next_ticket = 1;
+
+static pthread_t workers[TRANSFER_WORKERS_MAX];
+static int workers_started = 0;
+static atomic_int concurrency = TRANSFER_CONCURRENCY;
+static atomic_bool stopping = false;
+/* Guards a slot's move from QUEUED to RUNNING; workers wait on the cond. */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* The transfer the calling worker runs, for the progress callback. */
+static __thread transfer_t *current = NULL;
+
+void transfer_set_concurrency(int n)
+{
+	if (n < 1) n = 1;
+	if (n > TRANSFER_WORKERS_MAX) n = TRANSFER_WORKERS_MAX;
+	atomic_store(&concurrency, n);
+}
+
+static void transfer_progress(size_t sent, size_t total, double speed_mbps, int streams)
+{
+	(void)streams;
+	if (!current) return;
+	atomic_store_explicit(&current->total, total, memory_order_relaxed);
+	atomic_store_explicit(&current->sent, sent, memory_order_relaxed);
+	atomic_store_explicit(&current->rate_kbps, (unsigned)(speed_mbps * 1024.0), memory_order_relaxed);
+}
+
+/*
+ * Takes the queued transfer that has waited longest, waiting for one when
+ * none is; NULL when stopping. A queued slot is only rewritten once it has
+ * finished, so its ticket is stable while the queue lock is held.
+ */
+static transfer_t *transfer_claim(void)
+{
+	transfer_t *oldest = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+	while (!atomic_load(&stopping)) {
+		for (int i = 0; i < TRANSFER_SLOTS; i++) {
+			transfer_t *t = &slots[i];
+			if (atomic_load_explicit(&t->state, memory_order_acquire) != TRANSFER_QUEUED)
+				continue;
+			if (!oldest || t->ticket < oldest->ticket)
+				oldest = t;
+		}
+		if (oldest) {
+			atomic_store_explicit(&oldest->state, TRANSFER_RUNNING, memory_order_release);
+			break;
+		}
+		pthread_cond_wait(&queue_cond, &queue_lock);
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return oldest;
+}
+
+static void transfer_run(transfer_t *t)
+{
+	int res;
+	bool ok;
+
+	current = t;
+	switch (t->kind) {
+	case TRANSFER_DIR:
+		res = core_upload_dir(t->ip, t->port, t->path, transfer_progress, &t->packed);
+		ok = res == 0;
+		break;
+	case TRANSFER_CHAIN:
+		res = core_upload_chain(t->nodes, t->node_count, t->path, transfer_progress, &t->upload);
+		ok = res > 0;
+		break;
+	default:
+		res = core_upload_file_result(t->ip, t->port, t->path, transfer_progress, &t->upload);
+		ok = res == 0;
+		break;
+	}
+	current = NULL;
+
+	t->result = res;
+	if (ok)
+		atomic_store(&t->sent, atomic_load(&t->total));
+	atomic_store_explicit(&t->state, ok ? TRANSFER_DONE : TRANSFER_FAILED, memory_order_release);
+}
+
+static void *transfer_worker(void *arg)
+{
+	(void)arg;
+	transfer_t *t;
+	while ((t = transfer_claim()) != NULL)
+		transfer_run(t);
+	return NULL;
+}
+
+/*
+ * A slot for a new transfer: a free one, or else the one that finished
+ * first. Workers never touch a slot that is not queued or running, so the
+ * UI thread may refill it without a lock.
+ */
+static transfer_t *slot_take(void)
+{
+	transfer_t *finished = NULL;
+
+	for (int i = 0; i < TRANSFER_SLOTS; i++) {
+		transfer_t *t = &slots[i];
+		int state = atomic_load_explicit(&t->state, memory_order_acquire);
+		if (state == TRANSFER_FREE) return t;
+		if ((state == TRANSFER_DONE || state == TRANSFER_FAILED)
+		    && (!finished || t->ticket < finished->ticket))
+			finished = t;
+	}
+	return finished;
+}
+
+/* Starts another worker while fewer than the concurrency limit run. */
+static bool workers_spawn(void)
+{
+	if (workers_started < atomic_load(&concurrency)
+	    && pthread_create(&workers[workers_started], NULL, transfer_worker, NULL) == 0)
+		workers_started++;
+	return workers_started > 0;
+}
+
+static transfer_t *transfer_prepare(const char *path, transfer_kind_t kind)
+{
+	if (!path || strlen(path) >= PATH_MAX || atomic_load(&stopping))
+		return NULL;
+
+	transfer_t *t = slot_take();
+	if (!t || !workers_spawn()) return NULL;
+
+	atomic_store(&t->sent, 0);
+	atomic_store(&t->total, 0);
+	atomic_store(&t->rate_kbps, 0);
+	t->ticket = next_ticket++;
+	t->kind = kind;
+	t->result = 0;
+	memset(&t->upload, 0, sizeof(t->upload));
+	memset(&t->packed, 0, sizeof(t->packed));
+	t->node_count = 0;
+	snprintf(t->path, sizeof(t->path), "%s", path);
+
+	size_t len = strlen(path);
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	size_t base = len;
+	while (base > 0 && path[base - 1] != '/')
+		base--;
+	snprintf(t->name, sizeof(t->name), "%.*s%s", (int)(len - base), path + base,
+		 kind == TRANSFER_DIR ? "/" : "");
+	return t;
+}
+
+static void transfer_queue(transfer_t *t)
+{
+	pthread_mutex_lock(&queue_lock);
+	atomic_store_explicit(&t->state, TRANSFER_QUEUED, memory_order_release);
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+bool transfer_enqueue_upload(const char *ip, int port, const char *path, bool dir)
+{
+	if (!ip) return false;
+	transfer_t *t = transfer_prepare(path, dir ? TRANSFER_DIR : TRANSFER_FILE);
+	if (!t) return false;
+
+	snprintf(t->ip, sizeof(t->ip), "%s", ip);
+	t->port = port;
+	transfer_queue(t);
+	return true;
+}
+
+bool transfer_enqueue_chain(const chain_node_t *nodes, int count, const char *path)
+{
+	if (!nodes || count < 1 || count > MAX_SERVERS) return false;
+	transfer_t *t = transfer_prepare(path, TRANSFER_CHAIN);
+	if (!t) return false;
+
+	memcpy(t->nodes, nodes, (size_t)count * sizeof(*nodes));
+	t->node_count = count;
+	snprintf(t->ip, sizeof(t->ip), "%s", nodes[0].ip);
+	t->port = nodes[0].port;
+	transfer_queue(t);
+	return true;
+}
+
+int transfer_list(const transfer_t **list, int max)
+{
+	const transfer_t *all[TRANSFER_SLOTS];
+	int count = 0;
+
+	for (int i = 0; i < TRANSFER_SLOTS; i++) {
+		if (atomic_load_explicit(&slots[i].state, memory_order_acquire) == TRANSFER_FREE)
+			continue;
+		int j = count++;
+		while (j > 0 && all[j - 1]->ticket > slots[i].ticket) {
+			all[j] = all[j - 1];
+			j--;
+		}
+		all[j] = &slots[i];
+	}
+
+	int skip = count - max;
+	int n = 0;
+	for (int i = 0; i < count && n < max; i++) {
+		int state = atomic_load_explicit(&all[i]->state, memory_order_acquire);
+		if (skip > 0 && (state == TRANSFER_DONE || state == TRANSFER_FAILED)) {
+			skip--;
+			continue;
+		}
+		list[n++] = all[i];
+	}
+	return n;
+}
+
+void transfer_counts(int *running, int *waiting)
+{
+	int r = 0, q = 0;
+
+	for (int i = 0; i < TRANSFER_SLOTS; i++) {
+		int state = atomic_load_explicit(&slots[i].state, memory_order_relaxed);
+		if (state == TRANSFER_RUNNING) r++;
+		else if (state == TRANSFER_QUEUED) q++;
+	}
+	if (running) *running = r;
+	if (waiting) *waiting = q;
+}
+
+void transfer_shutdown(void)
+{
+	pthread_mutex_lock(&queue_lock);
+	atomic_store(&stopping, true);
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	for (int i = 0; i < workers_started; i++)
+		pthread_join(workers[i], NULL);
+	workers_started = 0;
+}
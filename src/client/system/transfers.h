@@ -0,0 +1,85 @@
+#ifndef TRANSFERS_H
+#define TRANSFERS_H
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "network.h"
+#include "../globals.h"
+
+#define TRANSFER_SLOTS		32
+#define TRANSFER_WORKERS_MAX	8
+#define TRANSFER_CONCURRENCY	2
+
+typedef enum {
+	TRANSFER_FREE,
+	TRANSFER_QUEUED,
+	TRANSFER_RUNNING,
+	TRANSFER_DONE,
+	TRANSFER_FAILED
+} transfer_state_t;
+
+typedef enum {
+	TRANSFER_FILE,
+	TRANSFER_DIR,
+	TRANSFER_CHAIN
+} transfer_kind_t;
+
+/*
+ * One upload of the queue. state, sent, total and rate are written by the
+ * worker running it and read by the UI without a lock. The rest is filled
+ * in before the transfer is queued, except result, upload, packed and the
+ * node statuses, which are set before it becomes DONE or FAILED. Workers
+ * read ticket only under the queue lock, while the slot is QUEUED.
+ */
+typedef struct {
+	atomic_int state;
+	atomic_size_t sent;
+	atomic_size_t total;
+	atomic_uint rate_kbps;
+	unsigned long ticket;
+	transfer_kind_t kind;
+	char path[PATH_MAX];
+	char name[64];
+	char ip[16];
+	int port;
+	chain_node_t nodes[MAX_SERVERS];
+	int node_count;
+	int result;
+	upload_result_t upload;
+	pack_result_t packed;
+} transfer_t;
+
+/*
+ * Transfers run on up to this many threads; the rest wait in the queue in
+ * the order they were added. Takes effect for workers not started yet, so
+ * it is set before the first transfer is queued.
+ */
+void transfer_set_concurrency(int workers);
+
+/*
+ * Queues an upload of path, a regular file or a directory, to ip:port, or
+ * of a file down a chain of nodes as core_upload_chain() would. Only the
+ * UI thread queues transfers; a slot whose transfer finished longest ago
+ * is reused when none is free. False when every slot is still busy.
+ */
+bool transfer_enqueue_upload(const char *ip, int port, const char *path, bool dir);
+bool transfer_enqueue_chain(const chain_node_t *nodes, int count, const char *path);
+
+/*
+ * Fills list with up to max transfers in the order they were queued. When
+ * they do not all fit, those that finished longest ago are left out.
+ */
+int transfer_list(const transfer_t **list, int max);
+
+/* Transfers running and waiting to run. */
+void transfer_counts(int *running, int *waiting);
+
+/*
+ * Stops starting queued transfers and waits for those running to finish,
+ * at their own pace: a stream in flight holds its session until then.
+ */
+void transfer_shutdown(void);
+
+#endif
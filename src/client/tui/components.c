@@ -1,7 +1,9 @@
 #define _XOPEN_SOURCE_EXTENDED
 #include "../globals.h"
 #include "interface.h"
+#include "../system/transfers.h"
 #include <ncurses.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -178,3 +180,72 @@ void draw_server_table(void)
 
 	pthread_mutex_unlock(&list_mutex);
 }
+
+/* One line of the transfers panel: what became of t, in at most 14 columns. */
+static void transfer_status(const transfer_t *t, int state, char *out, size_t size)
+{
+	size_t sent = atomic_load_explicit(&t->sent, memory_order_relaxed);
+	size_t total = atomic_load_explicit(&t->total, memory_order_relaxed);
+
+	if (state == TRANSFER_QUEUED) {
+		snprintf(out, size, "queued");
+	} else if (state == TRANSFER_RUNNING) {
+		int pct = total ? (int)(sent * 100 / total) : 0;
+		unsigned kbps = atomic_load_explicit(&t->rate_kbps,
+						     memory_order_relaxed);
+		snprintf(out, size, "%3d%% %5.1fMB/s", pct, kbps / 1024.0);
+	} else if (state == TRANSFER_FAILED) {
+		snprintf(out, size, "%s", t->result == NET_ERR_BUSY ? "busy"
+			 : t->kind == TRANSFER_CHAIN && t->result == -2 ?
+			 "no chain" : "failed");
+	} else if (t->kind == TRANSFER_CHAIN) {
+		snprintf(out, size, "on %d of %d", t->result, t->node_count);
+	} else if (t->kind == TRANSFER_DIR) {
+		snprintf(out, size, "%zu files", t->packed.files);
+	} else if (t->upload.deduplicated) {
+		snprintf(out, size, "stored");
+	} else if (t->upload.reused > 0 && total > 0) {
+		snprintf(out, size, "reused %d%%",
+			 (int)(t->upload.reused * 100 / total));
+	} else if (t->upload.compressed_wire > 0) {
+		snprintf(out, size, "lz %.1fx", (double)t->upload.compressed /
+			 t->upload.compressed_wire);
+	} else {
+		snprintf(out, size, "crc %08x", t->upload.crc32c);
+	}
+}
+
+void draw_transfer_panel(int y, int x, int h, int w)
+{
+	const transfer_t *list[TRANSFER_SLOTS];
+	int max = h - 2 < TRANSFER_SLOTS ? h - 2 : TRANSFER_SLOTS;
+
+	if (h < 3 || w < 24)
+		return;
+	draw_btop_box(y, x, h, w, "TRANSFERS");
+
+	int count = transfer_list(list, max);
+	if (count == 0) {
+		attron(COLOR_PAIR(CP_DIM));
+		mvprintw(y + 1, x + 2, "NO TRANSFERS");
+		attroff(COLOR_PAIR(CP_DIM));
+		return;
+	}
+
+	int name_w = w - 4 - 15;
+	for (int i = 0; i < count; i++) {
+		const transfer_t *t = list[i];
+		int state = atomic_load_explicit(&t->state,
+						 memory_order_acquire);
+		char status[32];
+		int attr = state == TRANSFER_FAILED ? COLOR_PAIR(CP_WARN)
+		    : state == TRANSFER_RUNNING ? COLOR_PAIR(CP_DEFAULT) | A_BOLD
+		    : COLOR_PAIR(CP_DEFAULT) | A_DIM;
+
+		transfer_status(t, state, status, sizeof(status));
+		attron(attr);
+		mvprintw(y + 1 + i, x + 2, "%-*.*s %14.14s", name_w, name_w,
+			 t->name, status);
+		attroff(attr);
+	}
+}
@@ -166,6 +166,7 @@ void handle_input_btop(pthread_t *thread_ptr)
 		    && last_click_x >= btn_start_x
 		    && last_click_x < btn_start_x + btn_w) {
 			connected_to_server = false;
+			core_disconnect(current_server.ip, current_server.port);
 			memset(connection_password, 0,
 			       sizeof(connection_password));
 		}
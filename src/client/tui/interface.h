@@ -25,13 +25,13 @@ void draw_btop_box(int y, int x, int h, int w, const char *title);
 void draw_meter(int y, int x, int w, int percent);
 void draw_button_btop(int y, int x, int w, const char *text, bool active);
 void draw_server_table(void);
+void draw_transfer_panel(int y, int x, int h, int w);
 
 // Popups (popups.c)
 void popup_input_btop(void);
 void popup_file_upload(void);
 void popup_execute_cmd(void);
 void popup_show_output(const char *title, const char *content);
-void on_upload_progress(size_t sent, size_t total, double speed_mbps);
 
 // Input (input.c)
 void handle_input_btop(pthread_t * thread_ptr);
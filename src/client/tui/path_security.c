@@ -110,7 +110,7 @@ bool is_path_safe(const char* path, const char* allowed_base)
 
         if (stat(path_copy, &st) == 0)
         {
-                if (!S_ISREG(st.st_mode))
+                if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
                         return false;
 
                 if (access(path_copy, R_OK) != 0)
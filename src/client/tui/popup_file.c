@@ -1,8 +1,10 @@
 #define _XOPEN_SOURCE_EXTENDED
 #include "../globals.h"
 #include "../system/api.h"
+#include "../system/transfers.h"
 #include "interface.h"
 #include "path_security.h"
+#include <ctype.h>
 #include <ncurses.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,34 +17,70 @@
 #define UPLOAD_BASE_DIR "./uploads"
 #endif
 
-void on_upload_progress(size_t sent, size_t total, double speed_mbps)
+/*
+ * Asks which other discovered servers should get the file too, by ID or
+ * "all", and fills nodes with them behind the current server. Returns the
+ * number of nodes; 1 leaves the upload to the current server alone.
+ */
+static int prompt_chain_targets(int y, int x, int w, int h, chain_node_t *nodes)
 {
-	int w = 60, h = 12;
-	int y = rows / 2 - h / 2;
-	int x = cols / 2 - w / 2;
+	char input_buf[128] = { 0 };
+	int count = 1;
 
-	int pct = (int)((sent * 100) / total);
+	snprintf(nodes[0].ip, sizeof(nodes[0].ip), "%s", current_server.ip);
+	nodes[0].port = current_server.port;
+
+	pthread_mutex_lock(&list_mutex);
+	int others = server_count > 1;
+	pthread_mutex_unlock(&list_mutex);
+	if (!others)
+		return count;
 
 	attron(COLOR_PAIR(CP_DEFAULT));
 	for (int i = 0; i < h; i++) {
 		mvhline(y + i, x, ' ', w);
 	}
-	draw_btop_box(y, x, h, w, "UPLOADING FILE");
-
-	mvprintw(y + 2, x + 2, "Transferred: %zu / %zu bytes", sent, total);
-	mvprintw(y + 3, x + 2, "Speed: %.2f MB/s", speed_mbps);
-
-	draw_meter(y + 5, x + 2, w - 4, pct);
+	draw_btop_box(y, x, h, w, "FILE UPLOAD");
+	mvprintw(y + 2, x + 2, "ALSO SEND TO (IDs, all; Enter: none):");
 
-	int spinner_x = x + w / 2 - 4;
-	draw_spinner(y + 7, spinner_x);
+	attron(A_REVERSE);
+	mvhline(y + 4, x + 2, ' ', w - 4);
+	attroff(A_REVERSE);
 
-	attron(A_BOLD);
-	mvprintw(y + 7, x + 2, " %d%% COMPLETE ", pct);
-	attroff(A_BOLD);
+	echo();
+	curs_set(1);
+	move(y + 4, x + 2);
+	timeout(-1);
+	safe_getnstr(input_buf, sizeof(input_buf), w - 4 - 1);
+	timeout(10);
+	noecho();
+	curs_set(0);
 
-	attroff(COLOR_PAIR(CP_DEFAULT));
-	refresh();
+	bool all = strncmp(input_buf, "all", 3) == 0;
+	pthread_mutex_lock(&list_mutex);
+	for (int i = 0; i < server_count && count < MAX_SERVERS; i++) {
+		struct ServerInfo *srv = &server_list[i];
+		bool picked = all;
+
+		if (strcmp(srv->ip, current_server.ip) == 0
+		    && srv->port == current_server.port)
+			continue;
+		for (char *p = input_buf; !picked && *p;) {
+			if (!isdigit((unsigned char)*p)) {
+				p++;
+				continue;
+			}
+			picked = strtol(p, &p, 10) == srv->server_id;
+		}
+		if (!picked)
+			continue;
+		snprintf(nodes[count].ip, sizeof(nodes[count].ip), "%s",
+			 srv->ip);
+		nodes[count].port = srv->port;
+		count++;
+	}
+	pthread_mutex_unlock(&list_mutex);
+	return count;
 }
 
 void popup_file_upload(void)
@@ -123,7 +161,8 @@ void popup_file_upload(void)
 
 		struct stat st;
 
-		if (stat(safe_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+		if (stat(safe_path, &st) != 0
+		    || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))) {
 			attron(COLOR_PAIR(CP_DEFAULT));
 
 			for (int i = 0; i < h; i++) {
@@ -134,7 +173,7 @@ void popup_file_upload(void)
 			attron(COLOR_PAIR(CP_WARN) | A_BOLD);
 
 			mvprintw(y + 3, x + 2, " FILE NOT FOUND ");
-			mvprintw(y + 5, x + 2, " or not a regular file ");
+			mvprintw(y + 5, x + 2, " or not a file or directory ");
 			attroff(COLOR_PAIR(CP_WARN) | A_BOLD);
 
 			refresh();
@@ -143,30 +182,31 @@ void popup_file_upload(void)
 			return;
 		}
 
-		int res =
-		    core_upload_file(current_server.ip, current_server.port,
-				     safe_path, on_upload_progress);
+		chain_node_t nodes[MAX_SERVERS];
+		bool dir = S_ISDIR(st.st_mode);
+		int chain = dir ? 1 : prompt_chain_targets(y, x, w, h, nodes);
+		bool queued = chain > 1 ?
+		    transfer_enqueue_chain(nodes, chain, safe_path) :
+		    transfer_enqueue_upload(current_server.ip,
+					    current_server.port, safe_path, dir);
 
-		attron(COLOR_PAIR(CP_DEFAULT));
-
-		for (int i = 0; i < h; i++) {
-			mvhline(y + i, x, ' ', w);
-		}
+		if (!queued) {
+			attron(COLOR_PAIR(CP_DEFAULT));
 
-		draw_btop_box(y, x, h, w, "STATUS");
+			for (int i = 0; i < h; i++) {
+				mvhline(y + i, x, ' ', w);
+			}
 
-		if (res == 0) {
-			attron(COLOR_PAIR(CP_INVERT));
-			mvprintw(y + 3, x + w / 2 - 8, " UPLOAD COMPLETE ");
-			attroff(COLOR_PAIR(CP_INVERT));
-		} else {
+			draw_btop_box(y, x, h, w, "ERROR");
 			attron(COLOR_PAIR(CP_WARN) | A_BOLD);
-			mvprintw(y + 3, x + w / 2 - 6, " UPLOAD FAILED ");
+
+			mvprintw(y + 3, x + 2, " TRANSFER QUEUE FULL ");
+			mvprintw(y + 5, x + 2, " wait for a transfer to finish ");
 			attroff(COLOR_PAIR(CP_WARN) | A_BOLD);
-		}
 
-		refresh();
-		usleep(1000000);
+			refresh();
+			usleep(2000000);
+		}
 	}
 
 	attroff(COLOR_PAIR(CP_DEFAULT));
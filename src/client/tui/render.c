@@ -1,6 +1,7 @@
 #define _XOPEN_SOURCE_EXTENDED
 #include "../globals.h"
 #include "interface.h"
+#include "../system/transfers.h"
 #include <ncurses.h>
 #include <stdlib.h>
 #include <string.h>
@@ -65,5 +66,11 @@ void draw_background(void)
 		mvprintw(rows - 1, 2, " CPU: --- %s MEM: --- %s NET: IDLE ",
 			 dots, dots);
 	}
+
+	int running, waiting;
+	transfer_counts(&running, &waiting);
+	if (running + waiting > 0)
+		mvprintw(rows - 1, cols - 28, " XFER: %d RUN %d QUEUED ",
+			 running, waiting);
 	attroff(COLOR_PAIR(CP_FRAME) | A_DIM);
 }
@@ -0,0 +1,199 @@
+#include "crc32c.h"
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY	0x82F63B78u
+#define CRC32C_STRIPE	4096
+
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+static uint32_t (*update_fn)(uint32_t crc, const unsigned char *p, size_t len);
+
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec);
+static void gf2_square(uint32_t *square, const uint32_t *mat);
+
+/* Slicing-by-8: one table lookup per byte, eight bytes per step. */
+static uint32_t update_table(uint32_t crc, const unsigned char *p, size_t len)
+{
+	crc = ~crc;
+	while (len >= 8) {
+		uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8
+				     | (uint32_t)p[2] << 16
+				     | (uint32_t)p[3] << 24);
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff]
+		    ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24]
+		    ^ table[3][p[4]] ^ table[2][p[5]]
+		    ^ table[1][p[6]] ^ table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+/* Operators appending one and two stripes of zero bytes to a CRC register. */
+static uint32_t shift_one[32];
+static uint32_t shift_two[32];
+
+/*
+ * SSE4.2 crc32 instruction, eight bytes at a time. The instruction has a
+ * latency of three cycles but issues every cycle, so long buffers are cut
+ * into three stripes hashed side by side; the three registers are then
+ * joined by shifting the first two over the stripes that follow them.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t update_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t a = ~crc;
+	uint64_t v0, v1, v2;
+
+	while (len >= 3 * CRC32C_STRIPE) {
+		uint64_t b = 0, c = 0;
+		for (size_t i = 0; i < CRC32C_STRIPE; i += 8) {
+			memcpy(&v0, p + i, 8);
+			memcpy(&v1, p + CRC32C_STRIPE + i, 8);
+			memcpy(&v2, p + 2 * CRC32C_STRIPE + i, 8);
+			a = _mm_crc32_u64(a, v0);
+			b = _mm_crc32_u64(b, v1);
+			c = _mm_crc32_u64(c, v2);
+		}
+		a = gf2_times(shift_two, (uint32_t)a)
+		    ^ gf2_times(shift_one, (uint32_t)b) ^ (uint32_t)c;
+		p += 3 * CRC32C_STRIPE;
+		len -= 3 * CRC32C_STRIPE;
+	}
+	while (len >= 8) {
+		memcpy(&v0, p, 8);
+		a = _mm_crc32_u64(a, v0);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		a = _mm_crc32_u8((uint32_t)a, *p++);
+	return ~(uint32_t)a;
+}
+
+/* Builds the operator for len zero bytes by squaring the one-bit shift. */
+static void gf2_zeros(uint32_t *mat, uint64_t len)
+{
+	uint32_t op[32];
+	uint32_t tmp[32];
+
+	op[0] = CRC32C_POLY;
+	for (int i = 1; i < 32; i++)
+		op[i] = 1u << (i - 1);
+	gf2_square(tmp, op);
+	gf2_square(op, tmp);
+	gf2_square(tmp, op);
+	for (int i = 0; i < 32; i++)
+		mat[i] = 1u << i;
+	for (;;) {
+		if (len & 1) {
+			for (int i = 0; i < 32; i++)
+				mat[i] = gf2_times(tmp, mat[i]);
+		}
+		len >>= 1;
+		if (len == 0)
+			break;
+		gf2_square(op, tmp);
+		memcpy(tmp, op, sizeof(tmp));
+	}
+}
+#endif
+
+static void table_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+		table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int t = 1; t < 8; t++)
+			table[t][i] = (table[t - 1][i] >> 8)
+			    ^ table[0][table[t - 1][i] & 0xff];
+	}
+	update_fn = update_table;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		gf2_zeros(shift_one, CRC32C_STRIPE);
+		gf2_zeros(shift_two, 2 * CRC32C_STRIPE);
+		update_fn = update_sse42;
+	}
+#endif
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len)
+{
+	pthread_once(&table_once, table_init);
+	return update_fn(crc, data, len);
+}
+
+bool crc32c_hardware(void)
+{
+	pthread_once(&table_once, table_init);
+	return update_fn != update_table;
+}
+
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	for (int i = 0; vec; i++, vec >>= 1) {
+		if (vec & 1)
+			sum ^= mat[i];
+	}
+	return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+	for (int i = 0; i < 32; i++)
+		square[i] = gf2_times(mat, mat[i]);
+}
+
+/*
+ * Appends len_b zero bytes to crc_a by repeated squaring of the operator
+ * that shifts the register by one bit, then folds in crc_b; as in zlib.
+ */
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b)
+{
+	uint32_t even[32];
+	uint32_t odd[32];
+
+	if (len_b == 0)
+		return crc_a;
+
+	odd[0] = CRC32C_POLY;
+	for (int i = 1; i < 32; i++)
+		odd[i] = 1u << (i - 1);
+	gf2_square(even, odd);
+	gf2_square(odd, even);
+
+	do {
+		gf2_square(even, odd);
+		if (len_b & 1)
+			crc_a = gf2_times(even, crc_a);
+		len_b >>= 1;
+		if (len_b == 0)
+			break;
+		gf2_square(odd, even);
+		if (len_b & 1)
+			crc_a = gf2_times(odd, crc_a);
+		len_b >>= 1;
+	} while (len_b);
+
+	return crc_a ^ crc_b;
+}
+
+/* Zero bytes only shift the register, so none need to be read. */
+uint32_t crc32c_zeros(uint32_t crc, uint64_t len)
+{
+	return ~crc32c_combine(~crc, 0, len);
+}
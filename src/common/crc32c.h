@@ -0,0 +1,26 @@
+#ifndef OVERSEER_CRC32C_H
+#define OVERSEER_CRC32C_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli), the checksum uploads are verified with. Updates
+ * chain: crc32c_update(crc32c_update(0, a), b) is the CRC of a followed
+ * by b, so a file can be checksummed as it streams, in any window size.
+ * On x86-64 CPUs with SSE4.2 the crc32 instruction is used; elsewhere a
+ * slicing-by-8 table.
+ */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len);
+
+/* True when crc32c_update() runs on the CPU's crc32 instruction. */
+bool crc32c_hardware(void);
+
+/* CRC of a followed by b, given the CRC of each and the length of b. */
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b);
+
+/* CRC of the data crc covers followed by len zero bytes, e.g. a file hole. */
+uint32_t crc32c_zeros(uint32_t crc, uint64_t len);
+
+#endif
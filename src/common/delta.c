@@ -0,0 +1,37 @@
+#include "delta.h"
+#include "xxh64.h"
+
+size_t delta_block_size(uint64_t size)
+{
+	size_t block = DELTA_BLOCK_MIN;
+
+	while (size / block > DELTA_MAX_BLOCKS)
+		block *= 2;
+	return block;
+}
+
+/*
+ * a is the sum of the bytes, b the sum of a after each byte; both mod 2^16.
+ * Four bytes are folded in per step.
+ */
+uint32_t delta_weak(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint32_t a = 0, b = 0;
+	size_t i = 0;
+
+	for (; i + 4 <= len; i += 4) {
+		b += 4 * a + 4 * p[i] + 3 * p[i + 1] + 2 * p[i + 2] + p[i + 3];
+		a += p[i] + p[i + 1] + p[i + 2] + p[i + 3];
+	}
+	for (; i < len; i++) {
+		a += p[i];
+		b += a;
+	}
+	return (a & 0xffff) | (b << 16);
+}
+
+uint64_t delta_strong(const void *data, size_t len)
+{
+	return xxh64(data, len);
+}
@@ -0,0 +1,33 @@
+#ifndef OVERSEER_DELTA_H
+#define OVERSEER_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Block checksums for delta uploads, as in rsync. The weak checksum can be
+ * rolled along a buffer one byte at a time, so the client can look for
+ * every block of the server's copy at every offset of its own file; the
+ * strong one, XXH64, confirms a weak match.
+ */
+#define DELTA_BLOCK_MIN		4096
+#define DELTA_MAX_BLOCKS	65536
+
+/* Block size for a file of size bytes: at most DELTA_MAX_BLOCKS blocks. */
+size_t delta_block_size(uint64_t size);
+
+uint32_t delta_weak(const void *data, size_t len);
+
+/* Weak checksum of the window moved one byte on: out leaves, in enters. */
+static inline uint32_t delta_roll(uint32_t weak, size_t len, unsigned char out,
+				  unsigned char in)
+{
+	uint32_t a = (weak & 0xffff) - out + in;
+	uint32_t b = (weak >> 16) - (uint32_t)(len * out) + a;
+
+	return (a & 0xffff) | (b << 16);
+}
+
+uint64_t delta_strong(const void *data, size_t len);
+
+#endif
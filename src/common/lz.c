@@ -0,0 +1,200 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS	14
+#define LZ_SKIP_SHIFT	6
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Bytes from a and b that are equal, b stopping at end. */
+static size_t match_length(const unsigned char *a, const unsigned char *b,
+			   const unsigned char *end)
+{
+	const unsigned char *start = b;
+
+	while (end - b >= 8) {
+		uint64_t x, y;
+
+		memcpy(&x, a, sizeof(x));
+		memcpy(&y, b, sizeof(y));
+		if (x != y) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			return (size_t)(b - start)
+			    + (size_t)(__builtin_clzll(x ^ y) >> 3);
+#else
+			return (size_t)(b - start)
+			    + (size_t)(__builtin_ctzll(x ^ y) >> 3);
+#endif
+		}
+		a += 8;
+		b += 8;
+	}
+	while (b < end && *a == *b) {
+		a++;
+		b++;
+	}
+	return (size_t)(b - start);
+}
+
+static unsigned char *put_length(unsigned char *op, size_t n)
+{
+	while (n >= 255) {
+		*op++ = 255;
+		n -= 255;
+	}
+	*op++ = (unsigned char)n;
+	return op;
+}
+
+/*
+ * Appends literals and, when match is non-zero, a back-reference of match
+ * bytes offset back. NULL when it does not fit before end.
+ */
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *end,
+				   const unsigned char *lit, size_t lits,
+				   size_t offset, size_t match)
+{
+	size_t extra = match ? match - LZ_MIN_MATCH : 0;
+	size_t need = 1 + lits / 255 + 1 + lits
+	    + (match ? 2 + extra / 255 + 1 : 0);
+
+	if (need > (size_t)(end - op))
+		return NULL;
+	unsigned char *token = op++;
+	*token = (unsigned char)((lits < 15 ? lits : 15) << 4
+				 | (extra < 15 ? extra : 15));
+	if (lits >= 15)
+		op = put_length(op, lits - 15);
+	memcpy(op, lit, lits);
+	op += lits;
+	if (!match)
+		return op;
+	*op++ = (unsigned char)(offset & 0xff);
+	*op++ = (unsigned char)(offset >> 8);
+	if (extra >= 15)
+		op = put_length(op, extra - 15);
+	return op;
+}
+
+size_t lz_bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const unsigned char *in = src;
+	const unsigned char *end = in + len;
+	const unsigned char *ip = in;
+	const unsigned char *anchor = in;
+	unsigned char *op = dst;
+	const unsigned char *oend = op + cap;
+
+	memset(table, 0, sizeof(table));
+	while (len >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+		uint32_t seq = read32(ip);
+		uint32_t h = lz_hash(seq);
+		const unsigned char *ref = in + table[h];
+
+		table[h] = (uint32_t)(ip - in);
+		if (ref < ip && ip - ref <= LZ_WINDOW && read32(ref) == seq) {
+			size_t match = LZ_MIN_MATCH
+			    + match_length(ref + LZ_MIN_MATCH,
+					   ip + LZ_MIN_MATCH, end);
+
+			op = put_sequence(op, oend, anchor,
+					  (size_t)(ip - anchor),
+					  (size_t)(ip - ref), match);
+			if (!op)
+				return 0;
+			ip += match;
+			anchor = ip;
+			continue;
+		}
+		ip += 1 + ((size_t)(ip - anchor) >> LZ_SKIP_SHIFT);
+	}
+	op = put_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+	return op ? (size_t)(op - (unsigned char *)dst) : 0;
+}
+
+static bool get_length(const unsigned char **ip, const unsigned char *end,
+		       size_t *n)
+{
+	unsigned char b;
+
+	do {
+		if (*ip == end)
+			return false;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+	return true;
+}
+
+bool lz_decompress(const void *src, size_t len, void *dst, size_t raw)
+{
+	const unsigned char *ip = src;
+	const unsigned char *end = ip + len;
+	unsigned char *out = dst;
+	unsigned char *op = out;
+	unsigned char *oend = out + raw;
+
+	while (ip < end) {
+		unsigned int token = *ip++;
+		size_t lits = token >> 4;
+		size_t match = token & 15;
+
+		if (lits == 15 && !get_length(&ip, end, &lits))
+			return false;
+		if (lits > (size_t)(end - ip) || lits > (size_t)(oend - op))
+			return false;
+		if (end - ip >= 16 && oend - op >= 16 && lits <= 16)
+			memcpy(op, ip, 16);
+		else
+			memcpy(op, ip, lits);
+		op += lits;
+		ip += lits;
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return false;
+		size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		if (match == 15 && !get_length(&ip, end, &match))
+			return false;
+		match += LZ_MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(op - out)
+		    || match > (size_t)(oend - op))
+			return false;
+
+		const unsigned char *ref = op - offset;
+		if (offset >= 16 && match <= 16 && oend - op >= 16) {
+			memcpy(op, ref, 16);
+			op += match;
+			continue;
+		}
+		while (match > 0) {
+			size_t step = (size_t)(op - ref);
+			if (step > match)
+				step = match;
+			memcpy(op, ref, step);
+			op += step;
+			match -= step;
+		}
+	}
+	return op == oend;
+}
@@ -0,0 +1,41 @@
+#ifndef OVERSEER_LZ_H
+#define OVERSEER_LZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Block compressor in the manner of LZ4: a block is a run of sequences,
+ * each a token, literal bytes copied as they are and a back-reference of
+ * at least LZ_MIN_MATCH bytes within the last LZ_WINDOW, the last sequence
+ * carrying literals only. Matches are found through a hash of the next
+ * four bytes with no search beyond it, and the scan speeds up over data
+ * that does not match, so text and logs shrink several times at hundreds
+ * of MB/s while data that does not compress costs little to try.
+ *
+ *   token: literal count:4 | match length - LZ_MIN_MATCH:4
+ *   [255...] literals [offset:16 little-endian [255...]]
+ *
+ * A nibble of 15 is continued by bytes added to it, up to the first that
+ * is not 255.
+ */
+#define LZ_MIN_MATCH	4
+#define LZ_WINDOW	65535
+
+/* The most lz_compress() can produce from len bytes. */
+size_t lz_bound(size_t len);
+
+/*
+ * Compresses len bytes of src into dst; returns the compressed size, or 0
+ * when it would not fit in cap.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/*
+ * Expands the block of len bytes at src into exactly raw bytes at dst.
+ * Never reads or writes out of bounds, whatever src holds; false when the
+ * block is malformed or does not expand to raw bytes.
+ */
+bool lz_decompress(const void *src, size_t len, void *dst, size_t raw);
+
+#endif
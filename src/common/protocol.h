@@ -0,0 +1,269 @@
+#ifndef OVERSEER_PROTOCOL_H
+#define OVERSEER_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Binary wire protocol shared by client and server.
+ *
+ * Every message is a frame: a fixed FRAME_HEADER_SIZE header followed by
+ * length payload bytes. All integers are big-endian.
+ *
+ *   0      1        2     3      4          8              12
+ *   magic  version  type  flags  length:32  request_id:32  payload...
+ *
+ * The magic byte is not printable ASCII, so the server tells a binary peer
+ * from a text one by the first byte of the connection. A binary client
+ * opens with HELLO (payload: u32 capability mask) and AUTH (payload: the
+ * password); the server answers HELLO with the capabilities both sides
+ * share and AUTH with OK or ERR. Replies carry the request_id of the frame
+ * they answer. A reply split over several frames sets FRAME_F_MORE on all
+ * but the last. Requests carry at most FRAME_MAX_REQUEST payload bytes;
+ * only DATA frames, up to FRAME_MAX_PAYLOAD, are larger. Unknown request
+ * types are answered with ERR and the connection stays usable, so new
+ * commands can be added without breaking older peers.
+ */
+
+#define FRAME_MAGIC		0xA7
+#define FRAME_VERSION		1
+#define FRAME_HEADER_SIZE	12
+#define FRAME_MAX_REQUEST	1000
+#define FRAME_MAX_PAYLOAD	(1024 * 1024)
+#define FRAME_DATA_CHUNK	FRAME_MAX_PAYLOAD
+
+#define FRAME_F_MORE		0x01
+#define FRAME_F_LZ		0x02
+
+enum FrameType {
+	FRAME_HELLO = 0x01,
+	FRAME_AUTH = 0x02,
+	FRAME_OK = 0x03,
+	FRAME_ERR = 0x04,
+	FRAME_BUSY = 0x05,
+	FRAME_PING = 0x06,
+	FRAME_PONG = 0x07,
+	FRAME_QUIT = 0x08,
+
+	FRAME_MSG = 0x10,
+	FRAME_STATS = 0x11,
+	FRAME_METRICS = 0x12,
+	FRAME_EXEC = 0x13,
+	FRAME_FILE = 0x14,
+	FRAME_GO = 0x15,
+	FRAME_UPLOAD = 0x16,
+	FRAME_RANGE = 0x17,
+	FRAME_COMMIT = 0x18,
+	FRAME_PARTIAL = 0x19,
+	FRAME_RESUME = 0x1A,
+	FRAME_CHECKSUM = 0x1B,
+	FRAME_SIGNATURE = 0x1C,
+	FRAME_DELTA = 0x1D,
+	FRAME_COPY = 0x1E,
+	FRAME_PROBE = 0x1F,
+
+	FRAME_DATA = 0x20,
+	FRAME_LINK = 0x21,
+	FRAME_HOLE = 0x22,
+	FRAME_PACK = 0x23,
+	FRAME_ENTRY = 0x24,
+	FRAME_GET = 0x25,
+	FRAME_CHAIN = 0x26
+};
+
+/* Capability bits exchanged in HELLO. */
+#define CAP_EXEC		(1u << 0)
+#define CAP_UPLOAD		(1u << 1)
+#define CAP_METRICS		(1u << 2)
+#define CAP_PARALLEL		(1u << 3)
+#define CAP_RESUME		(1u << 4)
+#define CAP_DELTA		(1u << 5)
+#define CAP_DEDUP		(1u << 6)
+#define CAP_SPARSE		(1u << 7)
+#define CAP_PACK		(1u << 8)
+#define CAP_GET			(1u << 9)
+#define CAP_LZ			(1u << 10)
+#define CAP_CHAIN		(1u << 11)
+
+#define PROTOCOL_CAPS		(CAP_EXEC | CAP_UPLOAD | CAP_METRICS \
+				 | CAP_PARALLEL | CAP_RESUME | CAP_DELTA \
+				 | CAP_DEDUP | CAP_SPARSE | CAP_PACK \
+				 | CAP_GET | CAP_LZ | CAP_CHAIN)
+
+/*
+ * Fixed payloads. STATS: u32 cpu usage in hundredths of a percent, u64 used
+ * and u64 total memory in MB. FILE: u64 size followed by the file name.
+ * BUSY: u32 seconds to wait. The final OK of an upload: u64 bytes stored.
+ *
+ * Parallel uploads (CAP_PARALLEL) split a file into ranges sent over
+ * separate connections. UPLOAD: u64 size followed by the name, answered by
+ * OK with a u32 upload id and, when an interrupted upload of the same file
+ * is picked up, one u64 offset, u64 length, u32 CRC32C per range already
+ * stored. RANGE: u32 upload id, u64 offset, u64 length, then GO, DATA
+ * frames and OK with u64 bytes stored, like FILE. COMMIT: u32 upload id
+ * and optionally the u32 CRC32C of the whole file, answered by OK with u64
+ * size once every byte has arrived and the file is in place.
+ *
+ * Resumable uploads (CAP_RESUME). PARTIAL: u64 size followed by the name,
+ * answered by OK with the u64 offset the server already holds and the u32
+ * CRC32C of those bytes. RESUME: u64 size, u64 offset (zero or the one
+ * PARTIAL returned) and the name, then GO and DATA frames from the offset
+ * on, and finally CHECKSUM with the u32 CRC32C of the whole file. The file
+ * is put in place and OK with u64 size returned only if it matches.
+ *
+ * Delta uploads (CAP_DELTA). SIGNATURE: the name, answered by DATA frames
+ * carrying u32 block size, u64 size and u32 block count of the stored
+ * file, then a u32 weak and u64 strong checksum per whole block, ended by
+ * OK; ERR when there is no stored file. DELTA: u64 size, u64 stored size,
+ * u32 block size and the name, then GO, and in file order DATA frames of
+ * new bytes and COPY frames (u32 first block, u32 block count) reusing the
+ * stored file, ended by CHECKSUM as for RESUME. OK carries u64 size and
+ * u64 bytes taken from the stored file.
+ *
+ * Deduplicated uploads (CAP_DEDUP). PROBE: u64 size, answered by OK with
+ * the u32 number of stored contents of that size. LINK: u64 size, the
+ * 32-byte SHA-256 of the file and the name, answered by OK with u64 size
+ * once the name refers to the stored content with that key, or ERR when
+ * the server holds no such content and the file has to be uploaded.
+ *
+ * Sparse uploads (CAP_SPARSE). Among the DATA frames of FILE and RESUME,
+ * HOLE with a u64 length stands for that many zero bytes, which the server
+ * leaves as a hole in the file instead of writing. They count toward the
+ * size and the CRC32C like any other bytes.
+ *
+ * Packed uploads (CAP_PACK) carry a directory tree over one stream. PACK:
+ * the name of the directory to fill under storage, answered by GO. Each
+ * file follows as ENTRY (u64 size and the path relative to that directory:
+ * at most PACK_PATH_MAX bytes, '/'-separated, no empty, . or ..
+ * components), the DATA frames of its bytes and CHECKSUM with their
+ * CRC32C. An empty ENTRY ends the pack. A file whose CRC does not match is
+ * dropped and the rest carry on; OK carries u32 files stored and u64
+ * bytes.
+ *
+ * Downloads (CAP_GET). GET: u64 offset, u64 length and the name of a file
+ * in storage, answered by OK with the u64 size of the file and the u64
+ * length actually sent, which is the range cut short at the end of the
+ * file, followed by that many bytes in DATA frames. Length 0 asks for the
+ * size alone. ERR when there is no such file or the offset is past its
+ * end.
+ *
+ * Compressed frames (CAP_LZ). Once both sides share CAP_LZ, the DATA
+ * frames of an upload and of EXEC output may set FRAME_F_LZ: the payload
+ * is then a u32 length, at most FRAME_DATA_CHUNK, followed by that many
+ * bytes compressed as one lz block (common/lz.h). The sender decides frame
+ * by frame, so data that does not compress goes out as it is.
+ *
+ * Chained uploads (CAP_CHAIN) pass one upload down a line of servers.
+ * CHAIN: u64 size, u32 count, then a u32 IPv4 address and u32 port for
+ * each of the count servers after this one, then the name; answered by
+ * GO, then DATA frames and CHECKSUM as for RESUME. The server opens CHAIN
+ * with the rest of the line on the first of those servers it can reach
+ * and forwards every frame to it as soon as the frame is stored. Each
+ * server checks the CRC32C on its own copy. OK carries one ChainStatus
+ * byte per server of the line, the addressed one first. A line holds at
+ * most CHAIN_MAX_NODES servers.
+ */
+#define STATS_PAYLOAD_SIZE	20
+#define FILE_PAYLOAD_MIN	8
+#define UPLOAD_PAYLOAD_MIN	8
+#define RANGE_PAYLOAD_SIZE	20
+#define COMMIT_PAYLOAD_SIZE	4
+#define COMMIT_PAYLOAD_CRC	8
+#define DONE_RANGE_SIZE		20
+#define UPLOAD_DONE_MAX		64
+#define PARTIAL_PAYLOAD_MIN	8
+#define PARTIAL_REPLY_SIZE	12
+#define RESUME_PAYLOAD_MIN	16
+#define CHECKSUM_PAYLOAD_SIZE	4
+#define LZ_HEAD_SIZE		4
+#define SIGNATURE_HEAD_SIZE	16
+#define SIGNATURE_ENTRY_SIZE	12
+#define DELTA_PAYLOAD_MIN	20
+#define COPY_PAYLOAD_SIZE	8
+#define DELTA_REPLY_SIZE	16
+#define PROBE_PAYLOAD_SIZE	8
+#define PROBE_REPLY_SIZE	4
+#define LINK_PAYLOAD_MIN	40
+#define HOLE_PAYLOAD_SIZE	8
+#define ENTRY_PAYLOAD_MIN	8
+#define PACK_PATH_MAX		400
+#define PACK_REPLY_SIZE		12
+#define GET_PAYLOAD_MIN		16
+#define GET_REPLY_SIZE		16
+#define CHAIN_PAYLOAD_MIN	12
+#define CHAIN_HOP_SIZE		8
+#define CHAIN_MAX_NODES		64
+
+/*
+ * How a chained upload went on one server: stored and verified; never
+ * reached, because it could not be connected to, was busy or refused
+ * CHAIN; cut off when the stream to it broke or its report was lost; or
+ * reached but its copy failed the CRC32C check or could not be stored.
+ */
+enum ChainStatus {
+	CHAIN_STORED = 0,
+	CHAIN_UNREACHABLE = 1,
+	CHAIN_BROKEN = 2,
+	CHAIN_REJECTED = 3
+};
+
+struct FrameHeader {
+	uint8_t magic;
+	uint8_t version;
+	uint8_t type;
+	uint8_t flags;
+	uint32_t length;
+	uint32_t request_id;
+};
+
+static inline void put_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static inline uint32_t get_u32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+	    | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void put_u64(unsigned char *p, uint64_t v)
+{
+	put_u32(p, (uint32_t)(v >> 32));
+	put_u32(p + 4, (uint32_t)v);
+}
+
+static inline uint64_t get_u64(const unsigned char *p)
+{
+	return ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+static inline void frame_encode(unsigned char *out, uint8_t type,
+				uint8_t flags, uint32_t length,
+				uint32_t request_id)
+{
+	out[0] = FRAME_MAGIC;
+	out[1] = FRAME_VERSION;
+	out[2] = type;
+	out[3] = flags;
+	put_u32(out + 4, length);
+	put_u32(out + 8, request_id);
+}
+
+/* Returns false when the magic or version does not match. */
+static inline bool frame_decode(const unsigned char *in, struct FrameHeader *h)
+{
+	h->magic = in[0];
+	h->version = in[1];
+	h->type = in[2];
+	h->flags = in[3];
+	h->length = get_u32(in + 4);
+	h->request_id = get_u32(in + 8);
+	return h->magic == FRAME_MAGIC && h->version == FRAME_VERSION;
+}
+
+#endif
@@ -0,0 +1,214 @@
+#include "sha256.h"
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+static void (*compress_fn)(uint32_t *h, const unsigned char *p, size_t blocks);
+
+static uint32_t rotr32(uint32_t x, int r)
+{
+	return (x >> r) | (x << (32 - r));
+}
+
+static uint32_t read32be(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16
+	    | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static void compress_c(uint32_t *h, const unsigned char *p, size_t blocks)
+{
+	uint32_t w[64];
+
+	while (blocks--) {
+		for (int i = 0; i < 16; i++)
+			w[i] = read32be(p + 4 * i);
+		for (int i = 16; i < 64; i++) {
+			uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18)
+			    ^ (w[i - 15] >> 3);
+			uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19)
+			    ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+		uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+		for (int i = 0; i < 64; i++) {
+			uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11)
+					   ^ rotr32(e, 25))
+			    + ((e & f) ^ (~e & g)) + K[i] + w[i];
+			uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13)
+				       ^ rotr32(a, 22))
+			    + ((a & b) ^ (a & c) ^ (b & c));
+			k = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+		h[5] += f;
+		h[6] += g;
+		h[7] += k;
+		p += 64;
+	}
+}
+
+#if defined(__x86_64__)
+/*
+ * SHA extensions: sha256rnds2 runs two rounds on the state held as ABEF
+ * and CDGH, and sha256msg1/msg2 extend the message schedule four words at
+ * a time, kept in a window of the last sixteen.
+ */
+__attribute__((target("sha,sse4.1")))
+static void compress_sha(uint32_t *h, const unsigned char *p, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					    0x0405060700010203ULL);
+	__m128i tmp = _mm_loadu_si128((const __m128i *)&h[0]);
+	__m128i state1 = _mm_loadu_si128((const __m128i *)&h[4]);
+
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);
+	state1 = _mm_shuffle_epi32(state1, 0x1B);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while (blocks--) {
+		__m128i abef = state0, cdgh = state1;
+		__m128i w[4];
+
+		for (int i = 0; i < 16; i++) {
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i *)(p + 16 * i)), mask);
+			} else {
+				__m128i prev = w[(i + 3) & 3];
+				__m128i x = _mm_sha256msg1_epu32(w[i & 3],
+								 w[(i + 1) & 3]);
+				x = _mm_add_epi32(x, _mm_alignr_epi8(prev,
+						  w[(i + 2) & 3], 4));
+				w[i & 3] = _mm_sha256msg2_epu32(x, prev);
+			}
+			__m128i msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128(
+				(const __m128i *)&K[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		p += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+	_mm_storeu_si128((__m128i *)&h[0], state0);
+	_mm_storeu_si128((__m128i *)&h[4], state1);
+}
+#endif
+
+static void compress_select(void)
+{
+	compress_fn = compress_c;
+#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)
+	    && (ebx & (1u << 29)) && __builtin_cpu_supports("sse4.1"))
+		compress_fn = compress_sha;
+#endif
+}
+
+void sha256_init(struct Sha256 *s)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	pthread_once(&select_once, compress_select);
+	memcpy(s->h, iv, sizeof(iv));
+	s->total = 0;
+	s->buffered = 0;
+}
+
+void sha256_update(struct Sha256 *s, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	s->total += len;
+	if (s->buffered > 0) {
+		size_t fill = sizeof(s->buf) - s->buffered;
+		if (fill > len)
+			fill = len;
+		memcpy(s->buf + s->buffered, p, fill);
+		s->buffered += fill;
+		p += fill;
+		len -= fill;
+		if (s->buffered < sizeof(s->buf))
+			return;
+		compress_fn(s->h, s->buf, 1);
+		s->buffered = 0;
+	}
+	if (len >= 64) {
+		compress_fn(s->h, p, len / 64);
+		p += len & ~(size_t)63;
+		len &= 63;
+	}
+	memcpy(s->buf, p, len);
+	s->buffered = len;
+}
+
+void sha256_digest(const struct Sha256 *s, unsigned char out[SHA256_SIZE])
+{
+	unsigned char tail[128] = { 0 };
+	uint32_t h[8];
+	uint64_t bits = s->total * 8;
+	size_t blocks = s->buffered < 56 ? 1 : 2;
+
+	memcpy(h, s->h, sizeof(h));
+	memcpy(tail, s->buf, s->buffered);
+	tail[s->buffered] = 0x80;
+	for (int i = 0; i < 8; i++)
+		tail[blocks * 64 - 1 - i] = (unsigned char)(bits >> (8 * i));
+	compress_fn(h, tail, blocks);
+	for (int i = 0; i < 8; i++) {
+		out[4 * i] = (unsigned char)(h[i] >> 24);
+		out[4 * i + 1] = (unsigned char)(h[i] >> 16);
+		out[4 * i + 2] = (unsigned char)(h[i] >> 8);
+		out[4 * i + 3] = (unsigned char)h[i];
+	}
+}
+
+bool sha256_hardware(void)
+{
+	pthread_once(&select_once, compress_select);
+	return compress_fn != compress_c;
+}
@@ -0,0 +1,30 @@
+#ifndef OVERSEER_SHA256_H
+#define OVERSEER_SHA256_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE	32
+
+/*
+ * SHA-256 (FIPS 180-4), the digest stored content is keyed by: unlike
+ * XXH64 or CRC32C, two files cannot be made to share it on purpose. On
+ * x86-64 CPUs with the SHA extensions the sha256rnds2 instruction is
+ * used, several times faster than the plain C elsewhere.
+ */
+struct Sha256 {
+	uint32_t h[8];
+	uint64_t total;
+	unsigned char buf[64];
+	size_t buffered;
+};
+
+void sha256_init(struct Sha256 *s);
+void sha256_update(struct Sha256 *s, const void *data, size_t len);
+void sha256_digest(const struct Sha256 *s, unsigned char out[SHA256_SIZE]);
+
+/* True when sha256_update() runs on the CPU's SHA instructions. */
+bool sha256_hardware(void);
+
+#endif
@@ -0,0 +1,169 @@
+#include "xxh64.h"
+#include <string.h>
+
+#define XXH_PRIME1	0x9E3779B185EBCA87ULL
+#define XXH_PRIME2	0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3	0x165667B19E3779F9ULL
+#define XXH_PRIME4	0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5	0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME2;
+	return rotl64(acc, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+#define XXH_ROUND(acc, input) \
+	((acc) += (input) * XXH_PRIME2, \
+	 (acc) = ((acc) << 31 | (acc) >> 33) * XXH_PRIME1)
+
+/*
+ * The bulk of the work: every 32 bytes go through the four lanes here, so
+ * the rounds are spelled out on locals rather than left to the optimizer.
+ */
+static const unsigned char *xxh_stripes(uint64_t v[4], const unsigned char *p,
+					const unsigned char *end)
+{
+	uint64_t v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+
+	while (end - p >= 32) {
+		uint64_t in[4];
+
+		memcpy(in, p, sizeof(in));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		for (int i = 0; i < 4; i++)
+			in[i] = __builtin_bswap64(in[i]);
+#endif
+		XXH_ROUND(v1, in[0]);
+		XXH_ROUND(v2, in[1]);
+		XXH_ROUND(v3, in[2]);
+		XXH_ROUND(v4, in[3]);
+		p += 32;
+	}
+	v[0] = v1;
+	v[1] = v2;
+	v[2] = v3;
+	v[3] = v4;
+	return p;
+}
+
+/* Folds in the last len < 32 bytes and mixes the result. */
+static uint64_t xxh_finish(uint64_t h, const unsigned char *p, size_t len)
+{
+	const unsigned char *end = p + len;
+
+	while (end - p >= 8) {
+		h ^= xxh_round(0, read64(p));
+		h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+		p += 8;
+	}
+	if (end - p >= 4) {
+		uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8
+		    | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+
+		h ^= (uint64_t)v * XXH_PRIME1;
+		h = rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= *p++ * XXH_PRIME5;
+		h = rotl64(h, 11) * XXH_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t xxh_converge(const uint64_t v[4])
+{
+	uint64_t h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12)
+	    + rotl64(v[3], 18);
+
+	h = xxh_merge(h, v[0]);
+	h = xxh_merge(h, v[1]);
+	h = xxh_merge(h, v[2]);
+	return xxh_merge(h, v[3]);
+}
+
+void xxh64_init(struct Xxh64 *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->v[0] = XXH_PRIME1 + XXH_PRIME2;
+	s->v[1] = XXH_PRIME2;
+	s->v[2] = 0;
+	s->v[3] = 0 - XXH_PRIME1;
+}
+
+void xxh64_update(struct Xxh64 *s, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+
+	s->total += len;
+	if (s->buffered + len < 32) {
+		memcpy(s->buf + s->buffered, p, len);
+		s->buffered += len;
+		return;
+	}
+	if (s->buffered) {
+		size_t fill = 32 - s->buffered;
+
+		memcpy(s->buf + s->buffered, p, fill);
+		xxh_stripes(s->v, s->buf, s->buf + 32);
+		p += fill;
+		s->buffered = 0;
+	}
+	p = xxh_stripes(s->v, p, end);
+	memcpy(s->buf, p, end - p);
+	s->buffered = end - p;
+}
+
+uint64_t xxh64_digest(const struct Xxh64 *s)
+{
+	uint64_t h = s->total >= 32 ? xxh_converge(s->v) : XXH_PRIME5;
+
+	return xxh_finish(h + s->total, s->buf, s->buffered);
+}
+
+uint64_t xxh64(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v[4] = { XXH_PRIME1 + XXH_PRIME2, XXH_PRIME2, 0,
+				  0 - XXH_PRIME1 };
+		const unsigned char *tail = xxh_stripes(v, p, p + len);
+
+		h = xxh_converge(v);
+		return xxh_finish(h + len, tail, p + len - tail);
+	}
+	h = XXH_PRIME5;
+	return xxh_finish(h + len, p, len);
+}
@@ -0,0 +1,24 @@
+#ifndef OVERSEER_XXH64_H
+#define OVERSEER_XXH64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * XXH64 with seed 0, per the reference specification. Fast, but not a
+ * cryptographic hash: it names content, it does not authenticate it.
+ */
+struct Xxh64 {
+	uint64_t v[4];
+	uint64_t total;
+	unsigned char buf[32];
+	size_t buffered;
+};
+
+void xxh64_init(struct Xxh64 *s);
+void xxh64_update(struct Xxh64 *s, const void *data, size_t len);
+uint64_t xxh64_digest(const struct Xxh64 *s);
+
+uint64_t xxh64(const void *data, size_t len);
+
+#endif
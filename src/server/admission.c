@@ -0,0 +1,92 @@
+#include "server.h"
+#include "admission.h"
+#include "pool.h"
+#include <stdatomic.h>
+
+static atomic_int active[ADMIT_CLASS_COUNT];
+static atomic_ullong rejected[ADMIT_CLASS_COUNT];
+
+static const char *class_names[ADMIT_CLASS_COUNT] = {
+	"conn", "exec", "upload", "download", "queue"
+};
+
+bool admission_acquire(enum AdmitClass cls)
+{
+	int limit = admission_limit(cls);
+	int cur = atomic_load(&active[cls]);
+
+	do {
+		if (limit > 0 && cur >= limit) {
+			atomic_fetch_add(&rejected[cls], 1);
+			return false;
+		}
+	} while (!atomic_compare_exchange_weak(&active[cls], &cur, cur + 1));
+	return true;
+}
+
+void admission_release(enum AdmitClass cls)
+{
+	atomic_fetch_sub(&active[cls], 1);
+}
+
+void admission_reject(enum AdmitClass cls)
+{
+	atomic_fetch_add(&rejected[cls], 1);
+}
+
+int admission_active(enum AdmitClass cls)
+{
+	if (cls == ADMIT_CONN)
+		return reactor_open_connections();
+	if (cls == ADMIT_QUEUE)
+		return (int)(pool_backlog(WORK_SHORT) + pool_backlog(WORK_LONG));
+	return atomic_load(&active[cls]);
+}
+
+int admission_limit(enum AdmitClass cls)
+{
+	switch (cls) {
+	case ADMIT_CONN:
+		return max_conns;
+	case ADMIT_EXEC:
+		return max_exec;
+	case ADMIT_UPLOAD:
+		return max_uploads;
+	case ADMIT_DOWNLOAD:
+		return max_downloads;
+	case ADMIT_QUEUE:
+		return max_queue;
+	default:
+		return 0;
+	}
+}
+
+unsigned long long admission_rejected(enum AdmitClass cls)
+{
+	return atomic_load(&rejected[cls]);
+}
+
+const char *admission_class_name(enum AdmitClass cls)
+{
+	if (cls < 0 || cls >= ADMIT_CLASS_COUNT)
+		return "unknown";
+	return class_names[cls];
+}
+
+int admission_retry_after(enum AdmitClass cls)
+{
+	enum WorkClass work = cls == ADMIT_CONN ? WORK_SHORT : WORK_LONG;
+	int workers = pool_worker_count(work);
+	size_t backlog = pool_backlog(work);
+	int retry = 1 + (workers > 0 ? (int)(backlog / (size_t)workers) : 0);
+
+	if (retry > BUSY_RETRY_MAX)
+		retry = BUSY_RETRY_MAX;
+	return retry;
+}
+
+int admission_busy_reply(enum AdmitClass cls, char *buf, size_t size)
+{
+	return snprintf(buf, size, "BUSY retry-after=%d",
+			admission_retry_after(cls));
+}
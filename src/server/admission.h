@@ -0,0 +1,46 @@
+#ifndef OVERSEER_ADMISSION_H
+#define OVERSEER_ADMISSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DEFAULT_MAX_EXEC	8
+#define DEFAULT_MAX_UPLOADS	32
+#define DEFAULT_MAX_DOWNLOADS	32
+#define DEFAULT_MAX_QUEUE	256
+#define BUSY_RETRY_MAX		30
+
+/*
+ * Resources guarded by admission control. Every connection holds
+ * ADMIT_CONN (bounded by the reactor slot table); EXEC, uploads and
+ * downloads additionally hold ADMIT_EXEC, ADMIT_UPLOAD or ADMIT_DOWNLOAD
+ * while a worker runs them, so a burst of one kind cannot lock out the
+ * others.
+ * ADMIT_QUEUE is never held, it only names the worker queue limit.
+ */
+enum AdmitClass {
+	ADMIT_CONN,
+	ADMIT_EXEC,
+	ADMIT_UPLOAD,
+	ADMIT_DOWNLOAD,
+	ADMIT_QUEUE,
+	ADMIT_CLASS_COUNT
+};
+
+/* Takes a slot of a bounded class; counts a rejection when it is full. */
+bool admission_acquire(enum AdmitClass cls);
+void admission_release(enum AdmitClass cls);
+void admission_reject(enum AdmitClass cls);
+
+int admission_active(enum AdmitClass cls);
+int admission_limit(enum AdmitClass cls);
+unsigned long long admission_rejected(enum AdmitClass cls);
+const char *admission_class_name(enum AdmitClass cls);
+
+/* Seconds a rejected client should wait, scaled by the backlog of cls. */
+int admission_retry_after(enum AdmitClass cls);
+
+/* Formats "BUSY retry-after=N" with N from admission_retry_after(). */
+int admission_busy_reply(enum AdmitClass cls, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "chain.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define CHAIN_COPY_BUF_SIZE	65536
+
+enum {
+	CHAIN_ID_HELLO = 1,
+	CHAIN_ID_AUTH,
+	CHAIN_ID_UPLOAD,
+	CHAIN_ID_QUIT
+};
+
+static void hop_name(const struct ChainHop *hop, char *out, size_t size)
+{
+	struct in_addr addr = {.s_addr = htonl(hop->addr) };
+	char ip[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+	snprintf(out, size, "%s:%u", ip, hop->port);
+}
+
+static void set_timeout(int fd, long ms)
+{
+	struct timeval tv = {.tv_sec = ms / 1000,.tv_usec = ms % 1000 * 1000 };
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static long ms_until(const struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long ms = (deadline->tv_sec - now.tv_sec) * 1000
+	    + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+/* Connects within ms milliseconds; -1 when the hop cannot be reached. */
+static int hop_connect(const struct ChainHop *hop, long ms)
+{
+	struct sockaddr_in sa = {
+		.sin_family = AF_INET,
+		.sin_port = htons((uint16_t)hop->port),
+		.sin_addr.s_addr = htonl(hop->addr)
+	};
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		struct pollfd p = {.fd = fd,.events = POLLOUT };
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		if (errno != EINPROGRESS
+		    || poll(&p, 1, (int)ms) != 1
+		    || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0
+		    || err != 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	int on = 1;
+	int flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return fd;
+}
+
+static bool link_send(int fd, const struct iovec *iov, int count)
+{
+	struct iovec v[2];
+	struct msghdr msg = {.msg_iov = v,.msg_iovlen = (size_t)count };
+
+	memcpy(v, iov, (size_t)count * sizeof(*iov));
+	while (msg.msg_iovlen > 0) {
+		ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (n <= 0)
+			return false;
+
+		struct iovec *p = msg.msg_iov;
+		while (msg.msg_iovlen > 0 && (size_t)n >= p->iov_len) {
+			n -= (ssize_t)p->iov_len;
+			msg.msg_iov = ++p;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			p->iov_base = (char *)p->iov_base + n;
+			p->iov_len -= (size_t)n;
+		}
+	}
+	return true;
+}
+
+static bool link_frame(int fd, uint8_t type, uint8_t flags, uint32_t id,
+		       const void *data, size_t len)
+{
+	unsigned char head[FRAME_HEADER_SIZE];
+	frame_encode(head, type, flags, (uint32_t)len, id);
+
+	struct iovec iov[2] = {
+		{.iov_base = head,.iov_len = sizeof(head)},
+		{.iov_base = (void *)data,.iov_len = len}
+	};
+	return link_send(fd, iov, len ? 2 : 1);
+}
+
+/* Reads the reply to id, with at most size bytes of payload. */
+static bool link_reply(int fd, uint32_t id, struct FrameHeader *h,
+		       unsigned char *payload, size_t size)
+{
+	unsigned char head[FRAME_HEADER_SIZE];
+
+	if (recv(fd, head, sizeof(head), MSG_WAITALL) != (ssize_t)sizeof(head)
+	    || !frame_decode(head, h) || h->request_id != id
+	    || h->length > size)
+		return false;
+	return h->length == 0
+	    || recv(fd, payload, h->length, MSG_WAITALL) == (ssize_t)h->length;
+}
+
+/* Logs in to an open link and starts CHAIN on it; true once it said GO. */
+static bool hop_start(int fd, const struct ChainHop *rest, size_t count,
+		      uint64_t size, const char *name)
+{
+	unsigned char req[CHAIN_PAYLOAD_MIN
+			  + (CHAIN_MAX_NODES - 1) * CHAIN_HOP_SIZE + 255];
+	unsigned char reply[64];
+	struct FrameHeader h;
+	size_t name_len = strlen(name);
+
+	put_u32(reply, PROTOCOL_CAPS);
+	if (!link_frame(fd, FRAME_HELLO, 0, CHAIN_ID_HELLO, reply, 4)
+	    || !link_frame(fd, FRAME_AUTH, 0, CHAIN_ID_AUTH, server_password,
+			   strlen(server_password))
+	    || !link_reply(fd, CHAIN_ID_HELLO, &h, reply, sizeof(reply))
+	    || h.type != FRAME_HELLO || h.length < 4
+	    || !(get_u32(reply) & CAP_CHAIN)
+	    || !link_reply(fd, CHAIN_ID_AUTH, &h, reply, sizeof(reply))
+	    || h.type != FRAME_OK)
+		return false;
+
+	put_u64(req, size);
+	put_u32(req + 8, (uint32_t)count);
+	for (size_t i = 0; i < count; i++) {
+		put_u32(req + CHAIN_PAYLOAD_MIN + i * CHAIN_HOP_SIZE,
+			rest[i].addr);
+		put_u32(req + CHAIN_PAYLOAD_MIN + i * CHAIN_HOP_SIZE + 4,
+			rest[i].port);
+	}
+	memcpy(req + CHAIN_PAYLOAD_MIN + count * CHAIN_HOP_SIZE, name,
+	       name_len);
+	return link_frame(fd, FRAME_CHAIN, 0, CHAIN_ID_UPLOAD, req,
+			  CHAIN_PAYLOAD_MIN + count * CHAIN_HOP_SIZE + name_len)
+	    && link_reply(fd, CHAIN_ID_UPLOAD, &h, reply, sizeof(reply))
+	    && h.type == FRAME_GO;
+}
+
+void chain_open(struct Chain *ch, const struct ChainHop *hops, size_t count,
+		uint64_t size, const char *name, unsigned char *status)
+{
+	struct timespec deadline;
+	char where[32];
+
+	ch->fd = -1;
+	ch->hops = hops;
+	ch->count = count;
+	ch->first = count;
+	ch->status = status;
+	ch->forwarded = 0;
+	for (size_t i = 0; i < count; i++)
+		status[i] = CHAIN_UNREACHABLE;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += CHAIN_OPEN_TIMEOUT;
+	for (size_t i = 0; i < count; i++) {
+		int fd = hop_connect(&hops[i], ms_until(&deadline));
+
+		if (fd >= 0)
+			set_timeout(fd, ms_until(&deadline) + 1);
+		if (fd >= 0 && hop_start(fd, hops + i + 1, count - i - 1, size,
+					 name)) {
+			set_timeout(fd, transfer_timeout * 1000L);
+			ch->fd = fd;
+			ch->first = i;
+			hop_name(&hops[i], where, sizeof(where));
+			log_msg(KCYN, "Chaining File: %s to %s (%zu more after it)",
+				name, where, count - i - 1);
+			return;
+		}
+		if (fd >= 0)
+			close(fd);
+		hop_name(&hops[i], where, sizeof(where));
+		log_msg(KYEL, "Chain Hop Skipped: %s unreachable for %s",
+			where, name);
+	}
+}
+
+static void chain_drop(struct Chain *ch)
+{
+	char where[32];
+
+	if (ch->fd < 0)
+		return;
+	close(ch->fd);
+	ch->fd = -1;
+	for (size_t i = ch->first; i < ch->count; i++)
+		ch->status[i] = CHAIN_BROKEN;
+	hop_name(&ch->hops[ch->first], where, sizeof(where));
+	log_msg(KRED, "Chain Broken: link to %s lost after %llu bytes",
+		where, ch->forwarded);
+}
+
+void chain_forward(struct Chain *ch, uint8_t type, uint8_t flags,
+		   const void *data, size_t len)
+{
+	if (ch->fd < 0)
+		return;
+	if (!link_frame(ch->fd, type, flags, CHAIN_ID_UPLOAD, data, len))
+		chain_drop(ch);
+	else if (type == FRAME_DATA)
+		ch->forwarded += len;
+}
+
+void chain_forward_file(struct Chain *ch, int fd, off_t offset, size_t len)
+{
+	unsigned char head[FRAME_HEADER_SIZE];
+	struct iovec iov = {.iov_base = head,.iov_len = sizeof(head) };
+	bool kernel = true;
+
+	if (ch->fd < 0)
+		return;
+	frame_encode(head, FRAME_DATA, 0, (uint32_t)len, CHAIN_ID_UPLOAD);
+	if (!link_send(ch->fd, &iov, 1)) {
+		chain_drop(ch);
+		return;
+	}
+	while (len > 0) {
+		ssize_t n;
+
+		if (kernel) {
+			n = sendfile(ch->fd, fd, &offset, len);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				kernel = false;
+				continue;
+			}
+		} else {
+			char buffer[CHAIN_COPY_BUF_SIZE];
+			size_t want = len < sizeof(buffer) ? len
+			    : sizeof(buffer);
+
+			n = pread(fd, buffer, want, offset);
+			if (n > 0)
+				n = send(ch->fd, buffer, (size_t)n,
+					 MSG_NOSIGNAL);
+			if (n > 0)
+				offset += n;
+		}
+		if (n <= 0) {
+			chain_drop(ch);
+			return;
+		}
+		ch->forwarded += (size_t)n;
+		len -= (size_t)n;
+	}
+}
+
+void chain_close(struct Chain *ch, bool complete)
+{
+	unsigned char report[CHAIN_MAX_NODES];
+	struct FrameHeader h;
+
+	if (ch->fd < 0)
+		return;
+	if (!complete) {
+		chain_drop(ch);
+		return;
+	}
+	if (!link_reply(ch->fd, CHAIN_ID_UPLOAD, &h, report, sizeof(report))
+	    || h.type != FRAME_OK) {
+		chain_drop(ch);
+		return;
+	}
+	for (size_t i = 0; i < ch->count - ch->first; i++)
+		ch->status[ch->first + i] = i < h.length
+		    && report[i] <= CHAIN_REJECTED ? report[i] : CHAIN_BROKEN;
+	link_frame(ch->fd, FRAME_QUIT, 0, CHAIN_ID_QUIT, NULL, 0);
+	close(ch->fd);
+	ch->fd = -1;
+}
@@ -0,0 +1,57 @@
+#ifndef OVERSEER_CHAIN_H
+#define OVERSEER_CHAIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CHAIN_OPEN_TIMEOUT	3
+
+/* A server further down a chained upload. */
+struct ChainHop {
+	uint32_t addr;
+	uint32_t port;
+};
+
+/*
+ * The link from this server to the next one of a chained upload that
+ * could be reached. status holds one ChainStatus per hop; fd is -1 once
+ * the link is gone, and every hop from first on is then accounted for.
+ */
+struct Chain {
+	int fd;
+	const struct ChainHop *hops;
+	size_t count;
+	size_t first;
+	unsigned char *status;
+	unsigned long long forwarded;
+};
+
+/*
+ * Opens CHAIN for an upload of size bytes named name on the first of the
+ * count hops that answers it with GO, passing on the hops after it. Hops
+ * skipped on the way, and those left when CHAIN_OPEN_TIMEOUT seconds have
+ * gone, are marked CHAIN_UNREACHABLE. Logs in with this server's password,
+ * so every server of a line must share it.
+ */
+void chain_open(struct Chain *ch, const struct ChainHop *hops, size_t count,
+		uint64_t size, const char *name, unsigned char *status);
+
+/*
+ * Passes a frame on as it is. A link that fails is dropped and the hops
+ * from first on are marked CHAIN_BROKEN; the upload itself carries on.
+ */
+void chain_forward(struct Chain *ch, uint8_t type, uint8_t flags,
+		   const void *data, size_t len);
+
+/* Passes on len bytes of fd at offset as a DATA frame, with sendfile(). */
+void chain_forward_file(struct Chain *ch, int fd, off_t offset, size_t len);
+
+/*
+ * Sends QUIT and closes the link. After a complete upload the report of
+ * the hops from first on is read first; hops it leaves out are broken.
+ */
+void chain_close(struct Chain *ch, bool complete);
+
+#endif
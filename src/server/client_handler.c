@@ -1,115 +1,1599 @@
+#define _GNU_SOURCE
 #include "server.h"
+#include "commands.h"
+#include "uring.h"
+#include "splice.h"
+#include "multipart.h"
+#include "resume.h"
+#include "store.h"
+#include "chain.h"
+#include "../common/crc32c.h"
+#include "../common/delta.h"
+#include "../common/lz.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
 
-void handle_file_transfer(int client_fd, const char *header_info)
+/* A name of up to 255 bytes and the size, as u64 or in decimal. */
+#define FILE_REQUEST_MAX	(FILE_PAYLOAD_MIN + 255 + 24)
+#define UPLOAD_REQUEST_MAX	(UPLOAD_PAYLOAD_MIN + 255)
+#define PARTIAL_REQUEST_MAX	(PARTIAL_PAYLOAD_MIN + 255)
+#define RESUME_REQUEST_MAX	(RESUME_PAYLOAD_MIN + 255)
+#define DELTA_REQUEST_MAX	(DELTA_PAYLOAD_MIN + 255)
+#define LINK_REQUEST_MAX	(LINK_PAYLOAD_MIN + 255)
+#define GET_REQUEST_MAX		(GET_PAYLOAD_MIN + 255)
+#define CHAIN_REQUEST_MAX	(CHAIN_PAYLOAD_MIN \
+				 + (CHAIN_MAX_NODES - 1) * CHAIN_HOP_SIZE + 255)
+#define DIGEST_BUF_SIZE		65536
+#define COPY_BUF_SIZE		65536
+#define SIGNATURE_FRAME_BLOCKS	1024
+#define EXEC_BUF_SIZE		65536
+#define LZ_MIN_FRAME		512
+#define LZ_MIN_SAVING		8
+
+static atomic_ullong upload_bytes = 0;
+static atomic_ullong upload_syscalls = 0;
+static atomic_ullong download_bytes = 0;
+static atomic_ullong lz_raw_bytes = 0;
+static atomic_ullong lz_wire_bytes = 0;
+static atomic_ullong lz_cpu_us = 0;
+
+static bool reply_frame(struct Request *req, uint8_t type, uint8_t flags,
+			const void *data, size_t len)
 {
-	char filename[256];
-	size_t filesize;
-	sscanf(header_info, "FILE %s %zu", filename, &filesize);
+	unsigned char head[FRAME_HEADER_SIZE];
+	frame_encode(head, type, flags, (uint32_t)len, req->head.request_id);
+
+	struct iovec iov[2] = {
+		{.iov_base = head,.iov_len = sizeof(head)},
+		{.iov_base = (void *)data,.iov_len = len}
+	};
+	return reactor_send(req->conn, iov, 2);
+}
 
-	log_msg(KCYN, "Receiving File: %s (%zu bytes)", filename, filesize);
+static bool reply_send(struct Request *req, const char *data, size_t len,
+		       bool last)
+{
+	struct Connection *c = req->conn;
+
+	if (c->proto == PROTO_BINARY)
+		return reply_frame(req, FRAME_DATA, last ? 0 : FRAME_F_MORE,
+				   data, len);
+	if (!atomic_load(&c->session))
+		return len == 0
+		    || send(c->fd, data, len, MSG_NOSIGNAL) == (ssize_t)len;
+
+	char head[24];
+	int head_len = len ? snprintf(head, sizeof(head), "%zx\n", len) : 0;
+	struct iovec iov[3] = {
+		{.iov_base = head,.iov_len = (size_t)head_len},
+		{.iov_base = (void *)data,.iov_len = len},
+		{.iov_base = "0\n",.iov_len = last ? 2 : 0}
+	};
+	struct msghdr msg = {.msg_iov = iov,.msg_iovlen = 3 };
+	ssize_t want = head_len + (ssize_t)len + (last ? 2 : 0);
 
-	struct stat st = { 0 };
-	if (stat("storage", &st) == -1) {
-		mkdir("storage", 0700);
+	if (sendmsg(c->fd, &msg, MSG_NOSIGNAL) != want) {
+		atomic_store(&c->session, false);
+		return false;
 	}
+	return true;
+}
 
-	char filepath[512];
-	snprintf(filepath, sizeof(filepath), "storage/%s", filename);
+static bool reply_chunk(struct Request *req, const char *data, size_t len)
+{
+	return len == 0 || reply_send(req, data, len, false);
+}
+
+static void reply_end(struct Request *req)
+{
+	reply_send(req, NULL, 0, true);
+}
 
-	FILE *fp = fopen(filepath, "wb");
-	if (!fp) {
-		log_msg(KRED, "Error opening file for write");
-		return;
+static void reply_text(struct Request *req, const char *msg)
+{
+	reply_send(req, msg, strlen(msg), true);
+}
+
+/*
+ * Reads len bytes of a request body, taking what the reactor buffered
+ * first. Small reads refill the buffer with whatever has arrived, so a
+ * stream of small frames costs a recv() per buffer rather than per frame;
+ * bytes read past the request stay there for the reactor.
+ */
+static bool conn_read(struct Connection *c, void *dst, size_t len)
+{
+	char *out = dst;
+
+	while (len > 0) {
+		size_t take = c->in_len - c->in_off;
+		ssize_t n;
+
+		if (take == 0 && len >= sizeof(c->in_buf) / 2) {
+			n = recv(c->fd, out, len, MSG_WAITALL);
+			if (n > 0)
+				reactor_touch(c);
+			return n == (ssize_t)len;
+		}
+		if (take == 0) {
+			n = recv(c->fd, c->in_buf, sizeof(c->in_buf) - 1, 0);
+			if (n <= 0)
+				return false;
+			reactor_touch(c);
+			c->in_off = 0;
+			c->in_len = (size_t)n;
+			continue;
+		}
+		if (take > len)
+			take = len;
+		memcpy(out, c->in_buf + c->in_off, take);
+		c->in_off += take;
+		out += take;
+		len -= take;
+	}
+	return true;
+}
+
+static bool upload_name_valid(const char *filename)
+{
+	return filename[0] != '\0' && strchr(filename, '/') == NULL
+	    && strcmp(filename, ".") != 0 && strcmp(filename, "..") != 0;
+}
+
+static void upload_init(struct Upload *up)
+{
+	memset(up, 0, sizeof(*up));
+	up->fd = -1;
+	up->writer.fd = -1;
+	sha256_init(&up->sha);
+	clock_gettime(CLOCK_MONOTONIC, &up->started);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &up->cpu_started);
+}
+
+/* Starts at offset, which is 0 or where an interrupted upload stopped. */
+static int upload_begin(struct Upload *up, const char *filename,
+			size_t filesize, uint64_t offset)
+{
+	upload_init(up);
+	up->filesize = filesize;
+	if (!upload_name_valid(filename))
+		return -1;
+
+	if (offset > 0)
+		log_msg(KCYN, "Resuming File: %s at %llu of %zu bytes",
+			filename, (unsigned long long)offset, filesize);
+	else
+		log_msg(KCYN, "Receiving File: %s (%zu bytes)", filename,
+			filesize);
+	if (resume_begin(up, filename, filesize, offset) != 0)
+		return -1;
+	writer_begin(&up->writer, up->fd, (off_t)up->received,
+		     up->filesize - up->received);
+	return 0;
+}
+
+static bool upload_write(struct Upload *up, const char *data, size_t len)
+{
+	size_t remaining = up->filesize - up->received;
+	if (len > remaining)
+		len = remaining;
+
+	while (len > 0) {
+		ssize_t n = pwrite(up->fd, data, len,
+				   up->base + (off_t)up->received);
+		if (n <= 0)
+			return false;
+		up->received += (size_t)n;
+		data += n;
+		len -= (size_t)n;
 	}
+	return true;
+}
 
-	send(client_fd, "GO", 2, 0);
+/*
+ * Stores the next len bytes of the connection at the current upload offset:
+ * what the reactor already buffered first, then the socket. Never reads
+ * past len, so a following frame stays in the socket.
+ */
+static bool upload_recv(struct Connection *c, struct Upload *up, size_t len,
+			unsigned long long *syscalls)
+{
+	size_t take = c->in_len - c->in_off;
+	if (take > len)
+		take = len;
+	if (take && !upload_write(up, c->in_buf + c->in_off, take))
+		return false;
+	c->in_off += take;
+	len -= take;
+
+	if (len > 0 && recv_mode == RECV_AUTO
+	    && io_backend == IO_BACKEND_URING) {
+		size_t before = up->received;
+		ssize_t stored = uring_socket_to_file(c, up->fd,
+						      up->base
+						      + (off_t)up->received,
+						      len, syscalls);
+		if (stored >= 0) {
+			up->paths |= RECV_PATH_URING;
+			up->received += (size_t)stored;
+			return up->received - before == len;
+		}
+	}
+
+	if (len > 0 && recv_mode != RECV_COPY) {
+		ssize_t stored = splice_socket_to_file(c, up->fd,
+						       up->base
+						       + (off_t)up->received,
+						       len, syscalls);
+		if (stored >= 0) {
+			up->paths |= RECV_PATH_SPLICE;
+			up->received += (size_t)stored;
+			len -= (size_t)stored;
+		}
+	}
 
 	char buffer[8192];
-	size_t received = 0;
-	while (received < filesize) {
-		ssize_t n = recv(client_fd, buffer, sizeof(buffer), 0);
+	if (len > 0)
+		up->paths |= RECV_PATH_COPY;
+	while (len > 0) {
+		size_t want = len < sizeof(buffer) ? len : sizeof(buffer);
+		ssize_t n = recv(c->fd, buffer, want, 0);
+		(*syscalls)++;
 		if (n <= 0)
-			break;
-		fwrite(buffer, 1, n, fp);
-		received += n;
+			return false;
+		reactor_touch(c);
+		if (!upload_write(up, buffer, (size_t)n))
+			return false;
+		(*syscalls)++;
+		len -= (size_t)n;
 	}
+	return true;
+}
+
+/*
+ * Appends len bytes of src at offset to the upload, in the kernel where
+ * copy_file_range() works between the two files.
+ */
+static bool upload_copy(struct Upload *up, int src, off_t offset, size_t len)
+{
+	bool kernel = true;
+
+	if (len > up->filesize - up->received)
+		return false;
+	while (len > 0) {
+		ssize_t n;
+
+		if (kernel) {
+			off_t out = up->base + (off_t)up->received;
+			n = copy_file_range(src, &offset, up->fd, &out, len, 0);
+			up->syscalls++;
+			if (n < 0 && (errno == EXDEV || errno == EINVAL
+				      || errno == ENOSYS || errno == EOPNOTSUPP)) {
+				kernel = false;
+				continue;
+			}
+			if (n <= 0)
+				return false;
+			up->received += (size_t)n;
+		} else {
+			char buffer[COPY_BUF_SIZE];
+			size_t want = len < sizeof(buffer) ? len : sizeof(buffer);
 
-	fclose(fp);
-	log_msg(KGRN, "File Saved: %s", filepath);
+			n = pread(src, buffer, want, offset);
+			if (n <= 0 || !upload_write(up, buffer, (size_t)n))
+				return false;
+			offset += n;
+		}
+		up->reused += (size_t)n;
+		len -= (size_t)n;
+	}
+	return true;
 }
 
-void handle_execution(int client_fd, const char *command_line)
+/*
+ * Folds what was stored since the last call into the upload CRC, and into
+ * the SHA-256 that keys the file in the store when the upload started at 0,
+ * reading it back from the page cache so every receive path is covered.
+ * Records a resume checkpoint every RESUME_CHECKPOINT_BYTES and hands what
+ * is digested to the storage writer.
+ */
+static bool upload_digest(struct Upload *up)
 {
-	const char *cmd = command_line + 5;
-	log_msg(KYEL, "Executing: %s", cmd);
+	char buffer[DIGEST_BUF_SIZE];
 
-	FILE *fp = popen(cmd, "r");
-	if (fp == NULL) {
-		const char *err = "Error: Failed to execute command.\n";
-		send(client_fd, err, strlen(err), 0);
-		return;
+	while (up->digested < up->received) {
+		size_t want = up->received - up->digested;
+		if (want > sizeof(buffer))
+			want = sizeof(buffer);
+		ssize_t n = pread(up->fd, buffer, want,
+				  up->base + (off_t)up->digested);
+		if (n <= 0)
+			return false;
+		up->crc = crc32c_update(up->crc, buffer, (size_t)n);
+		if (!up->range && !up->resumed)
+			sha256_update(&up->sha, buffer, (size_t)n);
+		up->digested += (size_t)n;
 	}
+	if (up->resumable
+	    && up->digested - up->checkpoint >= RESUME_CHECKPOINT_BYTES)
+		resume_checkpoint(up);
+	writer_progress(&up->writer, up->base + (off_t)up->digested);
+	return true;
+}
+
+/*
+ * Takes len zero bytes as a hole: the file is only extended past them with
+ * ftruncate(), once its preallocation is given back, so the filesystem
+ * allocates nothing, and the CRC is advanced without reading them back.
+ */
+static bool upload_hole(struct Upload *up, uint64_t len)
+{
+	struct stat st;
+
+	if (len > up->filesize - up->received || !upload_digest(up))
+		return false;
+	up->received += (size_t)len;
+	up->digested += (size_t)len;
+	up->holes += (size_t)len;
+	up->crc = crc32c_zeros(up->crc, len);
+
+	off_t end = up->base + (off_t)up->received;
+	if (fstat(up->fd, &st) != 0)
+		return false;
+	writer_hole(&up->writer, st.st_size);
+	return st.st_size >= end || ftruncate(up->fd, end) == 0;
+}
+
+static double elapsed_since(const struct timespec *start, clockid_t clock)
+{
+	struct timespec now;
 
-	char path[1024];
-	while (fgets(path, sizeof(path), fp) != NULL) {
-		send(client_fd, path, strlen(path), 0);
+	clock_gettime(clock, &now);
+	return (double)(now.tv_sec - start->tv_sec)
+	    + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static const char *upload_path_name(unsigned int paths)
+{
+	switch (paths) {
+	case RECV_PATH_URING:
+		return "uring";
+	case RECV_PATH_SPLICE:
+		return "splice";
+	case RECV_PATH_SPLICE | RECV_PATH_COPY:
+		return "splice+copy";
+	case RECV_PATH_URING | RECV_PATH_COPY:
+		return "uring+copy";
+	default:
+		return "copy";
 	}
+}
 
-	pclose(fp);
-	log_msg(KGRN, "Execution complete");
+/*
+ * Closes the file and, for a whole-file upload, puts it in place if it is
+ * complete and valid. Returns true when every byte is stored.
+ */
+static bool upload_finish(struct Upload *up, bool valid)
+{
+	if (up->fd < 0)
+		return false;
+
+	bool complete = up->received == up->filesize;
+	if (up->resumable && !complete)
+		resume_checkpoint(up);
+	bool written = writer_end(&up->writer, up->base + (off_t)up->received,
+				  complete && !up->range) == 0;
+	close(up->fd);
+	up->fd = -1;
+
+	if (!complete)
+		log_msg(KYEL, "File Incomplete: %s (%zu / %zu bytes)",
+			up->filepath, up->received, up->filesize);
+	else if (!written)
+		log_msg(KRED, "File Rejected: %s (write failed)",
+			up->filepath);
+	else if (!valid)
+		log_msg(KRED, "File Rejected: %s (checksum mismatch)",
+			up->filepath);
+	valid = valid && written;
+	if (up->resumable && resume_end(up, valid) != 0)
+		return false;
+	if (!complete || !valid)
+		return false;
+	if (up->range)
+		return true;
+
+	double secs = elapsed_since(&up->started, CLOCK_MONOTONIC);
+	double cpu = elapsed_since(&up->cpu_started, CLOCK_THREAD_CPUTIME_ID);
+	double mb = (double)(up->received - up->resumed - up->reused
+			     - up->holes) / (1024.0 * 1024.0);
+	double gb = (double)(up->received - up->resumed)
+	    / (1024.0 * 1024.0 * 1024.0);
+	char note[48] = "";
+	char codec[48] = "";
+	char disk[80];
+
+	if (up->shared)
+		snprintf(note, sizeof(note), ", already stored");
+	else if (up->reused)
+		snprintf(note, sizeof(note), ", %.1f MB reused",
+			 (double)up->reused / (1024.0 * 1024.0));
+	else if (up->holes)
+		snprintf(note, sizeof(note), ", %.1f MB in holes",
+			 (double)up->holes / (1024.0 * 1024.0));
+	else if (up->resumed)
+		snprintf(note, sizeof(note), ", resumed");
+	if (up->lz_wire)
+		snprintf(codec, sizeof(codec), ", lz %.1fx, %.0f ms to expand",
+			 (double)up->lz_raw / (double)up->lz_wire,
+			 up->lz_cpu * 1000.0);
+	writer_summary(&up->writer, disk, sizeof(disk));
+	log_msg(KGRN, "File Saved: %s (%.1f MB, %.1f MB/s, %.0f ms CPU/GB, %s%s%s%s, crc32c %08x)",
+		up->filepath, mb, secs > 0 ? mb / secs : 0.0,
+		gb > 0 ? cpu * 1000.0 / gb : 0.0, upload_path_name(up->paths),
+		note, codec, disk, up->crc);
+	return true;
 }
 
-bool authenticate_connection(int client_fd, struct sockaddr_in client_addr)
+static void upload_count_io(const struct Upload *up)
 {
-	char buf[256];
-	char *client_ip = inet_ntoa(client_addr.sin_addr);
+	atomic_fetch_add(&upload_syscalls, up->syscalls);
+	atomic_fetch_add(&lz_raw_bytes, up->lz_raw);
+	atomic_fetch_add(&lz_wire_bytes, up->lz_wire);
+	atomic_fetch_add(&lz_cpu_us, (unsigned long long)(up->lz_cpu * 1e6));
+}
 
-	ssize_t n = recv(client_fd, buf, sizeof(buf) - 1, 0);
-	if (n <= 0)
+static bool upload_account(struct Upload *up, bool valid)
+{
+	atomic_fetch_add(&upload_bytes,
+			 up->received - up->resumed - up->reused - up->holes);
+	upload_count_io(up);
+	return upload_finish(up, valid);
+}
+
+static enum CommandResult text_file_transfer(struct Request *req)
+{
+	struct Connection *c = req->conn;
+	struct Upload up;
+	char filename[256];
+	size_t filesize;
+
+	if (sscanf((const char *)req->payload, "%255s %zu", filename,
+		   &filesize) != 2
+	    || upload_begin(&up, filename, filesize, 0) != 0) {
+		if (atomic_load(&c->session))
+			reply_text(req, "ERR");
+		return CMD_FAILED;
+	}
+
+	reply_text(req, "GO");
+
+	bool ok = true;
+	while (ok && up.received < up.filesize) {
+		size_t len = up.filesize - up.received;
+		if (len > FRAME_MAX_PAYLOAD)
+			len = FRAME_MAX_PAYLOAD;
+		ok = upload_recv(c, &up, len, &up.syscalls)
+		    && upload_digest(&up);
+	}
+	if (!upload_account(&up, ok)) {
+		atomic_store(&c->session, false);
+		return CMD_FAILED;
+	}
+	if (atomic_load(&c->session)) {
+		char done[48];
+		snprintf(done, sizeof(done), "OK %zu", up.received);
+		reply_text(req, done);
+	}
+	return CMD_DONE;
+}
+
+/*
+ * Stores the payload of a DATA frame, straight from the socket unless it
+ * is compressed. A FRAME_F_LZ payload is read whole into *buf, allocated
+ * with the first one and freed by the caller, and expanded behind it.
+ */
+static bool upload_data(struct Connection *c, struct Upload *up,
+			const struct FrameHeader *h, unsigned char **buf)
+{
+	struct timespec start;
+
+	if (!(h->flags & FRAME_F_LZ))
+		return h->length <= FRAME_MAX_PAYLOAD
+		    && h->length <= up->filesize - up->received
+		    && upload_recv(c, up, h->length, &up->syscalls);
+
+	if (!*buf)
+		*buf = malloc(2 * (size_t)FRAME_MAX_PAYLOAD);
+	unsigned char *packed = *buf;
+	unsigned char *raw = packed + FRAME_MAX_PAYLOAD;
+	if (!packed || h->length < LZ_HEAD_SIZE || h->length > FRAME_MAX_PAYLOAD
+	    || !conn_read(c, packed, h->length))
+		return false;
+
+	size_t len = get_u32(packed);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	bool ok = len <= FRAME_DATA_CHUNK && len <= up->filesize - up->received
+	    && lz_decompress(packed + LZ_HEAD_SIZE, h->length - LZ_HEAD_SIZE,
+			     raw, len);
+	up->lz_cpu += elapsed_since(&start, CLOCK_THREAD_CPUTIME_ID);
+	up->lz_raw += len;
+	up->lz_wire += h->length;
+	up->paths |= RECV_PATH_COPY;
+	return ok && upload_write(up, (const char *)raw, len);
+}
+
+/*
+ * Stores the DATA frames, and for a whole file the HOLE frames, that
+ * follow until the upload is complete. A short upload leaves the stream
+ * out of sync, so the caller closes the session.
+ */
+static bool frame_data_recv(struct Request *req, struct Upload *up)
+{
+	struct Connection *c = req->conn;
+	unsigned char *lz = NULL;
+	bool ok = true;
+
+	while (ok && up->received < up->filesize) {
+		unsigned char head[FRAME_HEADER_SIZE];
+		unsigned char gap[HOLE_PAYLOAD_SIZE];
+		struct FrameHeader h;
+
+		ok = conn_read(c, head, sizeof(head)) && frame_decode(head, &h)
+		    && h.request_id == req->head.request_id;
+		if (ok && h.type == FRAME_HOLE && !up->range)
+			ok = h.length == HOLE_PAYLOAD_SIZE
+			    && conn_read(c, gap, sizeof(gap))
+			    && upload_hole(up, get_u64(gap));
+		else
+			ok = ok && h.type == FRAME_DATA
+			    && upload_data(c, up, &h, &lz) && upload_digest(up);
+	}
+	free(lz);
+	return ok && up->received == up->filesize;
+}
+
+static bool frame_upload_recv(struct Request *req, struct Upload *up)
+{
+	reply_frame(req, FRAME_GO, 0, NULL, 0);
+	return frame_data_recv(req, up);
+}
+
+/* Reads the CHECKSUM frame that ends a resumable upload or a pack entry. */
+static bool frame_checksum_read(struct Request *req, uint32_t *crc)
+{
+	unsigned char head[FRAME_HEADER_SIZE];
+	unsigned char sum[CHECKSUM_PAYLOAD_SIZE];
+	struct FrameHeader h;
+
+	if (!conn_read(req->conn, head, sizeof(head)) || !frame_decode(head, &h)
+	    || h.type != FRAME_CHECKSUM
+	    || h.request_id != req->head.request_id
+	    || h.length != CHECKSUM_PAYLOAD_SIZE
+	    || !conn_read(req->conn, sum, sizeof(sum)))
+		return false;
+	*crc = get_u32(sum);
+	return true;
+}
+
+static bool frame_checksum_matches(struct Request *req, struct Upload *up)
+{
+	uint32_t crc;
+
+	return frame_checksum_read(req, &crc) && crc == up->crc;
+}
+
+static enum CommandResult reply_stored(struct Request *req, size_t stored)
+{
+	unsigned char reply[8];
+	put_u64(reply, stored);
+	reply_frame(req, FRAME_OK, 0, reply, sizeof(reply));
+	return CMD_DONE;
+}
+
+/*
+ * Copies the name that follows a fixed header of min bytes into filename.
+ * Replies ERR and returns false when it is missing or malformed.
+ */
+static bool frame_name(struct Request *req, size_t min, char *filename)
+{
+	size_t len = req->head.length;
+	size_t name_len = len - min;
+
+	if (len < min || name_len > 255
+	    || memchr(req->payload + min, '\0', name_len)) {
+		reply_frame(req, FRAME_ERR, 0, "bad request", 11);
 		return false;
+	}
+	memcpy(filename, req->payload + min, name_len);
+	filename[name_len] = '\0';
+	return true;
+}
+
+/*
+ * Binary FILE: the request carries the size and name, then the client sends
+ * DATA frames until the whole size has arrived.
+ */
+static enum CommandResult frame_file_transfer(struct Request *req)
+{
+	struct Upload up;
+	char filename[256];
+
+	if (!frame_name(req, FILE_PAYLOAD_MIN, filename))
+		return CMD_FAILED;
+	if (upload_begin(&up, filename, (size_t)get_u64(req->payload), 0) != 0) {
+		reply_frame(req, FRAME_ERR, 0, "cannot store", 12);
+		return CMD_FAILED;
+	}
+	if (!upload_account(&up, frame_upload_recv(req, &up))) {
+		atomic_store(&req->conn->session, false);
+		return CMD_FAILED;
+	}
+	return reply_stored(req, up.received);
+}
+
+static enum CommandResult cmd_file(struct Request *req)
+{
+	if (req->conn->proto == PROTO_BINARY)
+		return frame_file_transfer(req);
+	return text_file_transfer(req);
+}
+
+/* How much of a file the server already holds from an interrupted upload. */
+static enum CommandResult cmd_partial(struct Request *req)
+{
+	char filename[256];
+	uint64_t offset;
+	uint32_t crc;
+
+	if (!frame_name(req, PARTIAL_PAYLOAD_MIN, filename))
+		return CMD_FAILED;
+	if (!upload_name_valid(filename)) {
+		reply_frame(req, FRAME_ERR, 0, "bad name", 8);
+		return CMD_FAILED;
+	}
+	resume_query(filename, (size_t)get_u64(req->payload), &offset, &crc);
+
+	unsigned char reply[PARTIAL_REPLY_SIZE];
+	put_u64(reply, offset);
+	put_u32(reply + 8, crc);
+	reply_frame(req, FRAME_OK, 0, reply, sizeof(reply));
+	return CMD_DONE;
+}
+
+/*
+ * Like binary FILE, but starting at an offset and ending with a CHECKSUM
+ * frame. The file is put in place only if the CRC32C of every byte,
+ * including those stored by earlier attempts, matches.
+ */
+static enum CommandResult cmd_resume(struct Request *req)
+{
+	struct Upload up;
+	char filename[256];
+
+	if (!frame_name(req, RESUME_PAYLOAD_MIN, filename))
+		return CMD_FAILED;
+	if (upload_begin(&up, filename, (size_t)get_u64(req->payload),
+			 get_u64(req->payload + 8)) != 0) {
+		reply_frame(req, FRAME_ERR, 0, "cannot resume", 13);
+		return CMD_FAILED;
+	}
+
+	bool received = frame_upload_recv(req, &up);
+	bool valid = received && frame_checksum_matches(req, &up);
+	if (!upload_account(&up, valid)) {
+		if (!received) {
+			atomic_store(&req->conn->session, false);
+			return CMD_FAILED;
+		}
+		reply_frame(req, FRAME_ERR, 0, "checksum mismatch", 17);
+		return CMD_FAILED;
+	}
+	return reply_stored(req, up.received);
+}
+
+/*
+ * Stores the frames of a chained upload as frame_data_recv() does and
+ * passes each on down the line once it is stored: a plain DATA frame
+ * straight from the file, before the digest reads it out of the cache, and
+ * a compressed one or a HOLE as it arrived.
+ */
+static bool frame_chain_recv(struct Request *req, struct Upload *up,
+			     struct Chain *ch)
+{
+	struct Connection *c = req->conn;
+	unsigned char *lz = NULL;
+	bool ok = true;
+
+	while (ok && up->received < up->filesize) {
+		unsigned char head[FRAME_HEADER_SIZE];
+		unsigned char gap[HOLE_PAYLOAD_SIZE];
+		struct FrameHeader h;
+		size_t at = up->received;
+
+		ok = conn_read(c, head, sizeof(head)) && frame_decode(head, &h)
+		    && h.request_id == req->head.request_id;
+		if (ok && h.type == FRAME_HOLE) {
+			ok = h.length == HOLE_PAYLOAD_SIZE
+			    && conn_read(c, gap, sizeof(gap))
+			    && upload_hole(up, get_u64(gap));
+			if (ok)
+				chain_forward(ch, FRAME_HOLE, 0, gap,
+					      sizeof(gap));
+			continue;
+		}
+		ok = ok && h.type == FRAME_DATA && upload_data(c, up, &h, &lz);
+		if (ok && (h.flags & FRAME_F_LZ))
+			chain_forward(ch, FRAME_DATA, FRAME_F_LZ, lz, h.length);
+		else if (ok)
+			chain_forward_file(ch, up->fd, up->base + (off_t)at,
+					   up->received - at);
+		ok = ok && upload_digest(up);
+	}
+	free(lz);
+	return ok && up->received == up->filesize;
+}
+
+/*
+ * Chained upload: stored here like RESUME from offset 0 and passed down
+ * the line of servers in the request as it arrives, so the client sends
+ * the file once however many servers keep it. GO goes out before the next
+ * server is looked for, so each server of the line spends its own
+ * CHAIN_OPEN_TIMEOUT at most, while the data waits in the socket buffers.
+ * Servers that cannot be reached are skipped; OK reports on every one.
+ */
+static enum CommandResult cmd_chain(struct Request *req)
+{
+	struct ChainHop hops[CHAIN_MAX_NODES - 1];
+	unsigned char status[CHAIN_MAX_NODES];
+	unsigned char sum[CHECKSUM_PAYLOAD_SIZE];
+	struct Upload up;
+	struct Chain ch;
+	char filename[256];
+	uint32_t crc = 0;
+	size_t count = req->head.length >= CHAIN_PAYLOAD_MIN
+	    ? get_u32(req->payload + 8) : 0;
+
+	if (count > CHAIN_MAX_NODES - 1) {
+		reply_frame(req, FRAME_ERR, 0, "bad request", 11);
+		return CMD_FAILED;
+	}
+	if (!frame_name(req, CHAIN_PAYLOAD_MIN + count * CHAIN_HOP_SIZE,
+			filename))
+		return CMD_FAILED;
+	for (size_t i = 0; i < count; i++) {
+		const unsigned char *hop = req->payload + CHAIN_PAYLOAD_MIN
+		    + i * CHAIN_HOP_SIZE;
+
+		hops[i].addr = get_u32(hop);
+		hops[i].port = get_u32(hop + 4);
+		if (hops[i].port == 0 || hops[i].port > 65535) {
+			reply_frame(req, FRAME_ERR, 0, "bad request", 11);
+			return CMD_FAILED;
+		}
+	}
+	if (upload_begin(&up, filename, (size_t)get_u64(req->payload), 0) != 0) {
+		reply_frame(req, FRAME_ERR, 0, "cannot store", 12);
+		return CMD_FAILED;
+	}
+
+	reply_frame(req, FRAME_GO, 0, NULL, 0);
+	chain_open(&ch, hops, count, up.filesize, filename, status + 1);
+	bool received = frame_chain_recv(req, &up, &ch)
+	    && frame_checksum_read(req, &crc);
+	if (received) {
+		put_u32(sum, crc);
+		chain_forward(&ch, FRAME_CHECKSUM, 0, sum, sizeof(sum));
+	}
+	bool stored = upload_account(&up, received && crc == up.crc);
+	chain_close(&ch, received);
+	if (!received) {
+		atomic_store(&req->conn->session, false);
+		return CMD_FAILED;
+	}
+	status[0] = stored ? CHAIN_STORED : CHAIN_REJECTED;
+	reply_frame(req, FRAME_OK, 0, status, count + 1);
+	return CMD_DONE;
+}
+
+/* Opens storage/<filename> for reading; -1 when there is no such file. */
+static int stored_open(const char *filename, size_t *size)
+{
+	char path[STORAGE_PATH_MAX];
+	struct stat st;
+
+	if (!upload_name_valid(filename))
+		return -1;
+	snprintf(path, sizeof(path), "storage/%s", filename);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return -1;
+	}
+	*size = (size_t)st.st_size;
+	return fd;
+}
+
+/*
+ * Block checksums of the stored copy of a file, for a delta upload. They
+ * are sent SIGNATURE_FRAME_BLOCKS at a time as the file is read, so the
+ * client sees progress on large files.
+ */
+static enum CommandResult cmd_signature(struct Request *req)
+{
+	char filename[256];
+	size_t size;
 
-	buf[n] = '\0';
+	if (!frame_name(req, 0, filename))
+		return CMD_FAILED;
+	int fd = stored_open(filename, &size);
+	if (fd < 0) {
+		reply_frame(req, FRAME_ERR, 0, "no such file", 12);
+		return CMD_FAILED;
+	}
 
-	if (strncmp(buf, "AUTH ", 5) == 0) {
-		char *pass = buf + 5;
-		if (strcmp(pass, server_password) == 0) {
-			send(client_fd, "OK", 2, 0);
-			return true;
+	size_t block = delta_block_size(size);
+	size_t count = size / block;
+	size_t cap = SIGNATURE_HEAD_SIZE
+	    + SIGNATURE_FRAME_BLOCKS * SIGNATURE_ENTRY_SIZE;
+	unsigned char *data = malloc(block);
+	unsigned char *out = malloc(cap);
+	bool ok = data && out;
+
+	if (ok) {
+		put_u32(out, (uint32_t)block);
+		put_u64(out + 4, size);
+		put_u32(out + 12, (uint32_t)count);
+	}
+	size_t len = SIGNATURE_HEAD_SIZE;
+	for (size_t i = 0; ok && i < count; i++) {
+		ok = pread(fd, data, block, (off_t)(i * block))
+		    == (ssize_t)block;
+		if (!ok)
+			break;
+		put_u32(out + len, delta_weak(data, block));
+		put_u64(out + len + 4, delta_strong(data, block));
+		len += SIGNATURE_ENTRY_SIZE;
+		if (len + SIGNATURE_ENTRY_SIZE > cap) {
+			ok = reply_frame(req, FRAME_DATA, FRAME_F_MORE, out, len);
+			reactor_touch(req->conn);
+			len = 0;
 		}
 	}
+	if (ok && len > 0)
+		ok = reply_frame(req, FRAME_DATA, FRAME_F_MORE, out, len);
+	close(fd);
+	free(data);
+	free(out);
+	if (!ok) {
+		reply_frame(req, FRAME_ERR, 0, "cannot read", 11);
+		return CMD_FAILED;
+	}
+	reply_frame(req, FRAME_OK, 0, NULL, 0);
+	return CMD_DONE;
+}
+
+/*
+ * Sends a range of a stored file as DATA frames, each frame's bytes moved
+ * by sendfile(). Other replies on the connection may go out between
+ * frames, so a download does not hold up the session.
+ */
+static enum CommandResult cmd_get(struct Request *req)
+{
+	char filename[256];
+	unsigned char head[GET_REPLY_SIZE];
+	struct timespec start;
+	size_t size;
+
+	if (!frame_name(req, GET_PAYLOAD_MIN, filename))
+		return CMD_FAILED;
+	uint64_t offset = get_u64(req->payload);
+	uint64_t len = get_u64(req->payload + 8);
+	int fd = stored_open(filename, &size);
+	if (fd < 0 || offset > size) {
+		if (fd >= 0)
+			close(fd);
+		reply_frame(req, FRAME_ERR, 0, "no such file", 12);
+		return CMD_FAILED;
+	}
+	if (len > size - offset)
+		len = size - offset;
+	put_u64(head, size);
+	put_u64(head + 8, len);
+	bool ok = reply_frame(req, FRAME_OK, len ? FRAME_F_MORE : 0, head,
+			      sizeof(head));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	posix_fadvise(fd, (off_t)offset, (off_t)len, POSIX_FADV_SEQUENTIAL);
+	for (uint64_t done = 0; ok && done < len;) {
+		size_t chunk = len - done < FRAME_DATA_CHUNK
+		    ? (size_t)(len - done) : FRAME_DATA_CHUNK;
+		unsigned char frame[FRAME_HEADER_SIZE];
+		struct iovec iov = {.iov_base = frame,.iov_len = sizeof(frame) };
 
-	log_msg(KRED, "Auth Failed from %s", client_ip);
-	send(client_fd, "ERR", 3, 0);
-	return false;
+		done += chunk;
+		frame_encode(frame, FRAME_DATA, done < len ? FRAME_F_MORE : 0,
+			     (uint32_t)chunk, req->head.request_id);
+		ok = reactor_send_file(req->conn, &iov, 1, fd,
+				       (off_t)(offset + done - chunk), chunk);
+		reactor_touch(req->conn);
+	}
+	close(fd);
+	if (!ok) {
+		log_msg(KYEL, "File Send Aborted: storage/%s", filename);
+		return CMD_FAILED;
+	}
+	atomic_fetch_add(&download_bytes, len);
+
+	double mb = (double)len / (1024.0 * 1024.0);
+	double secs = elapsed_since(&start, CLOCK_MONOTONIC);
+	if (len > 0)
+		log_msg(KGRN, "File Sent: storage/%s (%.1f MB at %llu, %.1f MB/s)",
+			filename, mb, (unsigned long long)offset,
+			secs > 0 ? mb / secs : 0.0);
+	return CMD_DONE;
 }
 
-void handle_client(int client_fd, struct sockaddr_in client_addr)
+/*
+ * Answers GO and rebuilds the file from the DATA and COPY frames that
+ * follow, COPY taking whole blocks of the stored copy in src.
+ */
+static bool frame_delta_recv(struct Request *req, struct Upload *up, int src,
+			     size_t stored, size_t block)
 {
-	if (!authenticate_connection(client_fd, client_addr)) {
-		close(client_fd);
-		return;
+	struct Connection *c = req->conn;
+	unsigned char *lz = NULL;
+
+	reply_frame(req, FRAME_GO, 0, NULL, 0);
+
+	bool ok = true;
+	while (ok && up->received < up->filesize) {
+		unsigned char head[FRAME_HEADER_SIZE];
+		unsigned char copy[COPY_PAYLOAD_SIZE];
+		struct FrameHeader h;
+		uint64_t first, count;
+
+		ok = conn_read(c, head, sizeof(head)) && frame_decode(head, &h)
+		    && h.request_id == req->head.request_id;
+		if (ok && h.type == FRAME_DATA)
+			ok = upload_data(c, up, &h, &lz);
+		else if (ok && h.type == FRAME_COPY) {
+			ok = h.length == COPY_PAYLOAD_SIZE
+			    && conn_read(c, copy, sizeof(copy));
+			first = ok ? get_u32(copy) : 0;
+			count = ok ? get_u32(copy + 4) : 0;
+			ok = ok && first + count <= stored / block
+			    && upload_copy(up, src, (off_t)(first * block),
+					   (size_t)(count * block));
+		} else
+			ok = false;
+		ok = ok && upload_digest(up);
+	}
+	free(lz);
+	return ok && up->received == up->filesize;
+}
+
+/*
+ * A new version of a stored file, rebuilt from the blocks it shares with
+ * the stored copy and the bytes it does not. It goes through the same part
+ * file and final CHECKSUM as RESUME, so a stored copy that changed since
+ * SIGNATURE only costs a retry.
+ */
+static enum CommandResult cmd_delta(struct Request *req)
+{
+	const unsigned char *payload = req->payload;
+	struct Upload up;
+	char filename[256];
+	size_t size;
+
+	if (!frame_name(req, DELTA_PAYLOAD_MIN, filename))
+		return CMD_FAILED;
+	int src = stored_open(filename, &size);
+	size_t block = get_u32(payload + 16);
+	if (src < 0 || size != get_u64(payload + 8)
+	    || block != delta_block_size(size)) {
+		if (src >= 0)
+			close(src);
+		reply_frame(req, FRAME_ERR, 0, "stale signature", 15);
+		return CMD_FAILED;
+	}
+	if (upload_begin(&up, filename, (size_t)get_u64(payload), 0) != 0) {
+		close(src);
+		reply_frame(req, FRAME_ERR, 0, "cannot store", 12);
+		return CMD_FAILED;
 	}
 
-	char buf[1024];
-	char *client_ip = inet_ntoa(client_addr.sin_addr);
+	bool received = frame_delta_recv(req, &up, src, size, block);
+	close(src);
+	bool valid = received && frame_checksum_matches(req, &up);
+	if (!upload_account(&up, valid)) {
+		if (!received) {
+			atomic_store(&req->conn->session, false);
+			return CMD_FAILED;
+		}
+		reply_frame(req, FRAME_ERR, 0, "checksum mismatch", 17);
+		return CMD_FAILED;
+	}
 
-	ssize_t n = recv(client_fd, buf, sizeof(buf) - 1, 0);
-	if (n > 0) {
-		buf[n] = '\0';
+	unsigned char reply[DELTA_REPLY_SIZE];
+	put_u64(reply, up.received);
+	put_u64(reply + 8, up.reused);
+	reply_frame(req, FRAME_OK, 0, reply, sizeof(reply));
+	return CMD_DONE;
+}
 
-		if (strncmp(buf, "FILE", 4) == 0) {
-			handle_file_transfer(client_fd, buf);
-		} else if (strncmp(buf, "EXEC", 4) == 0) {
-			handle_execution(client_fd, buf);
-		} else if (strncmp(buf, "STATS", 5) == 0) {
-			char stats_buf[128];
-			get_sys_stats(stats_buf, sizeof(stats_buf));
-			send(client_fd, stats_buf, strlen(stats_buf), 0);
+/* How many stored contents have the size of a file about to be uploaded. */
+static enum CommandResult cmd_probe(struct Request *req)
+{
+	unsigned char reply[PROBE_REPLY_SIZE];
+
+	if (req->head.length != PROBE_PAYLOAD_SIZE) {
+		reply_frame(req, FRAME_ERR, 0, "bad request", 11);
+		return CMD_FAILED;
+	}
+	put_u32(reply, store_count(get_u64(req->payload)));
+	reply_frame(req, FRAME_OK, 0, reply, sizeof(reply));
+	return CMD_DONE;
+}
+
+/*
+ * Stores a file by naming content the server already holds, so an upload
+ * of a file it has seen before moves no payload at all.
+ */
+static enum CommandResult cmd_link(struct Request *req)
+{
+	const unsigned char *payload = req->payload;
+	char filename[256];
+
+	if (!frame_name(req, LINK_PAYLOAD_MIN, filename))
+		return CMD_FAILED;
+
+	struct StoreKey key = {.size = get_u64(payload) };
+
+	memcpy(key.sha256, payload + 8, SHA256_SIZE);
+	if (!upload_name_valid(filename) || store_link(filename, &key) != 0) {
+		reply_frame(req, FRAME_ERR, 0, "not stored", 10);
+		return CMD_FAILED;
+	}
+	log_msg(KGRN, "File Saved: storage/%s (%.1f MB, already stored)",
+		filename, (double)key.size / (1024.0 * 1024.0));
+	return reply_stored(req, (size_t)key.size);
+}
+
+/*
+ * A path inside a pack: relative, '/'-separated, every component a file
+ * name of its own, so nothing in it can climb out of the pack directory.
+ */
+static bool pack_path_valid(const char *path)
+{
+	const char *p = path;
+
+	if (*p == '\0' || strlen(path) > PACK_PATH_MAX)
+		return false;
+	while (*p) {
+		const char *slash = strchr(p, '/');
+		size_t len = slash ? (size_t)(slash - p) : strlen(p);
+
+		if (len == 0 || len > 255 || (len == 1 && p[0] == '.')
+		    || (len == 2 && p[0] == '.' && p[1] == '.'))
+			return false;
+		if (!slash)
+			break;
+		p = slash + 1;
+		if (*p == '\0')
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Creates the directories above path, a file under storage/, refusing to
+ * pass through anything but a real directory.
+ */
+static bool pack_make_dirs(const char *path)
+{
+	char dir[STORAGE_PATH_MAX];
+	struct stat st;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (char *p = dir + strlen("storage/"); (p = strchr(p, '/')); p++) {
+		*p = '\0';
+		if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+			return false;
+		if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+			return false;
+		*p = '/';
+	}
+	return true;
+}
+
+/*
+ * Receives one file of a pack, whose ENTRY payload of len bytes is next on
+ * the connection: its DATA frames go to a part file beside the target and
+ * it is put in place through the store if its CHECKSUM matches. A file
+ * sent with holes is stored without a key, as resume_store() does, since
+ * its SHA-256 skipped them. Returns false when the stream is out of sync;
+ * *stored says whether the file was kept.
+ */
+static bool pack_entry_recv(struct Request *req, const char *root, size_t len,
+			    struct Upload *up, bool *stored)
+{
+	unsigned char entry[ENTRY_PAYLOAD_MIN + PACK_PATH_MAX];
+	char rel[PACK_PATH_MAX + 1];
+	char name[STORAGE_NAME_MAX];
+	size_t rel_len = len - ENTRY_PAYLOAD_MIN;
+	uint32_t crc;
+
+	*stored = false;
+	if (len < ENTRY_PAYLOAD_MIN || len > sizeof(entry)
+	    || !conn_read(req->conn, entry, len)
+	    || memchr(entry + ENTRY_PAYLOAD_MIN, '\0', rel_len))
+		return false;
+	memcpy(rel, entry + ENTRY_PAYLOAD_MIN, rel_len);
+	rel[rel_len] = '\0';
+	if (!pack_path_valid(rel))
+		return false;
+
+	if ((size_t)snprintf(name, sizeof(name), "%s/%s", root, rel)
+	    >= sizeof(name)
+	    || (size_t)snprintf(up->filepath, sizeof(up->filepath),
+				"storage/%s", name) >= sizeof(up->filepath))
+		return false;
+	const char *base = strrchr(up->filepath, '/') + 1;
+	if ((size_t)snprintf(up->partpath, sizeof(up->partpath), "%.*s.%s.part",
+			     (int)(base - up->filepath), up->filepath, base)
+	    >= sizeof(up->partpath))
+		return false;
+	up->filesize = (size_t)get_u64(entry);
+	up->received = up->digested = up->holes = 0;
+	up->lz_raw = up->lz_wire = 0;
+	up->lz_cpu = 0;
+	up->syscalls = 0;
+	up->crc = 0;
+	sha256_init(&up->sha);
+	if (!pack_make_dirs(up->filepath))
+		return false;
+	up->fd = open(up->partpath,
+		      O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0644);
+	if (up->fd < 0)
+		return false;
+	writer_begin(&up->writer, up->fd, 0, up->filesize);
+
+	bool ok = frame_data_recv(req, up) && frame_checksum_read(req, &crc);
+	bool written = writer_end(&up->writer, (off_t)up->received, ok) == 0;
+	close(up->fd);
+	up->fd = -1;
+	upload_count_io(up);
+	if (ok && crc == up->crc && written) {
+		struct StoreKey key = {.size = up->filesize };
+		bool shared;
+
+		sha256_digest(&up->sha, key.sha256);
+		*stored = store_commit(up->partpath, name,
+				       up->holes > 0 ? NULL : &key,
+				       &shared) == 0;
+	} else if (ok) {
+		log_msg(KRED, "File Rejected: %s (%s)", up->filepath,
+			written ? "checksum mismatch" : "write failed");
+	}
+	if (!*stored)
+		unlink(up->partpath);
+	return ok;
+}
+
+/*
+ * A directory tree in one stream: every file is an ENTRY, its DATA and a
+ * CHECKSUM, unpacked under storage/<name> as it arrives. One request
+ * and one log line cover the lot, however many small files it holds.
+ */
+static enum CommandResult cmd_pack(struct Request *req)
+{
+	struct Connection *c = req->conn;
+	struct Upload up;
+	char root[256];
+	uint32_t files = 0, rejected = 0;
+	uint64_t bytes = 0;
+
+	if (!frame_name(req, 0, root))
+		return CMD_FAILED;
+	if (!upload_name_valid(root) || root[0] == '.') {
+		reply_frame(req, FRAME_ERR, 0, "bad name", 8);
+		return CMD_FAILED;
+	}
+	mkdir("storage", 0700);
+	upload_init(&up);
+	log_msg(KCYN, "Receiving Pack: %s", root);
+	reply_frame(req, FRAME_GO, 0, NULL, 0);
+
+	bool ok = true;
+	for (;;) {
+		unsigned char head[FRAME_HEADER_SIZE];
+		struct FrameHeader h;
+		bool stored;
+
+		ok = conn_read(c, head, sizeof(head)) && frame_decode(head, &h)
+		    && h.type == FRAME_ENTRY
+		    && h.request_id == req->head.request_id;
+		if (!ok || h.length == 0)
+			break;
+		ok = pack_entry_recv(req, root, h.length, &up, &stored);
+		if (!ok)
+			break;
+		if (stored) {
+			files++;
+			bytes += up.filesize;
 		} else {
-			log_msg(KCYN, "CMD from %s: %s", client_ip, buf);
-			const char *response = "ACK: Command Received";
-			send(client_fd, response, strlen(response), 0);
+			rejected++;
 		}
 	}
-	close(client_fd);
+	atomic_fetch_add(&upload_bytes, bytes);
+
+	double secs = elapsed_since(&up.started, CLOCK_MONOTONIC);
+	double mb = (double)bytes / (1024.0 * 1024.0);
+	if (!ok) {
+		log_msg(KYEL, "Pack Incomplete: storage/%s (%u files stored)",
+			root, files);
+		atomic_store(&c->session, false);
+		return CMD_FAILED;
+	}
+	log_msg(KGRN, "Pack Saved: storage/%s (%u files, %u rejected, %.1f MB, %.1f MB/s, %.0f files/s)",
+		root, files, rejected, mb, secs > 0 ? mb / secs : 0.0,
+		secs > 0 ? files / secs : 0.0);
+
+	unsigned char reply[PACK_REPLY_SIZE];
+	put_u32(reply, files);
+	put_u64(reply + 4, bytes);
+	reply_frame(req, FRAME_OK, 0, reply, sizeof(reply));
+	return CMD_DONE;
+}
+
+/*
+ * Opens a parallel upload; the ranges arrive later, on any connection.
+ * When an interrupted upload of the file is picked up, the reply lists
+ * the ranges it already holds.
+ */
+static enum CommandResult cmd_upload(struct Request *req)
+{
+	char filename[256];
+	struct MultipartRange done[MULTIPART_MAX_RANGES];
+	int done_count;
+	uint32_t id;
+
+	if (!frame_name(req, UPLOAD_PAYLOAD_MIN, filename))
+		return CMD_FAILED;
+	if (!upload_name_valid(filename)
+	    || multipart_begin(filename, (size_t)get_u64(req->payload), &id,
+			       done, &done_count) != 0) {
+		reply_frame(req, FRAME_ERR, 0, "cannot store", 12);
+		return CMD_FAILED;
+	}
+
+	unsigned char reply[4 + MULTIPART_MAX_RANGES * DONE_RANGE_SIZE];
+	unsigned char *p = reply + 4;
+	put_u32(reply, id);
+	for (int i = 0; i < done_count; i++, p += DONE_RANGE_SIZE) {
+		put_u64(p, done[i].offset);
+		put_u64(p + 8, done[i].len);
+		put_u32(p + 16, done[i].crc);
+	}
+	reply_frame(req, FRAME_OK, 0, reply, (size_t)(p - reply));
+	return CMD_DONE;
+}
+
+static enum CommandResult cmd_range(struct Request *req)
+{
+	const unsigned char *payload = req->payload;
+	struct Upload up;
+
+	if (req->head.length != RANGE_PAYLOAD_SIZE) {
+		reply_frame(req, FRAME_ERR, 0, "bad request", 11);
+		return CMD_FAILED;
+	}
+	uint32_t id = get_u32(payload);
+	uint64_t offset = get_u64(payload + 4);
+	uint64_t len = get_u64(payload + 12);
+	int fd = multipart_acquire(id, offset, len);
+	if (fd < 0) {
+		reply_frame(req, FRAME_ERR, 0, "unknown upload", 14);
+		return CMD_FAILED;
+	}
+
+	upload_init(&up);
+	up.fd = dup(fd);
+	up.base = (off_t)offset;
+	up.filesize = (size_t)len;
+	up.range = true;
+	snprintf(up.filepath, sizeof(up.filepath), "upload %08x", id);
+	if (up.fd < 0) {
+		multipart_release(id, offset, len, false, 0);
+		reply_frame(req, FRAME_ERR, 0, "cannot store", 12);
+		return CMD_FAILED;
+	}
+	writer_begin(&up.writer, up.fd, up.base, 0);
+
+	bool ok = upload_account(&up, frame_upload_recv(req, &up));
+	multipart_release(id, offset, len, ok, up.crc);
+	if (!ok) {
+		atomic_store(&req->conn->session, false);
+		return CMD_FAILED;
+	}
+	return reply_stored(req, up.received);
+}
+
+static enum CommandResult cmd_commit(struct Request *req)
+{
+	size_t len = req->head.length;
+	uint32_t crc;
+	size_t size;
+
+	if (len != COMMIT_PAYLOAD_SIZE && len != COMMIT_PAYLOAD_CRC) {
+		reply_frame(req, FRAME_ERR, 0, "bad request", 11);
+		return CMD_FAILED;
+	}
+	crc = len == COMMIT_PAYLOAD_CRC ? get_u32(req->payload + 4) : 0;
+	int res = multipart_commit(get_u32(req->payload),
+				   len == COMMIT_PAYLOAD_CRC ? &crc : NULL,
+				   &size);
+	if (res == -2) {
+		reply_frame(req, FRAME_ERR, 0, "checksum mismatch", 17);
+		return CMD_FAILED;
+	}
+	if (res != 0) {
+		reply_frame(req, FRAME_ERR, 0, "incomplete", 10);
+		return CMD_FAILED;
+	}
+	return reply_stored(req, size);
+}
+
+/*
+ * Reads what the command has written so far, up to size bytes: waits for
+ * the first bytes, then takes more only while more are ready, so output
+ * streams as it comes while a chatty command fills whole blocks.
+ */
+static ssize_t exec_read(int fd, char *buf, size_t size)
+{
+	size_t used = 0;
+
+	for (;;) {
+		ssize_t n = read(fd, buf + used, size - used);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return used > 0 ? (ssize_t)used : n;
+		used += (size_t)n;
+
+		struct pollfd p = {.fd = fd,.events = POLLIN };
+		if (used == size || poll(&p, 1, 0) != 1)
+			return (ssize_t)used;
+	}
+}
+
+/*
+ * Sends a block of command output, compressed into packed when there is
+ * one and that saves at least 1/LZ_MIN_SAVING of it.
+ */
+static bool reply_output(struct Request *req, const char *data, size_t len,
+			 unsigned char *packed, size_t *wire, double *cpu)
+{
+	struct timespec start;
+	size_t n = 0;
+
+	if (packed && len >= LZ_MIN_FRAME) {
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+		n = lz_compress(data, len, packed + LZ_HEAD_SIZE,
+				len - len / LZ_MIN_SAVING);
+		*cpu += elapsed_since(&start, CLOCK_THREAD_CPUTIME_ID);
+	}
+	if (n == 0) {
+		*wire += len;
+		return reply_chunk(req, data, len);
+	}
+	put_u32(packed, (uint32_t)len);
+	*wire += LZ_HEAD_SIZE + n;
+	return reply_frame(req, FRAME_DATA, FRAME_F_MORE | FRAME_F_LZ, packed,
+			   LZ_HEAD_SIZE + n);
+}
+
+/*
+ * Runs a command and streams its output in blocks of up to EXEC_BUF_SIZE,
+ * compressed for a binary client that shares CAP_LZ.
+ */
+static enum CommandResult cmd_exec(struct Request *req)
+{
+	struct Connection *c = req->conn;
+	const char *cmd = (const char *)req->payload;
+
+	log_msg(KYEL, "Executing: %s", cmd);
+
+	FILE *fp = popen(cmd, "r");
+	if (fp == NULL) {
+		reply_text(req, "Error: Failed to execute command.\n");
+		return CMD_FAILED;
+	}
+
+	char output[EXEC_BUF_SIZE];
+	unsigned char *packed = NULL;
+	size_t raw = 0, wire = 0;
+	double cpu = 0.0;
+	bool ok = true;
+	ssize_t n;
+
+	if (c->proto == PROTO_BINARY && (c->caps & CAP_LZ))
+		packed = malloc(LZ_HEAD_SIZE + EXEC_BUF_SIZE);
+	while (ok && (n = exec_read(fileno(fp), output, sizeof(output))) > 0) {
+		raw += (size_t)n;
+		ok = reply_output(req, output, (size_t)n, packed, &wire, &cpu);
+		reactor_touch(c);
+	}
+	if (ok)
+		reply_end(req);
+
+	pclose(fp);
+	if (packed && wire < raw) {
+		atomic_fetch_add(&lz_raw_bytes, raw);
+		atomic_fetch_add(&lz_wire_bytes, wire);
+		atomic_fetch_add(&lz_cpu_us, (unsigned long long)(cpu * 1e6));
+		log_msg(KGRN, "Execution complete (%.1f KB, lz %.1fx, %.1f ms to compress)",
+			(double)raw / 1024.0, (double)raw / (double)wire,
+			cpu * 1000.0);
+	} else
+		log_msg(KGRN, "Execution complete");
+	free(packed);
+	return ok ? CMD_DONE : CMD_FAILED;
+}
+
+static enum CommandResult cmd_stats(struct Request *req)
+{
+	if (req->conn->proto == PROTO_TEXT) {
+		char stats_buf[128];
+		get_sys_stats(stats_buf, sizeof(stats_buf));
+		reply_text(req, stats_buf);
+		return CMD_DONE;
+	}
+
+	unsigned char stats[STATS_PAYLOAD_SIZE];
+	float cpu;
+	size_t mem_used, mem_total;
+	read_sys_stats(&cpu, &mem_used, &mem_total);
+	put_u32(stats, (uint32_t)(cpu * 100.0f));
+	put_u64(stats + 4, mem_used);
+	put_u64(stats + 12, mem_total);
+	return reply_frame(req, FRAME_STATS, 0, stats, sizeof(stats))
+	    ? CMD_DONE : CMD_FAILED;
+}
+
+static enum CommandResult cmd_metrics(struct Request *req)
+{
+	char metrics_buf[METRICS_BUF_SIZE];
+	get_server_metrics(metrics_buf, sizeof(metrics_buf));
+	reply_text(req, metrics_buf);
+	return CMD_DONE;
+}
+
+static enum CommandResult cmd_message(struct Request *req)
+{
+	log_msg(KCYN, "CMD from %s: %s", req->conn->ip,
+		(const char *)req->payload);
+	if (req->conn->proto == PROTO_BINARY)
+		reply_frame(req, FRAME_OK, 0, NULL, 0);
+	else
+		reply_text(req, "ACK: Command Received");
+	return CMD_DONE;
+}
+
+/*
+ * Commands served by the worker pool. A text line whose verb is not
+ * registered is handled as MSG with the whole line as its argument, which
+ * is what pre-registry clients send for plain messages.
+ */
+static struct Command handler_commands[] = {
+	{.name = "MSG",.frame = FRAME_MSG,.needs_auth = true,
+	 .run = RUN_POOL,.work = WORK_SHORT,.admit = ADMIT_CONN,
+	 .max_payload = CONN_BUF_SIZE - 1,.timeout = 10,.handler = cmd_message},
+	{.name = "STATS",.frame = FRAME_STATS,.needs_auth = true,
+	 .run = RUN_POOL,.work = WORK_SHORT,.admit = ADMIT_CONN,
+	 .max_payload = 0,.timeout = 10,.handler = cmd_stats},
+	{.name = "METRICS",.frame = FRAME_METRICS,.needs_auth = true,
+	 .run = RUN_POOL,.work = WORK_SHORT,.admit = ADMIT_CONN,
+	 .max_payload = 0,.timeout = 10,.handler = cmd_metrics},
+	{.name = "EXEC",.frame = FRAME_EXEC,.needs_auth = true,
+	 .run = RUN_POOL,.work = WORK_LONG,.admit = ADMIT_EXEC,
+	 .max_payload = FRAME_MAX_REQUEST,.timeout = 0,.handler = cmd_exec},
+	{.name = "FILE",.frame = FRAME_FILE,.needs_auth = true,
+	 .reads_body = true,.run = RUN_POOL,.work = WORK_LONG,.admit = ADMIT_UPLOAD,
+	 .max_payload = FILE_REQUEST_MAX,.timeout = 0,.handler = cmd_file},
+	{.name = "UPLOAD",.frame = FRAME_UPLOAD,.frame_only = true,
+	 .needs_auth = true,.run = RUN_POOL,.work = WORK_SHORT,
+	 .admit = ADMIT_CONN,.max_payload = UPLOAD_REQUEST_MAX,.timeout = 10,
+	 .handler = cmd_upload},
+	{.name = "RANGE",.frame = FRAME_RANGE,.frame_only = true,
+	 .needs_auth = true,.reads_body = true,.run = RUN_POOL,.work = WORK_LONG,
+	 .admit = ADMIT_UPLOAD,.max_payload = RANGE_PAYLOAD_SIZE,.timeout = 0,
+	 .handler = cmd_range},
+	{.name = "COMMIT",.frame = FRAME_COMMIT,.frame_only = true,
+	 .needs_auth = true,.run = RUN_POOL,.work = WORK_LONG,
+	 .admit = ADMIT_CONN,.max_payload = COMMIT_PAYLOAD_CRC,.timeout = 0,
+	 .handler = cmd_commit},
+	{.name = "PARTIAL",.frame = FRAME_PARTIAL,.frame_only = true,
+	 .needs_auth = true,.run = RUN_POOL,.work = WORK_SHORT,
+	 .admit = ADMIT_CONN,.max_payload = PARTIAL_REQUEST_MAX,.timeout = 10,
+	 .handler = cmd_partial},
+	{.name = "RESUME",.frame = FRAME_RESUME,.frame_only = true,
+	 .needs_auth = true,.reads_body = true,.run = RUN_POOL,.work = WORK_LONG,
+	 .admit = ADMIT_UPLOAD,.max_payload = RESUME_REQUEST_MAX,.timeout = 0,
+	 .handler = cmd_resume},
+	{.name = "SIGNATURE",.frame = FRAME_SIGNATURE,.frame_only = true,
+	 .needs_auth = true,.run = RUN_POOL,.work = WORK_LONG,
+	 .admit = ADMIT_UPLOAD,.max_payload = 255,.timeout = 0,
+	 .handler = cmd_signature},
+	{.name = "DELTA",.frame = FRAME_DELTA,.frame_only = true,
+	 .needs_auth = true,.reads_body = true,.run = RUN_POOL,.work = WORK_LONG,
+	 .admit = ADMIT_UPLOAD,.max_payload = DELTA_REQUEST_MAX,.timeout = 0,
+	 .handler = cmd_delta},
+	{.name = "PROBE",.frame = FRAME_PROBE,.frame_only = true,
+	 .needs_auth = true,.run = RUN_POOL,.work = WORK_SHORT,
+	 .admit = ADMIT_CONN,.max_payload = PROBE_PAYLOAD_SIZE,.timeout = 10,
+	 .handler = cmd_probe},
+	{.name = "LINK",.frame = FRAME_LINK,.frame_only = true,
+	 .needs_auth = true,.run = RUN_POOL,.work = WORK_SHORT,
+	 .admit = ADMIT_CONN,.max_payload = LINK_REQUEST_MAX,.timeout = 10,
+	 .handler = cmd_link},
+	{.name = "PACK",.frame = FRAME_PACK,.frame_only = true,
+	 .needs_auth = true,.reads_body = true,.run = RUN_POOL,.work = WORK_LONG,
+	 .admit = ADMIT_UPLOAD,.max_payload = 255,.timeout = 0,
+	 .handler = cmd_pack},
+	{.name = "GET",.frame = FRAME_GET,.frame_only = true,
+	 .needs_auth = true,.run = RUN_POOL,.work = WORK_LONG,
+	 .admit = ADMIT_DOWNLOAD,.max_payload = GET_REQUEST_MAX,.timeout = 0,
+	 .handler = cmd_get},
+	{.name = "CHAIN",.frame = FRAME_CHAIN,.frame_only = true,
+	 .needs_auth = true,.reads_body = true,.run = RUN_POOL,.work = WORK_LONG,
+	 .admit = ADMIT_UPLOAD,.max_payload = CHAIN_REQUEST_MAX,.timeout = 0,
+	 .handler = cmd_chain},
+};
+
+int handlers_init(void)
+{
+	return command_register_table(handler_commands,
+				      sizeof(handler_commands)
+				      / sizeof(handler_commands[0]));
+}
+
+bool check_password(const char *password, size_t len)
+{
+	return strlen(server_password) == len
+	    && memcmp(password, server_password, len) == 0;
+}
+
+unsigned long long upload_bytes_total(void)
+{
+	return atomic_load(&upload_bytes);
+}
+
+unsigned long long upload_syscalls_total(void)
+{
+	return atomic_load(&upload_syscalls);
+}
+
+unsigned long long download_bytes_total(void)
+{
+	return atomic_load(&download_bytes);
+}
+
+unsigned long long lz_raw_bytes_total(void)
+{
+	return atomic_load(&lz_raw_bytes);
+}
+
+unsigned long long lz_wire_bytes_total(void)
+{
+	return atomic_load(&lz_wire_bytes);
+}
+
+unsigned long long lz_cpu_us_total(void)
+{
+	return atomic_load(&lz_cpu_us);
 }
@@ -0,0 +1,129 @@
+#include "server.h"
+#include "commands.h"
+
+/*
+ * Registration happens at startup, before any listener runs; afterwards
+ * the tables are only read, so lookups take no lock.
+ */
+static struct Command *registered[COMMAND_MAX];
+static int registered_count = 0;
+static struct Command *by_frame[256];
+static struct Command *by_name[COMMAND_NAME_SLOTS];
+
+static unsigned int name_hash(const char *name, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct Command **name_slot(const char *name, size_t len)
+{
+	unsigned int i = name_hash(name, len) & (COMMAND_NAME_SLOTS - 1);
+
+	while (by_name[i]) {
+		if (strlen(by_name[i]->name) == len
+		    && memcmp(by_name[i]->name, name, len) == 0)
+			break;
+		i = (i + 1) & (COMMAND_NAME_SLOTS - 1);
+	}
+	return &by_name[i];
+}
+
+int command_register(struct Command *cmd)
+{
+	bool text = cmd->name && !cmd->frame_only;
+
+	if (registered_count >= COMMAND_MAX || !cmd->handler
+	    || cmd->max_payload >= CONN_BUF_SIZE
+	    || (cmd->frame && by_frame[cmd->frame])
+	    || (cmd->run == RUN_INLINE
+		&& (cmd->reads_body || cmd->admit != ADMIT_CONN
+		    || cmd->work == WORK_LONG))) {
+		log_msg(KRED, "Cannot register command %s",
+			cmd->name ? cmd->name : "?");
+		return -1;
+	}
+
+	if (text) {
+		struct Command **slot = name_slot(cmd->name, strlen(cmd->name));
+		if (*slot) {
+			log_msg(KRED, "Duplicate command %s", cmd->name);
+			return -1;
+		}
+		*slot = cmd;
+	}
+	if (cmd->frame)
+		by_frame[cmd->frame] = cmd;
+	registered[registered_count++] = cmd;
+	return 0;
+}
+
+int command_register_table(struct Command *cmds, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (command_register(&cmds[i]) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+struct Command *command_by_frame(uint8_t type)
+{
+	return by_frame[type];
+}
+
+struct Command *command_by_name(const char *name, size_t len)
+{
+	if (len == 0)
+		return NULL;
+	return *name_slot(name, len);
+}
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL
+	    + (unsigned long long)ts.tv_nsec / 1000ULL;
+}
+
+enum CommandResult command_invoke(struct Command *cmd, struct Request *req)
+{
+	unsigned long long start = now_us();
+	enum CommandResult res = cmd->handler(req);
+	unsigned long long took = now_us() - start;
+	unsigned long long max = atomic_load_explicit(&cmd->max_us,
+						      memory_order_relaxed);
+
+	atomic_fetch_add_explicit(&cmd->calls, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&cmd->total_us, took, memory_order_relaxed);
+	if (res == CMD_FAILED)
+		atomic_fetch_add_explicit(&cmd->failed, 1,
+					  memory_order_relaxed);
+	while (took > max
+	       && !atomic_compare_exchange_weak(&cmd->max_us, &max, took)) ;
+	return res;
+}
+
+void command_reject(struct Command *cmd)
+{
+	atomic_fetch_add_explicit(&cmd->rejected, 1, memory_order_relaxed);
+}
+
+int command_count(void)
+{
+	return registered_count;
+}
+
+struct Command *command_at(int index)
+{
+	if (index < 0 || index >= registered_count)
+		return NULL;
+	return registered[index];
+}
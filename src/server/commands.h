@@ -0,0 +1,87 @@
+#ifndef OVERSEER_COMMANDS_H
+#define OVERSEER_COMMANDS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "admission.h"
+#include "pool.h"
+
+#define COMMAND_MAX		32
+#define COMMAND_NAME_SLOTS	64
+
+struct Request;
+
+/*
+ * INLINE commands are answered on the reactor thread and must not block;
+ * POOL commands are queued on the worker class named by work. A command
+ * that reads its body, holds an admission slot or is declared WORK_LONG
+ * (EXEC, transfers) runs for as long as its peer or child process takes,
+ * so it is always POOL.
+ */
+enum CommandRun {
+	RUN_INLINE,
+	RUN_POOL
+};
+
+/* CMD_CLOSE ends the connection; CMD_FAILED is only counted. */
+enum CommandResult {
+	CMD_DONE,
+	CMD_FAILED,
+	CMD_CLOSE
+};
+
+typedef enum CommandResult (*command_fn_t)(struct Request *req);
+
+/*
+ * A server command and the limits the dispatcher enforces for it. name is
+ * the text protocol verb, matched as a whole word; frame is the binary
+ * frame type, 0 for text-only commands, and frame_only hides the verb from
+ * text clients. max_payload bounds the arguments (text) or payload
+ * (binary) and must stay below CONN_BUF_SIZE. reads_body marks a handler
+ * that goes on reading the connection after its request, so the reactor
+ * stops reading until it is done. timeout is in seconds; 0 falls back to
+ * --transfer-timeout. The counters are maintained by the registry.
+ */
+struct Command {
+	const char *name;
+	uint8_t frame;
+	bool frame_only;
+	bool needs_auth;
+	bool reads_body;
+	enum CommandRun run;
+	enum WorkClass work;
+	enum AdmitClass admit;
+	size_t max_payload;
+	int timeout;
+	command_fn_t handler;
+
+	atomic_ullong calls;
+	atomic_ullong failed;
+	atomic_ullong rejected;
+	atomic_ullong total_us;
+	atomic_ullong max_us;
+};
+
+/*
+ * Fails on a duplicate name or frame type, when the table is full, or for
+ * an INLINE command that would block the reactor.
+ */
+int command_register(struct Command *cmd);
+int command_register_table(struct Command *cmds, size_t count);
+
+/* O(1) lookups; NULL when nothing is registered under the key. */
+struct Command *command_by_frame(uint8_t type);
+struct Command *command_by_name(const char *name, size_t len);
+
+/* Runs the handler and records its service time. */
+enum CommandResult command_invoke(struct Command *cmd, struct Request *req);
+
+/* Counts a request refused before it ran (auth, size). */
+void command_reject(struct Command *cmd);
+
+int command_count(void);
+struct Command *command_at(int index);
+
+#endif
@@ -1,32 +1,217 @@
 #include "server.h"
+#include "pool.h"
+#include "store.h"
+#include "../common/crc32c.h"
+#include <getopt.h>
 
 int server_id = 0;
 int tcp_port = 8080;
 char *server_password = "admin";
 char beacon_msg[BEACON_MSG_SIZE];
 volatile bool running = true;
-int server_socket_fd = -1;
+int max_conns = DEFAULT_MAX_CONNS;
+int worker_cpus = 0;
+int listener_count = 1;
+int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+enum IoBackend io_backend = IO_BACKEND_EPOLL;
+enum RecvMode recv_mode = RECV_AUTO;
+int max_exec = DEFAULT_MAX_EXEC;
+int max_uploads = DEFAULT_MAX_UPLOADS;
+int max_downloads = DEFAULT_MAX_DOWNLOADS;
+int max_queue = DEFAULT_MAX_QUEUE;
+int auth_timeout = DEFAULT_AUTH_TIMEOUT;
+int header_timeout = DEFAULT_HEADER_TIMEOUT;
+int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+int transfer_timeout = DEFAULT_TRANSFER_TIMEOUT;
 
 void handle_signal(int sig)
 {
 	printf("\n");
 	log_msg(KRED, "Received shutdown signal...");
 	running = false;
-	if (server_socket_fd != -1) {
-		close(server_socket_fd);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [--max-conns N] [--max-exec N] [--max-uploads N] "
+	       "[--max-downloads N] [--max-queue N] [--workers N] "
+	       "[--listeners N] "
+	       "[--backlog N] [--io-backend epoll|uring] "
+	       "[--recv-mode auto|copy|splice] [--auth-timeout S] "
+	       "[--header-timeout S] [--idle-timeout S] [--transfer-timeout S] "
+	       "[--fsync none|end|MB] [port] [password]\n", prog);
+	printf("  --listeners 0 starts one SO_REUSEPORT listener per CPU\n");
+	printf("  a timeout of 0 seconds disables that deadline\n");
+	printf("  --max-exec, --max-uploads, --max-downloads and --max-queue "
+	       "accept 0 for\n  no limit\n");
+	printf("  --fsync end syncs each upload before it is acknowledged; "
+	       "--fsync N\n  also syncs every N MB on the way\n");
+}
+
+static int parse_count(const char *name, const char *arg, int min, int *out)
+{
+	char *end = NULL;
+	long value = strtol(arg, &end, 10);
+	if (!end || *end != '\0' || value < min || value > 1000000) {
+		fprintf(stderr, "Invalid --%s: %s\n", name, arg);
+		return -1;
+	}
+	*out = (int)value;
+	return 0;
+}
+
+static int open_listeners(int *fds, int count)
+{
+	for (int i = 0; i < count; i++) {
+		fds[i] = setup_server(tcp_port, listen_backlog, count > 1);
+		if (fds[i] < 0) {
+			while (i-- > 0)
+				close(fds[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int parse_args(int argc, char *argv[])
+{
+	static const struct option long_opts[] = {
+		{"max-conns", required_argument, NULL, 'm'},
+		{"max-exec", required_argument, NULL, 'e'},
+		{"max-uploads", required_argument, NULL, 'u'},
+		{"max-downloads", required_argument, NULL, 'd'},
+		{"max-queue", required_argument, NULL, 'q'},
+		{"workers", required_argument, NULL, 'w'},
+		{"listeners", required_argument, NULL, 'l'},
+		{"backlog", required_argument, NULL, 'b'},
+		{"io-backend", required_argument, NULL, 'i'},
+		{"recv-mode", required_argument, NULL, 'r'},
+		{"auth-timeout", required_argument, NULL, 'A'},
+		{"header-timeout", required_argument, NULL, 'H'},
+		{"idle-timeout", required_argument, NULL, 'I'},
+		{"transfer-timeout", required_argument, NULL, 'T'},
+		{"fsync", required_argument, NULL, 'F'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'm':
+			if (parse_count("max-conns", optarg, 1, &max_conns) != 0)
+				return -1;
+			break;
+		case 'e':
+			if (parse_count("max-exec", optarg, 0, &max_exec) != 0)
+				return -1;
+			break;
+		case 'u':
+			if (parse_count("max-uploads", optarg, 0,
+					&max_uploads) != 0)
+				return -1;
+			break;
+		case 'd':
+			if (parse_count("max-downloads", optarg, 0,
+					&max_downloads) != 0)
+				return -1;
+			break;
+		case 'q':
+			if (parse_count("max-queue", optarg, 0, &max_queue) != 0)
+				return -1;
+			break;
+		case 'w':
+			if (parse_count("workers", optarg, 1, &worker_cpus) != 0)
+				return -1;
+			break;
+		case 'l':
+			if (parse_count("listeners", optarg, 0,
+					&listener_count) != 0)
+				return -1;
+			break;
+		case 'b':
+			if (parse_count("backlog", optarg, 1,
+					&listen_backlog) != 0)
+				return -1;
+			break;
+		case 'i':
+			if (strcmp(optarg, "epoll") == 0) {
+				io_backend = IO_BACKEND_EPOLL;
+			} else if (strcmp(optarg, "uring") == 0) {
+				io_backend = IO_BACKEND_URING;
+			} else {
+				fprintf(stderr, "Invalid --io-backend: %s\n",
+					optarg);
+				return -1;
+			}
+			break;
+		case 'r':
+			if (strcmp(optarg, "auto") == 0) {
+				recv_mode = RECV_AUTO;
+			} else if (strcmp(optarg, "copy") == 0) {
+				recv_mode = RECV_COPY;
+			} else if (strcmp(optarg, "splice") == 0) {
+				recv_mode = RECV_SPLICE;
+			} else {
+				fprintf(stderr, "Invalid --recv-mode: %s\n",
+					optarg);
+				return -1;
+			}
+			break;
+		case 'A':
+			if (parse_count("auth-timeout", optarg, 0,
+					&auth_timeout) != 0)
+				return -1;
+			break;
+		case 'H':
+			if (parse_count("header-timeout", optarg, 0,
+					&header_timeout) != 0)
+				return -1;
+			break;
+		case 'I':
+			if (parse_count("idle-timeout", optarg, 0,
+					&idle_timeout) != 0)
+				return -1;
+			break;
+		case 'T':
+			if (parse_count("transfer-timeout", optarg, 0,
+					&transfer_timeout) != 0)
+				return -1;
+			break;
+		case 'F':
+			if (writer_set_fsync(optarg) != 0) {
+				fprintf(stderr, "Invalid --fsync: %s\n",
+					optarg);
+				return -1;
+			}
+			break;
+		default:
+			print_usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind < argc) {
+		tcp_port = atoi(argv[optind++]);
+	}
+	if (optind < argc) {
+		server_password = argv[optind++];
+	}
+	if (listener_count == 0) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		listener_count = online > 0 ? (int)online : 1;
 	}
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
 	srand((unsigned int)time(NULL));
 	signal(SIGINT, handle_signal);
+	signal(SIGPIPE, SIG_IGN);
 
-	if (argc > 1) {
-		tcp_port = atoi(argv[1]);
-	}
-	if (argc > 2) {
-		server_password = argv[2];
+	if (parse_args(argc, argv) != 0) {
+		return 1;
 	}
 
 	log_msg(KWHT, "--- SYSTEM BOOT ---");
@@ -37,31 +222,73 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	server_socket_fd = setup_server(tcp_port);
-	if (server_socket_fd < 0) {
+	int *listen_fds = calloc((size_t)listener_count, sizeof(int));
+	if (!listen_fds || open_listeners(listen_fds, listener_count) != 0) {
+		free(listen_fds);
+		running = false;
+		pthread_join(beacon_thread, NULL);
+		return 1;
+	}
+
+	if (pool_init(worker_cpus) != 0) {
+		log_msg(KRED, "Error: Could not start worker pool");
+		running = false;
+		for (int i = 0; i < listener_count; i++)
+			close(listen_fds[i]);
+		free(listen_fds);
+		pthread_join(beacon_thread, NULL);
+		return 1;
+	}
+
+	if (handlers_init() != 0
+	    || reactor_init(listen_fds, listener_count, max_conns, io_backend) != 0) {
+		log_msg(KRED, "Error: Could not start event loop");
 		running = false;
+		pool_shutdown();
+		free(listen_fds);
 		pthread_join(beacon_thread, NULL);
 		return 1;
 	}
+	free(listen_fds);
+	io_backend = reactor_backend();
+	int objects = store_init();
+	char storage[96];
+	if (writer_init() != 0)
+		log_msg(KYEL, "Warning: Could not start the storage writer");
+	writer_describe(storage, sizeof(storage));
 
 	log_msg(KGRN, "TCP Server Listening on port %d (ID: %d)", tcp_port,
 		server_id);
 	log_msg(KBLU, "Password protected: %s", server_password);
-
-	while (running) {
-		struct sockaddr_in client_addr;
-		socklen_t len = sizeof(client_addr);
-
-		int client_fd =
-		    accept(server_socket_fd, (struct sockaddr *)&client_addr,
-			   &len);
-		if (client_fd >= 0) {
-			handle_client(client_fd, client_addr);
-		}
+	log_msg(KBLU, "Connection limit: %d, backlog: %d", max_conns,
+		listen_backlog);
+	log_msg(KBLU, "Admission: %d EXEC, %d uploads, %d downloads, "
+		"%d queued per class", max_exec, max_uploads, max_downloads,
+		max_queue);
+	for (int i = 0; i < reactor_shard_count(); i++) {
+		int cpu = reactor_shard_cpu(i);
+		if (cpu >= 0)
+			log_msg(KBLU, "Listener shard %d pinned to CPU %d", i,
+				cpu);
 	}
+	log_msg(KBLU, "I/O backend: %s",
+		io_backend == IO_BACKEND_URING ? "io_uring" : "epoll");
+	log_msg(KBLU, "Timeouts: auth %ds, header %ds, idle %ds, transfer %ds",
+		auth_timeout, header_timeout, idle_timeout, transfer_timeout);
+	log_msg(KBLU, "Workers: %d short, %d long",
+		pool_worker_count(WORK_SHORT), pool_worker_count(WORK_LONG));
+	log_msg(KBLU, "Checksums: CRC32C (%s), SHA-256 (%s)",
+		crc32c_hardware() ? "sse4.2" : "table",
+		sha256_hardware() ? "sha-ni" : "portable");
+	log_msg(KBLU, "Store: %d objects in %s", objects, STORE_DIR);
+	log_msg(KBLU, "Storage: %s", storage);
+
+	reactor_run();
+	pool_shutdown();
+	reactor_destroy();
+	writer_shutdown();
 
 	log_msg(KYEL, "System Shutdown Complete.");
-	close(server_socket_fd);
 	pthread_join(beacon_thread, NULL);
 	return 0;
 }
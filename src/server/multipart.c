@@ -0,0 +1,293 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "multipart.h"
+#include "store.h"
+#include "../common/crc32c.h"
+#include <fcntl.h>
+
+struct Multipart {
+	uint32_t id;
+	int fd;
+	size_t size;
+	int active;
+	bool committing;
+	struct timespec started;
+	time_t touched;
+	int done_count;
+	struct MultipartRange done[MULTIPART_MAX_RANGES];
+	char temp_path[512];
+	char final_path[512];
+	struct Multipart *next;
+};
+
+static struct Multipart *uploads = NULL;
+static int upload_count = 0;
+static uint32_t next_id = 0;
+static pthread_mutex_t uploads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct Multipart *find_locked(uint32_t id)
+{
+	struct Multipart *m = uploads;
+	while (m && m->id != id)
+		m = m->next;
+	return m;
+}
+
+static void unlink_locked(struct Multipart *m)
+{
+	struct Multipart **p = &uploads;
+	while (*p && *p != m)
+		p = &(*p)->next;
+	if (*p)
+		*p = m->next;
+	upload_count--;
+}
+
+static void discard(struct Multipart *m)
+{
+	close(m->fd);
+	unlink(m->temp_path);
+	free(m);
+}
+
+static void expire_locked(time_t now)
+{
+	struct Multipart *m = uploads;
+	int idle = transfer_timeout > 0 ? transfer_timeout : MULTIPART_IDLE_MAX;
+
+	while (m) {
+		struct Multipart *next = m->next;
+		if (m->active == 0 && !m->committing && now - m->touched > idle) {
+			log_msg(KYEL, "Discarding stale upload %s",
+				m->final_path);
+			unlink_locked(m);
+			discard(m);
+		}
+		m = next;
+	}
+}
+
+/* Reserves the blocks up front; filesystems without fallocate get a hole. */
+static int preallocate(int fd, size_t size)
+{
+	if (size == 0)
+		return 0;
+	if (fallocate(fd, 0, 0, (off_t)size) == 0)
+		return 0;
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		return -1;
+	return ftruncate(fd, (off_t)size);
+}
+
+/* An idle, unfinished upload of the same file that can be picked up. */
+static struct Multipart *find_resumable_locked(const char *name, size_t size)
+{
+	char path[512];
+
+	snprintf(path, sizeof(path), "storage/%s", name);
+	for (struct Multipart *m = uploads; m; m = m->next) {
+		if (m->size == size && m->active == 0 && !m->committing
+		    && m->fd >= 0 && strcmp(m->final_path, path) == 0)
+			return m;
+	}
+	return NULL;
+}
+
+int multipart_begin(const char *name, size_t size, uint32_t *id,
+		    struct MultipartRange *done, int *done_count)
+{
+	*done_count = 0;
+	pthread_mutex_lock(&uploads_lock);
+	time_t now = time(NULL);
+	expire_locked(now);
+	struct Multipart *m = find_resumable_locked(name, size);
+	if (m) {
+		m->touched = now;
+		*id = m->id;
+		*done_count = m->done_count;
+		memcpy(done, m->done, (size_t)m->done_count * sizeof(*done));
+		pthread_mutex_unlock(&uploads_lock);
+		log_msg(KCYN, "Resuming File: %s (%d ranges stored, parallel)",
+			name, *done_count);
+		return 0;
+	}
+	pthread_mutex_unlock(&uploads_lock);
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return -1;
+
+	mkdir("storage", 0700);
+
+	pthread_mutex_lock(&uploads_lock);
+	if (upload_count >= MULTIPART_MAX_OPEN) {
+		pthread_mutex_unlock(&uploads_lock);
+		free(m);
+		return -1;
+	}
+	if (next_id == 0)
+		next_id = (uint32_t)now ^ ((uint32_t)getpid() << 16);
+	do {
+		m->id = ++next_id;
+	} while (m->id == 0 || find_locked(m->id));
+	m->touched = now;
+	m->size = size;
+	m->fd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &m->started);
+	m->next = uploads;
+	uploads = m;
+	upload_count++;
+	pthread_mutex_unlock(&uploads_lock);
+
+	snprintf(m->temp_path, sizeof(m->temp_path), "storage/.%s.%08x.part",
+		 name, m->id);
+	snprintf(m->final_path, sizeof(m->final_path), "storage/%s", name);
+
+	m->fd = open(m->temp_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (m->fd < 0 || preallocate(m->fd, size) != 0) {
+		log_msg(KRED, "Cannot prepare %s", m->temp_path);
+		pthread_mutex_lock(&uploads_lock);
+		unlink_locked(m);
+		pthread_mutex_unlock(&uploads_lock);
+		if (m->fd >= 0)
+			discard(m);
+		else
+			free(m);
+		return -1;
+	}
+
+	log_msg(KCYN, "Receiving File: %s (%zu bytes, parallel)", name, size);
+	*id = m->id;
+	return 0;
+}
+
+/* Forgets stored ranges that [offset, offset + len) is about to overwrite. */
+static void forget_overlaps_locked(struct Multipart *m, uint64_t offset,
+				   uint64_t len)
+{
+	int kept = 0;
+
+	for (int i = 0; i < m->done_count; i++) {
+		struct MultipartRange *r = &m->done[i];
+		if (r->offset < offset + len && offset < r->offset + r->len)
+			continue;
+		m->done[kept++] = *r;
+	}
+	m->done_count = kept;
+}
+
+int multipart_acquire(uint32_t id, uint64_t offset, uint64_t len)
+{
+	int fd = -1;
+
+	pthread_mutex_lock(&uploads_lock);
+	struct Multipart *m = find_locked(id);
+	if (m && !m->committing && m->fd >= 0 && offset <= m->size
+	    && len <= m->size - offset) {
+		forget_overlaps_locked(m, offset, len);
+		m->active++;
+		m->touched = time(NULL);
+		fd = m->fd;
+	}
+	pthread_mutex_unlock(&uploads_lock);
+	return fd;
+}
+
+void multipart_release(uint32_t id, uint64_t offset, uint64_t len,
+		       bool complete, uint32_t crc)
+{
+	pthread_mutex_lock(&uploads_lock);
+	struct Multipart *m = find_locked(id);
+	if (m) {
+		m->active--;
+		m->touched = time(NULL);
+		if (complete && len > 0 && m->done_count < MULTIPART_MAX_RANGES) {
+			forget_overlaps_locked(m, offset, len);
+			m->done[m->done_count].offset = offset;
+			m->done[m->done_count].len = len;
+			m->done[m->done_count].crc = crc;
+			m->done_count++;
+		}
+	}
+	pthread_mutex_unlock(&uploads_lock);
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct MultipartRange *x = a;
+	const struct MultipartRange *y = b;
+
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+	return 0;
+}
+
+/* True when the stored ranges tile the file; *crc is then the file's CRC. */
+static bool covered(struct Multipart *m, uint32_t *crc)
+{
+	uint64_t end = 0;
+
+	*crc = 0;
+	qsort(m->done, (size_t)m->done_count, sizeof(m->done[0]), range_cmp);
+	for (int i = 0; i < m->done_count; i++) {
+		if (m->done[i].offset != end)
+			return false;
+		*crc = crc32c_combine(*crc, m->done[i].crc, m->done[i].len);
+		end += m->done[i].len;
+	}
+	return end == m->size;
+}
+
+int multipart_commit(uint32_t id, const uint32_t *expected, size_t *size)
+{
+	uint32_t crc;
+
+	pthread_mutex_lock(&uploads_lock);
+	struct Multipart *m = find_locked(id);
+	if (!m || m->active > 0 || m->committing || !covered(m, &crc)) {
+		pthread_mutex_unlock(&uploads_lock);
+		return -1;
+	}
+	m->committing = true;
+	if (expected && *expected != crc) {
+		unlink_locked(m);
+		pthread_mutex_unlock(&uploads_lock);
+		log_msg(KRED, "File Rejected: %s (checksum mismatch)",
+			m->final_path);
+		discard(m);
+		return -2;
+	}
+	pthread_mutex_unlock(&uploads_lock);
+
+	struct StoreKey key = {.size = m->size };
+	bool shared = false;
+	int res = store_hash(m->fd, m->size, key.sha256);
+	if (res == 0 && writer_durable() && fdatasync(m->fd) != 0)
+		res = -1;
+	if (res == 0)
+		res = store_commit(m->temp_path,
+				   m->final_path + strlen("storage/"), &key,
+				   &shared);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double secs = (double)(now.tv_sec - m->started.tv_sec)
+	    + (double)(now.tv_nsec - m->started.tv_nsec) / 1e9;
+	double mb = (double)m->size / (1024.0 * 1024.0);
+
+	pthread_mutex_lock(&uploads_lock);
+	unlink_locked(m);
+	pthread_mutex_unlock(&uploads_lock);
+
+	if (res != 0) {
+		log_msg(KRED, "Cannot move %s into place", m->temp_path);
+		discard(m);
+		return -1;
+	}
+	log_msg(KGRN, "File Saved: %s (%.1f MB, %.1f MB/s, %d ranges%s, crc32c %08x)",
+		m->final_path, mb, secs > 0 ? mb / secs : mb,
+		m->done_count, shared ? ", already stored" : "", crc);
+	*size = m->size;
+	close(m->fd);
+	free(m);
+	return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef OVERSEER_MULTIPART_H
+#define OVERSEER_MULTIPART_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "../common/protocol.h"
+
+#define MULTIPART_MAX_RANGES	UPLOAD_DONE_MAX
+#define MULTIPART_MAX_OPEN	64
+#define MULTIPART_IDLE_MAX	3600
+
+struct MultipartRange {
+	uint64_t offset;
+	uint64_t len;
+	uint32_t crc;
+};
+
+/*
+ * Uploads assembled from ranges that arrive on different connections.
+ * multipart_begin() preallocates a hidden temporary file under storage/;
+ * each range is written in place with pwrite() through the shared fd, and
+ * multipart_commit() hashes the file and puts it in place through the store
+ * only once the completed ranges cover every byte. Uploads idle for longer than
+ * --transfer-timeout (an hour when that is off) are discarded the next
+ * time one begins.
+ *
+ * Beginning a file of the same name and size while an earlier upload of it
+ * sits idle picks that upload up again: its id is returned with the
+ * ranges already stored and their CRC32C, so only the rest is resent.
+ */
+int multipart_begin(const char *name, size_t size, uint32_t *id,
+		    struct MultipartRange *done, int *done_count);
+
+/*
+ * Checks that [offset, offset + len) lies inside upload id and pins the
+ * upload until multipart_release(). Returns the file to pwrite() into,
+ * or -1.
+ */
+int multipart_acquire(uint32_t id, uint64_t offset, uint64_t len);
+void multipart_release(uint32_t id, uint64_t offset, uint64_t len,
+		       bool complete, uint32_t crc);
+
+/*
+ * Returns 0 and the file size once the file is in place, -1 while ranges
+ * are missing. With expected, the CRC32C of the stored ranges must match
+ * it too; on a mismatch the upload is discarded and -2 returned.
+ */
+int multipart_commit(uint32_t id, const uint32_t *expected, size_t *size);
+
+#endif
@@ -8,7 +8,7 @@ int form_message(void)
 	return 0;
 }
 
-int setup_server(int port)
+int setup_server(int port, int backlog, bool reuse_port)
 {
 	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 	if (sockfd < 0)
@@ -16,6 +16,13 @@ int setup_server(int port)
 
 	int opt = 1;
 	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	if (reuse_port
+	    && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt,
+			  sizeof(opt)) < 0) {
+		log_msg(KRED, "Error: SO_REUSEPORT not supported");
+		close(sockfd);
+		return -1;
+	}
 
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
@@ -25,10 +32,12 @@ int setup_server(int port)
 
 	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 		log_msg(KRED, "Error: Could not bind to port %d", port);
+		close(sockfd);
 		return -1;
 	}
-	if (listen(sockfd, 5) < 0) {
+	if (listen(sockfd, backlog) < 0) {
 		log_msg(KRED, "Error: Could not listen");
+		close(sockfd);
 		return -1;
 	}
 	return sockfd;
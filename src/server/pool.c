@@ -0,0 +1,270 @@
+#include "server.h"
+#include "pool.h"
+#include <sched.h>
+#include <stdatomic.h>
+
+struct WorkItem {
+	work_fn_t fn;
+	void *arg;
+};
+
+struct WorkDeque {
+	pthread_mutex_t lock;
+	size_t top;
+	size_t bottom;
+	struct WorkItem items[POOL_DEQUE_CAPACITY];
+};
+
+struct Worker {
+	pthread_t thread;
+	enum WorkClass cls;
+	unsigned int seed;
+	bool started;
+	struct WorkDeque deque;
+};
+
+struct WorkClassState {
+	struct Worker *workers;
+	int count;
+	atomic_uint next;
+	atomic_size_t pending;
+	atomic_int busy;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+};
+
+static struct WorkClassState classes[WORK_CLASS_COUNT];
+static atomic_bool stopping = false;
+static atomic_ullong steals = 0;
+static __thread struct Worker *current_worker = NULL;
+
+static bool deque_push(struct WorkDeque *dq, struct WorkItem item)
+{
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom - dq->top >= POOL_DEQUE_CAPACITY) {
+		pthread_mutex_unlock(&dq->lock);
+		return false;
+	}
+	dq->items[dq->bottom % POOL_DEQUE_CAPACITY] = item;
+	dq->bottom++;
+	pthread_mutex_unlock(&dq->lock);
+	return true;
+}
+
+static bool deque_pop_bottom(struct WorkDeque *dq, struct WorkItem *out)
+{
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom == dq->top) {
+		pthread_mutex_unlock(&dq->lock);
+		return false;
+	}
+	dq->bottom--;
+	*out = dq->items[dq->bottom % POOL_DEQUE_CAPACITY];
+	pthread_mutex_unlock(&dq->lock);
+	return true;
+}
+
+static bool deque_steal_top(struct WorkDeque *dq, struct WorkItem *out)
+{
+	if (pthread_mutex_trylock(&dq->lock) != 0)
+		return false;
+	if (dq->bottom == dq->top) {
+		pthread_mutex_unlock(&dq->lock);
+		return false;
+	}
+	*out = dq->items[dq->top % POOL_DEQUE_CAPACITY];
+	dq->top++;
+	pthread_mutex_unlock(&dq->lock);
+	return true;
+}
+
+static bool steal_from_class(struct Worker *self, enum WorkClass cls,
+			     struct WorkItem *out)
+{
+	struct WorkClassState *wc = &classes[cls];
+	if (wc->count == 0 || atomic_load(&wc->pending) == 0)
+		return false;
+
+	int start = (int)(rand_r(&self->seed) % (unsigned int)wc->count);
+	for (int i = 0; i < wc->count; i++) {
+		struct Worker *victim = &wc->workers[(start + i) % wc->count];
+		if (victim == self)
+			continue;
+		if (deque_steal_top(&victim->deque, out)) {
+			atomic_fetch_sub(&wc->pending, 1);
+			atomic_fetch_add(&steals, 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool take_work(struct Worker *self, struct WorkItem *out)
+{
+	if (deque_pop_bottom(&self->deque, out)) {
+		atomic_fetch_sub(&classes[self->cls].pending, 1);
+		return true;
+	}
+	if (steal_from_class(self, self->cls, out))
+		return true;
+	return self->cls == WORK_LONG
+	    && steal_from_class(self, WORK_SHORT, out);
+}
+
+static void *worker_main(void *arg)
+{
+	struct Worker *self = arg;
+	struct WorkClassState *wc = &classes[self->cls];
+	current_worker = self;
+
+	while (!atomic_load(&stopping)) {
+		struct WorkItem item;
+		if (take_work(self, &item)) {
+			atomic_fetch_add(&wc->busy, 1);
+			item.fn(item.arg);
+			atomic_fetch_sub(&wc->busy, 1);
+			continue;
+		}
+
+		/*
+		 * Work is pending but every deque holding it was locked:
+		 * give the CPU to its owner rather than spin on trylock.
+		 */
+		if (atomic_load(&wc->pending) > 0) {
+			sched_yield();
+			continue;
+		}
+		pthread_mutex_lock(&wc->idle_lock);
+		while (!atomic_load(&stopping) && atomic_load(&wc->pending) == 0)
+			pthread_cond_wait(&wc->idle_cond, &wc->idle_lock);
+		pthread_mutex_unlock(&wc->idle_lock);
+	}
+	return NULL;
+}
+
+static int class_init(enum WorkClass cls, int count)
+{
+	struct WorkClassState *wc = &classes[cls];
+
+	wc->workers = calloc((size_t)count, sizeof(struct Worker));
+	if (!wc->workers)
+		return -1;
+	atomic_store(&wc->next, 0);
+	atomic_store(&wc->pending, 0);
+	pthread_mutex_init(&wc->idle_lock, NULL);
+	pthread_cond_init(&wc->idle_cond, NULL);
+
+	for (int i = 0; i < count; i++) {
+		struct Worker *w = &wc->workers[i];
+		w->cls = cls;
+		w->seed = (unsigned int)(i * 2654435761u) ^ (unsigned int)cls;
+		pthread_mutex_init(&w->deque.lock, NULL);
+		if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
+			return -1;
+		w->started = true;
+		wc->count = i + 1;
+	}
+	return 0;
+}
+
+int pool_init(int cpus)
+{
+	if (cpus <= 0) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		cpus = online > 0 ? (int)online : 1;
+	}
+
+	atomic_store(&stopping, false);
+	if (class_init(WORK_SHORT, cpus) != 0
+	    || class_init(WORK_LONG, cpus * LONG_WORKERS_PER_CPU) != 0) {
+		pool_shutdown();
+		return -1;
+	}
+	return 0;
+}
+
+int pool_submit(enum WorkClass cls, work_fn_t fn, void *arg)
+{
+	struct WorkClassState *wc = &classes[cls];
+	if (wc->count == 0 || atomic_load(&stopping))
+		return -1;
+
+	struct WorkItem item = {.fn = fn,.arg = arg };
+	bool queued = false;
+
+	atomic_fetch_add(&wc->pending, 1);
+	if (current_worker && current_worker->cls == cls)
+		queued = deque_push(&current_worker->deque, item);
+
+	unsigned int start = atomic_fetch_add(&wc->next, 1);
+	for (int i = 0; !queued && i < wc->count; i++) {
+		struct Worker *w = &wc->workers[(start + i) % wc->count];
+		queued = deque_push(&w->deque, item);
+	}
+
+	if (!queued) {
+		atomic_fetch_sub(&wc->pending, 1);
+		return -1;
+	}
+
+	pthread_mutex_lock(&wc->idle_lock);
+	pthread_cond_signal(&wc->idle_cond);
+	pthread_mutex_unlock(&wc->idle_lock);
+	return 0;
+}
+
+void pool_shutdown(void)
+{
+	atomic_store(&stopping, true);
+
+	for (int cls = 0; cls < WORK_CLASS_COUNT; cls++) {
+		struct WorkClassState *wc = &classes[cls];
+		if (!wc->workers)
+			continue;
+
+		pthread_mutex_lock(&wc->idle_lock);
+		pthread_cond_broadcast(&wc->idle_cond);
+		pthread_mutex_unlock(&wc->idle_lock);
+	}
+
+	for (int cls = 0; cls < WORK_CLASS_COUNT; cls++) {
+		struct WorkClassState *wc = &classes[cls];
+		if (!wc->workers)
+			continue;
+
+		for (int i = 0; i < wc->count; i++) {
+			if (wc->workers[i].started)
+				pthread_join(wc->workers[i].thread, NULL);
+			pthread_mutex_destroy(&wc->workers[i].deque.lock);
+		}
+		pthread_mutex_destroy(&wc->idle_lock);
+		pthread_cond_destroy(&wc->idle_cond);
+		free(wc->workers);
+		wc->workers = NULL;
+		wc->count = 0;
+	}
+}
+
+int pool_worker_count(enum WorkClass cls)
+{
+	return classes[cls].count;
+}
+
+size_t pool_queue_depth(enum WorkClass cls)
+{
+	return atomic_load(&classes[cls].pending);
+}
+
+size_t pool_backlog(enum WorkClass cls)
+{
+	struct WorkClassState *wc = &classes[cls];
+	size_t queued = atomic_load(&wc->pending);
+	int busy = atomic_load(&wc->busy);
+	int idle = wc->count > busy ? wc->count - busy : 0;
+	return queued > (size_t)idle ? queued - (size_t)idle : 0;
+}
+
+unsigned long long pool_steal_count(void)
+{
+	return atomic_load(&steals);
+}
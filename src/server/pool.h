@@ -0,0 +1,29 @@
+#ifndef OVERSEER_POOL_H
+#define OVERSEER_POOL_H
+
+#include <stddef.h>
+
+#define POOL_DEQUE_CAPACITY	1024
+#define LONG_WORKERS_PER_CPU	4
+
+/* Short work (STATS, messages) never waits behind long work (FILE, EXEC). */
+enum WorkClass {
+	WORK_SHORT,
+	WORK_LONG,
+	WORK_CLASS_COUNT
+};
+
+typedef void (*work_fn_t)(void *arg);
+
+/* cpus <= 0 sizes the pool to the online processors. */
+int pool_init(int cpus);
+int pool_submit(enum WorkClass cls, work_fn_t fn, void *arg);
+void pool_shutdown(void);
+
+int pool_worker_count(enum WorkClass cls);
+size_t pool_queue_depth(enum WorkClass cls);
+/* Queued jobs that no idle worker of the class can pick up right now. */
+size_t pool_backlog(enum WorkClass cls);
+unsigned long long pool_steal_count(void);
+
+#endif
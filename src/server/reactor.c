@@ -0,0 +1,1488 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "reactor.h"
+#include "pool.h"
+#include "commands.h"
+#include "uring.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#define REACTOR_MAX_EVENTS	256
+#define REACTOR_TICK_MS		100
+
+/* Low bits of a uring user_data or epoll data tag; see conn_tag(). */
+#define URING_EV_ACCEPT		1ULL
+#define URING_EV_RECV		2ULL
+#define URING_EV_SEND		3ULL
+#define URING_EV_WAKE		4ULL
+#define URING_EV_TICK		5ULL
+
+#define SESSION_KEEPIDLE	30
+#define SESSION_KEEPINTVL	10
+#define SESSION_KEEPCNT		3
+
+struct Reactor {
+	int id;
+	int cpu;
+	int epoll_fd;
+	int listen_fd;
+	int wake_fd;
+	pthread_t thread;
+	bool started;
+	bool use_uring;
+	struct Uring ring;
+	uint64_t wake_value;
+	struct __kernel_timespec tick;
+	struct Connection *done_list;
+	struct Request *req_done;
+	pthread_mutex_t done_lock;
+	atomic_ullong accepted;
+	struct TimerWheel wheel;
+};
+
+static struct Reactor *shards = NULL;
+static int shard_total = 0;
+static enum IoBackend active_backend = IO_BACKEND_EPOLL;
+
+static int conn_limit = 0;
+static struct Connection *conn_slots = NULL;
+static struct Connection *free_list = NULL;
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_int open_conns = 0;
+static atomic_ullong accepted_total = 0;
+static atomic_ullong expired_counts[DEADLINE_COUNT];
+static atomic_ullong clock_ms = 0;
+static atomic_ullong sessions_opened = 0;
+
+static const char *deadline_names[DEADLINE_COUNT] = {
+	"auth", "header", "idle", "transfer"
+};
+
+static unsigned long long clock_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (unsigned long long)ts.tv_sec * 1000ULL
+	    + (unsigned long long)ts.tv_nsec / 1000000ULL;
+}
+
+static void uring_arm_recv(struct Reactor *r, struct Connection *c);
+
+static int set_nonblocking(int fd, bool enable)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+	flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	return fcntl(fd, F_SETFL, flags);
+}
+
+static void raise_fd_limit(int wanted)
+{
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+		return;
+	if (rl.rlim_cur >= (rlim_t)wanted)
+		return;
+	rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY
+		       || rl.rlim_max > (rlim_t)wanted) ? (rlim_t)wanted
+	    : rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+static struct Connection *conn_alloc(struct Reactor *r)
+{
+	pthread_mutex_lock(&slot_lock);
+	struct Connection *c = free_list;
+	if (c)
+		free_list = c->next;
+	pthread_mutex_unlock(&slot_lock);
+
+	if (!c)
+		return NULL;
+	unsigned int gen = c->gen + 1;
+	memset(c, 0, offsetof(struct Connection, out_lock));
+	c->fd = -1;
+	c->gen = gen;
+	c->owner = r;
+	atomic_fetch_add(&open_conns, 1);
+	return c;
+}
+
+static struct io_uring_sqe *shard_sqe(struct Reactor *r)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+	while (!sqe) {
+		uring_submit(&r->ring, 0);
+		sqe = uring_get_sqe(&r->ring);
+	}
+	return sqe;
+}
+
+static uint64_t conn_tag(struct Connection *c, uint64_t event)
+{
+	uint64_t slot = (uint64_t)(c - conn_slots);
+	return (slot << 32) | ((uint64_t)(c->gen & 0xfffffff) << 4) | event;
+}
+
+static void conn_release(struct Connection *c)
+{
+	c->owner = NULL;
+	pthread_mutex_lock(&slot_lock);
+	c->next = free_list;
+	free_list = c;
+	pthread_mutex_unlock(&slot_lock);
+}
+
+/*
+ * Closes the socket. The slot goes back to the free list at once, or with
+ * io_uring once the last SEND reading its reply_buf has completed.
+ */
+static void conn_close(struct Connection *c)
+{
+	struct Reactor *r = c->owner;
+	timer_cancel(&c->timer);
+	if (r && r->use_uring && r->ring.fd >= 0
+	    && r->ring.local_tail != r->ring.submitted_tail)
+		uring_submit(&r->ring, 0);
+	if (r && r->use_uring)
+		shutdown(c->fd, SHUT_RDWR);
+
+	close(c->fd);
+	c->fd = -1;
+	atomic_fetch_sub(&open_conns, 1);
+	if (c->sends == 0)
+		conn_release(c);
+}
+
+/*
+ * Reactor-side reply on a text connection. io_uring sends it from
+ * reply_buf, which stays untouched until every SEND queued from it has
+ * completed; a client that lets more than CONN_REPLY_SIZE of replies pile
+ * up meanwhile is shut down.
+ */
+static void conn_reply(struct Connection *c, const char *msg)
+{
+	size_t len = strlen(msg);
+
+	if (!c->owner->use_uring) {
+		send(c->fd, msg, len, MSG_NOSIGNAL);
+		return;
+	}
+	if (len > sizeof(c->reply_buf) - c->reply_len) {
+		atomic_store(&c->session, false);
+		shutdown(c->fd, SHUT_RDWR);
+		return;
+	}
+
+	char *reply = c->reply_buf + c->reply_len;
+	memcpy(reply, msg, len);
+	c->reply_len += len;
+	c->sends++;
+
+	struct io_uring_sqe *sqe = shard_sqe(c->owner);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = c->fd;
+	sqe->addr = (unsigned long)reply;
+	sqe->len = (unsigned int)len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = conn_tag(c, URING_EV_SEND);
+}
+
+/*
+ * Reactor-side reply on a binary connection. It never blocks: while a
+ * worker is writing, the frame is queued in out_buf for that worker to
+ * flush. A connection that cannot take a small frame is shut down.
+ */
+static void conn_frame(struct Connection *c, uint8_t type, uint32_t id,
+		       const void *payload, size_t len)
+{
+	unsigned char frame[FRAME_HEADER_SIZE + 64];
+	bool ok;
+
+	if (len > sizeof(frame) - FRAME_HEADER_SIZE)
+		len = sizeof(frame) - FRAME_HEADER_SIZE;
+	frame_encode(frame, type, 0, (uint32_t)len, id);
+	if (len)
+		memcpy(frame + FRAME_HEADER_SIZE, payload, len);
+	len += FRAME_HEADER_SIZE;
+
+	pthread_mutex_lock(&c->out_lock);
+	if (c->out_busy) {
+		ok = c->out_len + len <= sizeof(c->out_buf);
+		if (ok) {
+			memcpy(c->out_buf + c->out_len, frame, len);
+			c->out_len += len;
+		}
+	} else
+		ok = send(c->fd, frame, len, MSG_DONTWAIT | MSG_NOSIGNAL)
+		    == (ssize_t)len;
+	pthread_mutex_unlock(&c->out_lock);
+
+	if (!ok) {
+		atomic_store(&c->session, false);
+		shutdown(c->fd, SHUT_RDWR);
+	}
+}
+
+static bool send_iov(int fd, struct iovec *iov, int count, int flags)
+{
+	struct msghdr msg = {.msg_iov = iov,.msg_iovlen = (size_t)count };
+
+	while (msg.msg_iovlen > 0) {
+		ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+			n -= (ssize_t)msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= (size_t)n;
+		}
+	}
+	return true;
+}
+
+static unsigned long long deadline_budget_ms(enum ConnDeadline d)
+{
+	int seconds = 0;
+	switch (d) {
+	case DEADLINE_AUTH:
+		seconds = auth_timeout;
+		break;
+	case DEADLINE_HEADER:
+		seconds = header_timeout;
+		break;
+	case DEADLINE_IDLE:
+		seconds = idle_timeout;
+		break;
+	case DEADLINE_TRANSFER:
+		seconds = transfer_timeout;
+		break;
+	default:
+		break;
+	}
+	return seconds > 0 ? (unsigned long long)seconds * 1000ULL : 0;
+}
+
+static void conn_schedule(struct Connection *c)
+{
+	unsigned long long at = c->deadline_ms;
+	unsigned long long idle = deadline_budget_ms(DEADLINE_IDLE);
+	if (idle) {
+		unsigned long long idle_at = atomic_load_explicit(
+		    &c->last_active_ms, memory_order_relaxed) + idle;
+		if (!at || idle_at < at)
+			at = idle_at;
+	}
+
+	if (at)
+		timer_arm(&c->owner->wheel, &c->timer, at);
+	else
+		timer_cancel(&c->timer);
+}
+
+static void conn_set_deadline(struct Connection *c, enum ConnDeadline d)
+{
+	unsigned long long now = atomic_load(&clock_ms);
+	unsigned long long budget = deadline_budget_ms(d);
+
+	c->deadline = d;
+	c->deadline_ms = budget ? now + budget : 0;
+	atomic_store_explicit(&c->last_active_ms, now, memory_order_relaxed);
+	conn_schedule(c);
+}
+
+static void conn_drop(struct Connection *c)
+{
+	if (c->state != CONN_PAYLOAD && c->inflight == 0) {
+		conn_close(c);
+		return;
+	}
+	if (c->closing)
+		return;
+	c->closing = true;
+	atomic_store(&c->session, false);
+	timer_cancel(&c->timer);
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+static void on_deadline(struct TimerNode *node, void *arg)
+{
+	struct Connection *c = (struct Connection *)
+	    ((char *)node - offsetof(struct Connection, timer));
+	unsigned long long now = atomic_load(&clock_ms);
+	unsigned long long idle = deadline_budget_ms(DEADLINE_IDLE);
+	unsigned long long last = atomic_load_explicit(&c->last_active_ms,
+						       memory_order_relaxed);
+	enum ConnDeadline reason;
+
+	if (c->deadline_ms && now >= c->deadline_ms) {
+		reason = c->deadline;
+	} else if (idle && now >= last + idle) {
+		reason = DEADLINE_IDLE;
+	} else {
+		conn_schedule(c);
+		return;
+	}
+
+	atomic_fetch_add(&expired_counts[reason], 1);
+	log_msg(KYEL, "Timed out (%s) from %s", deadline_names[reason], c->ip);
+	conn_drop(c);
+}
+
+static void shard_tick(struct Reactor *r)
+{
+	unsigned long long now = clock_now_ms();
+	atomic_store(&clock_ms, now);
+	timer_advance(&r->wheel, now, on_deadline, r);
+}
+
+static void request_init(struct Request *req, struct Connection *c,
+			 struct Command *cmd, const struct FrameHeader *h,
+			 const void *payload)
+{
+	req->conn = c;
+	req->command = cmd;
+	req->admitted = ADMIT_CONN;
+	req->reader = false;
+	req->head = *h;
+	req->next = NULL;
+	memcpy(req->payload, payload, h->length);
+	req->payload[h->length] = '\0';
+}
+
+static void run_command(void *arg)
+{
+	struct Request *req = arg;
+	struct Connection *c = req->conn;
+
+	command_invoke(req->command, req);
+	free(req);
+	if (c->admitted != ADMIT_CONN)
+		admission_release(c->admitted);
+	reactor_complete(c);
+}
+
+static void run_request(void *arg)
+{
+	struct Request *req = arg;
+
+	if (atomic_load(&req->conn->session))
+		command_invoke(req->command, req);
+	reactor_request_done(req);
+}
+
+static bool conn_watch(struct Connection *c)
+{
+	if (c->owner->use_uring)
+		return true;
+
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+		.data.u64 = conn_tag(c, URING_EV_RECV)
+	};
+	return (c->proto == PROTO_BINARY || set_nonblocking(c->fd, true) == 0)
+	    && epoll_ctl(c->owner->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) == 0;
+}
+
+static bool conn_busy(struct Connection *c, enum AdmitClass cls)
+{
+	char reply[32];
+	char text[48];
+	bool session = atomic_load(&c->session);
+
+	if (c->admitted != ADMIT_CONN)
+		admission_release(c->admitted);
+	c->admitted = ADMIT_CONN;
+
+	if (c->proto == PROTO_BINARY) {
+		unsigned char retry[4];
+		put_u32(retry, (uint32_t)admission_retry_after(cls));
+		conn_frame(c, FRAME_BUSY, c->reply_id, retry, sizeof(retry));
+		if (c->inflight == 0)
+			conn_set_deadline(c, DEADLINE_IDLE);
+		return session;
+	}
+
+	int len = admission_busy_reply(cls, reply, sizeof(reply));
+	if (session) {
+		snprintf(text, sizeof(text), "%x\n%s0\n", len, reply);
+		conn_set_deadline(c, DEADLINE_IDLE);
+	} else
+		snprintf(text, sizeof(text), "%s", reply);
+	conn_reply(c, text);
+	return session;
+}
+
+static void session_enable(struct Connection *c)
+{
+	int on = 1;
+	int idle = SESSION_KEEPIDLE;
+	int intvl = SESSION_KEEPINTVL;
+	int cnt = SESSION_KEEPCNT;
+
+	setsockopt(c->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	setsockopt(c->fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(c->fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+	setsockopt(c->fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	atomic_store(&c->session, true);
+	atomic_fetch_add(&sessions_opened, 1);
+	conn_set_deadline(c, DEADLINE_IDLE);
+}
+
+/* Reactor-side error for a request that never reached its handler. */
+static void conn_error(struct Connection *c, const char *reason)
+{
+	char msg[64];
+	char text[80];
+	int len;
+
+	if (c->proto == PROTO_BINARY) {
+		conn_frame(c, FRAME_ERR, c->reply_id, reason, strlen(reason));
+		return;
+	}
+	len = snprintf(msg, sizeof(msg), "ERR%s%s", reason[0] ? " " : "",
+		       reason);
+	if (atomic_load(&c->session))
+		snprintf(text, sizeof(text), "%x\n%s0\n", len, msg);
+	else
+		snprintf(text, sizeof(text), "%s", msg);
+	conn_reply(c, text);
+}
+
+/*
+ * A command's own timeout bounds the connection while it runs. With other
+ * requests in flight the later of the two deadlines wins, so a short
+ * command never cuts a long one off.
+ */
+static void conn_command_deadline(struct Connection *c,
+				  const struct Command *cmd)
+{
+	unsigned long long now = atomic_load(&clock_ms);
+	unsigned long long budget = cmd->timeout > 0
+	    ? (unsigned long long)cmd->timeout * 1000ULL
+	    : deadline_budget_ms(DEADLINE_TRANSFER);
+	unsigned long long at = budget ? now + budget : 0;
+
+	if (c->inflight > 1 && c->deadline == DEADLINE_TRANSFER
+	    && (c->deadline_ms == 0 || (at && c->deadline_ms > at)))
+		at = c->deadline_ms;
+
+	c->deadline = DEADLINE_TRANSFER;
+	c->deadline_ms = at;
+	atomic_store_explicit(&c->last_active_ms, now, memory_order_relaxed);
+	conn_schedule(c);
+}
+
+static enum CommandResult cmd_hello(struct Request *req)
+{
+	struct Connection *c = req->conn;
+	unsigned char caps[4];
+
+	c->caps = (req->head.length >= 4 ? get_u32(req->payload) : 0)
+	    & PROTOCOL_CAPS;
+	put_u32(caps, c->caps);
+	conn_frame(c, FRAME_HELLO, req->head.request_id, caps, sizeof(caps));
+	return CMD_DONE;
+}
+
+static enum CommandResult cmd_auth(struct Request *req)
+{
+	struct Connection *c = req->conn;
+	bool binary = c->proto == PROTO_BINARY;
+
+	if (c->state != CONN_AUTH) {
+		conn_error(c, "");
+		return binary || atomic_load(&c->session) ? CMD_FAILED
+		    : CMD_CLOSE;
+	}
+	if (!check_password((const char *)req->payload, req->head.length)) {
+		log_msg(KRED, "Auth Failed from %s", c->ip);
+		conn_error(c, "");
+		return CMD_CLOSE;
+	}
+
+	c->state = CONN_COMMAND;
+	if (!binary) {
+		conn_reply(c, "OK");
+		conn_set_deadline(c, DEADLINE_HEADER);
+		return CMD_DONE;
+	}
+	conn_frame(c, FRAME_OK, req->head.request_id, NULL, 0);
+	session_enable(c);
+	return set_nonblocking(c->fd, false) == 0 ? CMD_DONE : CMD_CLOSE;
+}
+
+static enum CommandResult cmd_session(struct Request *req)
+{
+	conn_reply(req->conn, "OK");
+	session_enable(req->conn);
+	return CMD_DONE;
+}
+
+static enum CommandResult cmd_ping(struct Request *req)
+{
+	struct Connection *c = req->conn;
+
+	if (c->proto == PROTO_BINARY) {
+		conn_frame(c, FRAME_PONG, req->head.request_id, NULL, 0);
+	} else if (atomic_load(&c->session)) {
+		conn_reply(c, "4\nPONG0\n");
+	} else {
+		conn_reply(c, "PONG");
+		return CMD_CLOSE;
+	}
+	if (c->inflight == 0)
+		conn_set_deadline(c, DEADLINE_IDLE);
+	return CMD_DONE;
+}
+
+static enum CommandResult cmd_quit(struct Request *req)
+{
+	struct Connection *c = req->conn;
+
+	if (c->proto == PROTO_BINARY)
+		conn_frame(c, FRAME_OK, req->head.request_id, NULL, 0);
+	else
+		conn_reply(c, atomic_load(&c->session) ? "3\nBYE0\n" : "BYE");
+	return CMD_CLOSE;
+}
+
+/* Connection control, answered by the reactor without a worker hop. */
+static struct Command control_commands[] = {
+	{.name = "HELLO",.frame = FRAME_HELLO,.frame_only = true,
+	 .run = RUN_INLINE,.max_payload = 64,.handler = cmd_hello},
+	{.name = "AUTH",.frame = FRAME_AUTH,
+	 .run = RUN_INLINE,.max_payload = 256,.handler = cmd_auth},
+	{.name = "SESSION",.needs_auth = true,
+	 .run = RUN_INLINE,.max_payload = 0,.handler = cmd_session},
+	{.name = "PING",.frame = FRAME_PING,.needs_auth = true,
+	 .run = RUN_INLINE,.max_payload = 0,.handler = cmd_ping},
+	{.name = "QUIT",.frame = FRAME_QUIT,.needs_auth = true,
+	 .run = RUN_INLINE,.max_payload = 0,.handler = cmd_quit},
+};
+
+static bool dispatch_command(struct Connection *c, struct Command *cmd,
+			     const struct FrameHeader *h, const void *payload)
+{
+	enum AdmitClass admit = cmd->admit;
+
+	if (max_queue > 0 && pool_backlog(cmd->work) >= (size_t)max_queue) {
+		admission_reject(ADMIT_QUEUE);
+		return conn_busy(c, ADMIT_QUEUE);
+	}
+	if (admit != ADMIT_CONN && !admission_acquire(admit))
+		return conn_busy(c, admit);
+	c->admitted = admit;
+
+	struct Request *req = malloc(sizeof(*req));
+	if (!req || (c->owner->epoll_fd >= 0
+		     && epoll_ctl(c->owner->epoll_fd, EPOLL_CTL_DEL, c->fd,
+				  NULL) < 0)
+	    || set_nonblocking(c->fd, false) < 0) {
+		free(req);
+		if (admit != ADMIT_CONN)
+			admission_release(admit);
+		c->admitted = ADMIT_CONN;
+		return false;
+	}
+	request_init(req, c, cmd, h, payload);
+
+	c->state = CONN_PAYLOAD;
+	conn_command_deadline(c, cmd);
+	if (pool_submit(cmd->work, run_command, req) != 0) {
+		free(req);
+		admission_reject(ADMIT_QUEUE);
+		c->state = CONN_COMMAND;
+		conn_set_deadline(c, DEADLINE_IDLE);
+		return conn_busy(c, ADMIT_QUEUE) && conn_watch(c);
+	}
+	return true;
+}
+
+static bool dispatch_request(struct Connection *c, struct Command *cmd,
+			     const struct FrameHeader *h, const void *payload)
+{
+	enum AdmitClass admit = cmd->admit;
+	bool reader = cmd->reads_body;
+
+	if (max_queue > 0 && pool_backlog(cmd->work) >= (size_t)max_queue) {
+		admission_reject(ADMIT_QUEUE);
+		return conn_busy(c, ADMIT_QUEUE);
+	}
+	if (admit != ADMIT_CONN && !admission_acquire(admit))
+		return conn_busy(c, admit);
+
+	struct Request *req = malloc(sizeof(*req));
+	if (!req || (reader && c->owner->epoll_fd >= 0
+		     && epoll_ctl(c->owner->epoll_fd, EPOLL_CTL_DEL, c->fd,
+				  NULL) < 0)) {
+		free(req);
+		if (admit != ADMIT_CONN)
+			admission_release(admit);
+		return false;
+	}
+	request_init(req, c, cmd, h, payload);
+	req->admitted = admit;
+	req->reader = reader;
+
+	if (reader)
+		c->state = CONN_PAYLOAD;
+	c->inflight++;
+	conn_command_deadline(c, cmd);
+	if (pool_submit(cmd->work, run_request, req) != 0) {
+		free(req);
+		if (admit != ADMIT_CONN)
+			admission_release(admit);
+		admission_reject(ADMIT_QUEUE);
+		c->inflight--;
+		c->state = CONN_COMMAND;
+		if (c->inflight == 0)
+			conn_set_deadline(c, DEADLINE_IDLE);
+		return conn_busy(c, ADMIT_QUEUE) && (!reader || conn_watch(c));
+	}
+	return true;
+}
+
+/*
+ * Enforces what the command declares before it runs: authentication and
+ * payload size. Control commands are answered here, everything else goes
+ * to the pool. Returns false when the connection should close.
+ */
+static bool dispatch(struct Connection *c, struct Command *cmd,
+		     const struct FrameHeader *h, const void *payload)
+{
+	if (cmd->needs_auth && c->state == CONN_AUTH) {
+		command_reject(cmd);
+		log_msg(KRED, "Auth Failed from %s", c->ip);
+		conn_error(c, "");
+		return false;
+	}
+	if (h->length > cmd->max_payload) {
+		command_reject(cmd);
+		conn_error(c, "too large");
+		if (c->proto == PROTO_TEXT && !atomic_load(&c->session))
+			return false;
+		if (c->inflight == 0)
+			conn_set_deadline(c, DEADLINE_IDLE);
+		return true;
+	}
+
+	if (cmd->run == RUN_INLINE) {
+		struct Request req;
+		request_init(&req, c, cmd, h, payload);
+		return command_invoke(cmd, &req) != CMD_CLOSE;
+	}
+	if (c->proto == PROTO_BINARY)
+		return dispatch_request(c, cmd, h, payload);
+	return dispatch_command(c, cmd, h, payload);
+}
+
+/*
+ * A text line is "<verb> <arguments>". A verb that is not registered makes
+ * the whole line a MSG.
+ */
+static bool process_message(struct Connection *c)
+{
+	struct FrameHeader h = { 0 };
+	size_t verb;
+	const char *args = c->in_buf;
+	struct Command *cmd;
+
+	c->in_buf[c->in_len] = '\0';
+	c->in_len = 0;
+	c->in_off = 0;
+
+	verb = strcspn(c->in_buf, " ");
+	cmd = command_by_name(c->in_buf, verb);
+	if (cmd)
+		args += verb + (c->in_buf[verb] == ' ');
+	else
+		cmd = command_by_name("MSG", 3);
+	if (!cmd)
+		return false;
+
+	h.type = cmd->frame;
+	h.length = (uint32_t)strlen(args);
+	return dispatch(c, cmd, &h, args);
+}
+
+static bool process_frame(struct Connection *c, const struct FrameHeader *h,
+			  const unsigned char *payload)
+{
+	struct Command *cmd = command_by_frame(h->type);
+
+	c->reply_id = h->request_id;
+	if (cmd)
+		return dispatch(c, cmd, h, payload);
+
+	conn_frame(c, FRAME_ERR, h->request_id, "unsupported", 11);
+	return c->state != CONN_AUTH;
+}
+
+static bool process_frames(struct Connection *c)
+{
+	while (c->state != CONN_PAYLOAD && c->inflight < CONN_MAX_INFLIGHT
+	       && !c->closing) {
+		size_t avail = c->in_len - c->in_off;
+		const unsigned char *frame =
+		    (const unsigned char *)c->in_buf + c->in_off;
+		struct FrameHeader h;
+
+		if (avail < FRAME_HEADER_SIZE)
+			break;
+		if (!frame_decode(frame, &h)) {
+			log_msg(KRED, "Bad frame from %s", c->ip);
+			return false;
+		}
+		if (h.length > FRAME_MAX_REQUEST) {
+			conn_frame(c, FRAME_ERR, h.request_id, "too large", 9);
+			return false;
+		}
+		if (avail < FRAME_HEADER_SIZE + h.length)
+			break;
+		c->in_off += FRAME_HEADER_SIZE + h.length;
+		if (!process_frame(c, &h, frame + FRAME_HEADER_SIZE))
+			return false;
+	}
+
+	if (c->state != CONN_PAYLOAD) {
+		memmove(c->in_buf, c->in_buf + c->in_off, c->in_len - c->in_off);
+		c->in_len -= c->in_off;
+		c->in_off = 0;
+	}
+	return true;
+}
+
+static bool process_input(struct Connection *c)
+{
+	if (c->proto == PROTO_UNKNOWN)
+		c->proto = (unsigned char)c->in_buf[0] == FRAME_MAGIC
+		    ? PROTO_BINARY : PROTO_TEXT;
+	if (c->proto == PROTO_BINARY)
+		return process_frames(c);
+	return process_message(c);
+}
+
+static bool read_message(struct Connection *c)
+{
+	for (;;) {
+		size_t room = sizeof(c->in_buf) - 1 - c->in_len;
+		if (room == 0) {
+			if (!process_input(c))
+				return false;
+			if (c->state == CONN_PAYLOAD
+			    || c->in_len == sizeof(c->in_buf) - 1)
+				return true;
+			continue;
+		}
+
+		ssize_t n = recv(c->fd, c->in_buf + c->in_len, room,
+				 MSG_DONTWAIT);
+		if (n > 0) {
+			c->in_len += (size_t)n;
+			reactor_touch(c);
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return c->in_len == 0 || process_input(c);
+		if (n < 0 && errno == EINTR)
+			continue;
+		return false;
+	}
+}
+
+/*
+ * The connection may have been closed by an earlier event of the same
+ * epoll_wait() batch, such as the completion of its last request, and its
+ * slot handed to another shard's connection since; the tag then no longer
+ * matches and the event is stale.
+ */
+static void on_readable(struct Reactor *r, uint64_t tag)
+{
+	uint64_t slot = tag >> 32;
+	if (slot >= (uint64_t)conn_limit)
+		return;
+
+	struct Connection *c = &conn_slots[slot];
+	if (c->fd < 0 || c->owner != r || conn_tag(c, URING_EV_RECV) != tag)
+		return;
+	if (c->state == CONN_PAYLOAD || c->closing)
+		return;
+	if (!read_message(c))
+		conn_drop(c);
+}
+
+static void conn_rearm(struct Connection *c)
+{
+	if (c->owner->use_uring && !c->recv_armed && !c->closing
+	    && c->state != CONN_PAYLOAD && c->inflight < CONN_MAX_INFLIGHT
+	    && c->in_len < sizeof(c->in_buf) - 1)
+		uring_arm_recv(c->owner, c);
+}
+
+static bool conn_resume(struct Connection *c)
+{
+	c->state = CONN_COMMAND;
+	c->in_len = 0;
+	conn_set_deadline(c, DEADLINE_IDLE);
+	if (!conn_watch(c))
+		return false;
+	conn_rearm(c);
+	return true;
+}
+
+/* Picks up frames held back while requests were in flight, then reads on. */
+static bool conn_pump(struct Connection *c)
+{
+	if (!process_frames(c))
+		return false;
+	if (c->owner->use_uring) {
+		conn_rearm(c);
+		return true;
+	}
+	return c->state == CONN_PAYLOAD || read_message(c);
+}
+
+static void request_finished(struct Request *req)
+{
+	struct Connection *c = req->conn;
+	bool reader = req->reader;
+
+	if (req->admitted != ADMIT_CONN)
+		admission_release(req->admitted);
+	free(req);
+	c->inflight--;
+	if (reader)
+		c->state = CONN_COMMAND;
+
+	if (c->closing || !atomic_load(&c->session)) {
+		conn_drop(c);
+		return;
+	}
+	if (c->inflight == 0)
+		conn_set_deadline(c, DEADLINE_IDLE);
+	if ((reader && !conn_watch(c)) || !conn_pump(c))
+		conn_drop(c);
+}
+
+static void drain_completions(struct Reactor *r)
+{
+	uint64_t count;
+	while (!r->use_uring && read(r->wake_fd, &count, sizeof(count)) > 0) ;
+
+	pthread_mutex_lock(&r->done_lock);
+	struct Connection *list = r->done_list;
+	struct Request *reqs = r->req_done;
+	r->done_list = NULL;
+	r->req_done = NULL;
+	pthread_mutex_unlock(&r->done_lock);
+
+	while (list) {
+		struct Connection *c = list;
+		list = c->next;
+		if (!atomic_load(&c->session) || !conn_resume(c))
+			conn_close(c);
+	}
+	while (reqs) {
+		struct Request *req = reqs;
+		reqs = req->next;
+		request_finished(req);
+	}
+}
+
+static struct Connection *conn_accepted(struct Reactor *r, int fd,
+					struct sockaddr_in *client_addr)
+{
+	atomic_fetch_add(&accepted_total, 1);
+	atomic_fetch_add(&r->accepted, 1);
+
+	struct Connection *c = conn_alloc(r);
+	if (!c) {
+		char reply[32];
+		admission_reject(ADMIT_CONN);
+		int len = admission_busy_reply(ADMIT_CONN, reply, sizeof(reply));
+		send(fd, reply, (size_t)len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		close(fd);
+		return NULL;
+	}
+
+	c->fd = fd;
+	c->addr = *client_addr;
+	c->state = CONN_AUTH;
+	inet_ntop(AF_INET, &client_addr->sin_addr, c->ip, sizeof(c->ip));
+	conn_set_deadline(c, DEADLINE_AUTH);
+	return c;
+}
+
+static void accept_pending(struct Reactor *r)
+{
+	for (;;) {
+		struct sockaddr_in client_addr;
+		socklen_t len = sizeof(client_addr);
+
+		int fd = accept4(r->listen_fd, (struct sockaddr *)&client_addr,
+				 &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+
+		struct Connection *c = conn_accepted(r, fd, &client_addr);
+		if (!c)
+			continue;
+
+		struct epoll_event ev = {
+			.events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+			.data.u64 = conn_tag(c, URING_EV_RECV)
+		};
+		if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			conn_close(c);
+	}
+}
+
+static void uring_arm_accept(struct Reactor *r)
+{
+	struct io_uring_sqe *sqe = shard_sqe(r);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = r->listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = URING_EV_ACCEPT;
+}
+
+static void uring_arm_recv(struct Reactor *r, struct Connection *c)
+{
+	struct io_uring_sqe *sqe = shard_sqe(r);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fd;
+	sqe->addr = (unsigned long)(c->in_buf + c->in_len);
+	sqe->len = (unsigned int)(sizeof(c->in_buf) - 1 - c->in_len);
+	sqe->user_data = conn_tag(c, URING_EV_RECV);
+	c->recv_armed = true;
+}
+
+static void uring_arm_wake(struct Reactor *r)
+{
+	struct io_uring_sqe *sqe = shard_sqe(r);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = r->wake_fd;
+	sqe->addr = (unsigned long)&r->wake_value;
+	sqe->len = sizeof(r->wake_value);
+	sqe->user_data = URING_EV_WAKE;
+}
+
+static void uring_arm_tick(struct Reactor *r)
+{
+	struct io_uring_sqe *sqe = shard_sqe(r);
+	r->tick.tv_sec = 0;
+	r->tick.tv_nsec = REACTOR_TICK_MS * 1000000LL;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)&r->tick;
+	sqe->len = 1;
+	sqe->user_data = URING_EV_TICK;
+}
+
+static void uring_on_accept(struct Reactor *r, struct io_uring_cqe *cqe)
+{
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		uring_arm_accept(r);
+	if (cqe->res < 0)
+		return;
+
+	struct sockaddr_in client_addr;
+	socklen_t len = sizeof(client_addr);
+	memset(&client_addr, 0, sizeof(client_addr));
+	getpeername(cqe->res, (struct sockaddr *)&client_addr, &len);
+
+	struct Connection *c = conn_accepted(r, cqe->res, &client_addr);
+	if (c)
+		uring_arm_recv(r, c);
+}
+
+static void uring_on_recv(struct Reactor *r, uint64_t tag, int res)
+{
+	uint64_t slot = tag >> 32;
+	if (slot >= (uint64_t)conn_limit)
+		return;
+
+	struct Connection *c = &conn_slots[slot];
+	if (c->fd < 0 || c->owner != r || conn_tag(c, URING_EV_RECV) != tag)
+		return;
+	c->recv_armed = false;
+	if (c->state == CONN_PAYLOAD || c->closing)
+		return;
+
+	if (res <= 0) {
+		conn_drop(c);
+		return;
+	}
+
+	c->in_len += (size_t)res;
+	reactor_touch(c);
+	if (!process_input(c))
+		conn_drop(c);
+	else
+		conn_rearm(c);
+}
+
+/* A reply left reply_buf; a closed connection's slot is free after its last. */
+static void uring_on_send(struct Reactor *r, uint64_t tag)
+{
+	uint64_t slot = tag >> 32;
+	if (slot >= (uint64_t)conn_limit)
+		return;
+
+	struct Connection *c = &conn_slots[slot];
+	if (c->owner != r || conn_tag(c, URING_EV_SEND) != tag || c->sends == 0)
+		return;
+	if (--c->sends > 0)
+		return;
+	c->reply_len = 0;
+	if (c->fd < 0)
+		conn_release(c);
+}
+
+static void uring_loop(struct Reactor *r)
+{
+	uring_arm_accept(r);
+	uring_arm_wake(r);
+	uring_arm_tick(r);
+
+	while (running) {
+		if (uring_submit(&r->ring, 1) < 0 && errno != EINTR
+		    && errno != EBUSY && errno != EAGAIN) {
+			log_msg(KRED, "Error: io_uring_enter failed on shard %d (%s)",
+				r->id, strerror(errno));
+			break;
+		}
+
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_peek_cqe(&r->ring)) != NULL) {
+			struct io_uring_cqe ev = *cqe;
+			uring_cqe_seen(&r->ring);
+
+			switch (ev.user_data & 0xf) {
+			case URING_EV_ACCEPT:
+				uring_on_accept(r, &ev);
+				break;
+			case URING_EV_RECV:
+				uring_on_recv(r, ev.user_data, ev.res);
+				break;
+			case URING_EV_SEND:
+				uring_on_send(r, ev.user_data);
+				break;
+			case URING_EV_WAKE:
+				drain_completions(r);
+				uring_arm_wake(r);
+				break;
+			case URING_EV_TICK:
+				uring_arm_tick(r);
+				break;
+			default:
+				break;
+			}
+		}
+		shard_tick(r);
+	}
+}
+
+static int pick_cpu(int index)
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return -1;
+
+	int count = CPU_COUNT(&allowed);
+	if (count <= 0)
+		return -1;
+
+	int wanted = index % count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && wanted-- == 0)
+			return cpu;
+	}
+	return -1;
+}
+
+static void epoll_loop(struct Reactor *r)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+
+	while (running) {
+		int n = epoll_wait(r->epoll_fd, events, REACTOR_MAX_EVENTS,
+				   REACTOR_TICK_MS);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_msg(KRED, "Error: epoll_wait failed on shard %d (%s)",
+				r->id, strerror(errno));
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			uint64_t tag = events[i].data.u64;
+			if (tag == URING_EV_ACCEPT)
+				accept_pending(r);
+			else if (tag == URING_EV_WAKE)
+				drain_completions(r);
+			else
+				on_readable(r, tag);
+		}
+		shard_tick(r);
+	}
+}
+
+static void *shard_main(void *arg)
+{
+	struct Reactor *r = arg;
+
+	if (r->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(r->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	if (r->use_uring)
+		uring_loop(r);
+	else
+		epoll_loop(r);
+	return NULL;
+}
+
+static int shard_init(struct Reactor *r, bool pin)
+{
+	r->cpu = pin ? pick_cpu(r->id) : -1;
+	atomic_store(&clock_ms, clock_now_ms());
+	timer_wheel_init(&r->wheel, atomic_load(&clock_ms));
+	r->wake_fd = eventfd(0, EFD_CLOEXEC | (r->use_uring ? 0 : EFD_NONBLOCK));
+	if (r->wake_fd < 0)
+		return -1;
+
+	if (r->use_uring)
+		return uring_init(&r->ring, URING_QUEUE_DEPTH);
+
+	r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epoll_fd < 0 || set_nonblocking(r->listen_fd, true) < 0)
+		return -1;
+
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLET,
+		.data.u64 = URING_EV_ACCEPT
+	};
+	struct epoll_event wake_ev = {
+		.events = EPOLLIN | EPOLLET,
+		.data.u64 = URING_EV_WAKE
+	};
+	if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev) < 0
+	    || epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &wake_ev) < 0)
+		return -1;
+	return 0;
+}
+
+int reactor_init(const int *listen_fds, int count, int max_conns,
+		 enum IoBackend backend)
+{
+	if (!listen_fds || count <= 0 || max_conns <= 0)
+		return -1;
+
+	if (backend == IO_BACKEND_URING && !uring_supported()) {
+		log_msg(KYEL, "io_uring unavailable, falling back to epoll");
+		backend = IO_BACKEND_EPOLL;
+	}
+	active_backend = backend;
+
+	if (command_register_table(control_commands,
+				   sizeof(control_commands)
+				   / sizeof(control_commands[0])) != 0)
+		return -1;
+
+	raise_fd_limit(max_conns + count + 64);
+
+	conn_slots = calloc((size_t)max_conns, sizeof(struct Connection));
+	shards = calloc((size_t)count, sizeof(struct Reactor));
+	if (!conn_slots || !shards) {
+		free(conn_slots);
+		free(shards);
+		conn_slots = NULL;
+		shards = NULL;
+		return -1;
+	}
+
+	for (int i = max_conns - 1; i >= 0; i--) {
+		conn_slots[i].fd = -1;
+		pthread_mutex_init(&conn_slots[i].out_lock, NULL);
+		pthread_cond_init(&conn_slots[i].out_cond, NULL);
+		conn_slots[i].next = free_list;
+		free_list = &conn_slots[i];
+	}
+	conn_limit = max_conns;
+
+	for (int i = 0; i < count; i++) {
+		struct Reactor *r = &shards[i];
+		r->id = i;
+		r->epoll_fd = -1;
+		r->wake_fd = -1;
+		r->ring.fd = -1;
+		r->use_uring = backend == IO_BACKEND_URING;
+		r->listen_fd = listen_fds[i];
+		pthread_mutex_init(&r->done_lock, NULL);
+	}
+	shard_total = count;
+
+	for (int i = 0; i < count; i++) {
+		if (shard_init(&shards[i], count > 1) != 0) {
+			reactor_destroy();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void reactor_run(void)
+{
+	for (int i = 0; i < shard_total; i++) {
+		if (pthread_create(&shards[i].thread, NULL, shard_main,
+				   &shards[i]) != 0) {
+			log_msg(KRED, "Error: Could not start listener shard %d",
+				i);
+			running = false;
+			break;
+		}
+		shards[i].started = true;
+	}
+
+	for (int i = 0; i < shard_total; i++) {
+		if (shards[i].started)
+			pthread_join(shards[i].thread, NULL);
+		shards[i].started = false;
+	}
+
+	for (int i = 0; i < conn_limit; i++) {
+		if (conn_slots[i].fd >= 0
+		    && conn_slots[i].state == CONN_PAYLOAD)
+			shutdown(conn_slots[i].fd, SHUT_RDWR);
+	}
+}
+
+void reactor_complete(struct Connection *c)
+{
+	struct Reactor *r = c->owner;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&r->done_lock);
+	c->next = r->done_list;
+	r->done_list = c;
+	pthread_mutex_unlock(&r->done_lock);
+
+	if (write(r->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		log_msg(KRED, "Error: Could not wake listener shard %d", r->id);
+}
+
+void reactor_request_done(struct Request *req)
+{
+	struct Reactor *r = req->conn->owner;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&r->done_lock);
+	req->next = r->req_done;
+	r->req_done = req;
+	pthread_mutex_unlock(&r->done_lock);
+
+	if (write(r->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		log_msg(KRED, "Error: Could not wake listener shard %d", r->id);
+}
+
+static void out_claim(struct Connection *c)
+{
+	pthread_mutex_lock(&c->out_lock);
+	while (c->out_busy)
+		pthread_cond_wait(&c->out_cond, &c->out_lock);
+	c->out_busy = true;
+	pthread_mutex_unlock(&c->out_lock);
+}
+
+/* Flushes what the reactor queued meanwhile and lets the next writer in. */
+static bool out_release(struct Connection *c, bool ok)
+{
+	pthread_mutex_lock(&c->out_lock);
+	while (ok && c->out_len > 0) {
+		unsigned char queued[CONN_OUT_SIZE];
+		struct iovec ctl = {.iov_base = queued,.iov_len = c->out_len };
+		memcpy(queued, c->out_buf, c->out_len);
+		c->out_len = 0;
+		pthread_mutex_unlock(&c->out_lock);
+		ok = send_iov(c->fd, &ctl, 1, 0);
+		pthread_mutex_lock(&c->out_lock);
+	}
+	c->out_len = 0;
+	c->out_busy = false;
+	pthread_cond_signal(&c->out_cond);
+	pthread_mutex_unlock(&c->out_lock);
+
+	if (!ok)
+		atomic_store(&c->session, false);
+	return ok;
+}
+
+bool reactor_send(struct Connection *c, struct iovec *iov, int count)
+{
+	out_claim(c);
+	return out_release(c, send_iov(c->fd, iov, count, 0));
+}
+
+/* Copies through user space when the file or socket refuses sendfile(). */
+static bool send_file_copy(int sock, int fd, off_t offset, size_t len)
+{
+	char buf[65536];
+
+	while (len > 0) {
+		size_t want = len < sizeof(buf) ? len : sizeof(buf);
+		ssize_t n = pread(fd, buf, want, offset);
+		struct iovec iov = {.iov_base = buf,.iov_len = (size_t)n };
+
+		if (n <= 0 || !send_iov(sock, &iov, 1, 0))
+			return false;
+		offset += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
+
+bool reactor_send_file(struct Connection *c, struct iovec *iov, int count,
+		       int fd, off_t offset, size_t len)
+{
+	out_claim(c);
+	bool ok = send_iov(c->fd, iov, count, len > 0 ? MSG_MORE : 0);
+
+	while (ok && len > 0) {
+		ssize_t n = sendfile(c->fd, fd, &offset, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			ok = send_file_copy(c->fd, fd, offset, len);
+			break;
+		}
+		ok = n > 0;
+		if (ok)
+			len -= (size_t)n;
+	}
+	return out_release(c, ok);
+}
+
+void reactor_touch(struct Connection *c)
+{
+	atomic_store_explicit(&c->last_active_ms,
+			      atomic_load_explicit(&clock_ms,
+						   memory_order_relaxed),
+			      memory_order_relaxed);
+}
+
+void reactor_destroy(void)
+{
+	if (conn_slots) {
+		for (int i = 0; i < conn_limit; i++) {
+			if (conn_slots[i].fd >= 0)
+				conn_close(&conn_slots[i]);
+			pthread_mutex_destroy(&conn_slots[i].out_lock);
+			pthread_cond_destroy(&conn_slots[i].out_cond);
+		}
+		free(conn_slots);
+		conn_slots = NULL;
+	}
+	free_list = NULL;
+	conn_limit = 0;
+
+	for (int i = 0; i < shard_total; i++) {
+		struct Reactor *r = &shards[i];
+		if (r->wake_fd >= 0)
+			close(r->wake_fd);
+		if (r->epoll_fd >= 0)
+			close(r->epoll_fd);
+		uring_exit(&r->ring);
+		if (r->listen_fd >= 0)
+			close(r->listen_fd);
+		pthread_mutex_destroy(&r->done_lock);
+	}
+	free(shards);
+	shards = NULL;
+	shard_total = 0;
+}
+
+enum IoBackend reactor_backend(void)
+{
+	return active_backend;
+}
+
+int reactor_open_connections(void)
+{
+	return atomic_load(&open_conns);
+}
+
+int reactor_max_connections(void)
+{
+	return conn_limit;
+}
+
+unsigned long long reactor_accepted_total(void)
+{
+	return atomic_load(&accepted_total);
+}
+
+int reactor_shard_count(void)
+{
+	return shard_total;
+}
+
+int reactor_shard_cpu(int shard)
+{
+	if (shard < 0 || shard >= shard_total)
+		return -1;
+	return shards[shard].cpu;
+}
+
+unsigned long long reactor_shard_accepted(int shard)
+{
+	if (shard < 0 || shard >= shard_total)
+		return 0;
+	return atomic_load(&shards[shard].accepted);
+}
+
+unsigned long long reactor_sessions_opened(void)
+{
+	return atomic_load(&sessions_opened);
+}
+
+unsigned long long reactor_expired_total(enum ConnDeadline reason)
+{
+	if (reason < 0 || reason >= DEADLINE_COUNT)
+		return 0;
+	return atomic_load(&expired_counts[reason]);
+}
+
+const char *reactor_deadline_name(enum ConnDeadline reason)
+{
+	if (reason < 0 || reason >= DEADLINE_COUNT)
+		return "unknown";
+	return deadline_names[reason];
+}
@@ -0,0 +1,172 @@
+#ifndef OVERSEER_REACTOR_H
+#define OVERSEER_REACTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "timer.h"
+#include "admission.h"
+#include "../common/protocol.h"
+
+#define CONN_BUF_SIZE		1024
+#define CONN_OUT_SIZE		256
+#define CONN_REPLY_SIZE		256
+#define CONN_MAX_INFLIGHT	16
+#define DEFAULT_MAX_CONNS	4096
+
+#define DEFAULT_AUTH_TIMEOUT		10
+#define DEFAULT_HEADER_TIMEOUT		10
+#define DEFAULT_IDLE_TIMEOUT		60
+#define DEFAULT_TRANSFER_TIMEOUT	3600
+
+struct Reactor;
+struct Command;
+
+enum IoBackend {
+	IO_BACKEND_EPOLL,
+	IO_BACKEND_URING
+};
+
+/*
+ * Per-connection protocol position: AUTH -> command -> payload. Once the
+ * command is known the connection is handed to the worker pool, which owns
+ * the blocking socket until it calls reactor_complete(). A connection that
+ * sent SESSION goes back to CONN_COMMAND afterwards instead of closing, and
+ * its replies are framed as "<hex length>\n<bytes>" chunks ended by "0\n".
+ */
+enum ConnState {
+	CONN_AUTH,
+	CONN_COMMAND,
+	CONN_PAYLOAD
+};
+
+/*
+ * Wire protocol, decided by the first byte a client sends. Binary
+ * connections (see common/protocol.h) always stay open between commands
+ * and are multiplexed: the reactor keeps reading frames while up to
+ * CONN_MAX_INFLIGHT requests run on workers, and each reply goes out as
+ * soon as its request finishes. Only FILE takes over the read side, until
+ * its DATA frames are in; it consumes them from in_buf at in_off first.
+ */
+enum ConnProto {
+	PROTO_UNKNOWN,
+	PROTO_TEXT,
+	PROTO_BINARY
+};
+
+/*
+ * Deadline kinds. AUTH, HEADER and TRANSFER bound the whole of their stage;
+ * IDLE bounds the gap between bytes in any stage.
+ */
+enum ConnDeadline {
+	DEADLINE_AUTH,
+	DEADLINE_HEADER,
+	DEADLINE_IDLE,
+	DEADLINE_TRANSFER,
+	DEADLINE_COUNT
+};
+
+struct Connection {
+	int fd;
+	enum ConnState state;
+	enum ConnProto proto;
+	atomic_bool session;
+	uint32_t caps;
+	uint32_t reply_id;
+	int inflight;
+	bool closing;
+	bool recv_armed;
+	enum AdmitClass admitted;
+	enum ConnDeadline deadline;
+	unsigned long long deadline_ms;
+	atomic_ullong last_active_ms;
+	struct TimerNode timer;
+	struct sockaddr_in addr;
+	char ip[INET_ADDRSTRLEN];
+	char in_buf[CONN_BUF_SIZE];
+	size_t in_len;
+	size_t in_off;
+	bool out_busy;
+	unsigned char out_buf[CONN_OUT_SIZE];
+	size_t out_len;
+	char reply_buf[CONN_REPLY_SIZE];
+	size_t reply_len;
+	int sends;
+	unsigned int gen;
+	struct Reactor *owner;
+	struct Connection *next;
+	/* Set up once per slot; conn_alloc() clears only the fields above. */
+	pthread_mutex_t out_lock;
+	pthread_cond_t out_cond;
+};
+
+/*
+ * One request, copied out of in_buf. Text requests get a header built from
+ * the command line, with request_id 0 and the arguments as the payload. The
+ * payload is always NUL-terminated.
+ */
+struct Request {
+	struct Connection *conn;
+	struct Command *command;
+	enum AdmitClass admitted;
+	bool reader;
+	struct FrameHeader head;
+	struct Request *next;
+	unsigned char payload[CONN_BUF_SIZE];
+};
+
+/*
+ * Takes ownership of the listening sockets, one event loop shard each, and
+ * preallocates max_conns slots shared by all shards. Shards are pinned to
+ * distinct CPUs when there is more than one. IO_BACKEND_URING falls back to
+ * epoll when the kernel refuses io_uring; reactor_backend() reports the
+ * backend actually in use.
+ */
+int reactor_init(const int *listen_fds, int count, int max_conns,
+		 enum IoBackend backend);
+void reactor_run(void);
+void reactor_destroy(void);
+
+/* Called by a worker when it is done with a CONN_PAYLOAD connection. */
+void reactor_complete(struct Connection *c);
+
+/* Called by a worker when it is done with a binary request; frees it. */
+void reactor_request_done(struct Request *req);
+
+/*
+ * Writes one whole reply on a binary connection from a worker. Writers take
+ * turns so frames never interleave; replies the reactor queued meanwhile
+ * follow right after. Returns false and ends the session on error.
+ */
+bool reactor_send(struct Connection *c, struct iovec *iov, int count);
+
+/*
+ * Like reactor_send(), with len bytes of fd at offset after the iovecs,
+ * moved by sendfile() so they never pass through user space.
+ */
+bool reactor_send_file(struct Connection *c, struct iovec *iov, int count,
+		       int fd, off_t offset, size_t len);
+
+/*
+ * Records progress on a connection for the idle deadline. Safe to call from
+ * the worker that owns it; costs one relaxed atomic store.
+ */
+void reactor_touch(struct Connection *c);
+
+enum IoBackend reactor_backend(void);
+int reactor_open_connections(void);
+int reactor_max_connections(void);
+unsigned long long reactor_accepted_total(void);
+int reactor_shard_count(void);
+int reactor_shard_cpu(int shard);
+unsigned long long reactor_shard_accepted(int shard);
+unsigned long long reactor_sessions_opened(void);
+unsigned long long reactor_expired_total(enum ConnDeadline reason);
+const char *reactor_deadline_name(enum ConnDeadline reason);
+
+#endif
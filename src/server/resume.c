@@ -0,0 +1,205 @@
+#include "server.h"
+#include "resume.h"
+#include "store.h"
+#include <fcntl.h>
+
+struct ActiveName {
+	char name[256];
+	struct ActiveName *next;
+};
+
+static struct ActiveName *active = NULL;
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool name_claim(const char *name)
+{
+	struct ActiveName *a;
+
+	pthread_mutex_lock(&active_lock);
+	for (a = active; a; a = a->next) {
+		if (strcmp(a->name, name) == 0)
+			break;
+	}
+	if (a) {
+		pthread_mutex_unlock(&active_lock);
+		return false;
+	}
+	a = calloc(1, sizeof(*a));
+	if (a) {
+		snprintf(a->name, sizeof(a->name), "%s", name);
+		a->next = active;
+		active = a;
+	}
+	pthread_mutex_unlock(&active_lock);
+	return a != NULL;
+}
+
+static void name_release(const char *name)
+{
+	pthread_mutex_lock(&active_lock);
+	for (struct ActiveName **p = &active; *p; p = &(*p)->next) {
+		if (strcmp((*p)->name, name) == 0) {
+			struct ActiveName *a = *p;
+			*p = a->next;
+			free(a);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&active_lock);
+}
+
+static void record_path(char *out, size_t size, const char *name)
+{
+	snprintf(out, size, "storage/.%s.resume", name);
+}
+
+static bool record_read(const char *name, size_t *size, uint64_t *offset,
+			uint32_t *crc)
+{
+	char path[512];
+	unsigned long long off;
+	unsigned int sum;
+
+	record_path(path, sizeof(path), name);
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return false;
+	bool ok = fscanf(fp, "%zu %llu %x", size, &off, &sum) == 3;
+	fclose(fp);
+	*offset = off;
+	*crc = sum;
+	return ok && off <= *size;
+}
+
+void resume_query(const char *name, size_t size, uint64_t *offset,
+		  uint32_t *crc)
+{
+	char path[512];
+	struct stat st;
+	size_t recorded;
+
+	*offset = 0;
+	*crc = 0;
+	snprintf(path, sizeof(path), "storage/.%s.part", name);
+	if (!record_read(name, &recorded, offset, crc) || recorded != size
+	    || stat(path, &st) != 0 || (uint64_t)st.st_size < *offset) {
+		*offset = 0;
+		*crc = 0;
+	}
+}
+
+int resume_begin(struct Upload *up, const char *name, size_t size,
+		 uint64_t offset)
+{
+	if (!name_claim(name)) {
+		log_msg(KYEL, "Upload of %s already in progress", name);
+		return -1;
+	}
+
+	mkdir("storage", 0700);
+	snprintf(up->filepath, sizeof(up->filepath), "storage/%s", name);
+	snprintf(up->partpath, sizeof(up->partpath), "storage/.%s.part", name);
+	up->filesize = size;
+	up->resumable = true;
+
+	uint64_t confirmed;
+	uint32_t crc;
+	if (offset > 0) {
+		resume_query(name, size, &confirmed, &crc);
+		if (confirmed != offset) {
+			log_msg(KRED, "Cannot resume %s at %llu", name,
+				(unsigned long long)offset);
+			name_release(name);
+			return -1;
+		}
+		up->fd = open(up->partpath, O_RDWR | O_CLOEXEC);
+		if (up->fd >= 0 && ftruncate(up->fd, (off_t)offset) != 0) {
+			close(up->fd);
+			up->fd = -1;
+		}
+		up->received = (size_t)offset;
+		up->resumed = (size_t)offset;
+		up->digested = (size_t)offset;
+		up->checkpoint = (size_t)offset;
+		up->crc = crc;
+	} else {
+		char path[512];
+		record_path(path, sizeof(path), name);
+		unlink(path);
+		up->fd = open(up->partpath,
+			      O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	}
+	if (up->fd < 0) {
+		log_msg(KRED, "Error opening file for write");
+		name_release(name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Written beside the record and renamed over it, so it is never torn. */
+void resume_checkpoint(struct Upload *up)
+{
+	const char *name = up->filepath + strlen("storage/");
+	char path[512];
+	char temp[520];
+
+	record_path(path, sizeof(path), name);
+	snprintf(temp, sizeof(temp), "%s.tmp", path);
+	if (fdatasync(up->fd) != 0)
+		return;
+
+	FILE *fp = fopen(temp, "w");
+	if (!fp)
+		return;
+	fprintf(fp, "%zu %zu %08x\n", up->filesize, up->digested, up->crc);
+	if (fclose(fp) != 0 || rename(temp, path) != 0)
+		unlink(temp);
+	up->checkpoint = up->digested;
+}
+
+/*
+ * Puts a complete part file in place through the store. Its SHA-256 was
+ * computed as it arrived unless part of it came from an earlier attempt.
+ * A sparse file is stored without a key: hashing its holes would cost
+ * what skipping them saved.
+ */
+static int resume_store(struct Upload *up, const char *name)
+{
+	struct StoreKey key = {.size = up->filesize };
+	struct stat st;
+
+	if (up->holes > 0 || (stat(up->partpath, &st) == 0
+			      && (uint64_t)st.st_blocks * 512 < key.size))
+		return store_commit(up->partpath, name, NULL, &up->shared);
+
+	sha256_digest(&up->sha, key.sha256);
+	if (up->resumed > 0) {
+		int fd = open(up->partpath, O_RDONLY | O_CLOEXEC);
+		int res = fd >= 0 ? store_hash(fd, up->filesize, key.sha256) : -1;
+
+		if (fd >= 0)
+			close(fd);
+		if (res != 0)
+			return -1;
+	}
+	return store_commit(up->partpath, name, &key, &up->shared);
+}
+
+int resume_end(struct Upload *up, bool valid)
+{
+	const char *name = up->filepath + strlen("storage/");
+	char path[512];
+	int res = -1;
+
+	record_path(path, sizeof(path), name);
+	if (up->received == up->filesize) {
+		if (valid && resume_store(up, name) == 0)
+			res = 0;
+		else
+			unlink(up->partpath);
+		unlink(path);
+	}
+	name_release(name);
+	return res;
+}
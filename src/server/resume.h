@@ -0,0 +1,46 @@
+#ifndef OVERSEER_RESUME_H
+#define OVERSEER_RESUME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RESUME_CHECKPOINT_BYTES	(256 * 1024 * 1024)
+
+struct Upload;
+
+/*
+ * Uploads are written to storage/.<name>.part and only renamed to
+ * storage/<name> once complete, so an interrupted transfer never looks like
+ * a finished file. Next to the part file, storage/.<name>.resume records
+ * the size, the offset confirmed so far and the CRC32C of the bytes before
+ * it. The record is rewritten every RESUME_CHECKPOINT_BYTES and when a
+ * transfer stops short, so it survives dropped links and server restarts.
+ * The part file is flushed with fdatasync() before each record is written,
+ * so a crash never leaves a record counting bytes that are not on disk.
+ */
+
+/* What the server holds of name at this size: offset and prefix CRC, or 0. */
+void resume_query(const char *name, size_t size, uint64_t *offset,
+		  uint32_t *crc);
+
+/*
+ * Opens the part file for up. offset must be 0, which starts over, or the
+ * confirmed offset, which continues after it. Fails while another
+ * connection is uploading the same name.
+ */
+int resume_begin(struct Upload *up, const char *name, size_t size,
+		 uint64_t offset);
+
+/* Records the bytes of up digested so far; up's fd must still be open. */
+void resume_checkpoint(struct Upload *up);
+
+/*
+ * Ends the transfer on up, whose fd is already closed. An incomplete
+ * upload keeps its part file and last checkpoint for later; a complete one
+ * is put in place through the store if valid and deleted if not. Returns 0
+ * once the file is in place.
+ */
+int resume_end(struct Upload *up, bool valid);
+
+#endif
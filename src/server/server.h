@@ -13,9 +13,22 @@
 #include <stdarg.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include "reactor.h"
+#include "admission.h"
+#include "../common/protocol.h"
+#include "../common/sha256.h"
+#include "writer.h"
 
 #define BEACON_PORT		9999
 #define BEACON_MSG_SIZE		256
+#define DEFAULT_LISTEN_BACKLOG	SOMAXCONN
+#define METRICS_BUF_SIZE	4096
+
+/* A name under storage/: at most a pack directory and a path inside it. */
+#define STORAGE_NAME_MAX	(255 + 1 + PACK_PATH_MAX + 1)
+/* storage/<name>, or the part file beside it with its dot and ".part". */
+#define STORAGE_PATH_MAX	(sizeof("storage/") + STORAGE_NAME_MAX \
+				 + sizeof("..part"))
 
 #define KNRM  "\x1B[0m"
 #define KRED  "\x1B[31m"
@@ -26,18 +39,83 @@
 #define KCYN  "\x1B[36m"
 #define KWHT  "\x1B[37m"
 
+/*
+ * How upload payloads reach the disk. AUTO uses the io_uring path on the
+ * uring backend and splice otherwise; every mode falls back to COPY.
+ */
+enum RecvMode {
+	RECV_AUTO,
+	RECV_COPY,
+	RECV_SPLICE
+};
+
+/* Receive paths an upload went through, for the completion log. */
+#define RECV_PATH_COPY		(1u << 0)
+#define RECV_PATH_SPLICE	(1u << 1)
+#define RECV_PATH_URING		(1u << 2)
+
+struct Upload {
+	int fd;
+	char filepath[STORAGE_PATH_MAX];
+	char partpath[STORAGE_PATH_MAX];
+	off_t base;
+	size_t filesize;
+	size_t received;
+	size_t resumed;
+	size_t reused;
+	size_t holes;
+	size_t digested;
+	size_t checkpoint;
+	uint32_t crc;
+	struct Sha256 sha;
+	struct Writer writer;
+	bool range;
+	bool resumable;
+	bool shared;
+	unsigned long long syscalls;
+	unsigned int paths;
+	size_t lz_raw;
+	size_t lz_wire;
+	double lz_cpu;
+	struct timespec started;
+	struct timespec cpu_started;
+};
+
 extern int server_id;
 extern int tcp_port;
 extern char *server_password;
 extern char beacon_msg[BEACON_MSG_SIZE];
 extern volatile bool running;
-extern int server_socket_fd;
+extern int max_conns;
+extern int worker_cpus;
+extern int listener_count;
+extern int listen_backlog;
+extern enum IoBackend io_backend;
+extern enum RecvMode recv_mode;
+extern int max_exec;
+extern int max_uploads;
+extern int max_downloads;
+extern int max_queue;
+extern int auth_timeout;
+extern int header_timeout;
+extern int idle_timeout;
+extern int transfer_timeout;
 
 void log_msg(const char *color, const char *format, ...);
-int setup_server(int port);
+int setup_server(int port, int backlog, bool reuse_port);
 void *send_beacon_thread(void *arg);
 int form_message(void);
+void read_sys_stats(float *cpu, size_t *mem_used, size_t *mem_total);
 void get_sys_stats(char *buffer, size_t size);
-void handle_client(int client_fd, struct sockaddr_in client_addr);
+void get_server_metrics(char *buffer, size_t size);
+
+bool check_password(const char *password, size_t len);
+int handlers_init(void);
+unsigned long long upload_bytes_total(void);
+unsigned long long upload_syscalls_total(void);
+unsigned long long download_bytes_total(void);
+unsigned long long lz_raw_bytes_total(void);
+unsigned long long lz_wire_bytes_total(void);
+unsigned long long lz_cpu_us_total(void);
 
 #endif
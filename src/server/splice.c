@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "splice.h"
+#include <fcntl.h>
+
+struct SplicePipe {
+	int fds[2];
+	size_t size;
+};
+
+static pthread_key_t pipe_key;
+static pthread_once_t pipe_key_once = PTHREAD_ONCE_INIT;
+
+static void pipe_free(void *arg)
+{
+	struct SplicePipe *p = arg;
+	if (!p)
+		return;
+	close(p->fds[0]);
+	close(p->fds[1]);
+	free(p);
+}
+
+static void pipe_key_create(void)
+{
+	pthread_key_create(&pipe_key, pipe_free);
+}
+
+static struct SplicePipe *worker_pipe(void)
+{
+	pthread_once(&pipe_key_once, pipe_key_create);
+
+	struct SplicePipe *p = pthread_getspecific(pipe_key);
+	if (p)
+		return p;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+	if (pipe2(p->fds, O_CLOEXEC) != 0) {
+		free(p);
+		return NULL;
+	}
+
+	fcntl(p->fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	int size = fcntl(p->fds[1], F_GETPIPE_SZ);
+	p->size = size > 0 ? (size_t)size : 65536;
+
+	pthread_setspecific(pipe_key, p);
+	return p;
+}
+
+/* Copies what is left in the pipe to the file after a failed file splice. */
+static size_t pipe_drain(struct SplicePipe *p, int file_fd, off_t offset,
+			 size_t len, unsigned long long *syscalls)
+{
+	char buffer[8192];
+	size_t done = 0;
+
+	while (done < len) {
+		size_t want = len - done;
+		if (want > sizeof(buffer))
+			want = sizeof(buffer);
+		ssize_t n = read(p->fds[0], buffer, want);
+		(*syscalls)++;
+		if (n <= 0)
+			break;
+		for (ssize_t w = 0; w < n;) {
+			ssize_t m = pwrite(file_fd, buffer + w, (size_t)(n - w),
+					   offset + (off_t)(done + (size_t)w));
+			(*syscalls)++;
+			if (m <= 0)
+				return done + (size_t)w;
+			w += m;
+		}
+		done += (size_t)n;
+	}
+	return done;
+}
+
+ssize_t splice_socket_to_file(struct Connection *c, int file_fd, off_t offset,
+			      size_t len, unsigned long long *syscalls)
+{
+	struct SplicePipe *p = worker_pipe();
+	if (!p)
+		return -1;
+
+	size_t stored = 0;
+	while (stored < len) {
+		size_t want = len - stored;
+		if (want > p->size)
+			want = p->size;
+
+		ssize_t n = splice(c->fd, NULL, p->fds[1], NULL, want,
+				   SPLICE_F_MOVE | SPLICE_F_MORE);
+		(*syscalls)++;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && stored == 0 && (errno == EINVAL || errno == ENOSYS))
+			return -1;
+		if (n <= 0)
+			break;
+		reactor_touch(c);
+
+		size_t in_pipe = (size_t)n;
+		while (in_pipe > 0) {
+			loff_t off = offset + (off_t)stored;
+			ssize_t m = splice(p->fds[0], NULL, file_fd, &off,
+					   in_pipe, SPLICE_F_MOVE);
+			(*syscalls)++;
+			if (m < 0 && errno == EINTR)
+				continue;
+			if (m <= 0) {
+				size_t drained = pipe_drain(p, file_fd,
+							    offset + (off_t)stored,
+							    in_pipe, syscalls);
+				if (drained < in_pipe) {
+					pthread_setspecific(pipe_key, NULL);
+					pipe_free(p);
+				}
+				return (ssize_t)(stored + drained);
+			}
+			stored += (size_t)m;
+			in_pipe -= (size_t)m;
+		}
+	}
+	return (ssize_t)stored;
+}
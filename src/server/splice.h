@@ -0,0 +1,22 @@
+#ifndef OVERSEER_SPLICE_H
+#define OVERSEER_SPLICE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define SPLICE_PIPE_SIZE	(1024 * 1024)
+
+struct Connection;
+
+/*
+ * Moves len bytes from the connection socket into file_fd at offset through
+ * a per-thread pipe, so the payload never enters user space. Returns bytes
+ * stored, which may be short if the socket fails or the file refuses
+ * splice; in the latter case whatever was already in the pipe is copied out
+ * first, so nothing read from the socket is lost. Returns -1 without
+ * touching the socket when splice is unavailable.
+ */
+ssize_t splice_socket_to_file(struct Connection *c, int file_fd, off_t offset,
+			      size_t len, unsigned long long *syscalls);
+
+#endif
@@ -1,12 +1,21 @@
 #include "server.h"
+#include "pool.h"
+#include "commands.h"
+#include <ctype.h>
+
+static pthread_mutex_t cpu_sample_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static unsigned long long prev_user = 0, prev_nice = 0, prev_system = 0,
     prev_idle = 0;
 static unsigned long long prev_iowait = 0, prev_irq = 0, prev_softirq = 0,
     prev_steal = 0;
 
-void get_sys_stats(char *buffer, size_t size)
+void read_sys_stats(float *cpu, size_t *mem_used, size_t *mem_total)
 {
+	*cpu = 0.0;
+	*mem_used = 0;
+	*mem_total = 0;
+
 	FILE *fp = fopen("/proc/stat", "r");
 	if (!fp)
 		return;
@@ -21,6 +30,8 @@ void get_sys_stats(char *buffer, size_t size)
 	}
 	fclose(fp);
 
+	pthread_mutex_lock(&cpu_sample_lock);
+
 	unsigned long long prev_idle_total = prev_idle + prev_iowait;
 	unsigned long long idle_total = idle + iowait;
 
@@ -48,13 +59,14 @@ void get_sys_stats(char *buffer, size_t size)
 	prev_irq = irq;
 	prev_softirq = softirq;
 	prev_steal = steal;
+	pthread_mutex_unlock(&cpu_sample_lock);
 
-	size_t mem_total = 0, mem_available = 0;
+	size_t total_kb = 0, mem_available = 0;
 	fp = fopen("/proc/meminfo", "r");
 	if (fp) {
 		char line[256];
 		while (fgets(line, sizeof(line), fp)) {
-			if (sscanf(line, "MemTotal: %zu kB", &mem_total) == 1)
+			if (sscanf(line, "MemTotal: %zu kB", &total_kb) == 1)
 				continue;
 			if (sscanf(line, "MemAvailable: %zu kB", &mem_available)
 			    == 1)
@@ -63,9 +75,83 @@ void get_sys_stats(char *buffer, size_t size)
 		fclose(fp);
 	}
 
-	size_t mem_used = (mem_total - mem_available) / 1024;
-	size_t mem_total_mb = mem_total / 1024;
+	*cpu = cpu_usage;
+	*mem_used = (total_kb - mem_available) / 1024;
+	*mem_total = total_kb / 1024;
+}
+
+void get_sys_stats(char *buffer, size_t size)
+{
+	float cpu;
+	size_t mem_used, mem_total;
+
+	read_sys_stats(&cpu, &mem_used, &mem_total);
+	snprintf(buffer, size, "STATS %.1f %zu %zu", cpu, mem_used, mem_total);
+}
+
+void get_server_metrics(char *buffer, size_t size)
+{
+	int len = snprintf(buffer, size,
+			   "METRICS open=%d max=%d accepted=%llu rejected=%llu "
+			   "short_workers=%d long_workers=%d short_queue=%zu "
+			   "long_queue=%zu steals=%llu backend=%s "
+			   "upload_bytes=%llu upload_syscalls=%llu "
+			   "download_bytes=%llu write_windows=%llu "
+			   "write_wait_us=%llu fsyncs=%llu lz_raw_bytes=%llu "
+			   "lz_wire_bytes=%llu lz_cpu_us=%llu",
+			   reactor_open_connections(), reactor_max_connections(),
+			   reactor_accepted_total(), admission_rejected(ADMIT_CONN),
+			   pool_worker_count(WORK_SHORT), pool_worker_count(WORK_LONG),
+			   pool_queue_depth(WORK_SHORT), pool_queue_depth(WORK_LONG),
+			   pool_steal_count(),
+			   reactor_backend() == IO_BACKEND_URING ? "uring" : "epoll",
+			   upload_bytes_total(), upload_syscalls_total(),
+			   download_bytes_total(), writer_windows_total(),
+			   writer_wait_us_total(), writer_syncs_total(),
+			   lz_raw_bytes_total(), lz_wire_bytes_total(),
+			   lz_cpu_us_total());
+
+	for (int i = ADMIT_EXEC; i < ADMIT_CLASS_COUNT; i++) {
+		if (len < 0 || (size_t)len >= size)
+			return;
+		len += snprintf(buffer + len, size - (size_t)len,
+				" %s_active=%d %s_limit=%d busy_%s=%llu",
+				admission_class_name(i), admission_active(i),
+				admission_class_name(i), admission_limit(i),
+				admission_class_name(i), admission_rejected(i));
+	}
+
+	for (int i = 0; i < DEADLINE_COUNT; i++) {
+		if (len < 0 || (size_t)len >= size)
+			return;
+		len += snprintf(buffer + len, size - (size_t)len,
+				" expired_%s=%llu", reactor_deadline_name(i),
+				reactor_expired_total(i));
+	}
+
+	for (int i = 0; i < reactor_shard_count(); i++) {
+		if (len < 0 || (size_t)len >= size)
+			return;
+		len += snprintf(buffer + len, size - (size_t)len,
+				" shard%d=%llu", i, reactor_shard_accepted(i));
+	}
 
-	snprintf(buffer, size, "STATS %.1f %zu %zu", cpu_usage, mem_used,
-		 mem_total_mb);
+	for (int i = 0; i < command_count(); i++) {
+		struct Command *cmd = command_at(i);
+		unsigned long long calls = atomic_load(&cmd->calls);
+		char name[16];
+		size_t n;
+
+		if (len < 0 || (size_t)len >= size)
+			return;
+		for (n = 0; cmd->name[n] && n < sizeof(name) - 1; n++)
+			name[n] = (char)tolower((unsigned char)cmd->name[n]);
+		name[n] = '\0';
+		len += snprintf(buffer + len, size - (size_t)len,
+				" cmd_%s=%llu/%llu/%llu/%llu/%llu", name, calls,
+				atomic_load(&cmd->failed),
+				atomic_load(&cmd->rejected),
+				calls ? atomic_load(&cmd->total_us) / calls : 0,
+				atomic_load(&cmd->max_us));
+	}
 }
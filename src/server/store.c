@@ -0,0 +1,313 @@
+#include "server.h"
+#include "store.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/xattr.h>
+
+#define HASH_BUF_SIZE	65536
+#define OBJECT_NAME_MAX	(16 + 1 + 2 * SHA256_SIZE + 1)
+#define OBJECT_PATH_MAX	(sizeof(STORE_DIR "/") + OBJECT_NAME_MAX)
+#define COUNT_BUCKETS	4096
+
+/* Objects stored per size, for PROBE; only touched under store_lock. */
+struct SizeCount {
+	uint64_t size;
+	unsigned int count;
+	struct SizeCount *next;
+};
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct SizeCount *counts[COUNT_BUCKETS];
+
+static struct SizeCount **count_slot(uint64_t size)
+{
+	struct SizeCount **slot = &counts[(size * 0x9E3779B97F4A7C15ULL) >> 52];
+
+	while (*slot && (*slot)->size != size)
+		slot = &(*slot)->next;
+	return slot;
+}
+
+static void count_add(uint64_t size)
+{
+	struct SizeCount **slot = count_slot(size);
+
+	if (!*slot) {
+		*slot = calloc(1, sizeof(**slot));
+		if (!*slot)
+			return;
+		(*slot)->size = size;
+	}
+	(*slot)->count++;
+}
+
+static void count_drop(uint64_t size)
+{
+	struct SizeCount **slot = count_slot(size);
+	struct SizeCount *entry = *slot;
+
+	if (entry && --entry->count == 0) {
+		*slot = entry->next;
+		free(entry);
+	}
+}
+
+static void counts_clear(void)
+{
+	for (int i = 0; i < COUNT_BUCKETS; i++) {
+		while (counts[i]) {
+			struct SizeCount *next = counts[i]->next;
+			free(counts[i]);
+			counts[i] = next;
+		}
+	}
+}
+
+static void object_name(char *out, const struct StoreKey *key)
+{
+	int len = sprintf(out, "%016llx-", (unsigned long long)key->size);
+
+	for (int i = 0; i < SHA256_SIZE; i++)
+		len += sprintf(out + len, "%02x", key->sha256[i]);
+}
+
+/* STORE_DIR/<name>; the name starts at out + sizeof(STORE_DIR). */
+static void object_path(char *out, const struct StoreKey *key)
+{
+	strcpy(out, STORE_DIR "/");
+	object_name(out + sizeof(STORE_DIR), key);
+}
+
+static bool object_name_valid(const char *name)
+{
+	return strlen(name) == OBJECT_NAME_MAX - 1 && name[0] != '.'
+	    && !strchr(name, '/');
+}
+
+/*
+ * Deletes the objects no name refers to and counts the rest by size.
+ * Returns the number kept.
+ */
+static int reclaim_locked(void)
+{
+	DIR *dir = opendir(STORE_DIR);
+	struct dirent *e;
+	int kept = 0;
+
+	counts_clear();
+	if (!dir)
+		return 0;
+	while ((e = readdir(dir)) != NULL) {
+		char path[512];
+		struct stat st;
+
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), STORE_DIR "/%s", e->d_name);
+		if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (st.st_nlink > 1) {
+			kept++;
+			if (object_name_valid(e->d_name))
+				count_add((uint64_t)st.st_size);
+		} else if (unlink(path) == 0) {
+			log_msg(KBLU, "Object Reclaimed: %s (%.1f MB)",
+				e->d_name,
+				(double)st.st_size / (1024.0 * 1024.0));
+		}
+	}
+	closedir(dir);
+	return kept;
+}
+
+/* Deletes the object called name if old, a name just replaced, was its last. */
+static void object_drop_locked(const char *name, const struct stat *old)
+{
+	char path[OBJECT_PATH_MAX];
+	struct stat st;
+
+	if (!object_name_valid(name))
+		return;
+	snprintf(path, sizeof(path), STORE_DIR "/%s", name);
+	if (lstat(path, &st) != 0 || st.st_ino != old->st_ino
+	    || st.st_dev != old->st_dev || st.st_nlink != 1)
+		return;
+	if (unlink(path) == 0) {
+		count_drop((uint64_t)st.st_size);
+		log_msg(KBLU, "Object Reclaimed: %s (%.1f MB)", name,
+			(double)st.st_size / (1024.0 * 1024.0));
+	}
+}
+
+/*
+ * Renames src over storage/<name>. Replacing the last name of an object
+ * leaves it unreferenced, so the object is deleted: the one named in the
+ * name's STORE_XATTR, or any found by a sweep when it has none.
+ */
+static int name_replace_locked(const char *src, const char *name)
+{
+	char path[STORAGE_PATH_MAX];
+	char object[OBJECT_NAME_MAX];
+	struct stat old, st;
+	ssize_t len = -1;
+
+	snprintf(path, sizeof(path), "storage/%s", name);
+	bool had = lstat(path, &old) == 0;
+	if (had && stat(src, &st) == 0 && st.st_ino == old.st_ino
+	    && st.st_dev == old.st_dev)
+		return unlink(src);
+	bool last = had && S_ISREG(old.st_mode) && old.st_nlink == 2;
+	if (last)
+		len = lgetxattr(path, STORE_XATTR, object, sizeof(object) - 1);
+	if (rename(src, path) != 0)
+		return -1;
+	if (len > 0) {
+		object[len] = '\0';
+		object_drop_locked(object, &old);
+	} else if (last) {
+		reclaim_locked();
+	}
+	return 0;
+}
+
+/*
+ * Links the object at object to storage/<name>, through a hidden name in
+ * STORE_DIR that store_lock keeps to one user at a time.
+ */
+static int share_locked(const char *object, const char *name)
+{
+	const char *temp = STORE_DIR "/.link";
+
+	unlink(temp);
+	if (link(object, temp) != 0)
+		return -1;
+	if (name_replace_locked(temp, name) != 0) {
+		unlink(temp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Makes a new name durable when --fsync asks for it. */
+static void name_sync(const char *name)
+{
+	char path[STORAGE_PATH_MAX];
+
+	snprintf(path, sizeof(path), "storage/%s", name);
+	writer_sync_dir(path);
+}
+
+/*
+ * Makes the finished file at path the object of key, recording the
+ * object's name on it for name_replace_locked().
+ */
+static void object_store_locked(const char *path, const char *object,
+				const struct StoreKey *key)
+{
+	const char *base = object + sizeof(STORE_DIR);
+
+	lsetxattr(path, STORE_XATTR, base, strlen(base), 0);
+	if (link(path, object) == 0)
+		count_add(key->size);
+	else if (errno != EEXIST)
+		log_msg(KYEL, "Cannot store object %s", base);
+}
+
+static bool object_exists(const char *object, const struct StoreKey *key)
+{
+	struct stat st;
+
+	return stat(object, &st) == 0 && S_ISREG(st.st_mode)
+	    && (uint64_t)st.st_size == key->size;
+}
+
+int store_init(void)
+{
+	mkdir("storage", 0700);
+	mkdir(STORE_DIR, 0700);
+
+	pthread_mutex_lock(&store_lock);
+	int kept = reclaim_locked();
+	pthread_mutex_unlock(&store_lock);
+	return kept;
+}
+
+int store_hash(int fd, size_t size, unsigned char sha[SHA256_SIZE])
+{
+	char *buffer = malloc(HASH_BUF_SIZE);
+	struct Sha256 state;
+	size_t done = 0;
+
+	if (!buffer)
+		return -1;
+	sha256_init(&state);
+	while (done < size) {
+		size_t want = size - done;
+		if (want > HASH_BUF_SIZE)
+			want = HASH_BUF_SIZE;
+		ssize_t n = pread(fd, buffer, want, (off_t)done);
+		if (n <= 0)
+			break;
+		sha256_update(&state, buffer, (size_t)n);
+		done += (size_t)n;
+	}
+	free(buffer);
+	sha256_digest(&state, sha);
+	return done == size ? 0 : -1;
+}
+
+int store_commit(const char *path, const char *name, const struct StoreKey *key,
+		 bool *shared)
+{
+	char object[OBJECT_PATH_MAX];
+	int res = 0;
+
+	*shared = false;
+	if (!key) {
+		pthread_mutex_lock(&store_lock);
+		res = name_replace_locked(path, name);
+		pthread_mutex_unlock(&store_lock);
+		if (res == 0)
+			name_sync(name);
+		return res;
+	}
+	object_path(object, key);
+
+	pthread_mutex_lock(&store_lock);
+	if (object_exists(object, key) && share_locked(object, name) == 0) {
+		unlink(path);
+		*shared = true;
+	} else {
+		object_store_locked(path, object, key);
+		res = name_replace_locked(path, name);
+	}
+	pthread_mutex_unlock(&store_lock);
+	if (res == 0)
+		name_sync(name);
+	return res;
+}
+
+int store_link(const char *name, const struct StoreKey *key)
+{
+	char object[OBJECT_PATH_MAX];
+	int res = -1;
+
+	object_path(object, key);
+
+	pthread_mutex_lock(&store_lock);
+	if (object_exists(object, key))
+		res = share_locked(object, name);
+	pthread_mutex_unlock(&store_lock);
+	if (res == 0)
+		name_sync(name);
+	return res;
+}
+
+unsigned int store_count(uint64_t size)
+{
+	pthread_mutex_lock(&store_lock);
+	struct SizeCount *entry = *count_slot(size);
+	unsigned int count = entry ? entry->count : 0;
+	pthread_mutex_unlock(&store_lock);
+	return count;
+}
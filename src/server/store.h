@@ -0,0 +1,53 @@
+#ifndef OVERSEER_STORE_H
+#define OVERSEER_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "../common/sha256.h"
+
+#define STORE_DIR	"storage/.objects"
+
+/*
+ * Content-addressed storage. Every finished file is also an object under
+ * STORE_DIR named by its size and SHA-256, and storage/<name> is a hard
+ * link to it, so a name is a reference to its content and the inode link
+ * count is the reference count. A finished file whose content is already
+ * stored is dropped and its name linked to the existing object; when the
+ * last name of an object is replaced, the object is deleted. Each object
+ * carries its own name in the STORE_XATTR attribute, so the one a name
+ * pointed at is found without a search. Stored files are only ever
+ * replaced, never written in place, so names sharing an object cannot
+ * change each other.
+ */
+struct StoreKey {
+	uint64_t size;
+	unsigned char sha256[SHA256_SIZE];
+};
+
+#define STORE_XATTR	"user.overseer.object"
+
+/*
+ * Creates STORE_DIR, reclaims unreferenced objects and counts the rest
+ * by size for store_count(). Returns the number of objects kept.
+ */
+int store_init(void);
+
+/* SHA-256 of the first size bytes of fd, for a file not hashed as it arrived. */
+int store_hash(int fd, size_t size, unsigned char sha[SHA256_SIZE]);
+
+/*
+ * Puts the finished file at path in place as storage/<name>, sharing the
+ * object of the same key if there is one. Sets *shared when it did. A
+ * NULL key places the file without making it an object.
+ */
+int store_commit(const char *path, const char *name, const struct StoreKey *key,
+		 bool *shared);
+
+/* Points storage/<name> at the object of key; -1 when there is none. */
+int store_link(const char *name, const struct StoreKey *key);
+
+/* Number of stored objects of size bytes. */
+unsigned int store_count(uint64_t size);
+
+#endif
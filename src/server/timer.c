@@ -0,0 +1,121 @@
+#include "timer.h"
+#include <stddef.h>
+
+#define TIMER_SLOT_MASK		(TIMER_SLOTS - 1)
+#define TIMER_MAX_DELTA		((1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+static void node_link(struct TimerNode *head, struct TimerNode *node)
+{
+	node->prev = head->prev;
+	node->next = head;
+	head->prev->next = node;
+	head->prev = node;
+}
+
+static void node_unlink(struct TimerNode *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->prev = NULL;
+	node->next = NULL;
+}
+
+static void wheel_insert(struct TimerWheel *w, struct TimerNode *node)
+{
+	if (node->expires < w->now)
+		node->expires = w->now;
+
+	uint64_t delta = node->expires - w->now;
+	int level = 0;
+	while (level < TIMER_LEVELS - 1
+	       && delta >= 1ULL << (TIMER_SLOT_BITS * (level + 1)))
+		level++;
+
+	unsigned int idx = (unsigned int)(node->expires
+					  >> (TIMER_SLOT_BITS * level))
+	    & TIMER_SLOT_MASK;
+	node_link(&w->slots[level][idx], node);
+}
+
+static void wheel_cascade(struct TimerWheel *w, int level)
+{
+	unsigned int idx = (unsigned int)(w->now >> (TIMER_SLOT_BITS * level))
+	    & TIMER_SLOT_MASK;
+	struct TimerNode *head = &w->slots[level][idx];
+
+	while (head->next != head) {
+		struct TimerNode *node = head->next;
+		node_unlink(node);
+		wheel_insert(w, node);
+	}
+}
+
+void timer_wheel_init(struct TimerWheel *w, uint64_t now_ms)
+{
+	w->now = now_ms / TIMER_TICK_MS;
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		for (int i = 0; i < TIMER_SLOTS; i++) {
+			w->slots[level][i].prev = &w->slots[level][i];
+			w->slots[level][i].next = &w->slots[level][i];
+		}
+	}
+}
+
+void timer_node_init(struct TimerNode *node)
+{
+	node->prev = NULL;
+	node->next = NULL;
+	node->expires = 0;
+}
+
+bool timer_pending(const struct TimerNode *node)
+{
+	return node->next != NULL;
+}
+
+void timer_arm(struct TimerWheel *w, struct TimerNode *node,
+	       uint64_t expires_ms)
+{
+	if (timer_pending(node))
+		node_unlink(node);
+
+	uint64_t expires = (expires_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	if (expires <= w->now)
+		expires = w->now + 1;
+	if (expires - w->now > TIMER_MAX_DELTA)
+		expires = w->now + TIMER_MAX_DELTA;
+
+	node->expires = expires;
+	wheel_insert(w, node);
+}
+
+void timer_cancel(struct TimerNode *node)
+{
+	if (timer_pending(node))
+		node_unlink(node);
+}
+
+void timer_advance(struct TimerWheel *w, uint64_t now_ms, timer_fn_t fn,
+		   void *arg)
+{
+	uint64_t target = now_ms / TIMER_TICK_MS;
+
+	while (w->now < target) {
+		w->now++;
+
+		for (int level = 1; level < TIMER_LEVELS; level++) {
+			uint64_t low = (1ULL << (TIMER_SLOT_BITS * level)) - 1;
+			if ((w->now & low) != 0)
+				break;
+			wheel_cascade(w, level);
+		}
+
+		struct TimerNode *head =
+		    &w->slots[0][w->now & TIMER_SLOT_MASK];
+		while (head->next != head) {
+			struct TimerNode *node = head->next;
+			node_unlink(node);
+			fn(node, arg);
+		}
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef OVERSEER_TIMER_H
+#define OVERSEER_TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS		100
+#define TIMER_LEVELS		4
+#define TIMER_SLOT_BITS		6
+#define TIMER_SLOTS		(1 << TIMER_SLOT_BITS)
+
+/*
+ * Intrusive timer node. Embed it in the object being timed; arming and
+ * cancelling only relink it, so timers cost no allocation or syscall.
+ */
+struct TimerNode {
+	struct TimerNode *prev;
+	struct TimerNode *next;
+	uint64_t expires;
+};
+
+/*
+ * Hierarchical timing wheel with TIMER_LEVELS levels of TIMER_SLOTS slots.
+ * Level 0 has TIMER_TICK_MS resolution; each level above is TIMER_SLOTS
+ * times coarser, and its slots cascade down as the wheel turns. A wheel is
+ * owned by one thread and is not locked.
+ */
+struct TimerWheel {
+	uint64_t now;
+	struct TimerNode slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+typedef void (*timer_fn_t)(struct TimerNode *node, void *arg);
+
+void timer_wheel_init(struct TimerWheel *w, uint64_t now_ms);
+void timer_node_init(struct TimerNode *node);
+bool timer_pending(const struct TimerNode *node);
+
+/* Arms or re-arms node for an absolute time in milliseconds. O(1). */
+void timer_arm(struct TimerWheel *w, struct TimerNode *node,
+	       uint64_t expires_ms);
+void timer_cancel(struct TimerNode *node);
+
+/*
+ * Turns the wheel up to now_ms and calls fn for each expired node, already
+ * unlinked. fn may re-arm the node.
+ */
+void timer_advance(struct TimerWheel *w, uint64_t now_ms, timer_fn_t fn,
+		   void *arg);
+
+#endif
@@ -0,0 +1,340 @@
+#include "server.h"
+#include "uring.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define URING_OP_READ	1ULL
+#define URING_OP_WRITE	2ULL
+
+struct UringWorker {
+	struct Uring ring;
+	char *buffers[2];
+};
+
+static pthread_key_t worker_key;
+static pthread_once_t worker_key_once = PTHREAD_ONCE_INIT;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, NULL, 0);
+}
+
+bool uring_supported(void)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = sys_io_uring_setup(4, &p);
+	if (fd < 0)
+		return false;
+	close(fd);
+	return true;
+}
+
+int uring_init(struct Uring *u, unsigned int entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(u, 0, sizeof(*u));
+
+	u->fd = sys_io_uring_setup(entries, &p);
+	if (u->fd < 0)
+		return -1;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_size =
+	    p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		close(u->fd);
+		return -1;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			munmap(u->sq_ring, u->sq_ring_size);
+			close(u->fd);
+			return -1;
+		}
+	}
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		if (u->cq_ring != u->sq_ring)
+			munmap(u->cq_ring, u->cq_ring_size);
+		munmap(u->sq_ring, u->sq_ring_size);
+		close(u->fd);
+		return -1;
+	}
+
+	char *sq = u->sq_ring;
+	char *cq = u->cq_ring;
+	u->sq_entries = p.sq_entries;
+	u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	u->local_tail = *u->sq_tail;
+	u->submitted_tail = u->local_tail;
+	return 0;
+}
+
+void uring_exit(struct Uring *u)
+{
+	if (u->fd < 0)
+		return;
+	munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+	u->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct Uring *u)
+{
+	unsigned int head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (u->local_tail - head >= u->sq_entries)
+		return NULL;
+
+	unsigned int idx = u->local_tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	u->local_tail++;
+	return sqe;
+}
+
+int uring_submit(struct Uring *u, unsigned int wait_nr)
+{
+	unsigned int pending = u->local_tail - u->submitted_tail;
+	__atomic_store_n(u->sq_tail, u->local_tail, __ATOMIC_RELEASE);
+
+	int ret = sys_io_uring_enter(u->fd, pending, wait_nr,
+				     wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	if (ret >= 0)
+		u->submitted_tail += (unsigned int)ret;
+	return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct Uring *u)
+{
+	unsigned int head = *u->cq_head;
+	unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return NULL;
+	return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_cqe_seen(struct Uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_buffers(struct Uring *u, const struct iovec *iov,
+			   unsigned int count)
+{
+	return (int)syscall(__NR_io_uring_register, u->fd,
+			    IORING_REGISTER_BUFFERS, iov, count);
+}
+
+static void worker_ring_free(void *arg)
+{
+	struct UringWorker *w = arg;
+	uring_exit(&w->ring);
+	free(w->buffers[0]);
+	free(w->buffers[1]);
+	free(w);
+}
+
+static void worker_key_create(void)
+{
+	pthread_key_create(&worker_key, worker_ring_free);
+}
+
+static struct UringWorker *worker_ring(void)
+{
+	pthread_once(&worker_key_once, worker_key_create);
+
+	struct UringWorker *w = pthread_getspecific(worker_key);
+	if (w)
+		return w;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	w->ring.fd = -1;
+
+	for (int i = 0; i < 2; i++) {
+		w->buffers[i] = aligned_alloc(4096, URING_CHUNK_SIZE);
+		if (!w->buffers[i]) {
+			worker_ring_free(w);
+			return NULL;
+		}
+	}
+
+	struct iovec iov[2] = {
+		{.iov_base = w->buffers[0],.iov_len = URING_CHUNK_SIZE},
+		{.iov_base = w->buffers[1],.iov_len = URING_CHUNK_SIZE}
+	};
+	if (uring_init(&w->ring, 8) != 0
+	    || uring_register_buffers(&w->ring, iov, 2) != 0) {
+		worker_ring_free(w);
+		return NULL;
+	}
+
+	pthread_setspecific(worker_key, w);
+	return w;
+}
+
+/* Queues the part of buffer b that is not on disk yet. */
+static void queue_write(struct UringWorker *w, int file_fd, int b,
+			const size_t *fill, const size_t *done, const off_t *at)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = file_fd;
+	sqe->addr = (unsigned long)(w->buffers[b] + done[b]);
+	sqe->len = (unsigned int)(fill[b] - done[b]);
+	sqe->off = (unsigned long long)(at[b] + (off_t)done[b]);
+	sqe->buf_index = (unsigned short)b;
+	sqe->user_data = (URING_OP_WRITE << 8) | (unsigned int)b;
+}
+
+ssize_t uring_socket_to_file(struct Connection *c, int file_fd, off_t offset,
+			     size_t len, unsigned long long *syscalls)
+{
+	struct UringWorker *w = worker_ring();
+	if (!w)
+		return -1;
+
+	struct Uring *u = &w->ring;
+	bool busy[2] = { false, false };
+	size_t want[2] = { 0, 0 };
+	size_t fill[2] = { 0, 0 };
+	size_t done[2] = { 0, 0 };
+	off_t at[2] = { 0, 0 };
+	bool reading = false;
+	bool failed = false;
+	bool draining = false;
+	size_t requested = 0;
+	size_t stored = 0;
+	int inflight = 0;
+
+	for (;;) {
+		for (int b = 0; b < 2 && !reading && !failed && requested < len;
+		     b++) {
+			if (busy[b])
+				continue;
+			size_t chunk = len - requested;
+			if (chunk > URING_CHUNK_SIZE)
+				chunk = URING_CHUNK_SIZE;
+
+			struct io_uring_sqe *sqe = uring_get_sqe(u);
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = c->fd;
+			sqe->addr = (unsigned long)w->buffers[b];
+			sqe->len = (unsigned int)chunk;
+			sqe->user_data = (URING_OP_READ << 8) | (unsigned int)b;
+			busy[b] = true;
+			want[b] = chunk;
+			reading = true;
+			requested += chunk;
+			inflight++;
+		}
+
+		if (inflight == 0)
+			break;
+
+		/*
+		 * Queued RECV and WRITE_FIXED own the buffers until they
+		 * complete: on a failed submit stop queueing and wait for
+		 * them, and if the ring cannot even do that, give it up but
+		 * leave the buffers to the kernel rather than free them.
+		 */
+		if (uring_submit(u, 1) < 0 && errno != EINTR
+		    && errno != EAGAIN && errno != EBUSY) {
+			if (!draining) {
+				draining = true;
+				failed = true;
+				continue;
+			}
+			log_msg(KRED, "Error: io_uring receive ring failed (%s)",
+				strerror(errno));
+			pthread_setspecific(worker_key, NULL);
+			uring_exit(&w->ring);
+			free(w);
+			break;
+		}
+		draining = false;
+		if (syscalls)
+			(*syscalls)++;
+
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_peek_cqe(u)) != NULL) {
+			unsigned long long op = cqe->user_data >> 8;
+			int b = (int)(cqe->user_data & 0xff);
+			int res = cqe->res;
+			uring_cqe_seen(u);
+			inflight--;
+
+			if (op == URING_OP_READ) {
+				reading = false;
+				if (res <= 0) {
+					busy[b] = false;
+					failed = true;
+					continue;
+				}
+				requested -= want[b] - (size_t)res;
+				reactor_touch(c);
+				fill[b] = (size_t)res;
+				done[b] = 0;
+				at[b] = offset;
+				offset += res;
+				queue_write(w, file_fd, b, fill, done, at);
+				inflight++;
+				continue;
+			}
+
+			if (res <= 0) {
+				busy[b] = false;
+				failed = true;
+				continue;
+			}
+			stored += (size_t)res;
+			done[b] += (size_t)res;
+			if (done[b] < fill[b]) {
+				queue_write(w, file_fd, b, fill, done, at);
+				inflight++;
+			} else {
+				busy[b] = false;
+			}
+		}
+	}
+	return (ssize_t)stored;
+}
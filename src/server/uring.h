@@ -0,0 +1,58 @@
+#ifndef OVERSEER_URING_H
+#define OVERSEER_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_QUEUE_DEPTH	256
+#define URING_CHUNK_SIZE	(256 * 1024)
+
+struct Connection;
+
+/* Minimal raw-syscall io_uring instance; no liburing dependency. */
+struct Uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	unsigned int local_tail;
+	unsigned int submitted_tail;
+};
+
+bool uring_supported(void);
+int uring_init(struct Uring *u, unsigned int entries);
+void uring_exit(struct Uring *u);
+
+/* Returns NULL when the submission queue is full; call uring_submit(). */
+struct io_uring_sqe *uring_get_sqe(struct Uring *u);
+int uring_submit(struct Uring *u, unsigned int wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct Uring *u);
+void uring_cqe_seen(struct Uring *u);
+int uring_register_buffers(struct Uring *u, const struct iovec *iov,
+			   unsigned int count);
+
+/*
+ * Streams len bytes from the connection socket into file_fd at offset
+ * through two registered buffers, overlapping each socket read with the
+ * previous file write. Uses a per-thread ring. Returns bytes stored, or -1
+ * without touching the socket when io_uring is unavailable.
+ */
+ssize_t uring_socket_to_file(struct Connection *c, int file_fd, off_t offset,
+			     size_t len, unsigned long long *syscalls);
+
+#endif
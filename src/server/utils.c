@@ -7,9 +7,11 @@ void log_msg(const char *color, const char *format, ...)
 	char buffer[80];
 
 	time(&rawtime);
-	timeinfo = localtime(&rawtime);
+	struct tm tm_buf;
+	timeinfo = localtime_r(&rawtime, &tm_buf);
 	strftime(buffer, sizeof(buffer), "%H:%M:%S", timeinfo);
 
+	flockfile(stdout);
 	printf("%s[%s] ", KNRM, buffer);
 	printf("%s", color);
 
@@ -19,4 +21,5 @@ void log_msg(const char *color, const char *format, ...)
 	va_end(args);
 
 	printf("%s\n", KNRM);
+	funlockfile(stdout);
 }
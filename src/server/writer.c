@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "writer.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdatomic.h>
+
+/*
+ * The file of one upload as the I/O thread holds it: a descriptor of its
+ * own, so the upload may close its copy before the last window is written.
+ * Freed by whichever of the upload and its last job lets go of it last.
+ */
+struct WriteStream {
+	int fd;
+	int refs;
+	unsigned int pending;
+	unsigned int windows;
+	unsigned int syncs;
+	double wait_total;
+	double wait_max;
+	bool failed;
+};
+
+struct WriteJob {
+	struct WriteStream *stream;
+	off_t offset;
+	off_t len;
+	bool sync;
+	struct timespec queued;
+	struct WriteJob *next;
+};
+
+static enum FsyncPolicy fsync_policy = FSYNC_NONE;
+static size_t fsync_every;
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writer_done = PTHREAD_COND_INITIALIZER;
+static struct WriteJob *jobs_head, *jobs_tail;
+static pthread_t writer_thread;
+static bool writer_started, writer_stopping;
+
+static atomic_ullong windows_total = 0;
+static atomic_ullong wait_us_total = 0;
+static atomic_ullong syncs_total = 0;
+
+int writer_set_fsync(const char *arg)
+{
+	char *end = NULL;
+	long mb;
+
+	if (strcmp(arg, "none") == 0) {
+		fsync_policy = FSYNC_NONE;
+		return 0;
+	}
+	if (strcmp(arg, "end") == 0) {
+		fsync_policy = FSYNC_END;
+		return 0;
+	}
+	mb = strtol(arg, &end, 10);
+	if (!end || *end != '\0' || mb < 1 || mb > 1024 * 1024)
+		return -1;
+	fsync_policy = FSYNC_EVERY;
+	fsync_every = (size_t)mb * 1024 * 1024;
+	return 0;
+}
+
+void writer_describe(char *out, size_t size)
+{
+	char sync[32];
+
+	if (fsync_policy == FSYNC_EVERY)
+		snprintf(sync, sizeof(sync), "every %zu MB",
+			 fsync_every / (1024 * 1024));
+	else
+		snprintf(sync, sizeof(sync), "%s",
+			 fsync_policy == FSYNC_END ? "at end" : "none");
+	if (writer_started)
+		snprintf(out, size, "fsync %s, write-behind in %d MB windows",
+			 sync, WRITER_WINDOW / (1024 * 1024));
+	else
+		snprintf(out, size, "fsync %s, no write-behind", sync);
+}
+
+bool writer_durable(void)
+{
+	return fsync_policy != FSYNC_NONE;
+}
+
+static double seconds_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - start->tv_sec)
+	    + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void stream_put_locked(struct WriteStream *s)
+{
+	if (--s->refs > 0)
+		return;
+	close(s->fd);
+	free(s);
+}
+
+/*
+ * Writes a window back and waits for it, syncs if asked, then drops its
+ * pages: clean pages are all POSIX_FADV_DONTNEED can evict.
+ */
+static void job_run(struct WriteJob *j)
+{
+	struct WriteStream *s = j->stream;
+	bool ok = true;
+
+	if (j->len > 0
+	    && sync_file_range(s->fd, j->offset, j->len,
+			       SYNC_FILE_RANGE_WAIT_BEFORE
+			       | SYNC_FILE_RANGE_WRITE
+			       | SYNC_FILE_RANGE_WAIT_AFTER) != 0
+	    && errno == EIO)
+		ok = false;
+	if (j->sync && fdatasync(s->fd) != 0)
+		ok = false;
+	if (j->len > 0)
+		posix_fadvise(s->fd, j->offset, j->len, POSIX_FADV_DONTNEED);
+
+	double wait = seconds_since(&j->queued);
+	atomic_fetch_add(&windows_total, j->len > 0);
+	atomic_fetch_add(&wait_us_total, (unsigned long long)(wait * 1e6));
+	if (j->sync)
+		atomic_fetch_add(&syncs_total, 1);
+
+	pthread_mutex_lock(&writer_lock);
+	s->windows += j->len > 0;
+	s->syncs += j->sync;
+	s->wait_total += wait;
+	if (wait > s->wait_max)
+		s->wait_max = wait;
+	if (!ok)
+		s->failed = true;
+	s->pending--;
+	stream_put_locked(s);
+	pthread_cond_broadcast(&writer_done);
+	pthread_mutex_unlock(&writer_lock);
+}
+
+static void *writer_run(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&writer_lock);
+	for (;;) {
+		while (!jobs_head && !writer_stopping)
+			pthread_cond_wait(&writer_work, &writer_lock);
+		struct WriteJob *j = jobs_head;
+		if (!j)
+			break;
+		jobs_head = j->next;
+		if (!jobs_head)
+			jobs_tail = NULL;
+		pthread_mutex_unlock(&writer_lock);
+
+		job_run(j);
+		free(j);
+		pthread_mutex_lock(&writer_lock);
+	}
+	pthread_mutex_unlock(&writer_lock);
+	return NULL;
+}
+
+int writer_init(void)
+{
+	writer_started = pthread_create(&writer_thread, NULL, writer_run,
+					NULL) == 0;
+	return writer_started ? 0 : -1;
+}
+
+void writer_shutdown(void)
+{
+	if (!writer_started)
+		return;
+	pthread_mutex_lock(&writer_lock);
+	writer_stopping = true;
+	pthread_cond_broadcast(&writer_work);
+	pthread_mutex_unlock(&writer_lock);
+	pthread_join(writer_thread, NULL);
+	writer_started = false;
+}
+
+void writer_begin(struct Writer *w, int fd, off_t offset, size_t prealloc)
+{
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+	w->queued = offset;
+	if (prealloc >= WRITER_PREALLOC_MIN)
+		w->preallocated = fallocate(fd, FALLOC_FL_KEEP_SIZE, offset,
+					    (off_t)prealloc) == 0;
+}
+
+/*
+ * Queues [w->queued, end) on the I/O thread, once the upload has fewer than
+ * WRITER_MAX_PENDING windows waiting. The stream is only set up with the
+ * first window, so small files cost nothing here.
+ */
+static bool writer_queue(struct Writer *w, off_t end, bool sync)
+{
+	struct WriteJob *j = malloc(sizeof(*j));
+
+	if (!j)
+		return false;
+	if (!w->stream) {
+		w->stream = calloc(1, sizeof(*w->stream));
+		if (w->stream)
+			w->stream->fd = dup(w->fd);
+		if (!w->stream || w->stream->fd < 0) {
+			free(w->stream);
+			w->stream = NULL;
+			free(j);
+			return false;
+		}
+		w->stream->refs = 1;
+	}
+	j->stream = w->stream;
+	j->offset = w->queued;
+	j->len = end - w->queued;
+	j->sync = sync;
+	j->next = NULL;
+
+	pthread_mutex_lock(&writer_lock);
+	while (w->stream->pending >= WRITER_MAX_PENDING)
+		pthread_cond_wait(&writer_done, &writer_lock);
+	clock_gettime(CLOCK_MONOTONIC, &j->queued);
+	w->stream->pending++;
+	w->stream->refs++;
+	if (jobs_tail)
+		jobs_tail->next = j;
+	else
+		jobs_head = j;
+	jobs_tail = j;
+	pthread_cond_signal(&writer_work);
+	pthread_mutex_unlock(&writer_lock);
+
+	w->queued = end;
+	return true;
+}
+
+/*
+ * A window ends WRITER_WINDOW bytes on, or earlier at the next --fsync
+ * boundary, which then gets its sync whatever N is next to the window.
+ */
+void writer_progress(struct Writer *w, off_t done)
+{
+	if (!writer_started)
+		return;
+	for (;;) {
+		size_t len = WRITER_WINDOW;
+		bool sync = false;
+
+		if (fsync_policy == FSYNC_EVERY
+		    && fsync_every - w->unsynced <= len) {
+			len = fsync_every - w->unsynced;
+			sync = true;
+		}
+		if (done - w->queued < (off_t)len
+		    || !writer_queue(w, w->queued + (off_t)len, sync))
+			return;
+		w->unsynced = sync ? 0 : w->unsynced + len;
+	}
+}
+
+void writer_hole(struct Writer *w, off_t size)
+{
+	if (!w->preallocated)
+		return;
+	w->preallocated = false;
+	if (ftruncate(w->fd, size) != 0)
+		log_msg(KYEL, "Cannot release preallocated space");
+}
+
+int writer_end(struct Writer *w, off_t done, bool final)
+{
+	bool sync = final && fsync_policy != FSYNC_NONE;
+	int res = 0;
+
+	if (w->fd < 0)
+		return 0;
+	if (writer_started && w->stream && (done > w->queued || sync)
+	    && !writer_queue(w, done, sync))
+		res = -1;
+	if (!w->stream) {
+		struct timespec start;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (sync && fdatasync(w->fd) != 0)
+			res = -1;
+		if (sync) {
+			w->syncs++;
+			w->wait_total = w->wait_max = seconds_since(&start);
+			atomic_fetch_add(&syncs_total, 1);
+		}
+		return res;
+	}
+
+	struct WriteStream *s = w->stream;
+	pthread_mutex_lock(&writer_lock);
+	while (sync && s->pending > 0)
+		pthread_cond_wait(&writer_done, &writer_lock);
+	if (sync && s->failed)
+		res = -1;
+	w->windows = s->windows;
+	w->syncs = s->syncs;
+	w->wait_total = s->wait_total;
+	w->wait_max = s->wait_max;
+	stream_put_locked(s);
+	pthread_mutex_unlock(&writer_lock);
+	w->stream = NULL;
+	return res;
+}
+
+void writer_summary(const struct Writer *w, char *out, size_t size)
+{
+	*out = '\0';
+	if (w->windows > 0)
+		snprintf(out, size,
+			 ", %u written behind, %.1f ms avg, %.1f ms max",
+			 w->windows, w->wait_total * 1000.0 / w->windows,
+			 w->wait_max * 1000.0);
+	else if (w->syncs > 0)
+		snprintf(out, size, ", fsync %.1f ms", w->wait_max * 1000.0);
+}
+
+void writer_sync_dir(const char *path)
+{
+	char copy[STORAGE_PATH_MAX];
+
+	if (fsync_policy == FSYNC_NONE)
+		return;
+	snprintf(copy, sizeof(copy), "%s", path);
+	int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fsync(fd) != 0)
+		log_msg(KYEL, "Cannot sync directory of %s", path);
+	close(fd);
+}
+
+unsigned long long writer_windows_total(void)
+{
+	return atomic_load(&windows_total);
+}
+
+unsigned long long writer_wait_us_total(void)
+{
+	return atomic_load(&wait_us_total);
+}
+
+unsigned long long writer_syncs_total(void)
+{
+	return atomic_load(&syncs_total);
+}
@@ -0,0 +1,84 @@
+#ifndef OVERSEER_WRITER_H
+#define OVERSEER_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define WRITER_WINDOW		(8 * 1024 * 1024)
+#define WRITER_MAX_PENDING	4
+#define WRITER_PREALLOC_MIN	(1024 * 1024)
+
+/*
+ * Storage writer. Upload bytes reach the page cache through whichever
+ * receive path is in use; every WRITER_WINDOW of them is then written back
+ * by a dedicated I/O thread with sync_file_range() and dropped from the
+ * cache with POSIX_FADV_DONTNEED, so a large upload neither piles up dirty
+ * pages nor pushes other data out of the cache. The receiving thread only
+ * waits on the disk when an upload gets WRITER_MAX_PENDING windows ahead
+ * of it. Files are preallocated from their declared size, beyond EOF, so
+ * an interrupted upload keeps its true length.
+ *
+ * --fsync picks the durability: none leaves it to the kernel, end syncs a
+ * file and its directory before an upload is acknowledged, and a number of
+ * MB also syncs every that many MB on the way, cutting a window short
+ * where a sync falls inside it.
+ */
+enum FsyncPolicy {
+	FSYNC_NONE,
+	FSYNC_END,
+	FSYNC_EVERY
+};
+
+struct WriteStream;
+
+/* One upload's file as the writer sees it, embedded in struct Upload. */
+struct Writer {
+	int fd;
+	struct WriteStream *stream;
+	off_t queued;
+	size_t unsynced;
+	bool preallocated;
+	unsigned int windows;
+	unsigned int syncs;
+	double wait_total;
+	double wait_max;
+};
+
+/* Parses an --fsync argument: none, end or every N MB. */
+int writer_set_fsync(const char *arg);
+void writer_describe(char *out, size_t size);
+bool writer_durable(void);
+
+/* Starts the I/O thread; without it uploads are written back by the kernel. */
+int writer_init(void);
+void writer_shutdown(void);
+
+/* Attaches w to fd at offset, preallocating prealloc bytes from there. */
+void writer_begin(struct Writer *w, int fd, off_t offset, size_t prealloc);
+
+/* Hands the windows finished below done to the I/O thread. */
+void writer_progress(struct Writer *w, off_t done);
+
+/* Gives back the preallocation past size before a hole is left there. */
+void writer_hole(struct Writer *w, off_t size);
+
+/*
+ * Hands over the rest up to done and detaches w. When final and --fsync
+ * asks for it, waits until all of it is synced, so the counters in w cover
+ * every window; otherwise they cover the windows finished so far. Returns
+ * -1 when the data could not be written.
+ */
+int writer_end(struct Writer *w, off_t done, bool final);
+
+/* The write-behind latency of w for the completion log, or "". */
+void writer_summary(const struct Writer *w, char *out, size_t size);
+
+/* Syncs the directory holding path when --fsync asks for durability. */
+void writer_sync_dir(const char *path);
+
+unsigned long long writer_windows_total(void);
+unsigned long long writer_wait_us_total(void);
+unsigned long long writer_syncs_total(void);
+
+#endif